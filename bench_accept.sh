@@ -0,0 +1,47 @@
+#!/bin/bash
+
+# Connection bursts against the server's accept path: the old listen queue of 10 without deferred
+# accept, the current defaults, and the defaults with TCP Fast Open. pcc_bench opens BURST
+# connections at once, one small request each, until DURATION ends, and verifies the server's
+# final statistics. SYNs dropped by a full accept queue show up as latencies of a second or more.
+# The Fast Open run only uses Fast Open if net.ipv4.tcp_fastopen has bits 1 and 2 set (3).
+
+# 1. Configuration - Change these if needed
+PORT=12347
+IP="127.0.0.1"
+BURST=${BURST:-500}
+THREADS=${THREADS:-1}
+DURATION=${DURATION:-5}
+SIZE=${SIZE:-200}
+BENCH_BIN="./pcc_bench"
+
+# 2. Cleanup - Kill any old instances that might be holding the port
+echo "Cleaning up old processes..."
+killall -9 pcc_server pcc_bench 2>/dev/null
+sleep 1
+
+# 3. Compile - Using the required flags
+echo "Compiling with required flags..."
+gcc -O3 -Wall -std=c11 -D_DEFAULT_SOURCE -pthread pcc_server.c -o pcc_server && \
+gcc -O3 -Wall -std=c11 -pthread pcc_bench.c -o pcc_bench -lm
+
+if [ $? -ne 0 ]; then
+    echo "Compilation failed! Fix errors before running."
+    exit 1
+fi
+
+# 4. Run - pcc_bench starts and stops the server itself for every configuration
+run() {
+    echo "== $1"
+    shift
+    $BENCH_BIN --connections $THREADS --burst $BURST --sizes fixed:$SIZE --duration $DURATION "$@"
+    if [ $? -ne 0 ]; then
+        echo "Burst run failed!"
+    fi
+}
+
+run "listen queue of 10, no deferred accept" --spawn-server $IP $PORT --backlog 10 --defer-accept 0
+run "defaults" --spawn-server $IP $PORT
+run "defaults with TCP Fast Open" --fast-open --spawn-server $IP $PORT --fast-open 4096
+
+echo "Benchmark complete."
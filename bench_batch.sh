@@ -0,0 +1,75 @@
+#!/bin/bash
+
+# Counts a tree of FILES small files three ways: one pcc_client per file (a process and a
+# connection each), every file as arguments of one pipelined pcc_client, and pcc_client --batch
+# on the directory. All three must arrive at the same total. Caches are dropped before each run
+# when running as root, that is where the batch I/O threads have disk waits to hide.
+
+# 1. Configuration - Change these if needed
+PORT=12348
+IP="127.0.0.1"
+FILES=${FILES:-5000}
+MAX_SIZE=${MAX_SIZE:-20000}
+STREAMS=${STREAMS:-4}
+IO_THREADS=${IO_THREADS:-4}
+TREE="bench_batch_tree"
+SERVER_BIN="./pcc_server"
+CLIENT_BIN="./pcc_client"
+
+# 2. Cleanup - Kill any old instances that might be holding the port
+echo "Cleaning up old processes..."
+killall -9 pcc_server pcc_client 2>/dev/null
+sleep 1
+
+# 3. Compile - Using the required flags
+echo "Compiling with required flags..."
+gcc -O3 -Wall -std=c11 -D_DEFAULT_SOURCE -pthread pcc_server.c -o pcc_server && \
+gcc -O3 -Wall -std=c11 -pthread pcc_client.c -o pcc_client
+
+if [ $? -ne 0 ]; then
+    echo "Compilation failed! Fix errors before running."
+    exit 1
+fi
+
+# 4. Create Test Data - FILES files of up to MAX_SIZE bytes, spread over 100 directories
+echo "Generating $FILES files..."
+rm -rf $TREE
+for ((i = 0; i < FILES; i++))
+do
+    DIR=$TREE/d$((i % 10))/d$((i / 10 % 10))
+    mkdir -p $DIR
+    head -c $((RANDOM * RANDOM % MAX_SIZE)) /dev/urandom > $DIR/f$i
+done
+
+# 5. Start Server - Running in background
+echo "Starting server on port $PORT..."
+$SERVER_BIN $PORT > /dev/null &
+SERVER_PID=$!
+sleep 2
+
+drop_caches() {
+    sync
+    echo 3 > /proc/sys/vm/drop_caches 2>/dev/null
+}
+
+# 6. Run - prints the time taken and the total the run arrived at, over all the clients it ran
+run() {
+    NAME=$1
+    shift
+    drop_caches
+    START=$(date +%s%N)
+    TOTAL=$("$@" | awk '/^# of printable characters/ { sum += $NF } END { print sum }')
+    END=$(date +%s%N)
+    printf "%-12s %10.1f ms %14s\n" $NAME $(awk -v ns=$((END - START)) 'BEGIN { print ns / 1e6 }') "$TOTAL"
+}
+
+printf "%-12s %13s %14s\n" "client" "time" "total"
+run per-file sh -c "find $TREE -type f | while read FILE; do $CLIENT_BIN $IP $PORT \$FILE; done"
+run pipelined sh -c "$CLIENT_BIN $IP $PORT \$(find $TREE -type f)"
+run batch $CLIENT_BIN --batch --streams $STREAMS --io-threads $IO_THREADS $IP $PORT $TREE
+
+# 7. Shutdown
+kill -SIGINT $SERVER_PID
+wait $SERVER_PID
+rm -rf $TREE
+echo "Benchmark complete."
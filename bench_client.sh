@@ -0,0 +1,66 @@
+#!/bin/bash
+
+# Compares pcc_client send modes (copy = the original read/send loop, sendfile, zerocopy, auto)
+# on files from 1MB to 1GB. Files are read once before timing, so they are hot in page cache.
+
+# 1. Configuration - Change these if needed
+PORT=12346
+IP="127.0.0.1"
+SIZES=${SIZES:-"1M 16M 256M 1G"}
+MODES=${MODES:-"copy sendfile zerocopy auto"}
+RUNS=${RUNS:-5}
+SERVER_BIN="./pcc_server"
+CLIENT_BIN="./pcc_client"
+
+# 2. Cleanup - Kill any old instances that might be holding the port
+echo "Cleaning up old processes..."
+killall -9 pcc_server pcc_client 2>/dev/null
+sleep 1
+
+# 3. Compile - Using the required flags
+echo "Compiling with required flags..."
+gcc -O3 -Wall -std=c11 -D_DEFAULT_SOURCE -pthread pcc_server.c -o pcc_server && \
+gcc -O3 -Wall -std=c11 -pthread pcc_client.c -o pcc_client
+
+if [ $? -ne 0 ]; then
+    echo "Compilation failed! Fix errors before running."
+    exit 1
+fi
+
+# 4. Start Server - Running in background
+echo "Starting server on port $PORT..."
+$SERVER_BIN $PORT > /dev/null &
+SERVER_PID=$!
+sleep 2
+
+# 5. Run - every mode on every size, RUNS times each
+printf "%-8s %-10s %12s %12s\n" "size" "mode" "avg ms" "MB/s"
+for SIZE in $SIZES
+do
+    TEST_FILE="bench_data_$SIZE.bin"
+    head -c $SIZE /dev/urandom > $TEST_FILE
+    cat $TEST_FILE > /dev/null
+    BYTES=$(stat -c %s $TEST_FILE)
+
+    for MODE in $MODES
+    do
+        START=$(date +%s%N)
+        for ((i = 0; i < RUNS; i++))
+        do
+            $CLIENT_BIN --send-mode $MODE $IP $PORT $TEST_FILE > /dev/null
+            if [ $? -ne 0 ]; then
+                echo "Client failed in mode $MODE on $SIZE!"
+            fi
+        done
+        END=$(date +%s%N)
+        awk -v size=$SIZE -v mode=$MODE -v ns=$((END - START)) -v runs=$RUNS -v bytes=$BYTES \
+            'BEGIN { ms = ns / runs / 1e6; printf "%-8s %-10s %12.2f %12.1f\n", size, mode, ms, bytes / 1048576 / (ms / 1000) }'
+    done
+
+    rm $TEST_FILE
+done
+
+# 6. Shutdown
+kill -SIGINT $SERVER_PID
+wait $SERVER_PID
+echo "Benchmark complete."
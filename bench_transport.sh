@@ -0,0 +1,71 @@
+#!/bin/bash
+
+# Sends the same file to a server on this host three ways: over loopback TCP, over the server's
+# Unix socket, and through a shared memory ring (--shm) where only the chunk lengths cross the
+# socket. Each is run RUNS times, the file stays in the page cache, so what differs is the cost of
+# moving the bytes from the client to the server. All must arrive at the same count.
+
+# 1. Configuration - Change these if needed
+PORT=12349
+IP="127.0.0.1"
+SOCKET_PATH="/tmp/pcc_bench_transport.sock"
+FILE_SIZE_MB=${FILE_SIZE_MB:-1000}
+RUNS=${RUNS:-5}
+TEST_FILE="bench_transport_data.bin"
+SERVER_BIN="./pcc_server"
+CLIENT_BIN="./pcc_client"
+
+# 2. Cleanup - Kill any old instances that might be holding the port
+echo "Cleaning up old processes..."
+killall -9 pcc_server pcc_client 2>/dev/null
+sleep 1
+
+# 3. Compile - Using the required flags
+echo "Compiling with required flags..."
+gcc -O3 -Wall -std=c11 -D_DEFAULT_SOURCE -pthread pcc_server.c -o pcc_server && \
+gcc -O3 -Wall -std=c11 -pthread pcc_client.c -o pcc_client
+
+if [ $? -ne 0 ]; then
+    echo "Compilation failed! Fix errors before running."
+    exit 1
+fi
+
+# 4. Create Test Data - random bytes, so the counting is the same work on every path
+echo "Generating ${FILE_SIZE_MB}MB test file..."
+head -c $((FILE_SIZE_MB * 1024 * 1024)) /dev/urandom > $TEST_FILE
+cat $TEST_FILE > /dev/null
+
+# 5. Start Server - Running in background, on the TCP port and the Unix socket
+echo "Starting server on port $PORT and $SOCKET_PATH..."
+$SERVER_BIN --unix-socket $SOCKET_PATH $PORT > /dev/null &
+SERVER_PID=$!
+sleep 2
+
+# 6. Run - prints the best time of RUNS, the throughput it stands for and the count
+run() {
+    NAME=$1
+    shift
+    BEST=0
+    for ((i = 0; i < RUNS; i++))
+    do
+        START=$(date +%s%N)
+        COUNT=$("$@" $TEST_FILE | awk '/^# of printable characters/ { print $NF }')
+        END=$(date +%s%N)
+        if [ $BEST -eq 0 ] || [ $((END - START)) -lt $BEST ]; then
+            BEST=$((END - START))
+        fi
+    done
+    printf "%-10s %10.1f ms %10.2f GB/s %14s\n" $NAME $(awk -v ns=$BEST 'BEGIN { print ns / 1e6 }') \
+        $(awk -v ns=$BEST -v mb=$FILE_SIZE_MB 'BEGIN { print mb * 1048576 / ns }') "$COUNT"
+}
+
+printf "%-10s %13s %15s %14s\n" "transport" "best time" "throughput" "count"
+run tcp $CLIENT_BIN $IP $PORT
+run unix $CLIENT_BIN --unix-socket $SOCKET_PATH
+run shm $CLIENT_BIN --shm --unix-socket $SOCKET_PATH
+
+# 7. Shutdown
+kill -SIGINT $SERVER_PID
+wait $SERVER_PID
+rm -f $TEST_FILE
+echo "Benchmark complete."
@@ -0,0 +1,950 @@
+#define _GNU_SOURCE  // clock_nanosleep with TIMER_ABSTIME, MSG_MORE, TCP_FASTOPEN_CONNECT
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "pcc_count.h"
+#include "pcc_protocol.h"
+#include "pcc_telemetry.h"
+
+/*
+ * Load generator for pcc_server.
+ *
+ * Every connection is a thread issuing one request at a time (framed like pcc_tester's
+ * send_data / receive_count, or as v2 keep-alive requests with --keep-alive).
+ * Closed loop: the next request goes out as soon as the previous reply arrived.
+ * Open loop: requests are scheduled at --rate over all connections, and latency is measured
+ * from the scheduled time, so a server that falls behind shows up in the percentiles instead of
+ * silently slowing the load down.
+ *
+ * With --spawn-server the benchmark starts ./pcc_server itself (extra arguments after the port
+ * go to it), checks every reply against a local count and, after SIGINT, verifies the server's
+ * final table and client count the way pcc_tester does.
+ *
+ * --burst N replaces the steady load with bursts: each connection thread opens N sockets at once,
+ * sends one v1 request on each and waits for every reply before the next burst. Latency is then
+ * from the start of the burst, so SYNs dropped by a full accept queue show up as retransmit
+ * delays of a second or more, and requests/s is the accept rate.
+ *
+ * Build: gcc -O3 -Wall -std=c11 -pthread pcc_bench.c -o pcc_bench -lm
+ */
+
+#define GENERAL_ERROR (1)
+#define GENERAL_SUCCESS (0)
+
+#define DEFAULT_CONNECTIONS (8)
+#define MAX_CONNECTIONS (1024)
+#define DEFAULT_DURATION (10)
+#define DEFAULT_PARETO_MAX (64ULL * 1024 * 1024)
+#define MAX_PAYLOAD_SIZE (1024ULL * 1024 * 1024)
+#define SEND_CHUNK_SIZE (1024 * 1024)
+#define SERVER_START_TIMEOUT_MS (5000)
+#define SERVER_OUTPUT_SIZE (16 * 1024)
+#define MAX_BURST (65536)
+#define BURST_EVENTS (256)
+#define BURST_TIMEOUT_MS (30 * 1000)
+
+enum size_distribution {
+    SIZE_FIXED,    // fixed:N
+    SIZE_UNIFORM,  // uniform:MIN:MAX
+    SIZE_PARETO,   // pareto:MIN:ALPHA[:MAX], heavy tailed, most requests near MIN
+};
+
+struct size_config {
+    enum size_distribution distribution;
+    uint64_t min;
+    uint64_t max;
+    double alpha;
+};
+
+enum load_mode {
+    LOAD_CLOSED,
+    LOAD_OPEN,
+};
+
+struct bench_config {
+    struct sockaddr_in serv_addr;
+    unsigned int connections;
+    struct size_config sizes;
+    enum load_mode mode;
+    double rate;  // requests per second over all connections, open loop only
+    unsigned int duration;
+    bool keep_alive;
+    bool fast_open;      // TCP Fast Open, the first request rides on the SYN
+    unsigned int burst;  // connections opened at once per thread, 0 for a steady load
+    bool verify;  // count every payload locally, needed to check replies and the final totals
+};
+
+struct bench_thread {
+    const struct bench_config *config;
+    const char *pool;  // random payload bytes, requests are slices of it
+    size_t pool_size;
+    uint64_t rng_state;
+    uint64_t start_ns;
+    uint64_t deadline_ns;
+    int sock_fd;  // the keep-alive connection, -1 while there is none
+    // results
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t end_ns;
+    uint64_t pcc_total[AMOUNT_OF_PRINTABLE_CHARS];
+    struct pcc_latency_histogram latency;  // ns
+    struct pcc_histogram histogram;        // scratch for verify
+    pthread_t thread;
+};
+
+uint64_t next_random(uint64_t *state) {
+    // xorshift64
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// uniform in (0, 1]
+double next_unit(uint64_t *state) {
+    return (double)((next_random(state) >> 11) + 1) / 9007199254740992.0;
+}
+
+uint64_t next_size(const struct size_config *sizes, uint64_t *state) {
+    switch (sizes->distribution) {
+    case SIZE_UNIFORM:
+        return sizes->min + next_random(state) % (sizes->max - sizes->min + 1);
+    case SIZE_PARETO: {
+        double size = (double)sizes->min / pow(next_unit(state), 1.0 / sizes->alpha);
+        return size > (double)sizes->max ? sizes->max : (uint64_t)size;
+    }
+    default:
+        return sizes->min;
+    }
+}
+
+// accepts a K, M or G suffix
+bool parse_size(const char *text, uint64_t *size) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text) {
+        return false;
+    }
+    switch (*end) {
+    case 'K':
+        value *= 1024;
+        end++;
+        break;
+    case 'M':
+        value *= 1024 * 1024;
+        end++;
+        break;
+    case 'G':
+        value *= 1024 * 1024 * 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+    *size = value;
+    return *end == '\0' || *end == ':';
+}
+
+bool parse_size_config(const char *text, struct size_config *sizes) {
+    const char *fields = strchr(text, ':');
+    if (fields == NULL) {
+        return false;
+    }
+    fields++;
+
+    if (strncmp(text, "fixed:", 6) == 0) {
+        sizes->distribution = SIZE_FIXED;
+        if (!parse_size(fields, &sizes->min)) {
+            return false;
+        }
+        sizes->max = sizes->min;
+    } else if (strncmp(text, "uniform:", 8) == 0) {
+        const char *max_field = strchr(fields, ':');
+        sizes->distribution = SIZE_UNIFORM;
+        if (max_field == NULL || !parse_size(fields, &sizes->min) || !parse_size(max_field + 1, &sizes->max) ||
+            sizes->min > sizes->max) {
+            return false;
+        }
+    } else if (strncmp(text, "pareto:", 7) == 0) {
+        const char *alpha_field = strchr(fields, ':');
+        sizes->distribution = SIZE_PARETO;
+        sizes->max = DEFAULT_PARETO_MAX;
+        if (alpha_field == NULL || !parse_size(fields, &sizes->min) ||
+            sscanf(alpha_field + 1, "%lf", &sizes->alpha) != 1 || sizes->alpha <= 0 || sizes->min == 0) {
+            return false;
+        }
+        const char *max_field = strchr(alpha_field + 1, ':');
+        if (max_field != NULL && (!parse_size(max_field + 1, &sizes->max) || sizes->max < sizes->min)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+
+    return sizes->max <= MAX_PAYLOAD_SIZE;
+}
+
+int send_all(int sock_fd, const char *data, size_t len, int flags) {
+    size_t sent = 0;
+    while (sent < len) {
+        size_t to_send = len - sent > SEND_CHUNK_SIZE ? SEND_CHUNK_SIZE : len - sent;
+        ssize_t bytes_sent = send(sock_fd, data + sent, to_send, flags | MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            perror("send failed");
+            return GENERAL_ERROR;
+        }
+        sent += bytes_sent;
+    }
+    return GENERAL_SUCCESS;
+}
+
+// pcc_tester's framing, MSG_MORE keeps N and a small body in one segment
+int send_data(int sock_fd, uint32_t N, const char *data) {
+    uint32_t net_N = htonl(N);
+    // with an empty body nothing would follow to push N out
+    if (send_all(sock_fd, (const char *)&net_N, sizeof(net_N), N > 0 ? MSG_MORE : 0) != GENERAL_SUCCESS) {
+        return GENERAL_ERROR;
+    }
+    return send_all(sock_fd, data, N, 0);
+}
+
+int receive_count(int sock_fd, uint32_t *count) {
+    uint32_t net_count;
+    ssize_t bytes_recv = recv(sock_fd, &net_count, sizeof(net_count), MSG_WAITALL);
+    if (bytes_recv != sizeof(net_count)) {
+        perror("recv count failed");
+        return GENERAL_ERROR;
+    }
+    *count = ntohl(net_count);
+    return GENERAL_SUCCESS;
+}
+
+int send_keep_alive_request(int sock_fd, uint64_t N, const char *data) {
+    struct pcc_v2_header header = {
+        .magic = htonl(PCC_V2_MAGIC),
+        .version = PCC_V2_VERSION,
+        .flags = PCC_V2_FLAG_KEEP_ALIVE,
+    };
+    uint64_t net_N = pcc_hton64(N);
+    if (send_all(sock_fd, (const char *)&header, sizeof(header), MSG_MORE) != GENERAL_SUCCESS ||
+        send_all(sock_fd, (const char *)&net_N, sizeof(net_N), MSG_MORE) != GENERAL_SUCCESS) {
+        return GENERAL_ERROR;
+    }
+    return send_all(sock_fd, data, N, 0);
+}
+
+int receive_keep_alive_count(int sock_fd, uint64_t *count) {
+    uint64_t net_count;
+    ssize_t bytes_recv = recv(sock_fd, &net_count, sizeof(net_count), MSG_WAITALL);
+    if (bytes_recv != sizeof(net_count)) {
+        perror("recv count failed");
+        return GENERAL_ERROR;
+    }
+    *count = pcc_ntoh64(net_count);
+    return GENERAL_SUCCESS;
+}
+
+int connect_to_server(const struct sockaddr_in *serv_addr, bool fast_open) {
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd == -1) {
+        perror("socket creation failed");
+        return -1;
+    }
+
+    // connect returns at once and the SYN goes out with the first send
+    int opt_true = 1;
+    if (fast_open && 0 != setsockopt(sock_fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opt_true, sizeof(opt_true))) {
+        perror("setsockopt TCP_FASTOPEN_CONNECT failed");
+        close(sock_fd);
+        return -1;
+    }
+
+    if (connect(sock_fd, (const struct sockaddr *)serv_addr, sizeof(*serv_addr)) == -1) {
+        perror("connect failed");
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+// checks a reply against a local count and adds the request to the expected totals
+int check_reply(struct bench_thread *bench, const char *data, uint64_t size, uint64_t received) {
+    uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+    uint64_t expected = pcc_histogram_add(&bench->histogram, data, size, counts);
+
+    if (received != expected) {
+        fprintf(stderr, "FAIL: %lu byte request, expected %lu, received %lu\n", (unsigned long)size,
+                (unsigned long)expected, (unsigned long)received);
+        return GENERAL_ERROR;
+    }
+    for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+        bench->pcc_total[i] += counts[i];
+    }
+    return GENERAL_SUCCESS;
+}
+
+// one request and its reply, the reply is checked against a local count when verifying
+int run_request(struct bench_thread *bench, const char *data, uint64_t size) {
+    const struct bench_config *config = bench->config;
+    uint64_t received = 0;
+
+    if (config->keep_alive) {
+        if (bench->sock_fd == -1) {
+            bench->sock_fd = connect_to_server(&config->serv_addr, config->fast_open);
+            if (bench->sock_fd == -1) {
+                return GENERAL_ERROR;
+            }
+        }
+        if (send_keep_alive_request(bench->sock_fd, size, data) != GENERAL_SUCCESS ||
+            receive_keep_alive_count(bench->sock_fd, &received) != GENERAL_SUCCESS) {
+            close(bench->sock_fd);
+            bench->sock_fd = -1;
+            return GENERAL_ERROR;
+        }
+    } else {
+        int sock_fd = connect_to_server(&config->serv_addr, config->fast_open);
+        if (sock_fd == -1) {
+            return GENERAL_ERROR;
+        }
+        uint32_t count = 0;
+        int return_code = send_data(sock_fd, (uint32_t)size, data);
+        if (return_code == GENERAL_SUCCESS) {
+            return_code = receive_count(sock_fd, &count);
+        }
+        close(sock_fd);
+        if (return_code != GENERAL_SUCCESS) {
+            return GENERAL_ERROR;
+        }
+        received = count;
+    }
+
+    if (config->verify) {
+        return check_reply(bench, data, size, received);
+    }
+    return GENERAL_SUCCESS;
+}
+
+// one connection of a burst
+struct burst_client {
+    int fd;
+    const char *data;
+    uint64_t size;
+    uint32_t net_N;
+    uint64_t sent;  // of the N field and the body together
+    unsigned char reply[sizeof(uint32_t)];
+    size_t received;
+};
+
+// sends whatever the socket takes right now, returns GENERAL_ERROR if the connection failed
+int burst_send(struct burst_client *client) {
+    while (client->sent < sizeof(client->net_N) + client->size) {
+        struct iovec iov[2];
+        struct msghdr msg = {.msg_iov = iov};
+        if (client->sent < sizeof(client->net_N)) {
+            iov[0] = (struct iovec){(char *)&client->net_N + client->sent, sizeof(client->net_N) - client->sent};
+            iov[1] = (struct iovec){(char *)client->data, client->size};
+            msg.msg_iovlen = 2;
+        } else {
+            uint64_t body_sent = client->sent - sizeof(client->net_N);
+            iov[0] = (struct iovec){(char *)client->data + body_sent, client->size - body_sent};
+            msg.msg_iovlen = 1;
+        }
+
+        ssize_t bytes_sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            // EINPROGRESS: a Fast Open connect without a cookie yet, the data follows the handshake
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+                return GENERAL_SUCCESS;
+            }
+            perror("send failed");
+            return GENERAL_ERROR;
+        }
+        client->sent += bytes_sent;
+    }
+    return GENERAL_SUCCESS;
+}
+
+// returns true once the client is done, successfully or not
+bool progress_burst_client(struct bench_thread *bench, struct burst_client *client, int epoll_fd, uint64_t started) {
+    if (client->sent < sizeof(client->net_N) + client->size) {
+        if (burst_send(client) != GENERAL_SUCCESS) {
+            bench->errors++;
+            return true;
+        }
+        if (client->sent == sizeof(client->net_N) + client->size) {
+            struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+            if (0 != epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event)) {
+                perror("epoll_ctl failed");
+                bench->errors++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    ssize_t bytes_recv = recv(client->fd, client->reply + client->received, sizeof(client->reply) - client->received, 0);
+    if (bytes_recv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    }
+    if (bytes_recv <= 0) {
+        perror("recv count failed");
+        bench->errors++;
+        return true;
+    }
+    client->received += bytes_recv;
+    if (client->received < sizeof(client->reply)) {
+        return false;
+    }
+
+    uint32_t net_count;
+    memcpy(&net_count, client->reply, sizeof(net_count));
+    if (bench->config->verify && check_reply(bench, client->data, client->size, ntohl(net_count)) != GENERAL_SUCCESS) {
+        bench->errors++;
+        return true;
+    }
+    pcc_latency_record(&bench->latency, pcc_monotonic_ns() - started);
+    bench->requests++;
+    bench->bytes += client->size;
+    return true;
+}
+
+// opens config->burst connections at once and waits for all of their replies
+int run_burst(struct bench_thread *bench) {
+    const struct bench_config *config = bench->config;
+    int return_code = GENERAL_ERROR;
+    struct epoll_event events[BURST_EVENTS];
+    unsigned int pending = 0;
+    int opt_true = 1;
+
+    struct burst_client *clients = calloc(config->burst, sizeof(*clients));
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (clients == NULL || epoll_fd == -1) {
+        perror("burst setup failed");
+        goto cleanup;
+    }
+    for (unsigned int i = 0; i < config->burst; i++) {
+        clients[i].fd = -1;
+    }
+
+    uint64_t started = pcc_monotonic_ns();
+    for (unsigned int i = 0; i < config->burst; i++) {
+        struct burst_client *client = &clients[i];
+        client->size = next_size(&config->sizes, &bench->rng_state);
+        client->data = bench->pool + next_random(&bench->rng_state) % (bench->pool_size - client->size + 1);
+        client->net_N = htonl((uint32_t)client->size);
+
+        client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (client->fd == -1) {
+            perror("socket creation failed");
+            goto cleanup;
+        }
+        if (config->fast_open &&
+            0 != setsockopt(client->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opt_true, sizeof(opt_true))) {
+            perror("setsockopt TCP_FASTOPEN_CONNECT failed");
+            goto cleanup;
+        }
+        if (connect(client->fd, (const struct sockaddr *)&config->serv_addr, sizeof(config->serv_addr)) == -1 &&
+            errno != EINPROGRESS) {
+            perror("connect failed");
+            goto cleanup;
+        }
+
+        struct epoll_event event = {.events = EPOLLOUT, .data.ptr = client};
+        if (0 != epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event)) {
+            perror("epoll_ctl failed");
+            goto cleanup;
+        }
+        pending++;
+    }
+
+    while (pending > 0) {
+        int events_amount = epoll_wait(epoll_fd, events, BURST_EVENTS, BURST_TIMEOUT_MS);
+        if (events_amount == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            goto cleanup;
+        }
+        if (events_amount == 0) {
+            fprintf(stderr, "Burst timed out with %u connection(s) still waiting\n", pending);
+            goto cleanup;
+        }
+
+        for (int i = 0; i < events_amount; i++) {
+            struct burst_client *client = events[i].data.ptr;
+            if (progress_burst_client(bench, client, epoll_fd, started)) {
+                close(client->fd);
+                client->fd = -1;
+                pending--;
+            }
+        }
+    }
+
+    return_code = GENERAL_SUCCESS;
+
+cleanup:
+    if (return_code != GENERAL_SUCCESS) {
+        bench->errors++;
+    }
+    for (unsigned int i = 0; clients != NULL && i < config->burst; i++) {
+        if (clients[i].fd != -1) {
+            close(clients[i].fd);
+        }
+    }
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+    }
+    free(clients);
+    return return_code;
+}
+
+void sleep_until(uint64_t when_ns) {
+    struct timespec when = {.tv_sec = when_ns / 1000000000ULL, .tv_nsec = when_ns % 1000000000ULL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR) {
+    }
+}
+
+void *bench_thread_main(void *arg) {
+    struct bench_thread *bench = arg;
+    const struct bench_config *config = bench->config;
+    uint64_t interval_ns = 0;
+    uint64_t scheduled = bench->start_ns;
+
+    if (config->mode == LOAD_OPEN) {
+        // every connection carries an equal share of the rate, with a random phase so they don't send in lockstep
+        interval_ns = (uint64_t)(1e9 * config->connections / config->rate);
+        scheduled += next_random(&bench->rng_state) % (interval_ns > 0 ? interval_ns : 1);
+    }
+    sleep_until(scheduled);
+
+    while (config->burst > 0) {
+        if (pcc_monotonic_ns() >= bench->deadline_ns || run_burst(bench) != GENERAL_SUCCESS || bench->errors > 0) {
+            break;
+        }
+    }
+
+    while (config->burst == 0) {
+        uint64_t started = pcc_monotonic_ns();
+        if (started >= bench->deadline_ns || scheduled >= bench->deadline_ns) {
+            break;
+        }
+
+        uint64_t size = next_size(&config->sizes, &bench->rng_state);
+        size_t offset = next_random(&bench->rng_state) % (bench->pool_size - size + 1);
+        if (run_request(bench, bench->pool + offset, size) == GENERAL_SUCCESS) {
+            uint64_t finished = pcc_monotonic_ns();
+            // open loop: from when the request should have gone out, so queueing behind a slow reply counts
+            pcc_latency_record(&bench->latency, finished - (config->mode == LOAD_OPEN ? scheduled : started));
+            bench->requests++;
+            bench->bytes += size;
+        } else {
+            // the run is not measuring what it was asked to anymore, stop this connection
+            bench->errors++;
+            break;
+        }
+
+        if (config->mode == LOAD_OPEN) {
+            scheduled += interval_ns;
+            sleep_until(scheduled);
+        }
+    }
+
+    if (bench->sock_fd != -1) {
+        close(bench->sock_fd);  // the server sees an idle keep-alive connection close
+        bench->sock_fd = -1;
+    }
+    bench->end_ns = pcc_monotonic_ns();
+    return NULL;
+}
+
+void print_report(const struct bench_config *config, struct bench_thread *threads, uint64_t start_ns) {
+    static struct pcc_latency_histogram latency;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    uint64_t end_ns = start_ns;
+
+    memset(&latency, 0, sizeof(latency));
+    for (unsigned int t = 0; t < config->connections; t++) {
+        requests += threads[t].requests;
+        errors += threads[t].errors;
+        bytes += threads[t].bytes;
+        end_ns = threads[t].end_ns > end_ns ? threads[t].end_ns : end_ns;
+        pcc_latency_merge(&latency, &threads[t].latency);
+    }
+
+    double seconds = (double)(end_ns - start_ns) / 1e9;
+    printf("requests: %lu (%lu errors) in %.2f s\n", (unsigned long)requests, (unsigned long)errors, seconds);
+    printf("throughput: %.1f requests/s, %.3f GB/s\n", requests / seconds, bytes / seconds / 1e9);
+    printf("latency: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, mean %.1f us\n",
+           pcc_latency_percentile(&latency, 0.50) / 1e3, pcc_latency_percentile(&latency, 0.99) / 1e3,
+           pcc_latency_percentile(&latency, 0.999) / 1e3,
+           latency.count > 0 ? (double)latency.sum / latency.count / 1e3 : 0.0);
+}
+
+// forks ./pcc_server with the extra arguments and the port, its stdout goes to *output_fd
+pid_t spawn_server(char *server_args[], int server_args_count, const char *port, int *output_fd) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        perror("pipe failed");
+        return -1;
+    }
+
+    pid_t child_pid = fork();
+    if (child_pid == -1) {
+        perror("fork failed");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+
+    if (child_pid == 0) {
+        close(pipefd[0]);
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[1]);
+        char *server_argv[server_args_count + 3];
+        server_argv[0] = "pcc_server";
+        for (int i = 0; i < server_args_count; i++) {
+            server_argv[i + 1] = server_args[i];
+        }
+        server_argv[server_args_count + 1] = (char *)port;
+        server_argv[server_args_count + 2] = NULL;
+        execv("./pcc_server", server_argv);
+        perror("execv failed");
+        exit(GENERAL_ERROR);
+    }
+
+    close(pipefd[1]);
+    *output_fd = pipefd[0];
+    return child_pid;
+}
+
+int wait_for_server(const struct sockaddr_in *serv_addr) {
+    for (int waited = 0; waited < SERVER_START_TIMEOUT_MS; waited += 10) {
+        int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock_fd == -1) {
+            perror("socket creation failed");
+            return GENERAL_ERROR;
+        }
+        // an empty v1 request, so the probe is a well formed client too
+        if (connect(sock_fd, (const struct sockaddr *)serv_addr, sizeof(*serv_addr)) == 0) {
+            uint32_t count = 0;
+            int return_code = send_data(sock_fd, 0, "");
+            if (return_code == GENERAL_SUCCESS) {
+                return_code = receive_count(sock_fd, &count);
+            }
+            close(sock_fd);
+            return return_code;
+        }
+        close(sock_fd);
+        usleep(10 * 1000);
+    }
+    fprintf(stderr, "Server did not start listening\n");
+    return GENERAL_ERROR;
+}
+
+// stops the server and checks its final table against what the benchmark sent, like pcc_tester
+int verify_server(pid_t server_pid, int output_fd, const uint64_t expected_totals[], uint64_t expected_clients) {
+    char output[SERVER_OUTPUT_SIZE];
+    size_t output_size = 0;
+    int status = 0;
+
+    if (kill(server_pid, SIGINT) == -1) {
+        perror("kill failed");
+        return GENERAL_ERROR;
+    }
+    while (output_size < sizeof(output) - 1) {
+        ssize_t bytes_read = read(output_fd, output + output_size, sizeof(output) - 1 - output_size);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        output_size += bytes_read;
+    }
+    output[output_size] = '\0';
+    if (waitpid(server_pid, &status, 0) == -1) {
+        perror("waitpid failed");
+        return GENERAL_ERROR;
+    }
+
+    long long clients_served = -1;
+    uint64_t actual_totals[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+    for (char *line = strtok(output, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        char c;
+        unsigned long long count;
+        if (sscanf(line, "Served %lld client(s) successfully", &clients_served) == 1) {
+            continue;
+        }
+        if (sscanf(line, "char '%c' : %llu times", &c, &count) == 2 && PRINTABLE_LOWER_BOUND <= c &&
+            c <= PRINTABLE_UPPER_BOUND) {
+            actual_totals[c - PRINTABLE_LOWER_BOUND] = count;
+        }
+    }
+
+    int stats_ok = 1;
+    if (clients_served != (long long)expected_clients) {
+        printf("FAIL: Expected %llu clients, served %lld\n", (unsigned long long)expected_clients, clients_served);
+        stats_ok = 0;
+    }
+    for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+        if (expected_totals[i] != actual_totals[i]) {
+            printf("FAIL: Char '%c' expected %lu, actual %lu\n", (char)(PRINTABLE_LOWER_BOUND + i),
+                   (unsigned long)expected_totals[i], (unsigned long)actual_totals[i]);
+            stats_ok = 0;
+        }
+    }
+
+    if (stats_ok) {
+        printf("Server statistics verified successfully!\n");
+        return GENERAL_SUCCESS;
+    }
+    printf("Server statistics verification failed.\n");
+    return GENERAL_ERROR;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--connections C] [--sizes fixed:N|uniform:MIN:MAX|pareto:MIN:ALPHA[:MAX]]\n"
+            "          [--mode closed|open] [--rate R] [--duration SECONDS] [--keep-alive] [--burst N]\n"
+            "          [--fast-open] [--verify] [--spawn-server] <ip> <port> [server options...]\n"
+            "Sizes take K, M and G suffixes. --rate is in requests/s over all connections (open loop).\n"
+            "--burst opens N connections at once per connection thread, one request each, until the duration ends.\n"
+            "--spawn-server runs ./pcc_server with the server options and verifies its final statistics.\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+    int return_code = GENERAL_ERROR;
+    struct bench_config config = {
+        .connections = DEFAULT_CONNECTIONS,
+        .sizes = {.distribution = SIZE_FIXED, .min = 4096, .max = 4096},
+        .mode = LOAD_CLOSED,
+        .duration = DEFAULT_DURATION,
+    };
+    bool spawn = false;
+    pid_t server_pid = -1;
+    int server_output_fd = -1;
+    struct bench_thread *threads = NULL;
+    char *pool = NULL;
+    unsigned int threads_started = 0;
+    static const struct option long_options[] = {
+        {"connections", required_argument, NULL, 'c'},
+        {"sizes", required_argument, NULL, 's'},
+        {"mode", required_argument, NULL, 'm'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {"keep-alive", no_argument, NULL, 'k'},
+        {"burst", required_argument, NULL, 'b'},
+        {"fast-open", no_argument, NULL, 'f'},
+        {"verify", no_argument, NULL, 'v'},
+        {"spawn-server", no_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt = 0;
+
+    // "+" stops at the first positional argument, the rest are server options
+    while ((opt = getopt_long(argc, argv, "+c:s:m:r:d:kb:fvS", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            if (sscanf(optarg, "%u", &config.connections) != 1 || config.connections == 0 ||
+                config.connections > MAX_CONNECTIONS) {
+                fprintf(stderr, "Invalid number of connections: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 's':
+            if (!parse_size_config(optarg, &config.sizes)) {
+                fprintf(stderr, "Invalid size distribution: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'm':
+            if (strcmp(optarg, "closed") == 0) {
+                config.mode = LOAD_CLOSED;
+            } else if (strcmp(optarg, "open") == 0) {
+                config.mode = LOAD_OPEN;
+            } else {
+                fprintf(stderr, "Invalid mode: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'r':
+            if (sscanf(optarg, "%lf", &config.rate) != 1 || config.rate <= 0) {
+                fprintf(stderr, "Invalid rate: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'd':
+            if (sscanf(optarg, "%u", &config.duration) != 1 || config.duration == 0) {
+                fprintf(stderr, "Invalid duration: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'k':
+            config.keep_alive = true;
+            break;
+        case 'b':
+            if (sscanf(optarg, "%u", &config.burst) != 1 || config.burst == 0 || config.burst > MAX_BURST) {
+                fprintf(stderr, "Invalid burst size: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'f':
+            config.fast_open = true;
+            break;
+        case 'v':
+            config.verify = true;
+            break;
+        case 'S':
+            spawn = true;
+            config.verify = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            goto cleanup;
+        }
+    }
+
+    if (argc - optind < 2 || (!spawn && argc - optind != 2)) {
+        print_usage(argv[0]);
+        goto cleanup;
+    }
+    if (config.mode == LOAD_OPEN && config.rate == 0) {
+        fprintf(stderr, "Open loop needs --rate\n");
+        goto cleanup;
+    }
+    if (config.burst > 0 && (config.keep_alive || config.mode == LOAD_OPEN)) {
+        fprintf(stderr, "--burst sends one v1 request per connection, without --keep-alive or an open loop\n");
+        goto cleanup;
+    }
+    if (!config.keep_alive && config.sizes.max > PCC_V1_MAX_LENGTH) {
+        fprintf(stderr, "Requests over 4GiB need --keep-alive (protocol v2)\n");
+        goto cleanup;
+    }
+
+    uint16_t port = 0;
+    config.serv_addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, argv[optind], &config.serv_addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid IP address: %s\n", argv[optind]);
+        goto cleanup;
+    }
+    if (sscanf(argv[optind + 1], "%hu", &port) != 1) {
+        fprintf(stderr, "Invalid port number: %s\n", argv[optind + 1]);
+        goto cleanup;
+    }
+    config.serv_addr.sin_port = htons(port);
+
+    // one shared pool of random bytes, every request is a slice of it
+    uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+    size_t pool_size = config.sizes.max + 4096;
+    pool = malloc(pool_size);
+    threads = aligned_alloc(64, ((config.connections * sizeof(*threads) + 63) / 64) * 64);
+    if (pool == NULL || threads == NULL) {
+        perror("malloc failed");
+        goto cleanup;
+    }
+    for (size_t i = 0; i < pool_size; i++) {
+        pool[i] = (char)next_random(&rng_state);
+    }
+
+    if (spawn) {
+        server_pid = spawn_server(&argv[optind + 2], argc - optind - 2, argv[optind + 1], &server_output_fd);
+        if (server_pid == -1 || wait_for_server(&config.serv_addr) != GENERAL_SUCCESS) {
+            goto cleanup;
+        }
+    }
+
+    if (config.burst > 0) {
+        printf("bursts of %u connection(s) from each of %u thread(s)%s, %u s\n", config.burst, config.connections,
+               config.fast_open ? " with fast open" : "", config.duration);
+    } else {
+        printf("%s loop, %u connection(s)%s%s, %u s\n", config.mode == LOAD_OPEN ? "open" : "closed",
+               config.connections, config.keep_alive ? " with keep-alive" : "",
+               config.fast_open ? " with fast open" : "", config.duration);
+    }
+
+    uint64_t start_ns = pcc_monotonic_ns() + 10 * 1000 * 1000;  // time for every thread to get going
+    memset(threads, 0, config.connections * sizeof(*threads));
+    for (; threads_started < config.connections; threads_started++) {
+        struct bench_thread *bench = &threads[threads_started];
+        bench->config = &config;
+        bench->pool = pool;
+        bench->pool_size = pool_size;
+        bench->rng_state = next_random(&rng_state) | 1;
+        bench->start_ns = start_ns;
+        bench->deadline_ns = start_ns + (uint64_t)config.duration * 1000000000ULL;
+        bench->sock_fd = -1;
+        pcc_histogram_init(&bench->histogram);
+        int error = pthread_create(&bench->thread, NULL, bench_thread_main, bench);
+        if (error != 0) {
+            errno = error;
+            perror("pthread_create failed");
+            break;
+        }
+    }
+    for (unsigned int t = 0; t < threads_started; t++) {
+        pthread_join(threads[t].thread, NULL);
+    }
+    if (threads_started < config.connections) {
+        goto cleanup;
+    }
+
+    print_report(&config, threads, start_ns);
+
+    return_code = GENERAL_SUCCESS;
+    for (unsigned int t = 0; t < config.connections; t++) {
+        if (threads[t].errors > 0) {
+            return_code = GENERAL_ERROR;
+        }
+    }
+
+    if (spawn) {
+        uint64_t expected_totals[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+        uint64_t expected_clients = 1;  // the startup probe
+        for (unsigned int t = 0; t < config.connections; t++) {
+            expected_clients += threads[t].requests;
+            for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+                expected_totals[i] += threads[t].pcc_total[i];
+            }
+        }
+        if (verify_server(server_pid, server_output_fd, expected_totals, expected_clients) != GENERAL_SUCCESS) {
+            return_code = GENERAL_ERROR;
+        }
+        server_pid = -1;
+    }
+
+cleanup:
+    if (server_pid != -1) {
+        kill(server_pid, SIGINT);
+        waitpid(server_pid, NULL, 0);
+    }
+    if (server_output_fd != -1) {
+        close(server_output_fd);
+    }
+    free(threads);
+    free(pool);
+    return return_code;
+}
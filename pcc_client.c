@@ -1,47 +1,251 @@
+#define _GNU_SOURCE  // splice, pipe2, F_SETPIPE_SZ, readahead, memfd_create
 #include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+
+#include "pcc_protocol.h"
+#include "pcc_lz4.h"
+#include "pcc_shm.h"
 
 #define GENERAL_ERROR (1)
 #define GENERAL_SUCCESS (0)
+// the kernel can not do this transfer for this kind of file, nothing was sent yet
+#define TRANSFER_UNSUPPORTED (2)
 
 #define BUFFER_SIZE (1024)
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+// below this, or when the file is not in the page cache, sendfile is cheaper than pinning pages
+#define ZEROCOPY_THRESHOLD (4 * 1024 * 1024)
+#define ZEROCOPY_MIN_RESIDENT_PERCENT (90)
+#define ZEROCOPY_CHUNK_SIZE (1024 * 1024)
+
+#define MAX_STREAMS (256)
+
+// inputs of unknown length go out in v2 chunks of at most this size
+#define CHUNK_SIZE (64 * 1024)
+
+// --shm: every connection has a ring of this size, filled a quarter at a time so the client
+// reads the next chunk while the server counts the previous ones
+#define SHM_RING_CAPACITY (4 * 1024 * 1024)
+#define SHM_CHUNKS_PER_RING (4)
+
+// requests sent ahead of the oldest unread reply when several files share a connection
+#define MAX_IN_FLIGHT (32)
+
+// batch mode: connections unless --streams says otherwise, and threads opening and reading files
+#define BATCH_DEFAULT_STREAMS (4)
+#define BATCH_DEFAULT_IO_THREADS (4)
+#define MAX_IO_THREADS (64)
+// files opened and read ahead, waiting for a connection, each holds an open descriptor
+#define BATCH_READY_CAPACITY (256)
+// I/O threads waiting on a full ring resume once it drained to this, not one file at a time
+#define BATCH_READY_LOW_WATERMARK (BATCH_READY_CAPACITY / 2)
+// how much of each file the I/O threads pull into the page cache, sendfile streams the rest
+#define BATCH_PREFETCH_SIZE (4 * 1024 * 1024)
+
+enum send_mode {
+    SEND_MODE_AUTO,
+    SEND_MODE_COPY,
+    SEND_MODE_SENDFILE,
+    SEND_MODE_ZEROCOPY,
+};
+
+static const char *send_mode_names[] = {"auto", "copy", "sendfile", "zerocopy"};
+
+enum protocol {
+    PROTOCOL_AUTO,  // v1 whenever the request fits it, so older servers keep working
+    PROTOCOL_V1,
+    PROTOCOL_V2,
+};
+
+static const char *protocol_names[] = {"auto", "1", "2"};
+
+// where the server listens, TCP or its Unix socket
+struct server_address {
+    struct sockaddr_storage storage;
+    socklen_t length;
+    bool shm;  // Unix socket only: bodies go through a shared memory ring per connection
+};
+
+// the part of the input that one connection uploads
+struct file_range {
+    int fd;
+    off_t offset;
+    off_t length;
+    bool seekable;  // false for pipes, those are read from their current position
+};
+
+struct upload {
+    const struct server_address *address;
+    struct file_range range;
+    enum send_mode mode;
+    enum protocol protocol;
+    bool compress;
+    uint8_t byte_class;
+    const struct pcc_byte_set *byte_set;  // counted instead of the class, NULL for none
+    bool utf8;
+    uint64_t *histogram;  // the PCC_HISTOGRAM_BINS bins of the range, NULL when not asked for
+    uint64_t pcc_count;
+    int return_code;
+    pthread_t thread;
+};
+
+// while corked, the kernel only sends full segments, so N leaves together with the first data
+void set_cork(int sock_fd, int enabled) {
+    // best effort, not every socket type supports it
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_CORK, &enabled, sizeof(enabled));
+}
 
-int handle_client(int sock_fd, int file_fd) {
+int send_with_sendfile(int sock_fd, const struct file_range *range) {
+    off_t bytes_sent_overall = 0;
+    off_t position = range->offset;
+
+    while (bytes_sent_overall < range->length) {
+        ssize_t chunk_size = sendfile(sock_fd, range->fd, range->seekable ? &position : NULL,
+                                      range->length - bytes_sent_overall);
+        if (chunk_size == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (bytes_sent_overall == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                return TRANSFER_UNSUPPORTED;
+            }
+            perror("sendfile failed");
+            return GENERAL_ERROR;
+        }
+        if (chunk_size == 0) {
+            fprintf(stderr, "file read failed: file is shorter than its size\n");
+            return GENERAL_ERROR;
+        }
+        bytes_sent_overall += chunk_size;
+    }
+
+    return GENERAL_SUCCESS;
+}
+
+// moves up to len bytes from in_fd (at *in_offset, if given) to out_fd, returns how many or -1
+ssize_t splice_all(int in_fd, loff_t *in_offset, int out_fd, size_t len) {
+    while (true) {
+        ssize_t chunk_size = splice(in_fd, in_offset, out_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (chunk_size == -1 && errno == EINTR) {
+            continue;
+        }
+        return chunk_size;
+    }
+}
+
+// for inputs sendfile refuses: file -> pipe -> socket, the data still never enters user space
+int send_with_splice(int sock_fd, const struct file_range *range) {
     int return_code = GENERAL_ERROR;
-    uint32_t file_size = 0;
-    ssize_t bytes_read = 0;
-    ssize_t bytes_sent_overall = 0;
-    ssize_t bytes_sent = 0;
-    uint32_t pcc_count = 0;
-    char buffer[BUFFER_SIZE] = {0};
+    int pipe_fds[2] = {-1, -1};
     struct stat file_stat = {0};
+    off_t bytes_sent_overall = 0;
+    loff_t position = range->offset;
+    loff_t *position_ptr = range->seekable ? &position : NULL;
 
-    // Get file size
-    if (fstat(file_fd, &file_stat) == -1) {
+    if (fstat(range->fd, &file_stat) == -1) {
         perror("fstat failed");
         goto cleanup;
     }
 
-    // sending N - expecting to send an int in one call
-    file_size = htonl((uint32_t)file_stat.st_size);
-    bytes_sent = send(sock_fd, &file_size, sizeof(file_size), 0);
-    if (bytes_sent != sizeof(file_size)) {
-        perror("send N failed");
-        goto cleanup;
+    // a pipe input can be spliced straight into the socket
+    if (!S_ISFIFO(file_stat.st_mode)) {
+        if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            perror("pipe failed");
+            goto cleanup;
+        }
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);  // best effort, fewer round trips
     }
 
-    bytes_sent_overall = 0;
-    while (bytes_sent_overall < file_stat.st_size) {
+    while (bytes_sent_overall < range->length) {
+        ssize_t in_pipe = 0;
+        if (pipe_fds[0] == -1) {
+            in_pipe = splice_all(range->fd, position_ptr, sock_fd, range->length - bytes_sent_overall);
+        } else {
+            in_pipe = splice_all(range->fd, position_ptr, pipe_fds[1], range->length - bytes_sent_overall);
+        }
+        if (in_pipe == -1) {
+            if (bytes_sent_overall == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                return_code = TRANSFER_UNSUPPORTED;
+                goto cleanup;
+            }
+            perror("splice failed");
+            goto cleanup;
+        }
+        if (in_pipe == 0) {
+            fprintf(stderr, "file read failed: file is shorter than its size\n");
+            goto cleanup;
+        }
+
+        // drain what was just put in the pipe
+        for (ssize_t drained = 0; pipe_fds[0] != -1 && drained < in_pipe;) {
+            ssize_t chunk_size = splice_all(pipe_fds[0], NULL, sock_fd, in_pipe - drained);
+            if (chunk_size == -1) {
+                perror("splice failed");
+                goto cleanup;
+            }
+            drained += chunk_size;
+        }
+
+        bytes_sent_overall += in_pipe;
+    }
+
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    if (pipe_fds[0] != -1) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    return return_code;
+}
+
+// last resort, copies through a user space buffer
+int send_with_copy(int sock_fd, const struct file_range *range) {
+    ssize_t bytes_read = 0;
+    ssize_t bytes_sent = 0;
+    off_t bytes_sent_overall = 0;
+    char buffer[BUFFER_SIZE] = {0};
+
+    while (bytes_sent_overall < range->length) {
+        size_t to_read = range->length - bytes_sent_overall;
+        if (to_read > sizeof(buffer)) {
+            to_read = sizeof(buffer);
+        }
+
         // read from file into buffer
-        bytes_read = read(file_fd, buffer, sizeof(buffer));
+        if (range->seekable) {
+            bytes_read = pread(range->fd, buffer, to_read, range->offset + bytes_sent_overall);
+        } else {
+            bytes_read = read(range->fd, buffer, to_read);
+        }
         if (bytes_read == -1) {
             perror("file read failed");
-            goto cleanup;
+            return GENERAL_ERROR;
+        }
+        if (bytes_read == 0) {
+            fprintf(stderr, "file read failed: file is shorter than its size\n");
+            return GENERAL_ERROR;
         }
 
         // send buffer to server
@@ -50,7 +254,7 @@ int handle_client(int sock_fd, int file_fd) {
             ssize_t chunk_size = send(sock_fd, buffer + bytes_sent, bytes_read - bytes_sent, 0);
             if (chunk_size == -1) {
                 perror("send failed");
-                goto cleanup;
+                return GENERAL_ERROR;
             }
             bytes_sent += chunk_size;
         }
@@ -58,77 +262,1338 @@ int handle_client(int sock_fd, int file_fd) {
         bytes_sent_overall += bytes_read;
     }
 
-    // read pcc_count from server - expecting to receive an int in one call
-    bytes_read = recv(sock_fd, &pcc_count, sizeof(pcc_count), 0);
-    if (bytes_read != sizeof(pcc_count)) {
-        perror("recv pcc_count failed");
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Reads MSG_ZEROCOPY completion notifications off the socket error queue. Each notification
+ * covers a range of send calls, *completed is advanced by its length.
+ * Returns GENERAL_ERROR if the queue reports a real error.
+ */
+int reap_zerocopy_completions(int sock_fd, uint32_t *completed) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 8];
+
+    while (true) {
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sock_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return GENERAL_SUCCESS;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recvmsg MSG_ERRQUEUE failed");
+            return GENERAL_ERROR;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+                errno = err->ee_errno;
+                perror("zerocopy send failed");
+                return GENERAL_ERROR;
+            }
+            // ee_info..ee_data is the inclusive range of completed send calls
+            *completed += err->ee_data - err->ee_info + 1;
+        }
+    }
+}
+
+int wait_for_zerocopy_completion(int sock_fd, uint32_t *completed) {
+    struct pollfd pfd = {.fd = sock_fd, .events = 0};  // POLLERR is always reported
+
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+        perror("poll failed");
+        return GENERAL_ERROR;
+    }
+    return reap_zerocopy_completions(sock_fd, completed);
+}
+
+/*
+ * Maps the file and sends it with MSG_ZEROCOPY, the NIC reads straight from the page cache.
+ * The pages stay pinned until the kernel reports every send as complete, only then is the
+ * mapping released.
+ */
+int send_with_zerocopy(int sock_fd, const struct file_range *range) {
+    int return_code = GENERAL_ERROR;
+    char *mapping = MAP_FAILED;
+    off_t bytes_sent_overall = 0;
+    uint32_t sends = 0;
+    uint32_t completed = 0;
+    int opt_true = 1;
+    // mappings start on a page boundary, the range may not
+    off_t map_offset = range->offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+    size_t map_length = range->length + (range->offset - map_offset);
+
+    if (!range->seekable) {
+        return TRANSFER_UNSUPPORTED;
+    }
+    if (range->length == 0) {
+        return GENERAL_SUCCESS;
+    }
+
+    // older kernels and non TCP sockets do not support it
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_ZEROCOPY, &opt_true, sizeof(opt_true)) != 0) {
+        return TRANSFER_UNSUPPORTED;
+    }
+
+    mapping = mmap(NULL, map_length, PROT_READ, MAP_SHARED, range->fd, map_offset);
+    if (mapping == MAP_FAILED) {
+        return TRANSFER_UNSUPPORTED;
+    }
+    madvise(mapping, map_length, MADV_SEQUENTIAL);
+    const char *data = mapping + (range->offset - map_offset);
+
+    while (bytes_sent_overall < range->length) {
+        size_t to_send = range->length - bytes_sent_overall;
+        if (to_send > ZEROCOPY_CHUNK_SIZE) {
+            to_send = ZEROCOPY_CHUNK_SIZE;
+        }
+
+        ssize_t chunk_size = send(sock_fd, data + bytes_sent_overall, to_send, MSG_ZEROCOPY);
+        if (chunk_size == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS && sends > completed) {
+                // out of option memory for pinned pages, let some sends complete first
+                if (GENERAL_SUCCESS != wait_for_zerocopy_completion(sock_fd, &completed)) {
+                    goto cleanup;
+                }
+                continue;
+            }
+            perror("send failed");
+            goto cleanup;
+        }
+
+        sends++;
+        bytes_sent_overall += chunk_size;
+        if (GENERAL_SUCCESS != reap_zerocopy_completions(sock_fd, &completed)) {
+            goto cleanup;
+        }
+    }
+
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    // a corked tail would only complete once the cork times out
+    set_cork(sock_fd, 0);
+
+    // never unmap pages the kernel may still be reading from
+    while (completed < sends) {
+        if (GENERAL_SUCCESS != wait_for_zerocopy_completion(sock_fd, &completed)) {
+            return_code = GENERAL_ERROR;
+            if (errno != EINTR) {
+                // the socket is broken, completions will not come, leaking the mapping is the safe choice
+                return return_code;
+            }
+        }
+    }
+    munmap(mapping, map_length);
+    return return_code;
+}
+
+// zerocopy only pays off for large files whose pages are already cached
+bool should_use_zerocopy(const struct file_range *range) {
+    bool hot = false;
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t map_offset = range->offset & ~((off_t)page_size - 1);
+    size_t map_length = range->length + (range->offset - map_offset);
+    size_t pages = (map_length + page_size - 1) / page_size;
+    unsigned char *residency = NULL;
+
+    if (!range->seekable || range->length < ZEROCOPY_THRESHOLD) {
+        return false;
+    }
+
+    void *mapping = mmap(NULL, map_length, PROT_READ, MAP_SHARED, range->fd, map_offset);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    residency = malloc(pages);
+    if (residency != NULL && mincore(mapping, map_length, residency) == 0) {
+        size_t resident = 0;
+        for (size_t i = 0; i < pages; i++) {
+            resident += residency[i] & 1;
+        }
+        hot = resident * 100 >= pages * ZEROCOPY_MIN_RESIDENT_PERCENT;
+    }
+
+    free(residency);
+    munmap(mapping, map_length);
+    return hot;
+}
+
+// streams the range of the file, trying the copy-free paths first
+int send_file_contents(int sock_fd, const struct file_range *range, enum send_mode mode) {
+    int return_code = TRANSFER_UNSUPPORTED;
+
+    if (mode == SEND_MODE_COPY) {
+        return send_with_copy(sock_fd, range);
+    }
+
+    if (mode == SEND_MODE_ZEROCOPY || (mode == SEND_MODE_AUTO && should_use_zerocopy(range))) {
+        return_code = send_with_zerocopy(sock_fd, range);
+    }
+    if (return_code == TRANSFER_UNSUPPORTED) {
+        return_code = send_with_sendfile(sock_fd, range);
+    }
+    if (return_code == TRANSFER_UNSUPPORTED) {
+        return_code = send_with_splice(sock_fd, range);
+    }
+    if (return_code == TRANSFER_UNSUPPORTED) {
+        return_code = send_with_copy(sock_fd, range);
+    }
+    return return_code;
+}
+
+int send_all(int sock_fd, const void *data, size_t len, int flags) {
+    size_t bytes_sent = 0;
+
+    while (bytes_sent < len) {
+        ssize_t chunk_size = send(sock_fd, (const char *)data + bytes_sent, len - bytes_sent, flags);
+        if (chunk_size == -1) {
+            perror("send failed");
+            return GENERAL_ERROR;
+        }
+        bytes_sent += chunk_size;
+    }
+
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Streams the range as v2 chunks: a regular file until its length is sent, anything else (a pipe,
+ * stdin) until EOF. Whatever one read returns becomes a chunk, so nothing beyond CHUNK_SIZE is
+ * ever buffered. With compress every chunk is one LZ4 block, at worst slightly bigger than
+ * what was read, so it still fits its 32 bit length.
+ */
+int send_chunked(int sock_fd, const struct file_range *range, bool compress) {
+    int return_code = GENERAL_ERROR;
+    off_t sent = 0;
+    char *buffer = malloc(CHUNK_SIZE);
+    char *encoded = compress ? malloc(PCC_LZ4_MAX_ENCODED_SIZE(CHUNK_SIZE)) : NULL;
+    uint32_t *hash_table = compress ? malloc(PCC_LZ4_HASH_SIZE * sizeof(*hash_table)) : NULL;
+    if (buffer == NULL || (compress && (encoded == NULL || hash_table == NULL))) {
+        perror("malloc failed");
         goto cleanup;
     }
 
-    pcc_count = ntohl(pcc_count);
-    printf("# of printable characters: %u\n", pcc_count);
+    while (true) {
+        ssize_t bytes_read = 0;
+        if (range->seekable) {
+            size_t to_read = range->length - sent < CHUNK_SIZE ? (size_t)(range->length - sent) : CHUNK_SIZE;
+            bytes_read = to_read > 0 ? pread(range->fd, buffer, to_read, range->offset + sent) : 0;
+        } else {
+            bytes_read = read(range->fd, buffer, CHUNK_SIZE);
+        }
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("file read failed");
+            goto cleanup;
+        }
+        if (bytes_read == 0 && range->seekable && sent < range->length) {
+            fprintf(stderr, "file read failed: file shrank while sending\n");
+            goto cleanup;
+        }
+        sent += bytes_read;
+
+        const char *chunk = buffer;
+        size_t chunk_size = bytes_read;
+        if (compress && bytes_read > 0) {
+            chunk = encoded;
+            chunk_size = pcc_lz4_encode(buffer, bytes_read, encoded, hash_table);
+        }
+
+        uint32_t chunk_length = htonl((uint32_t)chunk_size);
+        if (GENERAL_SUCCESS != send_all(sock_fd, &chunk_length, sizeof(chunk_length), MSG_MORE)) {
+            goto cleanup;
+        }
+        if (chunk_size == 0) {
+            break;  // the empty chunk ends the stream
+        }
+        if (GENERAL_SUCCESS != send_all(sock_fd, chunk, chunk_size, MSG_MORE)) {
+            goto cleanup;
+        }
+    }
 
     return_code = GENERAL_SUCCESS;
 cleanup:
+    free(buffer);
+    free(encoded);
+    free(hash_table);
     return return_code;
 }
 
-int main(int argc, char *argv[]) {
+/*
+ * send_chunked for PCC_V2_FLAG_SHM: the range is read straight into the ring and only the chunk
+ * lengths go over the socket. A chunk never wraps around the end of the ring, the server would
+ * take one that does as well. Returns once the server counted all of it, so the ring is free for
+ * the next request.
+ */
+int send_shm_chunks(int sock_fd, const struct file_range *range, struct pcc_shm_ring *ring) {
+    size_t chunk_limit = ring->capacity / SHM_CHUNKS_PER_RING;
+    off_t sent = 0;
+
+    ring->position = 0;
+    while (true) {
+        size_t start = ring->position % ring->capacity;
+        size_t to_read = ring->capacity - start < chunk_limit ? ring->capacity - start : chunk_limit;
+        if (range->seekable && (off_t)to_read > range->length - sent) {
+            to_read = range->length - sent;
+        }
+
+        // the server may still be counting the bytes this chunk goes over
+        if (ring->position + to_read > ring->capacity &&
+            pcc_shm_wait(ring, sock_fd, ring->position + to_read - ring->capacity) == -1) {
+            perror("wait for shared memory ring failed");
+            return GENERAL_ERROR;
+        }
+
+        ssize_t bytes_read = 0;
+        if (range->seekable) {
+            bytes_read = to_read > 0 ? pread(range->fd, ring->data + start, to_read, range->offset + sent) : 0;
+        } else {
+            bytes_read = read(range->fd, ring->data + start, to_read);
+        }
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("file read failed");
+            return GENERAL_ERROR;
+        }
+        if (bytes_read == 0 && range->seekable && sent < range->length) {
+            fprintf(stderr, "file read failed: file shrank while sending\n");
+            return GENERAL_ERROR;
+        }
+        sent += bytes_read;
+        ring->position += bytes_read;
+
+        uint32_t chunk_length = htonl((uint32_t)bytes_read);
+        if (GENERAL_SUCCESS != send_all(sock_fd, &chunk_length, sizeof(chunk_length), 0)) {
+            return GENERAL_ERROR;
+        }
+        if (bytes_read == 0) {
+            break;  // the empty chunk ends the stream
+        }
+    }
+
+    if (pcc_shm_wait(ring, sock_fd, ring->position) == -1) {
+        perror("wait for shared memory ring failed");
+        return GENERAL_ERROR;
+    }
+    pcc_shm_ring_reset(ring);
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Sends one request for the range. keep_alive (v2 only) leaves the connection open for another
+ * request, compress (v2 only) sends the body as LZ4 blocks, a byte_class other than printable
+ * (v2 only) is what the reply counts, a byte_set (v2 only) counts instead of the class, histogram
+ * (v2 only) has the reply carry the bins, utf8 (v2 only) has it count printable codepoints, a ring
+ * (v2 only, over a Unix socket) carries the body instead of the socket. The version used goes to *version, the size of the
+ * reply depends on it.
+ */
+int send_request(int sock_fd, const struct file_range *range, enum send_mode mode, enum protocol protocol,
+                 bool keep_alive, bool compress, uint8_t byte_class, const struct pcc_byte_set *byte_set,
+                 bool histogram, bool utf8, struct pcc_shm_ring *ring, int *version) {
     int return_code = GENERAL_ERROR;
-    int sock_fd = -1;
-    int file_fd = -1;
-    struct sockaddr_in serv_addr = {0};
-    struct in_addr addr = {0};
-    uint16_t port = 0;
+    // only a regular file has a length to announce upfront, and the compressed length is only known
+    // once sent, the ring takes chunks of whatever size
+    bool chunked = !range->seekable || compress || ring != NULL;
+    bool fits_v1 = !chunked && range->length <= PCC_V1_MAX_LENGTH && !keep_alive && byte_class == PCC_CLASS_PRINTABLE &&
+                   byte_set == NULL && !histogram && !utf8;
+    bool v2 = protocol == PROTOCOL_V2 || (protocol == PROTOCOL_AUTO && !fits_v1);
 
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <ip> <port> <file path>\n", argv[0]);
+    if (!v2 && !fits_v1) {
+        fprintf(stderr, "protocol v1 needs a regular file smaller than 4GiB, no compression, no shared memory, "
+                        "the printable class, no byte set, no histogram and no UTF-8, use --protocol 2\n");
         goto cleanup;
     }
 
-    if (inet_pton(AF_INET, argv[1], &addr) != 1) {
-        fprintf(stderr, "Invalid IP address: %s\n", argv[1]);
-        goto cleanup;
+    set_cork(sock_fd, 1);
+
+    // sending the header, MSG_MORE holds it back for the data
+    if (v2) {
+        struct pcc_v2_header header = {
+            .magic = htonl(PCC_V2_MAGIC),
+            .version = PCC_V2_VERSION,
+            .flags = (chunked ? PCC_V2_FLAG_CHUNKED : 0) | (keep_alive ? PCC_V2_FLAG_KEEP_ALIVE : 0) |
+                     (compress ? PCC_V2_FLAG_LZ4 : 0) | (ring != NULL ? PCC_V2_FLAG_SHM : 0) |
+                     (utf8 ? PCC_V2_FLAG_UTF8 : 0) | (byte_set != NULL ? PCC_V2_FLAG_BYTE_SET : 0) |
+                     (histogram ? PCC_V2_FLAG_HISTOGRAM : 0),
+            .byte_class = byte_class,
+        };
+        if (GENERAL_SUCCESS != send_all(sock_fd, &header, sizeof(header), MSG_MORE)) {
+            goto cleanup;
+        }
+        if (byte_set != NULL && GENERAL_SUCCESS != send_all(sock_fd, byte_set, sizeof(*byte_set), MSG_MORE)) {
+            goto cleanup;
+        }
+        if (ring != NULL && !ring->handed_over) {
+            if (pcc_shm_send_fd(sock_fd, ring->fd) == -1) {
+                perror("send shared memory ring failed");
+                goto cleanup;
+            }
+            ring->handed_over = true;
+        }
+        if (!chunked) {
+            uint64_t file_size = pcc_hton64((uint64_t)range->length);
+            if (GENERAL_SUCCESS != send_all(sock_fd, &file_size, sizeof(file_size), MSG_MORE)) {
+                goto cleanup;
+            }
+        }
+    } else {
+        uint32_t file_size = htonl((uint32_t)range->length);
+        if (GENERAL_SUCCESS != send_all(sock_fd, &file_size, sizeof(file_size), MSG_MORE)) {
+            goto cleanup;
+        }
     }
 
-    if (sscanf(argv[2], "%hu", &port) != 1) {
-        fprintf(stderr, "Invalid port number: %s\n", argv[2]);
+    if (ring != NULL) {
+        if (GENERAL_SUCCESS != send_shm_chunks(sock_fd, range, ring)) {
+            goto cleanup;
+        }
+    } else if (chunked) {
+        if (GENERAL_SUCCESS != send_chunked(sock_fd, range, compress)) {
+            goto cleanup;
+        }
+    } else if (GENERAL_SUCCESS != send_file_contents(sock_fd, range, mode)) {
         goto cleanup;
     }
 
-    file_fd = open(argv[3], O_RDONLY);
-    if (file_fd == -1) {
+    // flush the last partial segment
+    set_cork(sock_fd, 0);
+
+    *version = v2 ? PCC_V2_VERSION : 1;
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    return return_code;
+}
+
+// reads pcc_count from server, 64 bit in v2, and after it the bins into histogram unless it is NULL
+int recv_reply(int sock_fd, int version, uint64_t *pcc_count, uint64_t *histogram) {
+    ssize_t bytes_read = 0;
+
+    if (version == PCC_V2_VERSION) {
+        uint64_t reply = 0;
+        bytes_read = recv(sock_fd, &reply, sizeof(reply), MSG_WAITALL);
+        if (bytes_read != sizeof(reply)) {
+            perror("recv pcc_count failed");
+            return GENERAL_ERROR;
+        }
+        *pcc_count = pcc_ntoh64(reply);
+        if (histogram != NULL) {
+            size_t histogram_size = PCC_HISTOGRAM_BINS * sizeof(*histogram);
+            bytes_read = recv(sock_fd, histogram, histogram_size, MSG_WAITALL);
+            if (bytes_read != (ssize_t)histogram_size) {
+                perror("recv histogram failed");
+                return GENERAL_ERROR;
+            }
+            for (int i = 0; i < PCC_HISTOGRAM_BINS; i++) {
+                histogram[i] = pcc_ntoh64(histogram[i]);
+            }
+        }
+    } else {
+        uint32_t reply = 0;
+        bytes_read = recv(sock_fd, &reply, sizeof(reply), MSG_WAITALL);
+        if (bytes_read != sizeof(reply)) {
+            perror("recv pcc_count failed");
+            return GENERAL_ERROR;
+        }
+        *pcc_count = ntohl(reply);
+    }
+
+    return GENERAL_SUCCESS;
+}
+
+int handle_client(int sock_fd, const struct file_range *range, enum send_mode mode, enum protocol protocol,
+                  bool compress, uint8_t byte_class, const struct pcc_byte_set *byte_set, bool utf8,
+                  struct pcc_shm_ring *ring, uint64_t *histogram, uint64_t *pcc_count) {
+    int version = 0;
+
+    if (GENERAL_SUCCESS != send_request(sock_fd, range, mode, protocol, false, compress, byte_class, byte_set,
+                                        histogram != NULL, utf8, ring, &version)) {
+        return GENERAL_ERROR;
+    }
+    return recv_reply(sock_fd, version, pcc_count, histogram);
+}
+
+// opens the file ("-" is stdin) as one range covering all of it
+int open_input(const char *path, struct file_range *range) {
+    struct stat file_stat = {0};
+
+    range->fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+    if (range->fd == -1) {
         perror("file open failed");
-        goto cleanup;
+        return GENERAL_ERROR;
+    }
+
+    // Get file size
+    if (fstat(range->fd, &file_stat) == -1) {
+        perror("fstat failed");
+        close(range->fd);
+        range->fd = -1;
+        return GENERAL_ERROR;
     }
 
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    range->offset = 0;
+    range->length = file_stat.st_size;
+    range->seekable = S_ISREG(file_stat.st_mode);
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Returns a connected socket, or -1. With address->shm the connection gets its ring, which the
+ * caller unmaps along with closing the socket.
+ */
+int connect_to_server(const struct server_address *address, struct pcc_shm_ring *ring) {
+    int sock_fd = socket(address->storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sock_fd == -1) {
         perror("socket creation failed");
+        return -1;
+    }
+
+    if (connect(sock_fd, (const struct sockaddr *)&address->storage, address->length) == -1) {
+        perror("connect failed");
+        close(sock_fd);
+        return -1;
+    }
+
+    if (address->shm && pcc_shm_ring_create(ring, SHM_RING_CAPACITY) == -1) {
+        perror("create shared memory ring failed");
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+int read_pipelined_reply(int sock_fd, const char *path, uint64_t *total) {
+    uint64_t pcc_count = 0;
+
+    if (GENERAL_SUCCESS != recv_reply(sock_fd, PCC_V2_VERSION, &pcc_count, NULL)) {
+        return GENERAL_ERROR;
+    }
+    printf("%s: %" PRIu64 "\n", path, pcc_count);
+    *total += pcc_count;
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Counts several files over one keep-alive connection. Requests are pipelined, up to
+ * MAX_IN_FLIGHT of them go out before the oldest reply is read, so unread replies never fill
+ * the socket buffers. Each file's count is printed as its reply arrives, the sum goes to *total.
+ */
+int run_pipelined(const struct server_address *address, char *paths[], int paths_count, enum send_mode mode,
+                  bool compress, uint8_t byte_class, const struct pcc_byte_set *byte_set, bool utf8, uint64_t *total) {
+    int return_code = GENERAL_ERROR;
+    int sock_fd = -1;
+    int replies_read = 0;
+    struct pcc_shm_ring ring = {.fd = -1, .header = MAP_FAILED};
+
+    sock_fd = connect_to_server(address, &ring);
+    if (sock_fd == -1) {
         goto cleanup;
     }
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr = addr;
-    serv_addr.sin_port = htons(port);
+    for (int i = 0; i < paths_count; i++) {
+        if (i - replies_read == MAX_IN_FLIGHT) {
+            if (GENERAL_SUCCESS != read_pipelined_reply(sock_fd, paths[replies_read], total)) {
+                goto cleanup;
+            }
+            replies_read++;
+        }
 
-    if (connect(sock_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1) {
-        perror("connect failed");
+        struct file_range range = {0};
+        int version = 0;
+        if (GENERAL_SUCCESS != open_input(paths[i], &range)) {
+            goto cleanup;
+        }
+        // the last request lets the server close the connection
+        int sent = send_request(sock_fd, &range, mode, PROTOCOL_V2, i + 1 < paths_count, compress, byte_class,
+                                byte_set, false, utf8, address->shm ? &ring : NULL, &version);
+        close(range.fd);
+        if (GENERAL_SUCCESS != sent) {
+            goto cleanup;
+        }
+    }
+
+    for (; replies_read < paths_count; replies_read++) {
+        if (GENERAL_SUCCESS != read_pipelined_reply(sock_fd, paths[replies_read], total)) {
+            goto cleanup;
+        }
+    }
+
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    pcc_shm_ring_unmap(&ring);
+    if (sock_fd != -1) {
+        close(sock_fd);
+    }
+    return return_code;
+}
+
+// one connection uploading one range of the file
+int run_upload(struct upload *upload) {
+    int return_code = GENERAL_ERROR;
+    int sock_fd = -1;
+    struct pcc_shm_ring ring = {.fd = -1, .header = MAP_FAILED};
+
+    sock_fd = connect_to_server(upload->address, &ring);
+    if (sock_fd == -1) {
         goto cleanup;
     }
 
-    if (GENERAL_SUCCESS != handle_client(sock_fd, file_fd)) {
+    if (GENERAL_SUCCESS != handle_client(sock_fd, &upload->range, upload->mode, upload->protocol, upload->compress,
+                                          upload->byte_class, upload->byte_set, upload->utf8,
+                                          upload->address->shm ? &ring : NULL, upload->histogram, &upload->pcc_count)) {
         goto cleanup;
     }
 
     return_code = GENERAL_SUCCESS;
+cleanup:
+    pcc_shm_ring_unmap(&ring);
+    if (sock_fd != -1) {
+        close(sock_fd);
+    }
+    return return_code;
+}
+
+void *upload_thread_main(void *arg) {
+    struct upload *upload = arg;
+    upload->return_code = run_upload(upload);
+    return NULL;
+}
+
+/*
+ * Splits the file into `streams` byte ranges and uploads each over its own connection from its
+ * own thread. The server counts every range as a separate client, the printed count is their sum.
+ */
+int run_uploads(struct upload *uploads, unsigned int streams) {
+    int return_code = GENERAL_SUCCESS;
+    unsigned int started = 0;
+
+    if (streams == 1) {
+        return run_upload(&uploads[0]);
+    }
+
+    for (; started < streams; started++) {
+        int error = pthread_create(&uploads[started].thread, NULL, upload_thread_main, &uploads[started]);
+        if (error != 0) {
+            errno = error;
+            perror("pthread_create failed");
+            return_code = GENERAL_ERROR;
+            break;
+        }
+    }
+
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(uploads[i].thread, NULL);
+        if (uploads[i].return_code != GENERAL_SUCCESS) {
+            return_code = GENERAL_ERROR;
+        }
+    }
+
+    return return_code;
+}
+
+// a file opened by an I/O thread, for a connection to send
+struct batch_job {
+    size_t index;  // into paths
+    struct file_range range;
+};
+
+/*
+ * Batch mode state, shared by the I/O threads and the connections. I/O threads open the files in
+ * order and read their start into the page cache, so the disk waits happen on them and not on a
+ * connection. Connections take the ready files and pipeline them as keep-alive requests.
+ */
+struct batch {
+    struct server_address address;
+    enum send_mode mode;
+    bool compress;
+    uint8_t byte_class;
+    const struct pcc_byte_set *byte_set;
+    bool utf8;
+    char **paths;  // every file to count, directories already walked
+    size_t paths_count;
+    size_t paths_capacity;
+    pthread_mutex_t lock;  // guards everything below
+    // only signalled when the ring stops being empty, or drained to the low watermark, so most
+    // files change hands without waking anyone
+    pthread_cond_t file_ready;  // or the batch ended
+    pthread_cond_t slot_free;   // or the batch failed
+    size_t next_to_open;
+    struct batch_job ready[BATCH_READY_CAPACITY];  // a ring
+    size_t ready_head;
+    size_t ready_count;
+    unsigned int io_threads_running;
+    bool failed;  // a connection broke, everyone stops
+    size_t files_skipped;
+    uint64_t total;
+};
+
+struct batch_connection {
+    struct batch *batch;
+    int return_code;
+    pthread_t thread;
+};
+
+int batch_add_file(struct batch *batch, const char *path) {
+    if (batch->paths_count == batch->paths_capacity) {
+        size_t capacity = batch->paths_capacity > 0 ? batch->paths_capacity * 2 : 1024;
+        char **paths = realloc(batch->paths, capacity * sizeof(*paths));
+        if (paths == NULL) {
+            perror("realloc failed");
+            return GENERAL_ERROR;
+        }
+        batch->paths = paths;
+        batch->paths_capacity = capacity;
+    }
+
+    batch->paths[batch->paths_count] = strdup(path);
+    if (batch->paths[batch->paths_count] == NULL) {
+        perror("strdup failed");
+        return GENERAL_ERROR;
+    }
+    batch->paths_count++;
+    return GENERAL_SUCCESS;
+}
+
+// adds every regular file under the directory, symbolic links are not followed so there are no loops
+int batch_walk_directory(struct batch *batch, const char *path) {
+    int return_code = GENERAL_ERROR;
+    char *child = NULL;
+    struct dirent *entry = NULL;
+    DIR *dir = opendir(path);
+
+    if (dir == NULL) {
+        fprintf(stderr, "Skipping %s: %s\n", path, strerror(errno));
+        batch->files_skipped++;
+        return GENERAL_SUCCESS;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        free(child);
+        child = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        if (child == NULL) {
+            perror("malloc failed");
+            goto cleanup;
+        }
+        sprintf(child, "%s/%s", path, entry->d_name);
+
+        // not every file system fills in d_type
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat child_stat = {0};
+            if (lstat(child, &child_stat) == -1) {
+                fprintf(stderr, "Skipping %s: %s\n", child, strerror(errno));
+                batch->files_skipped++;
+                continue;
+            }
+            type = S_ISDIR(child_stat.st_mode) ? DT_DIR : S_ISREG(child_stat.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
 
+        if (type == DT_DIR && GENERAL_SUCCESS != batch_walk_directory(batch, child)) {
+            goto cleanup;
+        }
+        if (type == DT_REG && GENERAL_SUCCESS != batch_add_file(batch, child)) {
+            goto cleanup;
+        }
+    }
+
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    free(child);
+    closedir(dir);
+    return return_code;
+}
+
+// a path given on the command line: a directory is walked, anything else is counted as is
+int batch_add_input(struct batch *batch, const char *path) {
+    struct stat input_stat = {0};
+
+    if (strcmp(path, "-") != 0 && stat(path, &input_stat) == 0 && S_ISDIR(input_stat.st_mode)) {
+        return batch_walk_directory(batch, path);
+    }
+    return batch_add_file(batch, path);  // a missing file is reported once it is opened
+}
+
+void batch_fail(struct batch *batch) {
+    pthread_mutex_lock(&batch->lock);
+    batch->failed = true;
+    pthread_cond_broadcast(&batch->file_ready);
+    pthread_cond_broadcast(&batch->slot_free);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+void *batch_io_thread_main(void *arg) {
+    struct batch *batch = arg;
+
+    while (true) {
+        pthread_mutex_lock(&batch->lock);
+        if (batch->failed || batch->next_to_open == batch->paths_count) {
+            pthread_mutex_unlock(&batch->lock);
+            break;
+        }
+        struct batch_job job = {.index = batch->next_to_open++};
+        pthread_mutex_unlock(&batch->lock);
+
+        if (GENERAL_SUCCESS != open_input(batch->paths[job.index], &job.range)) {
+            fprintf(stderr, "Skipping %s\n", batch->paths[job.index]);
+            pthread_mutex_lock(&batch->lock);
+            batch->files_skipped++;
+            pthread_mutex_unlock(&batch->lock);
+            continue;
+        }
+        if (job.range.seekable) {
+            // blocks until the data is read, the connection then finds it cached
+            readahead(job.range.fd, 0, job.range.length < BATCH_PREFETCH_SIZE ? job.range.length : BATCH_PREFETCH_SIZE);
+        }
+
+        pthread_mutex_lock(&batch->lock);
+        while (batch->ready_count == BATCH_READY_CAPACITY && !batch->failed) {
+            pthread_cond_wait(&batch->slot_free, &batch->lock);
+        }
+        if (batch->failed) {
+            pthread_mutex_unlock(&batch->lock);
+            close(job.range.fd);
+            break;
+        }
+        batch->ready[(batch->ready_head + batch->ready_count) % BATCH_READY_CAPACITY] = job;
+        if (batch->ready_count++ == 0) {
+            pthread_cond_broadcast(&batch->file_ready);
+        }
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    if (--batch->io_threads_running == 0) {
+        pthread_cond_broadcast(&batch->file_ready);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+// waits for the next ready file, false once there are none left or the batch failed
+bool batch_take(struct batch *batch, struct batch_job *job) {
+    bool taken = false;
+
+    pthread_mutex_lock(&batch->lock);
+    while (batch->ready_count == 0 && batch->io_threads_running > 0 && !batch->failed) {
+        pthread_cond_wait(&batch->file_ready, &batch->lock);
+    }
+    if (batch->ready_count > 0 && !batch->failed) {
+        *job = batch->ready[batch->ready_head];
+        batch->ready_head = (batch->ready_head + 1) % BATCH_READY_CAPACITY;
+        if (--batch->ready_count == BATCH_READY_LOW_WATERMARK) {
+            pthread_cond_broadcast(&batch->slot_free);
+        }
+        taken = true;
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return taken;
+}
+
+int batch_read_reply(struct batch *batch, int sock_fd, size_t index) {
+    uint64_t pcc_count = 0;
+
+    if (GENERAL_SUCCESS != recv_reply(sock_fd, PCC_V2_VERSION, &pcc_count, NULL)) {
+        return GENERAL_ERROR;
+    }
+    printf("%s: %" PRIu64 "\n", batch->paths[index], pcc_count);
+    pthread_mutex_lock(&batch->lock);
+    batch->total += pcc_count;
+    pthread_mutex_unlock(&batch->lock);
+    return GENERAL_SUCCESS;
+}
+
+// one long-lived connection, pipelining whatever files are ready like run_pipelined does
+int run_batch_connection(struct batch *batch) {
+    int return_code = GENERAL_ERROR;
+    int sock_fd = -1;
+    size_t in_flight[MAX_IN_FLIGHT] = {0};  // indexes of the files whose replies are still due, a ring
+    size_t sent = 0;
+    size_t replies_read = 0;
+    struct batch_job job = {0};
+    struct pcc_shm_ring ring = {.fd = -1, .header = MAP_FAILED};
+
+    sock_fd = connect_to_server(&batch->address, &ring);
+    if (sock_fd == -1) {
+        goto cleanup;
+    }
+
+    while (batch_take(batch, &job)) {
+        if (sent - replies_read == MAX_IN_FLIGHT) {
+            if (GENERAL_SUCCESS != batch_read_reply(batch, sock_fd, in_flight[replies_read % MAX_IN_FLIGHT])) {
+                close(job.range.fd);
+                goto cleanup;
+            }
+            replies_read++;
+        }
+
+        // every request is keep-alive, the server takes the close between requests as the end
+        int version = 0;
+        int sent_request = send_request(sock_fd, &job.range, batch->mode, PROTOCOL_V2, true, batch->compress,
+                                        batch->byte_class, batch->byte_set, false, batch->utf8,
+                                        batch->address.shm ? &ring : NULL, &version);
+        close(job.range.fd);
+        if (GENERAL_SUCCESS != sent_request) {
+            goto cleanup;
+        }
+        in_flight[sent % MAX_IN_FLIGHT] = job.index;
+        sent++;
+    }
+
+    for (; replies_read < sent; replies_read++) {
+        if (GENERAL_SUCCESS != batch_read_reply(batch, sock_fd, in_flight[replies_read % MAX_IN_FLIGHT])) {
+            goto cleanup;
+        }
+    }
+
+    return_code = GENERAL_SUCCESS;
 cleanup:
+    if (return_code != GENERAL_SUCCESS) {
+        batch_fail(batch);
+    }
+    pcc_shm_ring_unmap(&ring);
     if (sock_fd != -1) {
         close(sock_fd);
     }
-    if (file_fd != -1) {
-        close(file_fd);
+    return return_code;
+}
+
+void *batch_connection_thread_main(void *arg) {
+    struct batch_connection *connection = arg;
+    connection->return_code = run_batch_connection(connection->batch);
+    return NULL;
+}
+
+/*
+ * Counts every file under the given paths over `streams` keep-alive connections, with
+ * `io_threads` threads opening and reading the files ahead of them. Each file's count is printed
+ * as its reply arrives, in no particular order, the sum goes to *total. Files that can not be
+ * opened are skipped and reported, the batch still fails in the end.
+ */
+int run_batch(const struct server_address *address, char *paths[], int paths_count, enum send_mode mode,
+              bool compress, uint8_t byte_class, const struct pcc_byte_set *byte_set, bool utf8, unsigned int streams,
+              unsigned int io_threads, uint64_t *total) {
+    int return_code = GENERAL_ERROR;
+    struct batch batch = {.address = *address,
+                          .mode = mode,
+                          .compress = compress,
+                          .byte_class = byte_class,
+                          .byte_set = byte_set,
+                          .utf8 = utf8};
+    pthread_t io_thread_ids[MAX_IO_THREADS];
+    struct batch_connection connections[MAX_STREAMS];
+    unsigned int io_threads_started = 0;
+    unsigned int connections_started = 0;
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.file_ready, NULL);
+    pthread_cond_init(&batch.slot_free, NULL);
+
+    for (int i = 0; i < paths_count; i++) {
+        if (GENERAL_SUCCESS != batch_add_input(&batch, paths[i])) {
+            goto cleanup;
+        }
+    }
+
+    // no point in connections that would have nothing to send
+    if (streams > batch.paths_count) {
+        streams = batch.paths_count > 0 ? batch.paths_count : 1;
+    }
+
+    batch.io_threads_running = io_threads;
+    for (; io_threads_started < io_threads; io_threads_started++) {
+        int error = pthread_create(&io_thread_ids[io_threads_started], NULL, batch_io_thread_main, &batch);
+        if (error != 0) {
+            errno = error;
+            perror("pthread_create failed");
+            pthread_mutex_lock(&batch.lock);
+            batch.io_threads_running -= io_threads - io_threads_started;
+            pthread_mutex_unlock(&batch.lock);
+            batch_fail(&batch);
+            goto join;
+        }
+    }
+
+    for (; connections_started < streams; connections_started++) {
+        connections[connections_started].batch = &batch;
+        int error = pthread_create(&connections[connections_started].thread, NULL, batch_connection_thread_main,
+                                   &connections[connections_started]);
+        if (error != 0) {
+            errno = error;
+            perror("pthread_create failed");
+            batch_fail(&batch);
+            goto join;
+        }
+    }
+
+join:
+    for (unsigned int i = 0; i < connections_started; i++) {
+        pthread_join(connections[i].thread, NULL);
+    }
+    for (unsigned int i = 0; i < io_threads_started; i++) {
+        pthread_join(io_thread_ids[i], NULL);
+    }
+    // a failed batch may have left files opened but never sent
+    for (; batch.ready_count > 0; batch.ready_count--) {
+        close(batch.ready[batch.ready_head].range.fd);
+        batch.ready_head = (batch.ready_head + 1) % BATCH_READY_CAPACITY;
+    }
+
+    *total = batch.total;
+    if (batch.files_skipped > 0) {
+        fprintf(stderr, "%zu files skipped\n", batch.files_skipped);
     }
+    if (!batch.failed && batch.files_skipped == 0) {
+        return_code = GENERAL_SUCCESS;
+    }
+cleanup:
+    for (size_t i = 0; i < batch.paths_count; i++) {
+        free(batch.paths[i]);
+    }
+    free(batch.paths);
+    pthread_cond_destroy(&batch.file_ready);
+    pthread_cond_destroy(&batch.slot_free);
+    pthread_mutex_destroy(&batch.lock);
     return return_code;
-}
\ No newline at end of file
+}
+
+// a comma separated list of byte values and ranges of them, like 48-57,0x2c, in C notation
+int parse_byte_set(const char *list, struct pcc_byte_set *set) {
+    const char *item = list;
+
+    memset(set, 0, sizeof(*set));
+    while (true) {
+        char *end = NULL;
+        unsigned long first = strtoul(item, &end, 0);
+        unsigned long last = first;
+        if (end == item || first > UINT8_MAX) {
+            return GENERAL_ERROR;
+        }
+        if (*end == '-') {
+            item = end + 1;
+            last = strtoul(item, &end, 0);
+            if (end == item || last > UINT8_MAX || last < first) {
+                return GENERAL_ERROR;
+            }
+        }
+        for (unsigned long byte = first; byte <= last; byte++) {
+            pcc_byte_set_add(set, (uint8_t)byte);
+        }
+        if (*end == '\0') {
+            return GENERAL_SUCCESS;
+        }
+        if (*end != ',') {
+            return GENERAL_ERROR;
+        }
+        item = end + 1;
+    }
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--send-mode auto|copy|sendfile|zerocopy] [--streams K] [--protocol auto|1|2] [--compress] "
+            "[--batch] [--io-threads J] [--class NAME | --bytes LIST] [--histogram] [--utf8] <ip> <port> "
+            "<file path, or - for stdin>...\n"
+            "       %s [options] [--shm] --unix-socket PATH <file path, or - for stdin>...\n"
+            "Several files are counted over one keep-alive connection.\n"
+            "--compress sends v2 chunks as LZ4 blocks, for repetitive inputs on slow links.\n"
+            "--batch walks directories and counts every file in them over K connections (default %d), with J\n"
+            "threads (default %d) reading the files ahead of them.\n"
+            "--unix-socket connects to a server on this host, --shm then hands it the data through shared memory.\n"
+            "--class counts printable (the default), digit, whitespace or any bytes instead, over protocol 2.\n"
+            "--bytes counts the listed bytes instead, values and ranges like 48-57,0x2c, over protocol 2.\n"
+            "--histogram also prints how many of each counted byte a single file has, with --class any all of them.\n"
+            "--utf8 counts printable codepoints of UTF-8 text instead of bytes, the server rejects invalid text.\n",
+            program, program, BATCH_DEFAULT_STREAMS, BATCH_DEFAULT_IO_THREADS);
+}
+
+int main(int argc, char *argv[]) {
+    int return_code = GENERAL_ERROR;
+    struct file_range input = {.fd = -1};
+    struct server_address address = {0};
+    const char *unix_socket_path = NULL;
+    struct upload *uploads = NULL;
+    uint64_t *histograms = NULL;  // PCC_HISTOGRAM_BINS per upload
+    uint16_t port = 0;
+    unsigned int streams = 0;  // 0 until given, the default depends on the mode
+    unsigned int io_threads = BATCH_DEFAULT_IO_THREADS;
+    uint64_t pcc_count = 0;
+    enum send_mode mode = SEND_MODE_AUTO;
+    enum protocol protocol = PROTOCOL_AUTO;
+    bool compress = false;
+    const struct pcc_class *byte_class = &pcc_classes[PCC_CLASS_PRINTABLE];
+    struct pcc_byte_set custom_set = {0};
+    const struct pcc_byte_set *byte_set = NULL;
+    bool histogram = false;
+    uint64_t bins[PCC_HISTOGRAM_BINS] = {0};
+    bool utf8 = false;
+    bool batch = false;
+    bool shm = false;
+    static const struct option long_options[] = {
+        {"send-mode", required_argument, NULL, 'm'},
+        {"streams", required_argument, NULL, 's'},
+        {"protocol", required_argument, NULL, 'p'},
+        {"compress", no_argument, NULL, 'z'},
+        {"batch", no_argument, NULL, 'b'},
+        {"io-threads", required_argument, NULL, 'j'},
+        {"unix-socket", required_argument, NULL, 'U'},
+        {"shm", no_argument, NULL, 'S'},
+        {"class", required_argument, NULL, 'c'},
+        {"bytes", required_argument, NULL, 'B'},
+        {"histogram", no_argument, NULL, 'H'},
+        {"utf8", no_argument, NULL, 'u'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt = 0;
+
+    while ((opt = getopt_long(argc, argv, "m:s:p:zbj:U:Sc:B:Hu", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            mode = SEND_MODE_AUTO;
+            while (mode <= SEND_MODE_ZEROCOPY && strcmp(optarg, send_mode_names[mode]) != 0) {
+                mode++;
+            }
+            if (mode > SEND_MODE_ZEROCOPY) {
+                fprintf(stderr, "Invalid send mode: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 's':
+            if (sscanf(optarg, "%u", &streams) != 1 || streams == 0 || streams > MAX_STREAMS) {
+                fprintf(stderr, "Invalid number of streams: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'p':
+            protocol = PROTOCOL_AUTO;
+            while (protocol <= PROTOCOL_V2 && strcmp(optarg, protocol_names[protocol]) != 0) {
+                protocol++;
+            }
+            if (protocol > PROTOCOL_V2) {
+                fprintf(stderr, "Invalid protocol: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'z':
+            compress = true;
+            break;
+        case 'b':
+            batch = true;
+            break;
+        case 'j':
+            if (sscanf(optarg, "%u", &io_threads) != 1 || io_threads == 0 || io_threads > MAX_IO_THREADS) {
+                fprintf(stderr, "Invalid number of I/O threads: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'U':
+            unix_socket_path = optarg;
+            break;
+        case 'S':
+            shm = true;
+            break;
+        case 'c':
+            byte_class = pcc_class_find(optarg);
+            if (byte_class == NULL) {
+                fprintf(stderr, "Invalid byte class: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'B':
+            if (GENERAL_SUCCESS != parse_byte_set(optarg, &custom_set)) {
+                fprintf(stderr, "Invalid byte list: %s\n", optarg);
+                goto cleanup;
+            }
+            byte_set = &custom_set;
+            break;
+        case 'H':
+            histogram = true;
+            break;
+        case 'u':
+            utf8 = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            goto cleanup;
+        }
+    }
+
+    // the Unix socket takes the place of <ip> <port>
+    int address_args = unix_socket_path != NULL ? 0 : 2;
+    if (argc - optind < address_args + 1) {
+        print_usage(argv[0]);
+        goto cleanup;
+    }
+    char **paths = &argv[optind + address_args];
+    int paths_count = argc - optind - address_args;
+
+    if (unix_socket_path != NULL) {
+        struct sockaddr_un *unix_addr = (struct sockaddr_un *)&address.storage;
+        if (strlen(unix_socket_path) >= sizeof(unix_addr->sun_path)) {
+            fprintf(stderr, "Unix socket path is too long: %s\n", unix_socket_path);
+            goto cleanup;
+        }
+        unix_addr->sun_family = AF_UNIX;
+        strcpy(unix_addr->sun_path, unix_socket_path);
+        address.length = sizeof(*unix_addr);
+    } else {
+        struct sockaddr_in *tcp_addr = (struct sockaddr_in *)&address.storage;
+        if (inet_pton(AF_INET, argv[optind], &tcp_addr->sin_addr) != 1) {
+            fprintf(stderr, "Invalid IP address: %s\n", argv[optind]);
+            goto cleanup;
+        }
+        if (sscanf(argv[optind + 1], "%hu", &port) != 1) {
+            fprintf(stderr, "Invalid port number: %s\n", argv[optind + 1]);
+            goto cleanup;
+        }
+        tcp_addr->sin_family = AF_INET;
+        tcp_addr->sin_port = htons(port);
+        address.length = sizeof(*tcp_addr);
+    }
+
+    if (shm) {
+        // the ring is handed over as a file descriptor and counted as is, not decoded
+        if (unix_socket_path == NULL || compress || protocol == PROTOCOL_V1) {
+            fprintf(stderr, "--shm needs --unix-socket and protocol 2, and does not compress\n");
+            goto cleanup;
+        }
+        address.shm = true;
+    }
+
+    // the server decodes compressed bodies straight into the printable counts
+    uint8_t class_id = (uint8_t)(byte_class - pcc_classes);
+    if ((class_id != PCC_CLASS_PRINTABLE || byte_set != NULL || histogram) && (compress || protocol == PROTOCOL_V1)) {
+        fprintf(stderr, "--class, --bytes and --histogram need protocol 2, and do not compress\n");
+        goto cleanup;
+    }
+    if (byte_set != NULL && class_id != PCC_CLASS_PRINTABLE) {
+        fprintf(stderr, "--bytes counts its own set of bytes instead of a --class\n");
+        goto cleanup;
+    }
+    if (histogram && (batch || paths_count > 1)) {
+        fprintf(stderr, "--histogram counts a single file\n");
+        goto cleanup;
+    }
+    // a sequence must not be cut in two, which splitting a file into streams could do
+    if (utf8 && (class_id != PCC_CLASS_PRINTABLE || byte_set != NULL || histogram || compress ||
+                 protocol == PROTOCOL_V1 || (!batch && streams > 1))) {
+        fprintf(stderr, "--utf8 counts printable codepoints over protocol 2 and one stream, and does not compress\n");
+        goto cleanup;
+    }
+    const char *class_name = byte_set != NULL ? "listed" : byte_class->name;
+    const char *counted = utf8 ? "codepoints" : "characters";
+
+    if (batch) {
+        if (protocol == PROTOCOL_V1) {
+            fprintf(stderr, "Batch mode keeps connections alive, which needs protocol 2\n");
+            goto cleanup;
+        }
+        return_code = run_batch(&address, paths, paths_count, mode, compress, class_id, byte_set, utf8,
+                                streams > 0 ? streams : BATCH_DEFAULT_STREAMS, io_threads, &pcc_count);
+        // even when some files were skipped, the rest still add up
+        printf("# of %s %s: %" PRIu64 "\n", class_name, counted, pcc_count);
+        goto cleanup;
+    }
+
+    if (streams == 0) {
+        streams = 1;
+    }
+
+    if (paths_count > 1) {
+        if (streams > 1 || protocol == PROTOCOL_V1) {
+            fprintf(stderr, "Several files share one keep-alive connection, which needs protocol 2 and one stream\n");
+            goto cleanup;
+        }
+        if (GENERAL_SUCCESS !=
+            run_pipelined(&address, paths, paths_count, mode, compress, class_id, byte_set, utf8, &pcc_count)) {
+            goto cleanup;
+        }
+        printf("# of %s %s: %" PRIu64 "\n", class_name, counted, pcc_count);
+        return_code = GENERAL_SUCCESS;
+        goto cleanup;
+    }
+
+    if (GENERAL_SUCCESS != open_input(paths[0], &input)) {
+        goto cleanup;
+    }
+
+    // only a regular file can be read at several offsets at once, and every stream needs a byte
+    if (!input.seekable) {
+        streams = 1;
+    } else if (input.length < (off_t)streams) {
+        streams = input.length > 0 ? input.length : 1;
+    }
+
+    uploads = calloc(streams, sizeof(*uploads));
+    histograms = histogram ? calloc((size_t)streams * PCC_HISTOGRAM_BINS, sizeof(*histograms)) : NULL;
+    if (uploads == NULL || (histogram && histograms == NULL)) {
+        perror("calloc failed");
+        goto cleanup;
+    }
+
+    off_t offset = 0;
+    for (unsigned int i = 0; i < streams; i++) {
+        // the first size % streams ranges take one extra byte
+        off_t length = input.length / streams + ((off_t)i < input.length % streams ? 1 : 0);
+        uploads[i].address = &address;
+        uploads[i].range = input;
+        uploads[i].range.offset = offset;
+        uploads[i].range.length = length;
+        uploads[i].mode = mode;
+        uploads[i].protocol = protocol;
+        uploads[i].compress = compress;
+        uploads[i].byte_class = class_id;
+        uploads[i].byte_set = byte_set;
+        uploads[i].utf8 = utf8;
+        uploads[i].histogram = histogram ? &histograms[(size_t)i * PCC_HISTOGRAM_BINS] : NULL;
+        offset += length;
+    }
+
+    if (GENERAL_SUCCESS != run_uploads(uploads, streams)) {
+        goto cleanup;
+    }
+
+    for (unsigned int i = 0; i < streams; i++) {
+        pcc_count += uploads[i].pcc_count;
+        for (int b = 0; histogram && b < PCC_HISTOGRAM_BINS; b++) {
+            bins[b] += uploads[i].histogram[b];
+        }
+    }
+    printf("# of %s %s: %" PRIu64 "\n", class_name, counted, pcc_count);
+    // only the bytes the file has, out of those counted
+    for (int b = 0; histogram && b < PCC_HISTOGRAM_BINS; b++) {
+        if (bins[b] > 0) {
+            printf("byte %3d: %" PRIu64 "\n", b, bins[b]);
+        }
+    }
+
+    return_code = GENERAL_SUCCESS;
+
+cleanup:
+    free(uploads);
+    free(histograms);
+    if (input.fd != -1) {
+        close(input.fd);
+    }
+    return return_code;
+}
@@ -0,0 +1,475 @@
+#ifndef PCC_COUNT_H
+#define PCC_COUNT_H
+
+/*
+ * Printable character counting kernels shared by the server, the tester and the benchmarks.
+ *
+ * A byte is printable if, read as a (signed) char, it lies in [PRINTABLE_LOWER_BOUND, PRINTABLE_UPPER_BOUND].
+ * Bytes >= 128 are negative chars and therefore never printable, every kernel must agree with
+ * pcc_count_printable_scalar on that bit for bit.
+ *
+ * pcc_count_init() picks the widest kernel the CPU supports, for printable and every other built
+ * in byte class, call it once at startup before any thread uses pcc_class_count().
+ *
+ * pcc_histogram_add() produces the per character counts of a whole buffer, see struct pcc_histogram.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#define PCC_COUNT_X86 (1)
+#include <immintrin.h>
+#endif
+
+#define PRINTABLE_LOWER_BOUND (32)
+#define PRINTABLE_UPPER_BOUND (126)
+#define AMOUNT_OF_PRINTABLE_CHARS (PRINTABLE_UPPER_BOUND - PRINTABLE_LOWER_BOUND + 1)
+#define PRINTABLE_TO_INDEX(c) ((c) - PRINTABLE_LOWER_BOUND)
+
+// byte accumulators overflow after 255 matches, fold them into 64 bit lanes before that
+#define PCC_COUNT_MAX_FOLD_ITERATIONS (255)
+
+typedef uint64_t (*pcc_count_fn)(const char *data, size_t len);
+
+struct pcc_count_kernel {
+    const char *name;
+    bool (*is_supported)(void);
+    pcc_count_fn count;
+};
+
+/*
+ * Range kernels.
+ *
+ * Every kernel below counts the bytes in [lower, upper] or [lower2, upper2], both within
+ * [0, 126] (an empty second range has lower2 > upper2). They are always inlined into a wrapper
+ * that passes the bounds as constants, so each class gets its own loop with the bounds as
+ * immediates and the second compare gone when it is empty: the printable kernels compile to
+ * exactly the single range loop they always were.
+ */
+
+__attribute__((always_inline))
+static inline uint64_t pcc_count_ranges_scalar(const char *data, size_t len, int lower, int upper, int lower2,
+                                               int upper2) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        if ((lower <= c && c <= upper) || (lower2 <= c && c <= upper2)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static inline bool pcc_count_always_supported(void) {
+    return true;
+}
+
+#ifdef PCC_COUNT_X86
+
+/*
+ * All vector kernels share the same shape: compare as signed bytes (so >= 128 is negative and
+ * fails the lower bound), subtract the 0 / -1 mask into byte accumulators and every
+ * PCC_COUNT_MAX_FOLD_ITERATIONS vectors sum the accumulators with psadbw. The tail goes scalar.
+ */
+
+__attribute__((target("sse2"), always_inline))
+static inline __m128i pcc_in_range_sse2(__m128i v, int lower, int upper) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lower - 1)), _mm_cmpgt_epi8(_mm_set1_epi8(upper + 1), v));
+}
+
+__attribute__((target("sse2"), always_inline))
+static inline uint64_t pcc_count_ranges_sse2(const char *data, size_t len, int lower, int upper, int lower2,
+                                             int upper2) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i totals = _mm_setzero_si128();
+    size_t i = 0;
+
+    while (len - i >= sizeof(__m128i)) {
+        __m128i counters = _mm_setzero_si128();
+        for (int n = 0; n < PCC_COUNT_MAX_FOLD_ITERATIONS && len - i >= sizeof(__m128i); n++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+            __m128i in_class = pcc_in_range_sse2(v, lower, upper);
+            if (lower2 <= upper2) {
+                in_class = _mm_or_si128(in_class, pcc_in_range_sse2(v, lower2, upper2));
+            }
+            counters = _mm_sub_epi8(counters, in_class);
+            i += sizeof(__m128i);
+        }
+        totals = _mm_add_epi64(totals, _mm_sad_epu8(counters, zero));
+    }
+
+    uint64_t count = (uint64_t)_mm_cvtsi128_si64(totals) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(totals, totals));
+    return count + pcc_count_ranges_scalar(data + i, len - i, lower, upper, lower2, upper2);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i pcc_in_range_avx2(__m256i v, int lower, int upper) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lower - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(upper + 1), v));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline uint64_t pcc_count_ranges_avx2(const char *data, size_t len, int lower, int upper, int lower2,
+                                             int upper2) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i totals = _mm256_setzero_si256();
+    size_t i = 0;
+
+    while (len - i >= sizeof(__m256i)) {
+        __m256i counters = _mm256_setzero_si256();
+        for (int n = 0; n < PCC_COUNT_MAX_FOLD_ITERATIONS && len - i >= sizeof(__m256i); n++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+            __m256i in_class = pcc_in_range_avx2(v, lower, upper);
+            if (lower2 <= upper2) {
+                in_class = _mm256_or_si256(in_class, pcc_in_range_avx2(v, lower2, upper2));
+            }
+            counters = _mm256_sub_epi8(counters, in_class);
+            i += sizeof(__m256i);
+        }
+        totals = _mm256_add_epi64(totals, _mm256_sad_epu8(counters, zero));
+    }
+
+    uint64_t count = (uint64_t)_mm256_extract_epi64(totals, 0) + (uint64_t)_mm256_extract_epi64(totals, 1) +
+                     (uint64_t)_mm256_extract_epi64(totals, 2) + (uint64_t)_mm256_extract_epi64(totals, 3);
+    return count + pcc_count_ranges_scalar(data + i, len - i, lower, upper, lower2, upper2);
+}
+
+// with mask registers a single unsigned compare of (c - lower) against the range width is enough
+__attribute__((target("avx512bw"), always_inline))
+static inline __mmask64 pcc_in_range_avx512bw(__mmask64 valid, __m512i v, int lower, int upper) {
+    return _mm512_mask_cmplt_epu8_mask(valid, _mm512_sub_epi8(v, _mm512_set1_epi8(lower)),
+                                       _mm512_set1_epi8(upper - lower + 1));
+}
+
+__attribute__((target("avx512bw,popcnt"), always_inline))
+static inline uint64_t pcc_count_ranges_avx512bw(const char *data, size_t len, int lower, int upper, int lower2,
+                                                 int upper2) {
+    uint64_t count = 0;
+    size_t i = 0;
+
+    for (; len - i >= sizeof(__m512i); i += sizeof(__m512i)) {
+        __m512i v = _mm512_loadu_si512((const void *)(data + i));
+        __mmask64 in_class = pcc_in_range_avx512bw(~0ULL, v, lower, upper);
+        if (lower2 <= upper2) {
+            in_class |= pcc_in_range_avx512bw(~0ULL, v, lower2, upper2);
+        }
+        count += _mm_popcnt_u64(in_class);
+    }
+
+    if (i < len) {
+        __mmask64 tail = (1ULL << (len - i)) - 1;  // fewer than 64 bytes left
+        __m512i v = _mm512_maskz_loadu_epi8(tail, data + i);
+        __mmask64 in_class = pcc_in_range_avx512bw(tail, v, lower, upper);
+        if (lower2 <= upper2) {
+            in_class |= pcc_in_range_avx512bw(tail, v, lower2, upper2);
+        }
+        count += _mm_popcnt_u64(in_class);
+    }
+
+    return count;
+}
+
+static inline bool pcc_count_avx2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static inline bool pcc_count_avx512bw_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt");
+}
+
+// the kernels of one class, pcc_count_<name>_sse2, _avx2 and _avx512bw
+#define PCC_COUNT_VECTOR_KERNELS(name, lower, upper, lower2, upper2)                                     \
+    __attribute__((target("sse2")))                                                                      \
+    static inline uint64_t pcc_count_##name##_sse2(const char *data, size_t len) {                       \
+        return pcc_count_ranges_sse2(data, len, lower, upper, lower2, upper2);                           \
+    }                                                                                                    \
+    __attribute__((target("avx2")))                                                                      \
+    static inline uint64_t pcc_count_##name##_avx2(const char *data, size_t len) {                       \
+        return pcc_count_ranges_avx2(data, len, lower, upper, lower2, upper2);                           \
+    }                                                                                                    \
+    __attribute__((target("avx512bw,popcnt")))                                                           \
+    static inline uint64_t pcc_count_##name##_avx512bw(const char *data, size_t len) {                   \
+        return pcc_count_ranges_avx512bw(data, len, lower, upper, lower2, upper2);                       \
+    }
+
+// widest last, pcc_count_init picks the last supported entry
+#define PCC_COUNT_KERNEL_TABLE(name)                                                                     \
+    static const struct pcc_count_kernel pcc_count_##name##_kernels[] = {                                \
+        {"scalar", pcc_count_always_supported, pcc_count_##name##_scalar},                               \
+        {"sse2", pcc_count_always_supported, pcc_count_##name##_sse2},                                   \
+        {"avx2", pcc_count_avx2_supported, pcc_count_##name##_avx2},                                     \
+        {"avx512bw", pcc_count_avx512bw_supported, pcc_count_##name##_avx512bw},                         \
+    };
+
+#else
+
+#define PCC_COUNT_VECTOR_KERNELS(name, lower, upper, lower2, upper2)
+#define PCC_COUNT_KERNEL_TABLE(name)                                                                     \
+    static const struct pcc_count_kernel pcc_count_##name##_kernels[] = {                                \
+        {"scalar", pcc_count_always_supported, pcc_count_##name##_scalar},                               \
+    };
+
+#endif // PCC_COUNT_X86
+
+// pcc_count_<name>_scalar and the vector kernels of a class, and their table pcc_count_<name>_kernels
+#define PCC_COUNT_RANGE_KERNELS(name, lower, upper, lower2, upper2)                                      \
+    static inline uint64_t pcc_count_##name##_scalar(const char *data, size_t len) {                     \
+        return pcc_count_ranges_scalar(data, len, lower, upper, lower2, upper2);                         \
+    }                                                                                                    \
+    PCC_COUNT_VECTOR_KERNELS(name, lower, upper, lower2, upper2)                                         \
+    PCC_COUNT_KERNEL_TABLE(name)
+
+PCC_COUNT_RANGE_KERNELS(printable, PRINTABLE_LOWER_BOUND, PRINTABLE_UPPER_BOUND, 1, 0)
+PCC_COUNT_RANGE_KERNELS(digit, '0', '9', 1, 0)
+// '\t', '\n', '\v', '\f', '\r' and ' ', like isspace in the C locale
+PCC_COUNT_RANGE_KERNELS(whitespace, '\t', '\r', ' ', ' ')
+
+#define PCC_COUNT_KERNELS_AMOUNT (sizeof(pcc_count_printable_kernels) / sizeof(pcc_count_printable_kernels[0]))
+
+// every byte is in the class, there is nothing to look at
+static inline uint64_t pcc_count_any(const char *data, size_t len) {
+    return len;
+}
+
+static const struct pcc_count_kernel pcc_count_any_kernels[] = {
+    {"length", pcc_count_always_supported, pcc_count_any},
+};
+
+/*
+ * Any other set of bytes: one table load per byte, into four sums so consecutive bytes do not
+ * wait on each other's add.
+ */
+static inline uint64_t pcc_count_table(const uint8_t members[256], const char *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t sums[4] = {0};
+    size_t i = 0;
+
+    for (; i + 4 <= len; i += 4) {
+        sums[0] += members[bytes[i]];
+        sums[1] += members[bytes[i + 1]];
+        sums[2] += members[bytes[i + 2]];
+        sums[3] += members[bytes[i + 3]];
+    }
+    for (; i < len; i++) {
+        sums[0] += members[bytes[i]];
+    }
+    return sums[0] + sums[1] + sums[2] + sums[3];
+}
+
+/*
+ * Byte classes.
+ *
+ * A class is a set of byte values with the kernel that counts it. The built in ones have the
+ * specialized kernels above and pcc_count_init selects the widest the CPU supports for each,
+ * their numbers are what a request names on the wire. pcc_class_init_set makes a class of any
+ * set, counted with pcc_count_table, like the byte set a request may carry instead.
+ */
+
+enum pcc_class_id {
+    PCC_CLASS_PRINTABLE,  // [32, 126], what the statistics count
+    PCC_CLASS_ANY,        // every byte, its histogram is all 256 bins
+    PCC_CLASS_DIGIT,
+    PCC_CLASS_WHITESPACE,
+    PCC_CLASS_BUILTIN_AMOUNT,
+};
+
+struct pcc_class {
+    const char *name;
+    const struct pcc_count_kernel *kernels;  // widest last, NULL for a set counted by table
+    size_t kernels_amount;
+    const struct pcc_count_kernel *selected;
+    uint8_t members[256];  // 1 for the bytes in the class, indexed by the byte as unsigned
+};
+
+#define PCC_CLASS_BUILTIN(id, class_name, kernel_table)                                                 \
+    [id] = {.name = class_name, .kernels = kernel_table,                                                 \
+            .kernels_amount = sizeof(kernel_table) / sizeof(kernel_table[0]), .selected = &kernel_table[0]}
+
+// members are filled in by pcc_count_init
+static struct pcc_class pcc_classes[PCC_CLASS_BUILTIN_AMOUNT] = {
+    PCC_CLASS_BUILTIN(PCC_CLASS_PRINTABLE, "printable", pcc_count_printable_kernels),
+    PCC_CLASS_BUILTIN(PCC_CLASS_ANY, "any", pcc_count_any_kernels),
+    PCC_CLASS_BUILTIN(PCC_CLASS_DIGIT, "digit", pcc_count_digit_kernels),
+    PCC_CLASS_BUILTIN(PCC_CLASS_WHITESPACE, "whitespace", pcc_count_whitespace_kernels),
+};
+
+static inline void pcc_class_init_set(struct pcc_class *byte_class, const char *name, const unsigned char *bytes,
+                                      size_t amount) {
+    memset(byte_class, 0, sizeof(*byte_class));
+    byte_class->name = name;
+    for (size_t i = 0; i < amount; i++) {
+        byte_class->members[bytes[i]] = 1;
+    }
+}
+
+static inline uint64_t pcc_class_count(const struct pcc_class *byte_class, const char *data, size_t len) {
+    if (byte_class->kernels == NULL) {
+        return pcc_count_table(byte_class->members, data, len);
+    }
+    return byte_class->selected->count(data, len);
+}
+
+// NULL if there is no built in class of that name
+static inline const struct pcc_class *pcc_class_find(const char *name) {
+    for (int id = 0; id < PCC_CLASS_BUILTIN_AMOUNT; id++) {
+        if (strcmp(pcc_classes[id].name, name) == 0) {
+            return &pcc_classes[id];
+        }
+    }
+    return NULL;
+}
+
+// returns the kernel selected for the printable class
+static inline const struct pcc_count_kernel *pcc_count_init(void) {
+    for (int id = 0; id < PCC_CLASS_BUILTIN_AMOUNT; id++) {
+        struct pcc_class *byte_class = &pcc_classes[id];
+        for (size_t k = byte_class->kernels_amount; k > 0; k--) {
+            if (byte_class->kernels[k - 1].is_supported()) {
+                byte_class->selected = &byte_class->kernels[k - 1];
+                break;
+            }
+        }
+        // the scalar kernel is the definition of the class
+        for (int byte = 0; byte < 256; byte++) {
+            char c = (char)byte;
+            byte_class->members[byte] = (uint8_t)byte_class->kernels[0].count(&c, 1);
+        }
+    }
+
+    return pcc_classes[PCC_CLASS_PRINTABLE].selected;
+}
+
+/*
+ * Histogram engine.
+ *
+ * Incrementing new_pcc_count[c - 32] byte by byte makes every repeated character a chain of
+ * dependent read-modify-writes on the same counter, which stalls on skewed text. Instead,
+ * consecutive bytes go round robin into PCC_HISTOGRAM_LANES independent sub-histograms of
+ * 16 bit counters indexed by the raw byte (no branch, no range check). Every
+ * PCC_HISTOGRAM_FLUSH_INTERVAL bytes, and at the end of each call, the printable bins are
+ * folded into the caller's 64 bit counts.
+ *
+ * Non-printable bins are never read, so they are allowed to wrap and are never cleared.
+ * The struct is scratch space (2KB), keep one per thread rather than one per connection.
+ *
+ * pcc_histogram_add_all() counts all 256 bins instead, indexed by the byte as unsigned.
+ */
+
+#define PCC_HISTOGRAM_LANES (4)
+#define PCC_HISTOGRAM_BINS (256)
+// each lane sees at most a quarter of a flush interval, which must fit a 16 bit counter
+#define PCC_HISTOGRAM_FLUSH_INTERVAL ((size_t)PCC_HISTOGRAM_LANES * UINT16_MAX)
+
+_Static_assert(PCC_HISTOGRAM_LANES == 4, "pcc_histogram_add unrolls exactly one byte per lane");
+
+struct pcc_histogram {
+    uint16_t lanes[PCC_HISTOGRAM_LANES][PCC_HISTOGRAM_BINS];
+};
+
+static inline void pcc_histogram_init(struct pcc_histogram *histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+// adds the printable bins into counts, clears them and returns how many printable bytes they held
+static inline uint64_t pcc_histogram_flush(struct pcc_histogram *histogram, uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS]) {
+    uint64_t total = 0;
+    for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+        uint32_t bin = 0;
+        for (int lane = 0; lane < PCC_HISTOGRAM_LANES; lane++) {
+            bin += histogram->lanes[lane][PRINTABLE_LOWER_BOUND + i];
+            histogram->lanes[lane][PRINTABLE_LOWER_BOUND + i] = 0;
+        }
+        counts[i] += bin;
+        total += bin;
+    }
+    return total;
+}
+
+// adds all bins into counts and clears them
+static inline void pcc_histogram_flush_all(struct pcc_histogram *histogram, uint64_t counts[PCC_HISTOGRAM_BINS]) {
+    for (int i = 0; i < PCC_HISTOGRAM_BINS; i++) {
+        uint32_t bin = 0;
+        for (int lane = 0; lane < PCC_HISTOGRAM_LANES; lane++) {
+            bin += histogram->lanes[lane][i];
+        }
+        counts[i] += bin;
+    }
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+__attribute__((always_inline))
+static inline void pcc_histogram_fill(struct pcc_histogram *histogram, const unsigned char *bytes, size_t chunk) {
+    size_t i = 0;
+
+    for (; i + PCC_HISTOGRAM_LANES <= chunk; i += PCC_HISTOGRAM_LANES) {
+        histogram->lanes[0][bytes[i]]++;
+        histogram->lanes[1][bytes[i + 1]]++;
+        histogram->lanes[2][bytes[i + 2]]++;
+        histogram->lanes[3][bytes[i + 3]]++;
+    }
+    for (; i < chunk; i++) {
+        histogram->lanes[i % PCC_HISTOGRAM_LANES][bytes[i]]++;
+    }
+}
+
+// accumulates data into counts (indexed like new_pcc_count) and returns the amount of printable bytes in it
+static inline uint64_t pcc_histogram_add(struct pcc_histogram *histogram, const char *data, size_t len,
+                                         uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS]) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t total = 0;
+
+    while (len > 0) {
+        size_t chunk = len < PCC_HISTOGRAM_FLUSH_INTERVAL ? len : PCC_HISTOGRAM_FLUSH_INTERVAL;
+        pcc_histogram_fill(histogram, bytes, chunk);
+        total += pcc_histogram_flush(histogram, counts);
+        bytes += chunk;
+        len -= chunk;
+    }
+
+    return total;
+}
+
+// accumulates data into all 256 counts, the non-printable bins pcc_histogram_add left wrapped are cleared first
+static inline void pcc_histogram_add_all(struct pcc_histogram *histogram, const char *data, size_t len,
+                                         uint64_t counts[PCC_HISTOGRAM_BINS]) {
+    const unsigned char *bytes = (const unsigned char *)data;
+
+    memset(histogram, 0, sizeof(*histogram));
+    while (len > 0) {
+        size_t chunk = len < PCC_HISTOGRAM_FLUSH_INTERVAL ? len : PCC_HISTOGRAM_FLUSH_INTERVAL;
+        pcc_histogram_fill(histogram, bytes, chunk);
+        pcc_histogram_flush_all(histogram, counts);
+        bytes += chunk;
+        len -= chunk;
+    }
+}
+
+// adds the bins of the class's bytes in all (a pcc_histogram_add_all result) to counts and returns their total
+static inline uint64_t pcc_class_select(const struct pcc_class *byte_class, const uint64_t all[PCC_HISTOGRAM_BINS],
+                                        uint64_t counts[PCC_HISTOGRAM_BINS]) {
+    uint64_t total = 0;
+
+    for (int i = 0; i < PCC_HISTOGRAM_BINS; i++) {
+        if (byte_class->members[i]) {
+            counts[i] += all[i];
+            total += all[i];
+        }
+    }
+    return total;
+}
+
+// accumulates the bins of the class's bytes into counts (indexed by the byte) and returns their total
+static inline uint64_t pcc_class_histogram(const struct pcc_class *byte_class, struct pcc_histogram *histogram,
+                                           const char *data, size_t len, uint64_t counts[PCC_HISTOGRAM_BINS]) {
+    uint64_t all[PCC_HISTOGRAM_BINS] = {0};
+
+    pcc_histogram_add_all(histogram, data, len, all);
+    return pcc_class_select(byte_class, all, counts);
+}
+
+#endif // PCC_COUNT_H
@@ -0,0 +1,385 @@
+#define _GNU_SOURCE  // clock_gettime under -std=c11
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "pcc_count.h"
+#include "pcc_utf8.h"
+#include "pcc_telemetry.h"
+
+/*
+ * Microbenchmark of every printable counting implementation in the tree.
+ *
+ * Each variant runs on the same inputs at every size from 64B to --max-size. Before it is timed it
+ * is checked against pcc_count_printable_scalar (counting variants), a per-character reference
+ * loop (histogram variants) or pcc_utf8_count_scalar (UTF-8 variants, which count printable
+ * codepoints and give UINT64_MAX for invalid input), and a mismatch fails the run. Times come from the TSC, so they are
+ * reference cycles per byte, the best of REPEATS batches of at least --min-bytes each.
+ *
+ * Build: gcc -O3 -Wall -std=c11 pcc_count_bench.c -o pcc_count_bench
+ */
+
+#define GENERAL_ERROR (1)
+#define GENERAL_SUCCESS (0)
+
+#define MIN_SIZE (64)
+#define DEFAULT_MAX_SIZE (64 * 1024 * 1024)
+#define DEFAULT_MIN_BYTES (32 * 1024 * 1024)
+#define REPEATS (3)
+#define DEFAULT_TEXT_PATH "pcc_server.c"
+
+enum variant_kind {
+    VARIANT_COUNT,      // returns the amount of printable bytes
+    VARIANT_HISTOGRAM,  // also fills the per character counts
+    VARIANT_UTF8,       // returns the amount of printable codepoints
+};
+
+struct bench_variant {
+    const char *name;
+    enum variant_kind kind;
+    bool (*is_supported)(void);
+    pcc_count_fn count;
+    uint64_t (*histogram)(const char *data, size_t len, uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS]);
+};
+
+struct bench_input {
+    const char *name;
+    void (*fill)(char *data, size_t len);
+};
+
+uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+const char *text_path = DEFAULT_TEXT_PATH;
+struct pcc_histogram histogram_scratch;
+
+uint64_t next_random() {
+    // xorshift64, deterministic so every run sees the same bytes
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// the server's original loop
+bool is_printable(char c) {
+    return (PRINTABLE_LOWER_BOUND <= c && c <= PRINTABLE_UPPER_BOUND);
+}
+
+uint64_t is_printable_loop(const char *data, size_t len, uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS]) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (is_printable(data[i])) {
+            counts[data[i] - PRINTABLE_LOWER_BOUND]++;
+            total++;
+        }
+    }
+    return total;
+}
+
+// pcc_tester's count_printable
+uint64_t tester_count_printable(const char *data, size_t len) {
+    uint32_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (is_printable(data[i])) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// the kernel a custom byte class gets, one table load per byte instead of two compares
+uint64_t table_count_printable(const char *data, size_t len) {
+    return pcc_count_table(pcc_classes[PCC_CLASS_PRINTABLE].members, data, len);
+}
+
+uint64_t utf8_count_with(const struct pcc_utf8_kernel *kernel, const char *data, size_t len) {
+    uint64_t printable = 0;
+    return kernel->count(data, len, &printable) == -1 ? UINT64_MAX : printable;
+}
+
+uint64_t utf8_scalar(const char *data, size_t len) {
+    return utf8_count_with(&pcc_utf8_kernels[0], data, len);
+}
+
+uint64_t utf8_selected(const char *data, size_t len) {
+    return utf8_count_with(pcc_utf8_selected_kernel, data, len);
+}
+
+uint64_t histogram_engine(const char *data, size_t len, uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS]) {
+    return pcc_histogram_add(&histogram_scratch, data, len, counts);
+}
+
+void fill_printable(char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        data[i] = PRINTABLE_LOWER_BOUND + next_random() % AMOUNT_OF_PRINTABLE_CHARS;
+    }
+}
+
+void fill_random(char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (char)next_random();
+    }
+}
+
+// like the tester's 1MB case
+void fill_cycling(char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (char)(i % 256);
+    }
+}
+
+void fill_alternating(char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        data[i] = i % 2 == 0 ? 'A' : '\n';
+    }
+}
+
+// valid UTF-8, one codepoint in ten of two to four bytes
+void fill_utf8(char *data, size_t len) {
+    static const char *const multibyte[] = {"\xc3\xa9", "\xd0\x96", "\xe2\x82\xac", "\xe4\xb8\x96",
+                                            "\xf0\x9f\x98\x80"};
+    size_t i = 0;
+    while (i < len) {
+        const char *sequence = multibyte[next_random() % (sizeof(multibyte) / sizeof(multibyte[0]))];
+        if (next_random() % 10 != 0 || strlen(sequence) > len - i) {
+            data[i++] = PRINTABLE_LOWER_BOUND + next_random() % AMOUNT_OF_PRINTABLE_CHARS;
+            continue;
+        }
+        memcpy(data + i, sequence, strlen(sequence));
+        i += strlen(sequence);
+    }
+}
+
+// text_path tiled over the buffer, random words if it can not be read
+void fill_text(char *data, size_t len) {
+    size_t filled = 0;
+    FILE *text = fopen(text_path, "r");
+    if (text != NULL) {
+        filled = fread(data, 1, len, text);
+        fclose(text);
+    }
+
+    if (filled == 0) {
+        static const char *const words[] = {"the ", "of ", "and ", "count ", "printable ", "server, ",
+                                            "client. ", "bytes ", "a ", "in\n"};
+        fprintf(stderr, "Could not read %s, using generated text\n", text_path);
+        while (filled < len) {
+            const char *word = words[next_random() % (sizeof(words) / sizeof(words[0]))];
+            for (; *word != '\0' && filled < len; word++) {
+                data[filled++] = *word;
+            }
+        }
+    }
+
+    for (size_t i = filled; i < len; i++) {
+        data[i] = data[i % filled];
+    }
+}
+
+static const struct bench_input inputs[] = {
+    {"printable", fill_printable},
+    {"random", fill_random},
+    {"i % 256", fill_cycling},
+    {"A\\n", fill_alternating},
+    {"text", fill_text},
+    {"utf8", fill_utf8},
+};
+
+#define INPUTS_AMOUNT (sizeof(inputs) / sizeof(inputs[0]))
+#define MAX_VARIANTS (PCC_COUNT_KERNELS_AMOUNT + 6)
+
+size_t collect_variants(struct bench_variant variants[]) {
+    size_t amount = 0;
+    variants[amount++] = (struct bench_variant){"is_printable", VARIANT_HISTOGRAM, pcc_count_always_supported, NULL,
+                                                is_printable_loop};
+    variants[amount++] = (struct bench_variant){"count_printable", VARIANT_COUNT, pcc_count_always_supported,
+                                                tester_count_printable, NULL};
+    for (size_t k = 0; k < PCC_COUNT_KERNELS_AMOUNT; k++) {
+        variants[amount++] = (struct bench_variant){pcc_count_printable_kernels[k].name, VARIANT_COUNT,
+                                                    pcc_count_printable_kernels[k].is_supported, pcc_count_printable_kernels[k].count, NULL};
+    }
+    variants[amount++] = (struct bench_variant){"table", VARIANT_COUNT, pcc_count_always_supported,
+                                                table_count_printable, NULL};
+    variants[amount++] = (struct bench_variant){"histogram", VARIANT_HISTOGRAM, pcc_count_always_supported, NULL,
+                                                histogram_engine};
+    variants[amount++] = (struct bench_variant){"utf8_scalar", VARIANT_UTF8, pcc_count_always_supported,
+                                                utf8_scalar, NULL};
+    variants[amount++] = (struct bench_variant){"utf8", VARIANT_UTF8, pcc_count_always_supported, utf8_selected,
+                                                NULL};
+    return amount;
+}
+
+uint64_t run_variant(const struct bench_variant *variant, const char *data, size_t len,
+                     uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS]) {
+    if (variant->kind == VARIANT_HISTOGRAM) {
+        return variant->histogram(data, len, counts);
+    }
+    return variant->count(data, len);
+}
+
+int check_variant(const struct bench_variant *variant, const char *data, size_t len, const char *input_name) {
+    uint64_t expected[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+    uint64_t actual[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+    uint64_t expected_total =
+        variant->kind == VARIANT_UTF8 ? utf8_scalar(data, len) : pcc_count_printable_scalar(data, len);
+    uint64_t actual_total = run_variant(variant, data, len, actual);
+
+    if (variant->kind == VARIANT_HISTOGRAM) {
+        for (size_t i = 0; i < len; i++) {
+            if (is_printable(data[i])) {
+                expected[data[i] - PRINTABLE_LOWER_BOUND]++;
+            }
+        }
+    }
+
+    if (expected_total != actual_total || memcmp(expected, actual, sizeof(expected)) != 0) {
+        printf("FAIL: %s on %s (%zu bytes): expected %lu, actual %lu\n", variant->name, input_name, len,
+               (unsigned long)expected_total, (unsigned long)actual_total);
+        return GENERAL_ERROR;
+    }
+    return GENERAL_SUCCESS;
+}
+
+// best of REPEATS batches, in ticks per byte
+double time_variant(const struct bench_variant *variant, const char *data, size_t len, size_t min_bytes) {
+    static uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS];
+    size_t iterations = len >= min_bytes ? 1 : min_bytes / len;
+    pcc_ticks_t best = UINT64_MAX;
+    volatile uint64_t sink = 0;
+
+    for (int repeat = 0; repeat < REPEATS; repeat++) {
+        pcc_ticks_t start = pcc_telemetry_now();
+        for (size_t i = 0; i < iterations; i++) {
+            sink += run_variant(variant, data, len, counts);
+            // keeps the calls from being merged or hoisted out of the loop
+            __asm__ volatile("" ::: "memory");
+        }
+        pcc_ticks_t elapsed = pcc_telemetry_now() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+
+    (void)sink;
+    return (double)best / ((double)iterations * len);
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--max-size BYTES] [--min-bytes BYTES] [--text PATH] [--gbps]\n"
+            "Reports cycles/byte (GB/s with --gbps) of every counting variant on every input, at sizes\n"
+            "from %d bytes up to --max-size (default %d). --text is the real text input (default %s).\n",
+            program, MIN_SIZE, DEFAULT_MAX_SIZE, DEFAULT_TEXT_PATH);
+}
+
+int main(int argc, char *argv[]) {
+    int return_code = GENERAL_ERROR;
+    size_t max_size = DEFAULT_MAX_SIZE;
+    size_t min_bytes = DEFAULT_MIN_BYTES;
+    bool gbps = false;
+    char *data = NULL;
+    struct bench_variant variants[MAX_VARIANTS];
+    static const struct option long_options[] = {
+        {"max-size", required_argument, NULL, 's'},
+        {"min-bytes", required_argument, NULL, 'b'},
+        {"text", required_argument, NULL, 't'},
+        {"gbps", no_argument, NULL, 'g'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt = 0;
+
+    while ((opt = getopt_long(argc, argv, "s:b:t:g", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            if (sscanf(optarg, "%zu", &max_size) != 1 || max_size < MIN_SIZE) {
+                fprintf(stderr, "Invalid max size: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'b':
+            if (sscanf(optarg, "%zu", &min_bytes) != 1 || min_bytes == 0) {
+                fprintf(stderr, "Invalid min bytes: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 't':
+            text_path = optarg;
+            break;
+        case 'g':
+            gbps = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            goto cleanup;
+        }
+    }
+
+    data = aligned_alloc(64, ((max_size + 63) / 64) * 64);
+    if (data == NULL) {
+        perror("malloc failed");
+        goto cleanup;
+    }
+
+    pcc_histogram_init(&histogram_scratch);
+    printf("Selected counting kernel: %s\n", pcc_count_init()->name);
+    printf("Selected UTF-8 kernel: %s\n", pcc_utf8_init()->name);
+
+    size_t variants_amount = collect_variants(variants);
+    for (size_t v = 0; v < variants_amount; v++) {
+        if (!variants[v].is_supported()) {
+            printf("SKIP: %s (not supported by this CPU)\n", variants[v].name);
+        }
+    }
+
+    struct pcc_clock_sample clock_start = pcc_clock_sample();
+    return_code = GENERAL_SUCCESS;
+
+    printf("%s\n%-10s %10s", gbps ? "GB/s" : "cycles/byte", "input", "size");
+    for (size_t v = 0; v < variants_amount; v++) {
+        if (variants[v].is_supported()) {
+            printf(" %15s", variants[v].name);
+        }
+    }
+    printf("\n");
+
+    for (size_t in = 0; in < INPUTS_AMOUNT; in++) {
+        inputs[in].fill(data, max_size);
+
+        for (size_t len = MIN_SIZE; len <= max_size; len *= 4) {
+            double ticks_per_byte[MAX_VARIANTS] = {0};
+            for (size_t v = 0; v < variants_amount; v++) {
+                if (!variants[v].is_supported()) {
+                    continue;
+                }
+                if (check_variant(&variants[v], data, len, inputs[in].name) != GENERAL_SUCCESS) {
+                    return_code = GENERAL_ERROR;
+                    continue;
+                }
+                ticks_per_byte[v] = time_variant(&variants[v], data, len, min_bytes);
+            }
+
+            double ns_per_tick = pcc_ns_per_tick(clock_start, pcc_clock_sample());
+            printf("%-10s %10zu", inputs[in].name, len);
+            for (size_t v = 0; v < variants_amount; v++) {
+                if (!variants[v].is_supported()) {
+                    continue;
+                }
+                if (gbps) {
+                    printf(" %15.2f", ticks_per_byte[v] > 0 ? 1.0 / (ticks_per_byte[v] * ns_per_tick) : 0.0);
+                } else {
+                    printf(" %15.3f", ticks_per_byte[v]);
+                }
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+    }
+
+    if (return_code == GENERAL_SUCCESS) {
+        printf("All variants match the scalar reference\n");
+    }
+
+cleanup:
+    free(data);
+    return return_code;
+}
@@ -0,0 +1,681 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcc_count.h"
+#include "pcc_lz4.h"
+#include "pcc_utf8.h"
+
+#define GENERAL_ERROR (1)
+#define GENERAL_SUCCESS (0)
+
+#define MAX_SMALL_SIZE (1100)
+#define MAX_OFFSET (64)
+#define LARGE_SIZE (5 * 1024 * 1024)
+
+uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+uint64_t next_random() {
+    // xorshift64, deterministic so failures reproduce
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+void fill_random(char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (char)next_random();
+    }
+}
+
+int check_kernel(const struct pcc_count_kernel *kernel, const char *data, size_t len, const char *input_name) {
+    uint64_t expected = pcc_count_printable_scalar(data, len);
+    uint64_t actual = kernel->count(data, len);
+    if (expected != actual) {
+        printf("FAIL: %s on %s (%zu bytes): expected %lu, actual %lu\n", kernel->name, input_name, len,
+               (unsigned long)expected, (unsigned long)actual);
+        return GENERAL_ERROR;
+    }
+    return GENERAL_SUCCESS;
+}
+
+int test_kernel(const struct pcc_count_kernel *kernel, char *data) {
+    int failures = 0;
+
+    // Test 1: every byte value, including the negative chars >= 128
+    for (int i = 0; i < 256; i++) {
+        data[i] = (char)i;
+    }
+    failures += check_kernel(kernel, data, 256, "all byte values");
+
+    // Test 2: every small size at every alignment, to cover heads and tails
+    fill_random(data, MAX_SMALL_SIZE + MAX_OFFSET);
+    for (size_t offset = 0; offset < MAX_OFFSET; offset++) {
+        for (size_t len = 0; len <= MAX_SMALL_SIZE; len++) {
+            failures += check_kernel(kernel, data + offset, len, "random small");
+        }
+    }
+
+    // Test 3: bytes right at the range edges
+    const char edges[] = {31, 32, 33, 125, 126, 127, (char)128, (char)159, (char)160, (char)255, 0, 1};
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        data[i] = edges[next_random() % sizeof(edges)];
+    }
+    failures += check_kernel(kernel, data, LARGE_SIZE, "range edges");
+
+    // Test 4: all printable, long enough to overflow any byte sized accumulator
+    memset(data, 'e', LARGE_SIZE);
+    failures += check_kernel(kernel, data, LARGE_SIZE, "all printable");
+
+    // Test 5: cycling through all bytes, like the tester's 1MB case
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        data[i] = (char)(i % 256);
+    }
+    failures += check_kernel(kernel, data, LARGE_SIZE, "i % 256");
+
+    // Test 6: random binary
+    fill_random(data, LARGE_SIZE);
+    failures += check_kernel(kernel, data, LARGE_SIZE - 3, "random binary");
+
+    if (failures == 0) {
+        printf("PASS: %s\n", kernel->name);
+        return GENERAL_SUCCESS;
+    }
+    return GENERAL_ERROR;
+}
+
+// the loop pcc_server used before the histogram engine
+uint64_t reference_histogram(const char *data, size_t len, uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS]) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        if (PRINTABLE_LOWER_BOUND <= c && c <= PRINTABLE_UPPER_BOUND) {
+            total++;
+            counts[c - PRINTABLE_LOWER_BOUND]++;
+        }
+    }
+    return total;
+}
+
+// feeds the engine in random sized pieces, the way recv hands out data
+int check_histogram(struct pcc_histogram *histogram, const char *data, size_t len, const char *input_name) {
+    uint64_t expected[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+    uint64_t actual[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+    uint64_t expected_total = reference_histogram(data, len, expected);
+    uint64_t actual_total = 0;
+
+    size_t offset = 0;
+    while (offset < len) {
+        size_t piece = 1 + next_random() % (2 * PCC_HISTOGRAM_FLUSH_INTERVAL);
+        if (piece > len - offset) {
+            piece = len - offset;
+        }
+        actual_total += pcc_histogram_add(histogram, data + offset, piece, actual);
+        offset += piece;
+    }
+
+    if (expected_total != actual_total || memcmp(expected, actual, sizeof(expected)) != 0) {
+        printf("FAIL: histogram on %s (%zu bytes): expected total %lu, actual %lu\n", input_name, len,
+               (unsigned long)expected_total, (unsigned long)actual_total);
+        return GENERAL_ERROR;
+    }
+    return GENERAL_SUCCESS;
+}
+
+int test_histogram(char *data) {
+    int failures = 0;
+    struct pcc_histogram histogram;
+    pcc_histogram_init(&histogram);
+
+    // Test 1: uniform printable
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        data[i] = PRINTABLE_LOWER_BOUND + next_random() % AMOUNT_OF_PRINTABLE_CHARS;
+    }
+    failures += check_histogram(&histogram, data, LARGE_SIZE, "uniform printable");
+
+    // Test 2: skewed, like a log file that is mostly spaces and 'e's
+    const char skewed[] = "      eeeee\ntaoin";
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        data[i] = skewed[next_random() % (sizeof(skewed) - 1)];
+    }
+    failures += check_histogram(&histogram, data, LARGE_SIZE, "skewed text");
+
+    // Test 3: one character only, every lane's counter for it fills up between flushes
+    memset(data, 'e', LARGE_SIZE);
+    failures += check_histogram(&histogram, data, LARGE_SIZE, "single character");
+
+    // Test 4: random binary, non-printable bins must never leak into the counts
+    fill_random(data, LARGE_SIZE);
+    failures += check_histogram(&histogram, data, LARGE_SIZE, "random binary");
+
+    // Test 5: cycling through all bytes
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        data[i] = (char)(i % 256);
+    }
+    failures += check_histogram(&histogram, data, LARGE_SIZE, "i % 256");
+
+    // Test 6: small buffers, every length around the unrolled loop's tail
+    fill_random(data, MAX_SMALL_SIZE);
+    for (size_t len = 0; len <= 2 * PCC_HISTOGRAM_LANES + 1; len++) {
+        failures += check_histogram(&histogram, data, len, "random small");
+    }
+
+    if (failures == 0) {
+        printf("PASS: histogram\n");
+        return GENERAL_SUCCESS;
+    }
+    return GENERAL_ERROR;
+}
+
+// what each built in class means, written out independently of its kernels
+bool reference_member(int id, unsigned char byte) {
+    switch (id) {
+    case PCC_CLASS_PRINTABLE:
+        return 32 <= byte && byte <= 126;
+    case PCC_CLASS_ANY:
+        return true;
+    case PCC_CLASS_DIGIT:
+        return '0' <= byte && byte <= '9';
+    case PCC_CLASS_WHITESPACE:
+        return byte == ' ' || byte == '\t' || byte == '\n' || byte == '\v' || byte == '\f' || byte == '\r';
+    default:
+        return false;
+    }
+}
+
+uint64_t reference_class_count(const struct pcc_class *byte_class, const char *data, size_t len) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        count += byte_class->members[(unsigned char)data[i]];
+    }
+    return count;
+}
+
+int check_class(const struct pcc_class *byte_class, const struct pcc_count_kernel *kernel, const char *data,
+                size_t len, const char *input_name) {
+    uint64_t expected = reference_class_count(byte_class, data, len);
+    uint64_t actual = kernel != NULL ? kernel->count(data, len) : pcc_class_count(byte_class, data, len);
+    if (expected != actual) {
+        printf("FAIL: %s %s on %s (%zu bytes): expected %lu, actual %lu\n", byte_class->name,
+               kernel != NULL ? kernel->name : "table", input_name, len, (unsigned long)expected,
+               (unsigned long)actual);
+        return GENERAL_ERROR;
+    }
+    return GENERAL_SUCCESS;
+}
+
+// every kernel of the class, or its table kernel if it has none
+int check_class_kernels(const struct pcc_class *byte_class, const char *data, size_t len, const char *input_name) {
+    int failures = 0;
+    if (byte_class->kernels == NULL) {
+        return check_class(byte_class, NULL, data, len, input_name);
+    }
+    for (size_t k = 0; k < byte_class->kernels_amount; k++) {
+        if (byte_class->kernels[k].is_supported()) {
+            failures += check_class(byte_class, &byte_class->kernels[k], data, len, input_name);
+        }
+    }
+    return failures;
+}
+
+int test_classes(char *data) {
+    int failures = 0;
+    struct pcc_class custom;
+    struct pcc_histogram histogram;
+    pcc_histogram_init(&histogram);
+
+    // Test 1: the built in classes hold exactly their bytes
+    for (int id = 0; id < PCC_CLASS_BUILTIN_AMOUNT; id++) {
+        for (int byte = 0; byte < 256; byte++) {
+            if (pcc_classes[id].members[byte] != reference_member(id, byte)) {
+                printf("FAIL: class %s has the wrong membership for byte %d\n", pcc_classes[id].name, byte);
+                failures++;
+                break;
+            }
+        }
+    }
+
+    // Test 2: a custom set, bytes from both halves and the range edges, counted by the table
+    const unsigned char set[] = {0, '\n', '"', ',', '9', 127, 128, 200, 255};
+    pcc_class_init_set(&custom, "csv", set, sizeof(set));
+
+    // Test 3: every kernel of every class on every small size and alignment, then on large inputs
+    fill_random(data, MAX_SMALL_SIZE + MAX_OFFSET);
+    for (int id = 0; id <= PCC_CLASS_BUILTIN_AMOUNT; id++) {
+        const struct pcc_class *byte_class = id < PCC_CLASS_BUILTIN_AMOUNT ? &pcc_classes[id] : &custom;
+        for (size_t offset = 0; offset < MAX_OFFSET; offset += 7) {
+            for (size_t len = 0; len <= MAX_SMALL_SIZE; len++) {
+                failures += check_class_kernels(byte_class, data + offset, len, "random small");
+            }
+        }
+    }
+    const char text[] = "12,\"3 4\"\t\r\n\v\f \x08\x0e\x1f/:09\xff\x80";
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        data[i] = text[next_random() % (sizeof(text) - 1)];
+    }
+    for (int id = 0; id <= PCC_CLASS_BUILTIN_AMOUNT; id++) {
+        failures += check_class_kernels(id < PCC_CLASS_BUILTIN_AMOUNT ? &pcc_classes[id] : &custom, data, LARGE_SIZE,
+                                        "class edges");
+    }
+
+    // Test 4: the 256 bin histogram, after pcc_histogram_add left its non-printable bins wrapped
+    uint64_t printable_counts[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+    uint64_t expected[PCC_HISTOGRAM_BINS] = {0};
+    uint64_t actual[PCC_HISTOGRAM_BINS] = {0};
+    fill_random(data, LARGE_SIZE);
+    pcc_histogram_add(&histogram, data, LARGE_SIZE, printable_counts);
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        expected[(unsigned char)data[i]] += custom.members[(unsigned char)data[i]];
+    }
+    uint64_t total = pcc_class_histogram(&custom, &histogram, data, LARGE_SIZE, actual);
+    if (total != reference_class_count(&custom, data, LARGE_SIZE) || memcmp(expected, actual, sizeof(expected)) != 0) {
+        printf("FAIL: class histogram of %s\n", custom.name);
+        failures++;
+    }
+
+    if (failures == 0) {
+        printf("PASS: byte classes\n");
+        return GENERAL_SUCCESS;
+    }
+    return GENERAL_ERROR;
+}
+
+/*
+ * Compresses in random sized blocks, the way the client compresses chunk by chunk, then decodes
+ * each block in random sized pieces, down to a single byte, so sequences split anywhere.
+ */
+int check_lz4(struct pcc_histogram *histogram, const char *data, size_t len, char *encoded, const char *input_name) {
+    uint64_t expected[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+    uint64_t actual[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+    uint64_t expected_total = reference_histogram(data, len, expected);
+    uint64_t actual_total = 0;
+    uint32_t hash_table[PCC_LZ4_HASH_SIZE];
+    static struct pcc_lz4_decoder decoder;  // 64KB window
+    pcc_lz4_decoder_init(&decoder);
+
+    // an empty input is still one (empty) block
+    size_t offset = 0;
+    do {
+        size_t block = next_random() % 2 == 0 ? 1 + next_random() % 64 : 1024 + next_random() % (512 * 1024);
+        if (block > len - offset) {
+            block = len - offset;
+        }
+        size_t encoded_len = pcc_lz4_encode(data + offset, block, encoded, hash_table);
+        if (encoded_len > PCC_LZ4_MAX_ENCODED_SIZE(block)) {
+            printf("FAIL: lz4 on %s: %zu bytes encoded to %zu\n", input_name, block, encoded_len);
+            return GENERAL_ERROR;
+        }
+
+        for (size_t position = 0; position < encoded_len;) {
+            size_t piece = next_random() % 4 == 0 ? 1 + next_random() % 16 : 1 + next_random() % (2 * UINT16_MAX);
+            if (piece > encoded_len - position) {
+                piece = encoded_len - position;
+            }
+            if (pcc_lz4_count(&decoder, histogram, encoded + position, piece, actual, &actual_total) != 0) {
+                printf("FAIL: lz4 on %s: valid block rejected at byte %zu\n", input_name, position);
+                return GENERAL_ERROR;
+            }
+            position += piece;
+        }
+        if (!pcc_lz4_is_complete(&decoder)) {
+            printf("FAIL: lz4 on %s: valid block left incomplete\n", input_name);
+            return GENERAL_ERROR;
+        }
+        pcc_lz4_decoder_init(&decoder);
+        offset += block;
+    } while (offset < len);
+
+    if (expected_total != actual_total || memcmp(expected, actual, sizeof(expected)) != 0) {
+        printf("FAIL: lz4 on %s (%zu bytes): expected total %lu, actual %lu\n", input_name, len,
+               (unsigned long)expected_total, (unsigned long)actual_total);
+        return GENERAL_ERROR;
+    }
+    return GENERAL_SUCCESS;
+}
+
+// a block that must either be rejected (expected_result -1) or be left incomplete
+int check_lz4_malformed(struct pcc_histogram *histogram, const char *block, size_t len, int expected_result,
+                        const char *input_name) {
+    uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+    uint64_t total = 0;
+    static struct pcc_lz4_decoder decoder;
+    pcc_lz4_decoder_init(&decoder);
+
+    int result = pcc_lz4_count(&decoder, histogram, block, len, counts, &total);
+    if (result != expected_result || (result == 0 && pcc_lz4_is_complete(&decoder))) {
+        printf("FAIL: lz4 accepted %s\n", input_name);
+        return GENERAL_ERROR;
+    }
+    return GENERAL_SUCCESS;
+}
+
+int test_lz4(char *data) {
+    int failures = 0;
+    struct pcc_histogram histogram;
+    pcc_histogram_init(&histogram);
+    char *encoded = malloc(PCC_LZ4_MAX_ENCODED_SIZE(LARGE_SIZE));
+    if (encoded == NULL) {
+        perror("malloc failed");
+        return GENERAL_ERROR;
+    }
+
+    // Test 1: one character only, runs far longer than the window and a 16 bit counter
+    memset(data, 'e', LARGE_SIZE);
+    failures += check_lz4(&histogram, data, LARGE_SIZE, encoded, "single character");
+
+    // Test 2: random runs, mostly short, of printable and non-printable bytes
+    for (size_t i = 0; i < LARGE_SIZE;) {
+        size_t run = next_random() % 64 == 0 ? next_random() % 100000 : 1 + next_random() % 8;
+        if (run > LARGE_SIZE - i) {
+            run = LARGE_SIZE - i;
+        }
+        memset(data + i, (int)(next_random() % 256), run);
+        i += run;
+    }
+    failures += check_lz4(&histogram, data, LARGE_SIZE, encoded, "random runs");
+
+    // Test 3: lines repeating at every distance up to the largest offset, with short periods too
+    const char *words[] = {"INFO ", "WARN ", "request ", "served ", "ab", "\x01\x02\x03", "=====", "\n"};
+    for (size_t i = 0; i < LARGE_SIZE;) {
+        size_t distance = 1 + next_random() % PCC_LZ4_MAX_OFFSET;
+        if (i >= distance && next_random() % 2 == 0) {
+            size_t repeat = 1 + next_random() % 300;
+            for (size_t j = 0; j < repeat && i < LARGE_SIZE; j++, i++) {
+                data[i] = data[i - distance];
+            }
+        } else {
+            const char *word = words[next_random() % (sizeof(words) / sizeof(words[0]))];
+            for (size_t j = 0; word[j] != '\0' && i < LARGE_SIZE; j++, i++) {
+                data[i] = word[j];
+            }
+        }
+    }
+    failures += check_lz4(&histogram, data, LARGE_SIZE, encoded, "repeating text");
+
+    // Test 4: random binary, nothing to match, literals longer than a flush interval
+    fill_random(data, LARGE_SIZE);
+    failures += check_lz4(&histogram, data, LARGE_SIZE, encoded, "random binary");
+
+    // Test 5: empty, cut short or invalid blocks
+    failures += check_lz4(&histogram, data, 0, encoded, "empty");
+    failures += check_lz4_malformed(&histogram, "\xf0\xff", 2, 0, "a cut short literal length");
+    failures += check_lz4_malformed(&histogram, "\x30" "ab", 3, 0, "cut short literals");
+    failures += check_lz4_malformed(&histogram, "\x10" "a\x01", 3, 0, "a cut short offset");
+    failures += check_lz4_malformed(&histogram, "\x10" "a\x01\x00", 4, 0, "a block ending after a match");
+    failures += check_lz4_malformed(&histogram, "\x1f" "a\x01\x00\xff", 5, 0, "a cut short match length");
+    failures += check_lz4_malformed(&histogram, "\x10" "a\x02\x00", 4, -1, "an offset before the block");
+    failures += check_lz4_malformed(&histogram, "\x10" "a\x00\x00", 4, -1, "offset 0");
+
+    free(encoded);
+    if (failures == 0) {
+        printf("PASS: lz4\n");
+        return GENERAL_SUCCESS;
+    }
+    return GENERAL_ERROR;
+}
+
+/*
+ * The well-formed sequences of the Unicode standard (table 3-7), byte range by byte range, so it
+ * shares nothing with the decoder it checks. Returns false if data is not valid UTF-8.
+ */
+bool reference_utf8(const char *data, size_t len, uint64_t *printable) {
+    static const unsigned char ranges[][4][2] = {
+        {{0xC2, 0xDF}, {0x80, 0xBF}},
+        {{0xE0, 0xE0}, {0xA0, 0xBF}, {0x80, 0xBF}},
+        {{0xE1, 0xEC}, {0x80, 0xBF}, {0x80, 0xBF}},
+        {{0xED, 0xED}, {0x80, 0x9F}, {0x80, 0xBF}},
+        {{0xEE, 0xEF}, {0x80, 0xBF}, {0x80, 0xBF}},
+        {{0xF0, 0xF0}, {0x90, 0xBF}, {0x80, 0xBF}, {0x80, 0xBF}},
+        {{0xF1, 0xF3}, {0x80, 0xBF}, {0x80, 0xBF}, {0x80, 0xBF}},
+        {{0xF4, 0xF4}, {0x80, 0x8F}, {0x80, 0xBF}, {0x80, 0xBF}},
+    };
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t i = 0;
+
+    *printable = 0;
+    while (i < len) {
+        if (bytes[i] < 0x80) {
+            *printable += (32 <= bytes[i] && bytes[i] <= 126);
+            i++;
+            continue;
+        }
+        size_t length = 0;
+        for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]) && length == 0; r++) {
+            size_t n = 1;
+            while (n < 4 && ranges[r][n][0] != 0) {
+                n++;
+            }
+            bool matches = i + n <= len;
+            for (size_t k = 0; k < n && matches; k++) {
+                matches = ranges[r][k][0] <= bytes[i + k] && bytes[i + k] <= ranges[r][k][1];
+            }
+            length = matches ? n : 0;
+        }
+        if (length == 0) {
+            return false;
+        }
+        *printable += !(bytes[i] == 0xC2 && bytes[i + 1] <= 0x9F);  // C1 controls
+        i += length;
+    }
+    return true;
+}
+
+int check_utf8(const struct pcc_utf8_kernel *kernel, const char *data, size_t len, const char *input_name) {
+    uint64_t expected = 0;
+    uint64_t actual = 0;
+    int expected_result = reference_utf8(data, len, &expected) ? 0 : -1;
+    int result = kernel->count(data, len, &actual);
+    if (result != expected_result || (result == 0 && expected != actual)) {
+        printf("FAIL: utf8 %s on %s (%zu bytes): expected %d / %lu, actual %d / %lu\n", kernel->name, input_name,
+               len, expected_result, (unsigned long)expected, result, (unsigned long)actual);
+        return GENERAL_ERROR;
+    }
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Feeds the decoder random sized pieces, down to a single byte, so sequences split anywhere. An
+ * invalid input must be rejected by a piece or leave the decoder incomplete.
+ */
+int check_utf8_pieces(const char *data, size_t len, const char *input_name) {
+    uint64_t expected = 0;
+    uint64_t actual = 0;
+    bool valid = reference_utf8(data, len, &expected);
+    struct pcc_utf8_decoder decoder;
+    pcc_utf8_decoder_init(&decoder);
+
+    for (size_t position = 0; position < len;) {
+        size_t piece = next_random() % 4 == 0 ? 1 + next_random() % 5 : 1 + next_random() % (64 * 1024);
+        if (piece > len - position) {
+            piece = len - position;
+        }
+        if (pcc_utf8_count(&decoder, data + position, piece, &actual) == -1) {
+            if (valid) {
+                printf("FAIL: utf8 pieces on %s: valid text rejected at byte %zu\n", input_name, position);
+                return GENERAL_ERROR;
+            }
+            return GENERAL_SUCCESS;
+        }
+        position += piece;
+    }
+    if (valid != pcc_utf8_is_complete(&decoder) || (valid && expected != actual)) {
+        printf("FAIL: utf8 pieces on %s (%zu bytes): expected %s / %lu, actual %lu\n", input_name, len,
+               valid ? "valid" : "invalid", (unsigned long)expected, (unsigned long)actual);
+        return GENERAL_ERROR;
+    }
+    return GENERAL_SUCCESS;
+}
+
+// valid text, a codepoint in ascii_percent of cases ASCII, else of a random length, C1 included
+void fill_utf8(char *data, size_t len, int ascii_percent) {
+    static const uint32_t first[] = {0x80, 0x800, 0x10000};
+    static const uint32_t last[] = {0x7FF, 0xFFFF, 0x10FFFF};
+    static const unsigned char lead[] = {0, 0, 0xC0, 0xE0, 0xF0};
+    size_t i = 0;
+
+    while (i < len) {
+        size_t length = (int)(next_random() % 100) < ascii_percent ? 1 : 2 + next_random() % 3;
+        if (length > len - i) {
+            length = 1;
+        }
+        if (length == 1) {
+            data[i++] = (char)(next_random() % 128);
+            continue;
+        }
+        uint32_t codepoint = first[length - 2] + next_random() % (last[length - 2] - first[length - 2] + 1);
+        if (0xD800 <= codepoint && codepoint <= 0xDFFF) {
+            codepoint -= 0x800;  // out of the surrogates
+        }
+        data[i] = (char)(lead[length] | (codepoint >> (6 * (length - 1))));
+        for (size_t k = 1; k < length; k++) {
+            data[i + k] = (char)(0x80 | ((codepoint >> (6 * (length - 1 - k))) & 0x3F));
+        }
+        i += length;
+    }
+}
+
+int test_utf8(const struct pcc_utf8_kernel *kernel, char *data) {
+    static const struct {
+        const char *bytes;
+        const char *name;
+    } sequences[] = {
+        {"\xc3\xa9", "2 bytes"},        {"\xe2\x82\xac", "3 bytes"},       {"\xf0\x9f\x98\x80", "4 bytes"},
+        {"\xc2\x85", "C1 control"},     {"\xc2\xa0", "past C1"},           {"\x7f", "DEL"},
+        {"\xef\xbb\xbf", "BOM"},        {"\xf4\x8f\xbf\xbf", "U+10FFFF"},  {"\xed\x9f\xbf", "before surrogates"},
+        {"\xc0\xaf", "overlong 2"},     {"\xc1\xbf", "overlong 2 max"},    {"\xe0\x9f\xbf", "overlong 3"},
+        {"\xf0\x8f\xbf\xbf", "overlong 4"}, {"\xed\xa0\x80", "surrogate"}, {"\xf4\x90\x80\x80", "too large"},
+        {"\xf5\x80\x80\x80", "F5"},     {"\xff", "FF"},                    {"\x80", "stray continuation"},
+        {"\xc3", "cut short 2"},        {"\xe2\x82", "cut short 3"},       {"\xf0\x9f\x98", "cut short 4"},
+        {"\xc3\xa9\xa9", "too long"},   {"\xe2\x41\xac", "ASCII inside"},  {"\xf0\x9f\x98\x80\x80", "5 bytes"},
+    };
+    int failures = 0;
+
+    // Test 1: single sequences at every position of an ASCII buffer, across the vector blocks
+    for (size_t s = 0; s < sizeof(sequences) / sizeof(sequences[0]); s++) {
+        size_t length = strlen(sequences[s].bytes);
+        for (size_t position = 0; position + length <= 300; position++) {
+            memset(data, 'a', 300);
+            memcpy(data + position, sequences[s].bytes, length);
+            failures += check_utf8(kernel, data, 300, sequences[s].name);
+            failures += check_utf8(kernel, data, position + length, sequences[s].name);
+        }
+    }
+
+    // Test 2: every two byte pair and every three byte sequence after each block's 30 bytes
+    memset(data, 'a', 64);
+    for (int pair = 0; pair < 256 * 256; pair++) {
+        data[30] = (char)(pair >> 8);
+        data[31] = (char)pair;
+        failures += check_utf8(kernel, data, 32, "every pair");
+        data[32] = 'a';
+        for (int third = 0x80; third < 0x100 && (unsigned char)data[30] >= 0xE0; third++) {
+            data[32] = (char)third;
+            failures += check_utf8(kernel, data, 64, "every triple");
+        }
+    }
+
+    // Test 3: every small size at every alignment, valid text and cut off anywhere
+    fill_utf8(data, MAX_SMALL_SIZE + MAX_OFFSET, 50);
+    for (size_t offset = 0; offset < MAX_OFFSET; offset += 3) {
+        for (size_t len = 0; len <= MAX_SMALL_SIZE; len++) {
+            failures += check_utf8(kernel, data + offset, len, "mixed small");
+        }
+    }
+
+    // Test 4: large valid text, mostly ASCII, mostly not, and with a byte corrupted here and there
+    int ascii_percents[] = {100, 95, 50, 0};
+    for (size_t p = 0; p < sizeof(ascii_percents) / sizeof(ascii_percents[0]); p++) {
+        fill_utf8(data, LARGE_SIZE, ascii_percents[p]);
+        failures += check_utf8(kernel, data, LARGE_SIZE, "mixed large");
+    }
+    for (int corrupted = 0; corrupted < 64; corrupted++) {
+        size_t len = 1 + next_random() % 4096;
+        fill_utf8(data, len, 80);
+        data[next_random() % len] = (char)next_random();
+        failures += check_utf8(kernel, data, len, "corrupted");
+    }
+
+    // Test 5: random binary, which is almost never valid
+    fill_random(data, LARGE_SIZE);
+    failures += check_utf8(kernel, data, LARGE_SIZE, "random binary");
+
+    if (failures == 0) {
+        printf("PASS: utf8 %s\n", kernel->name);
+        return GENERAL_SUCCESS;
+    }
+    return GENERAL_ERROR;
+}
+
+int test_utf8_decoder(char *data) {
+    int failures = 0;
+
+    // Test 1: valid text in pieces split anywhere, mostly ASCII and mostly not
+    fill_utf8(data, LARGE_SIZE, 90);
+    failures += check_utf8_pieces(data, LARGE_SIZE, "mostly ASCII");
+    fill_utf8(data, LARGE_SIZE, 10);
+    failures += check_utf8_pieces(data, LARGE_SIZE, "mostly multibyte");
+
+    // Test 2: text cut off inside its last sequence, or corrupted, is never accepted whole
+    for (int corrupted = 0; corrupted < 256; corrupted++) {
+        size_t len = 1 + next_random() % 256;
+        fill_utf8(data, len, 20);
+        if (corrupted % 2 == 0) {
+            data[next_random() % len] = (char)next_random();
+        }
+        failures += check_utf8_pieces(data, len - (corrupted % 4 == 1), "cut off or corrupted");
+    }
+
+    if (failures == 0) {
+        printf("PASS: utf8 decoder\n");
+        return GENERAL_SUCCESS;
+    }
+    return GENERAL_ERROR;
+}
+
+int main(int argc, char *argv[]) {
+    int return_code = GENERAL_SUCCESS;
+    char *data = malloc(LARGE_SIZE + MAX_OFFSET);
+    if (data == NULL) {
+        perror("malloc failed");
+        return GENERAL_ERROR;
+    }
+
+    const struct pcc_count_kernel *selected = pcc_count_init();
+    printf("Selected counting kernel: %s\n", selected->name);
+
+    for (size_t k = 0; k < PCC_COUNT_KERNELS_AMOUNT; k++) {
+        const struct pcc_count_kernel *kernel = &pcc_count_printable_kernels[k];
+        if (!kernel->is_supported()) {
+            printf("SKIP: %s (not supported by this CPU)\n", kernel->name);
+            continue;
+        }
+        if (test_kernel(kernel, data) != GENERAL_SUCCESS) {
+            return_code = GENERAL_ERROR;
+        }
+    }
+
+    if (test_histogram(data) != GENERAL_SUCCESS || test_classes(data) != GENERAL_SUCCESS ||
+        test_lz4(data) != GENERAL_SUCCESS) {
+        return_code = GENERAL_ERROR;
+    }
+
+    printf("Selected UTF-8 kernel: %s\n", pcc_utf8_init()->name);
+    for (size_t k = 0; k < PCC_UTF8_KERNELS_AMOUNT; k++) {
+        if (!pcc_utf8_kernels[k].is_supported()) {
+            printf("SKIP: utf8 %s (not supported by this CPU)\n", pcc_utf8_kernels[k].name);
+            continue;
+        }
+        if (test_utf8(&pcc_utf8_kernels[k], data) != GENERAL_SUCCESS) {
+            return_code = GENERAL_ERROR;
+        }
+    }
+    if (test_utf8_decoder(data) != GENERAL_SUCCESS) {
+        return_code = GENERAL_ERROR;
+    }
+
+    free(data);
+    return return_code;
+}
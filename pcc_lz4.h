@@ -0,0 +1,356 @@
+#ifndef PCC_LZ4_H
+#define PCC_LZ4_H
+
+/*
+ * LZ4 block format, for PCC_V2_FLAG_LZ4 bodies. Self-contained, no liblz4 needed on either side,
+ * and the blocks are standard ones any LZ4 implementation reads and writes.
+ *
+ * A block is a sequence of sequences, each of them:
+ *     token:    high nibble the literal length, low nibble the match length - 4, 15 in either
+ *               means more length bytes follow, each added on, until one is below 255
+ *     literals: that many bytes as is
+ *     offset:   uint16_t little endian, how far back the match starts, 1 to 65535
+ *     match:    copied from offset bytes back, it may overlap itself (offset 1 is a run)
+ * The last sequence stops after its literals, a block may only end there.
+ *
+ * Counting never produces the plaintext, only the last PCC_LZ4_WINDOW_SIZE bytes of it which
+ * later matches may copy from. Literals and matches are decoded into that window and counted
+ * from there by the histogram engine, while a long run (a match with offset 1) adds its length to
+ * its character's count in one step. The decoder keeps its place inside a sequence, so a block
+ * can be fed in pieces of any size.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "pcc_count.h"
+
+#define PCC_LZ4_MIN_MATCH (4)
+#define PCC_LZ4_MAX_OFFSET (65535)
+// the format guarantees these, so decoders can copy in wide steps near the end of a block
+#define PCC_LZ4_LAST_LITERALS (5)
+#define PCC_LZ4_MATCH_FIND_LIMIT (12)
+#define PCC_LZ4_MAX_ENCODED_SIZE(len) ((len) + (len) / 255 + 16)
+
+#define PCC_LZ4_WINDOW_SIZE (64 * 1024)  // a power of two above PCC_LZ4_MAX_OFFSET
+#define PCC_LZ4_WINDOW_MASK (PCC_LZ4_WINDOW_SIZE - 1)
+// decoded bytes are counted from the window in batches of about this size
+#define PCC_LZ4_COUNT_BATCH (16 * 1024)
+// runs at least this long are counted in one step instead of copied and counted
+#define PCC_LZ4_MIN_COUNTED_RUN (32)
+
+#define PCC_LZ4_HASH_BITS (12)
+#define PCC_LZ4_HASH_SIZE (1 << PCC_LZ4_HASH_BITS)
+
+enum pcc_lz4_phase {
+    PCC_LZ4_TOKEN,
+    PCC_LZ4_LITERAL_LENGTH,
+    PCC_LZ4_LITERALS,
+    PCC_LZ4_OFFSET_LOW,  // a block may end here, right after the literals
+    PCC_LZ4_OFFSET_HIGH,
+    PCC_LZ4_MATCH_LENGTH,
+};
+
+struct pcc_lz4_decoder {
+    uint64_t position;  // decoded bytes in the current block
+    uint64_t counted;   // of those, the ones already added to the counts
+    uint64_t length;    // of the literals or match being read
+    uint16_t offset;
+    uint8_t phase;        // enum pcc_lz4_phase
+    uint8_t match_token;  // the low nibble of the current token
+    unsigned char window[PCC_LZ4_WINDOW_SIZE];  // decoded byte i is at window[i & PCC_LZ4_WINDOW_MASK]
+};
+
+// the window is left as is, nothing before the start of a block can be referenced
+static inline void pcc_lz4_decoder_init(struct pcc_lz4_decoder *decoder) {
+    decoder->position = 0;
+    decoder->counted = 0;
+    decoder->length = 0;
+    decoder->offset = 0;
+    decoder->phase = PCC_LZ4_TOKEN;
+    decoder->match_token = 0;
+}
+
+// a block may only end after the literals of a sequence, or before its first byte
+static inline bool pcc_lz4_is_complete(const struct pcc_lz4_decoder *decoder) {
+    return decoder->phase == PCC_LZ4_OFFSET_LOW || (decoder->phase == PCC_LZ4_TOKEN && decoder->position == 0);
+}
+
+// adds whatever was decoded since the last time to the counts
+static inline void pcc_lz4_count_window(struct pcc_lz4_decoder *decoder, struct pcc_histogram *histogram,
+                                        uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS], uint64_t *printable) {
+    size_t start = decoder->counted & PCC_LZ4_WINDOW_MASK;
+    size_t len = decoder->position - decoder->counted;
+    size_t first = PCC_LZ4_WINDOW_SIZE - start < len ? PCC_LZ4_WINDOW_SIZE - start : len;
+
+    *printable += pcc_histogram_add(histogram, (const char *)decoder->window + start, first, counts);
+    *printable += pcc_histogram_add(histogram, (const char *)decoder->window, len - first, counts);
+    decoder->counted = decoder->position;
+}
+
+// appends at most PCC_LZ4_COUNT_BATCH literal bytes to the window
+static inline void pcc_lz4_window_write(struct pcc_lz4_decoder *decoder, const unsigned char *bytes, size_t len) {
+    size_t start = decoder->position & PCC_LZ4_WINDOW_MASK;
+    size_t first = PCC_LZ4_WINDOW_SIZE - start < len ? PCC_LZ4_WINDOW_SIZE - start : len;
+    memcpy(decoder->window + start, bytes, first);
+    memcpy(decoder->window, bytes + first, len - first);
+    decoder->position += len;
+}
+
+// appends at most PCC_LZ4_COUNT_BATCH bytes of the match to the window
+static inline size_t pcc_lz4_window_copy(struct pcc_lz4_decoder *decoder, uint64_t left) {
+    size_t step = left < PCC_LZ4_COUNT_BATCH ? left : PCC_LZ4_COUNT_BATCH;
+    size_t source = (decoder->position - decoder->offset) & PCC_LZ4_WINDOW_MASK;
+    size_t destination = decoder->position & PCC_LZ4_WINDOW_MASK;
+
+    if (decoder->offset < step || PCC_LZ4_WINDOW_SIZE - source < step || PCC_LZ4_WINDOW_SIZE - destination < step) {
+        // overlapping itself or wrapping around the window, byte by byte
+        for (size_t i = 0; i < step; i++) {
+            decoder->window[(destination + i) & PCC_LZ4_WINDOW_MASK] = decoder->window[(source + i) & PCC_LZ4_WINDOW_MASK];
+        }
+    } else {
+        // a match from more than PCC_LZ4_WINDOW_SIZE - step back overlaps its destination in the
+        // window, the source always lies ahead of it there so memmove copies it like the format does
+        memmove(decoder->window + destination, decoder->window + source, step);
+    }
+    decoder->position += step;
+    return step;
+}
+
+static inline void pcc_lz4_copy_match(struct pcc_lz4_decoder *decoder, struct pcc_histogram *histogram,
+                                      uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS], uint64_t *printable) {
+    uint64_t left = decoder->length;
+
+    if (decoder->offset == 1 && left >= PCC_LZ4_MIN_COUNTED_RUN) {
+        // a run, counted in one step, only its end can still be referenced
+        unsigned char byte = decoder->window[(decoder->position - 1) & PCC_LZ4_WINDOW_MASK];
+        pcc_lz4_count_window(decoder, histogram, counts, printable);
+        if (PRINTABLE_LOWER_BOUND <= byte && byte <= PRINTABLE_UPPER_BOUND) {
+            counts[byte - PRINTABLE_LOWER_BOUND] += left;
+            *printable += left;
+        }
+        if (left > PCC_LZ4_WINDOW_SIZE) {
+            decoder->position += left - PCC_LZ4_WINDOW_SIZE;
+            left = PCC_LZ4_WINDOW_SIZE;
+        }
+        size_t start = decoder->position & PCC_LZ4_WINDOW_MASK;
+        size_t first = PCC_LZ4_WINDOW_SIZE - start < left ? PCC_LZ4_WINDOW_SIZE - start : left;
+        memset(decoder->window + start, byte, first);
+        memset(decoder->window, byte, left - first);
+        decoder->position += left;
+        decoder->counted = decoder->position;
+        return;
+    }
+
+    while (left > 0) {
+        left -= pcc_lz4_window_copy(decoder, left);
+        if (decoder->position - decoder->counted >= PCC_LZ4_COUNT_BATCH) {
+            pcc_lz4_count_window(decoder, histogram, counts, printable);
+        }
+    }
+}
+
+// the most a sequence with both lengths in its token takes up: token, 14 literals and offset
+#define PCC_LZ4_SHORT_SEQUENCE_SIZE (1 + 14 + 2)
+
+/*
+ * Decodes whole sequences whose lengths fit in their token while enough input is left for one,
+ * which is most of them, without going through the phases byte by byte. Returns the amount of
+ * input used, or -1 if the block is malformed. Stops at the first other sequence.
+ */
+static inline ptrdiff_t pcc_lz4_short_sequences(struct pcc_lz4_decoder *decoder, struct pcc_histogram *histogram,
+                                                const unsigned char *bytes, size_t len,
+                                                uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS], uint64_t *printable) {
+    size_t i = 0;
+
+    while (len - i >= PCC_LZ4_SHORT_SEQUENCE_SIZE) {
+        unsigned int literals = bytes[i] >> 4;
+        unsigned int match = bytes[i] & 0x0F;
+        if (literals == 15 || match == 15) {
+            break;
+        }
+        pcc_lz4_window_write(decoder, bytes + i + 1, literals);
+        i += 1 + literals;
+        decoder->offset = bytes[i] | (uint16_t)bytes[i + 1] << 8;
+        i += 2;
+        if (decoder->offset == 0 || decoder->offset > decoder->position) {
+            return -1;
+        }
+        decoder->length = match + PCC_LZ4_MIN_MATCH;
+        pcc_lz4_window_copy(decoder, decoder->length);
+        if (decoder->position - decoder->counted >= PCC_LZ4_COUNT_BATCH) {
+            pcc_lz4_count_window(decoder, histogram, counts, printable);
+        }
+    }
+    return i;
+}
+
+/*
+ * Decodes the next piece of a block into counts (indexed like new_pcc_count) and adds the amount
+ * of printable characters it stands for to *printable. Returns 0, or -1 if the block is
+ * malformed. The histogram is only scratch, it is clean again when this returns.
+ *
+ * Bytes are counted from the window a batch at a time rather than sequence by sequence, a
+ * sequence is a couple dozen bytes and the histogram engine pays off on longer stretches. The
+ * window never holds more than two batches that were not counted yet, so nothing is overwritten
+ * before it was counted.
+ */
+static inline int pcc_lz4_count(struct pcc_lz4_decoder *decoder, struct pcc_histogram *histogram, const char *data,
+                                size_t len, uint64_t counts[AMOUNT_OF_PRINTABLE_CHARS], uint64_t *printable) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t i = 0;
+
+    while (i < len) {
+        switch (decoder->phase) {
+        case PCC_LZ4_TOKEN: {
+            ptrdiff_t used = pcc_lz4_short_sequences(decoder, histogram, bytes + i, len - i, counts, printable);
+            if (used < 0) {
+                return -1;
+            }
+            i += used;
+            if (i == len) {
+                break;
+            }
+            decoder->length = bytes[i] >> 4;
+            decoder->match_token = bytes[i] & 0x0F;
+            i++;
+            decoder->phase = decoder->length == 15 ? PCC_LZ4_LITERAL_LENGTH
+                             : decoder->length > 0 ? PCC_LZ4_LITERALS
+                                                   : PCC_LZ4_OFFSET_LOW;
+            break;
+        }
+        case PCC_LZ4_LITERAL_LENGTH:
+            decoder->length += bytes[i];
+            if (bytes[i++] != 255) {
+                decoder->phase = PCC_LZ4_LITERALS;
+            }
+            break;
+        case PCC_LZ4_LITERALS: {
+            size_t step = decoder->length < len - i ? decoder->length : len - i;
+            step = step < PCC_LZ4_COUNT_BATCH ? step : PCC_LZ4_COUNT_BATCH;
+            pcc_lz4_window_write(decoder, bytes + i, step);
+            if (decoder->position - decoder->counted >= PCC_LZ4_COUNT_BATCH) {
+                pcc_lz4_count_window(decoder, histogram, counts, printable);
+            }
+            i += step;
+            decoder->length -= step;
+            if (decoder->length == 0) {
+                decoder->phase = PCC_LZ4_OFFSET_LOW;
+            }
+            break;
+        }
+        case PCC_LZ4_OFFSET_LOW:
+            decoder->offset = bytes[i++];
+            decoder->phase = PCC_LZ4_OFFSET_HIGH;
+            break;
+        case PCC_LZ4_OFFSET_HIGH:
+            decoder->offset |= (uint16_t)bytes[i++] << 8;
+            if (decoder->offset == 0 || decoder->offset > decoder->position) {
+                return -1;  // before the start of the block
+            }
+            decoder->length = decoder->match_token + PCC_LZ4_MIN_MATCH;
+            if (decoder->match_token == 15) {
+                decoder->phase = PCC_LZ4_MATCH_LENGTH;
+                break;
+            }
+            pcc_lz4_copy_match(decoder, histogram, counts, printable);
+            decoder->phase = PCC_LZ4_TOKEN;
+            break;
+        case PCC_LZ4_MATCH_LENGTH:
+            decoder->length += bytes[i];
+            if (bytes[i++] != 255) {
+                pcc_lz4_copy_match(decoder, histogram, counts, printable);
+                decoder->phase = PCC_LZ4_TOKEN;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    pcc_lz4_count_window(decoder, histogram, counts, printable);
+    return 0;
+}
+
+static inline uint32_t pcc_lz4_read32(const unsigned char *bytes) {
+    uint32_t value = 0;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline uint32_t pcc_lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - PCC_LZ4_HASH_BITS);
+}
+
+static inline unsigned char *pcc_lz4_put_length(unsigned char *out, size_t length) {
+    for (; length >= 255; length -= 255) {
+        *out++ = 255;
+    }
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+// a match of match_length bytes (0 for the last sequence, which has none) after the literals
+static inline unsigned char *pcc_lz4_put_sequence(unsigned char *out, const unsigned char *literals,
+                                                  size_t literals_length, size_t offset, size_t match_length) {
+    unsigned char *token = out++;
+    size_t match_code = match_length > 0 ? match_length - PCC_LZ4_MIN_MATCH : 0;
+
+    *token = (unsigned char)(((literals_length < 15 ? literals_length : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if (literals_length >= 15) {
+        out = pcc_lz4_put_length(out, literals_length - 15);
+    }
+    memcpy(out, literals, literals_length);
+    out += literals_length;
+    if (match_length == 0) {
+        return out;
+    }
+
+    *out++ = (unsigned char)(offset & 0xFF);
+    *out++ = (unsigned char)(offset >> 8);
+    if (match_code >= 15) {
+        out = pcc_lz4_put_length(out, match_code - 15);
+    }
+    return out;
+}
+
+/*
+ * Compresses data into one block, greedily taking the latest earlier position with the same 4
+ * bytes. out must have room for PCC_LZ4_MAX_ENCODED_SIZE(len) bytes, table is scratch.
+ * Returns the block's size.
+ */
+static inline size_t pcc_lz4_encode(const char *data, size_t len, char *out, uint32_t table[PCC_LZ4_HASH_SIZE]) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    unsigned char *next = (unsigned char *)out;
+    size_t anchor = 0;  // the first byte not yet encoded
+    size_t i = 0;
+
+    memset(table, 0xFF, PCC_LZ4_HASH_SIZE * sizeof(table[0]));
+    // matches have to start PCC_LZ4_MATCH_FIND_LIMIT bytes and end PCC_LZ4_LAST_LITERALS bytes before the end
+    while (len > PCC_LZ4_MATCH_FIND_LIMIT && i < len - PCC_LZ4_MATCH_FIND_LIMIT) {
+        uint32_t sequence = pcc_lz4_read32(bytes + i);
+        uint32_t *slot = &table[pcc_lz4_hash(sequence)];
+        uint32_t candidate = *slot;
+        *slot = (uint32_t)i;
+        if (candidate == UINT32_MAX || i - candidate > PCC_LZ4_MAX_OFFSET ||
+            pcc_lz4_read32(bytes + candidate) != sequence) {
+            i++;
+            continue;
+        }
+
+        size_t match_length = PCC_LZ4_MIN_MATCH;
+        while (i + match_length < len - PCC_LZ4_LAST_LITERALS && bytes[candidate + match_length] == bytes[i + match_length]) {
+            match_length++;
+        }
+        next = pcc_lz4_put_sequence(next, bytes + anchor, i - anchor, i - candidate, match_length);
+        i += match_length;
+        anchor = i;
+    }
+
+    next = pcc_lz4_put_sequence(next, bytes + anchor, len - anchor, 0, 0);
+    return next - (unsigned char *)out;
+}
+
+#endif // PCC_LZ4_H
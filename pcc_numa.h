@@ -0,0 +1,214 @@
+#ifndef PCC_NUMA_H
+#define PCC_NUMA_H
+
+/*
+ * CPU affinity, NUMA placement and huge page buffers for the server's workers, without libnuma.
+ *
+ * CPU sets are given as Linux CPU lists ("0-3,8,10-11"). The NUMA topology comes from sysfs, a
+ * machine without /sys/devices/system/node is one node. Memory is placed with the mbind system
+ * call, MPOL_PREFERRED so a full node spills over instead of failing, and MPOL_MF_MOVE so pages
+ * that were already touched migrate too. Placement is best effort: on a kernel without NUMA
+ * support it fails with ENOSYS and the memory simply stays where it is.
+ *
+ * Buffers from pcc_buffer_map() are whole mappings, either plain pages, transparent huge pages
+ * (madvise, the kernel may still hand out small pages) or explicit huge pages (MAP_HUGETLB, from
+ * the vm.nr_hugepages pool). Explicit ones fall back to transparent ones when the pool is empty.
+ *
+ * Needs _GNU_SOURCE for cpu_set_t.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define PCC_HUGE_PAGE_SIZE (2 * 1024 * 1024)  // the default huge page size on x86-64 and on arm64 with 4K pages
+#define PCC_NUMA_MAX_NODES (64)               // nodes beyond fit no single mbind mask word and are never placed
+
+// from <numaif.h>, which comes with libnuma
+#define PCC_MPOL_PREFERRED (1)
+#define PCC_MPOL_MF_MOVE (1 << 1)
+
+enum pcc_huge_pages {
+    PCC_HUGE_PAGES_OFF,
+    PCC_HUGE_PAGES_TRANSPARENT,
+    PCC_HUGE_PAGES_EXPLICIT,
+};
+
+static const char *const pcc_huge_pages_names[] = {"off", "thp", "explicit"};
+
+// parses a CPU list into set, returns -1 if it is malformed or names a CPU beyond CPU_SETSIZE
+static inline int pcc_cpu_list_parse(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    do {
+        char *end = NULL;
+        errno = 0;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (end == p || errno != 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p || errno != 0 || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        p = end;
+    } while (*p++ == ',');
+    return p[-1] == '\0' || p[-1] == '\n' ? 0 : -1;
+}
+
+// the n-th CPU of the set, counting round, -1 for an empty set
+static inline int pcc_cpu_set_nth(const cpu_set_t *set, unsigned int n) {
+    int count = CPU_COUNT(set);
+    if (count == 0) {
+        return -1;
+    }
+    n %= (unsigned int)count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set) && n-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+// the online NUMA nodes, just node 0 when sysfs does not say
+static inline void pcc_numa_online_nodes(cpu_set_t *nodes) {
+    char list[256] = "";
+    FILE *file = fopen("/sys/devices/system/node/online", "r");
+    if (file != NULL) {
+        if (fgets(list, sizeof(list), file) == NULL) {
+            list[0] = '\0';
+        }
+        fclose(file);
+    }
+    if (list[0] == '\0' || pcc_cpu_list_parse(list, nodes) == -1 || CPU_COUNT(nodes) == 0) {
+        CPU_ZERO(nodes);
+        CPU_SET(0, nodes);
+    }
+}
+
+static inline int pcc_numa_node_count(void) {
+    cpu_set_t nodes;
+    pcc_numa_online_nodes(&nodes);
+    return CPU_COUNT(&nodes);
+}
+
+// the node a CPU belongs to, sysfs links it as cpuN/nodeM, 0 when there is no such link
+static inline int pcc_numa_node_of_cpu(int cpu) {
+    cpu_set_t nodes;
+    char path[96];
+
+    pcc_numa_online_nodes(&nodes);
+    for (int node = 0; node < PCC_NUMA_MAX_NODES; node++) {
+        if (!CPU_ISSET(node, &nodes)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0) {
+            return node;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Prefers node for the whole pages within [addr, addr + len) and moves those already touched
+ * there. Pages only partly inside the range are left alone. Returns 0, or -1 with errno set.
+ */
+static inline int pcc_numa_place(void *addr, size_t len, int node) {
+    uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)addr + page_size - 1) & ~(page_size - 1);
+    uintptr_t end = ((uintptr_t)addr + len) & ~(page_size - 1);
+    unsigned long mask = 1UL << node;
+
+    if (node < 0 || node >= PCC_NUMA_MAX_NODES) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (end <= start) {
+        return 0;
+    }
+    // the kernel takes one bit less than maxnode says
+    return (int)syscall(SYS_mbind, (void *)start, end - start, PCC_MPOL_PREFERRED, &mask, PCC_NUMA_MAX_NODES + 1,
+                        PCC_MPOL_MF_MOVE);
+}
+
+// rounds a buffer size up to what a mapping of the given kind holds anyway
+static inline size_t pcc_buffer_size(size_t size, enum pcc_huge_pages huge_pages) {
+    size_t unit = huge_pages != PCC_HUGE_PAGES_OFF ? PCC_HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    return (size + unit - 1) / unit * unit;
+}
+
+/*
+ * Maps a buffer of pcc_buffer_size(size, huge_pages) bytes, placed on node unless it is
+ * negative, before any of it is touched. *got is the kind of pages it really has, explicit huge
+ * pages fall back to transparent ones. Returns NULL with errno set on failure.
+ */
+static inline void *pcc_buffer_map(size_t size, enum pcc_huge_pages huge_pages, int node, enum pcc_huge_pages *got) {
+    size = pcc_buffer_size(size, huge_pages);
+    void *buffer = MAP_FAILED;
+
+    *got = huge_pages;
+    if (huge_pages == PCC_HUGE_PAGES_EXPLICIT) {
+        buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buffer == MAP_FAILED) {
+            *got = PCC_HUGE_PAGES_TRANSPARENT;
+        }
+    }
+    if (buffer == MAP_FAILED) {
+        if (*got == PCC_HUGE_PAGES_TRANSPARENT) {
+            // one huge page more, so a huge page aligned range of the full size is inside
+            void *mapping = mmap(NULL, size + PCC_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapping == MAP_FAILED) {
+                return NULL;
+            }
+            uintptr_t aligned = ((uintptr_t)mapping + PCC_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(PCC_HUGE_PAGE_SIZE - 1);
+            size_t head = aligned - (uintptr_t)mapping;
+            if (head > 0) {
+                munmap(mapping, head);
+            }
+            munmap((char *)aligned + size, PCC_HUGE_PAGE_SIZE - head);
+            buffer = (void *)aligned;
+            if (madvise(buffer, size, MADV_HUGEPAGE) == -1) {
+                *got = PCC_HUGE_PAGES_OFF;  // THP disabled or not built in
+            }
+        } else {
+            buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (buffer == MAP_FAILED) {
+                return NULL;
+            }
+        }
+    }
+
+    if (node >= 0) {
+        pcc_numa_place(buffer, size, node);  // best effort, see above
+    }
+    return buffer;
+}
+
+// size is the rounded one, pcc_buffer_size() of what was asked for
+static inline void pcc_buffer_unmap(void *buffer, size_t size) {
+    if (buffer != NULL) {
+        munmap(buffer, size);
+    }
+}
+
+#endif // PCC_NUMA_H
@@ -0,0 +1,139 @@
+#ifndef PCC_PROTOCOL_H
+#define PCC_PROTOCOL_H
+
+/*
+ * Wire format shared by pcc_server and pcc_client. All integers are big endian.
+ *
+ * v1 (what pcc_tester and older clients speak):
+ *     request: uint32_t N, then N bytes
+ *     reply:   uint32_t printable count
+ *
+ * v2 starts with PCC_V2_MAGIC where v1 has N, so the server tells the two apart from the
+ * first 4 bytes. The only v1 request this takes away is a body of exactly 4GiB - 1 bytes,
+ * which a v1 client can not send correctly anyway.
+ *     request: struct pcc_v2_header, then either
+ *              - uint64_t N, then N bytes
+ *              - with PCC_V2_FLAG_CHUNKED, chunks of uint32_t length + that many bytes,
+ *                ended by a chunk of length 0
+ *     reply:   uint64_t printable count
+ * With PCC_V2_FLAG_LZ4 the body is compressed: the N bytes are one LZ4 block, or with
+ * PCC_V2_FLAG_CHUNKED every chunk is one, see pcc_lz4.h. Blocks are independent, a match never
+ * reaches back into an earlier one. The reply and the statistics are those of the decoded data.
+ *
+ * PCC_V2_FLAG_SHM (with PCC_V2_FLAG_CHUNKED, and only over the server's Unix socket) moves the
+ * chunk bytes into a shared memory ring, see pcc_shm.h. Right after the header of the first such
+ * request on a connection comes a single byte carrying the ring's memfd as SCM_RIGHTS, later ones
+ * on the same keep-alive connection reuse that ring and send no byte. Each chunk is then only its
+ * uint32_t length on the socket, standing for that many bytes in the ring where the previous
+ * chunk of the request ended, the first one at the start of the ring. A chunk is at most the
+ * ring's capacity.
+ *
+ * PCC_V2_FLAG_DELTA is how a leaf server pushes its statistics to its parent: the body, announced
+ * with its uint64_t length and nothing else, is a struct pcc_delta. The parent adds it to its
+ * statistics instead of counting it, as clients_count clients, and replies with the sum of the
+ * counts. Only a parent started as an aggregator takes deltas, over TCP from its configured leaf
+ * addresses, every other server drops the connection. A leaf names itself with a leaf_id, random
+ * per run, and numbers its deltas from 1. A delta it got no reply for is resent unchanged, with
+ * the same sequence, before any newer one, and the parent adds a delta only if its sequence is
+ * above the last one it added from that leaf: a lost reply never makes a delta count twice.
+ *
+ * The header's byte_class picks what the reply counts, one of the built in classes of
+ * pcc_count.h (enum pcc_class_id): 0 is the printable characters, and the only class LZ4 and
+ * delta requests may name. The statistics count the printable characters whatever the class.
+ *
+ * PCC_V2_FLAG_BYTE_SET has the reply count any set of bytes instead: a struct pcc_byte_set follows
+ * the header, before anything else of the request, and byte_class must be 0. With
+ * PCC_V2_FLAG_HISTOGRAM the reply is the uint64_t count followed by 256 uint64_t bins, bin b
+ * holding how many bytes of value b the body has if b is in the class (or the set), 0 otherwise,
+ * so the class "any" gets the whole histogram. Neither flag goes with LZ4, UTF-8 or delta requests.
+ *
+ * With PCC_V2_FLAG_UTF8 (byte_class printable, neither LZ4 nor delta) the body is UTF-8 and the
+ * reply counts its printable codepoints instead of bytes, see pcc_utf8.h. Sequences may be split
+ * across chunks, but not cut off by the end of the body. A body that is not valid UTF-8 gets no
+ * reply, the server drops the connection. The statistics stay those of the bytes.
+ *
+ * With PCC_V2_FLAG_KEEP_ALIVE the connection stays open after the reply and the next request,
+ * of either version, follows on it. Clients may pipeline: send further requests before reading
+ * the earlier replies, which come back in request order. A request without the flag (every v1
+ * request) is the last one on its connection. The server counts each request as one client.
+ */
+
+#include <stdint.h>
+
+#define PCC_V2_MAGIC (0xFFFFFFFFu)
+#define PCC_V2_VERSION (2)
+
+// the body is a stream of chunks of unknown total length
+#define PCC_V2_FLAG_CHUNKED (1 << 0)
+// another request follows on the same connection
+#define PCC_V2_FLAG_KEEP_ALIVE (1 << 1)
+// the body is compressed, servers that do not know this flag drop the request
+#define PCC_V2_FLAG_LZ4 (1 << 2)
+// the chunks are in a shared memory ring instead of on the socket
+#define PCC_V2_FLAG_SHM (1 << 3)
+// the body is a struct pcc_delta
+#define PCC_V2_FLAG_DELTA (1 << 4)
+// the body is UTF-8 text, the reply counts printable codepoints
+#define PCC_V2_FLAG_UTF8 (1 << 5)
+// a struct pcc_byte_set follows the header, the reply counts its bytes
+#define PCC_V2_FLAG_BYTE_SET (1 << 6)
+// the reply carries the bins of the counted bytes after the count
+#define PCC_V2_FLAG_HISTOGRAM (1 << 7)
+#define PCC_V2_KNOWN_FLAGS                                                                          \
+    (PCC_V2_FLAG_CHUNKED | PCC_V2_FLAG_KEEP_ALIVE | PCC_V2_FLAG_LZ4 | PCC_V2_FLAG_SHM | PCC_V2_FLAG_DELTA | \
+     PCC_V2_FLAG_UTF8 | PCC_V2_FLAG_BYTE_SET | PCC_V2_FLAG_HISTOGRAM)
+
+// the largest body a v1 request can announce without being mistaken for v2
+#define PCC_V1_MAX_LENGTH (PCC_V2_MAGIC - 1)
+
+struct pcc_v2_header {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint8_t byte_class;  // what the reply counts, enum pcc_class_id
+    uint8_t reserved;    // must be 0
+};
+
+_Static_assert(sizeof(struct pcc_v2_header) == 8, "pcc_v2_header is sent as is");
+
+// byte b is in the set if bit b % 8 of bits[b / 8] is
+struct pcc_byte_set {
+    uint8_t bits[32];
+};
+
+_Static_assert(sizeof(struct pcc_byte_set) == 32, "pcc_byte_set is sent as is");
+
+static inline void pcc_byte_set_add(struct pcc_byte_set *set, uint8_t byte) {
+    set->bits[byte / 8] |= (uint8_t)(1u << (byte % 8));
+}
+
+static inline int pcc_byte_set_has(const struct pcc_byte_set *set, uint8_t byte) {
+    return (set->bits[byte / 8] >> (byte % 8)) & 1;
+}
+
+// one count per printable character, 32 to 126
+#define PCC_DELTA_COUNTS (95)
+
+// what a leaf served since its previous push, every field big endian
+struct pcc_delta {
+    uint64_t pcc_total[PCC_DELTA_COUNTS];
+    uint64_t clients_count;  // at most UINT32_MAX, what the statistics count clients in
+    uint64_t leaf_id;
+    uint64_t sequence;  // 1 for the leaf's first delta, the same again when it is resent
+};
+
+_Static_assert(sizeof(struct pcc_delta) == (PCC_DELTA_COUNTS + 3) * sizeof(uint64_t), "pcc_delta is sent as is");
+
+static inline uint64_t pcc_hton64(uint64_t value) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(value);
+#else
+    return value;
+#endif
+}
+
+static inline uint64_t pcc_ntoh64(uint64_t value) {
+    return pcc_hton64(value);
+}
+
+#endif // PCC_PROTOCOL_H
@@ -1,162 +1,2497 @@
+#define _GNU_SOURCE  // accept4, F_GET_SEALS
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/random.h>
+
+#include "pcc_count.h"
+#include "pcc_lz4.h"
+#include "pcc_uring.h"
+#include "pcc_protocol.h"
+#include "pcc_telemetry.h"
+#include "pcc_timer.h"
+#include "pcc_slab.h"
+#include "pcc_shm.h"
+#include "pcc_state.h"
+#include "pcc_utf8.h"
+#include "pcc_numa.h"
 
 #define GENERAL_ERROR (1)
 #define GENERAL_SUCCESS (0)
 
-#define LISTEN_QUEUE_SIZE (10)
-#define AMOUNT_OF_PRINTABLE_CHARS (126-32+1)
-#define PRINTABLE_LOWER_BOUND (32)
-#define PRINTABLE_UPPER_BOUND (126)
-#define PRINTABLE_TO_INDEX(c) ((c) - PRINTABLE_LOWER_BOUND)
+// the kernel caps this at net.core.somaxconn
+#define DEFAULT_LISTEN_QUEUE_SIZE (SOMAXCONN)
+// how long the kernel holds a connection that sent nothing yet before handing it over anyway
+#define DEFAULT_DEFER_ACCEPT_SECONDS (5)
+#define STATS_LISTEN_QUEUE_SIZE (10)
+#define DEFAULT_CHECKPOINT_INTERVAL_MS (1000)
+#define DEFAULT_PUSH_INTERVAL_MS (1000)
+// the largest shared memory ring a client may hand over, in MB, see pcc_shm.h
+#define DEFAULT_SHM_MAX_RING_MB (64)
+// how long a leaf waits for its parent before giving the push up for this interval
+#define UPSTREAM_TIMEOUT_SECONDS (5)
+// the leaves an aggregator takes deltas from at most
+#define MAX_LEAF_ADDRESSES (64)
+// leaf runs an aggregator has room for before its ledger first grows, it doubles from there
+#define DELTA_LEDGER_INITIAL_CAPACITY (64)
+
+// deadlines are kept in ticks of this length, a connection is dropped at most one tick late
+#define TIMER_TICK_MS (100)
+#define DEFAULT_HEADER_TIMEOUT_SECONDS (10)
+#define DEFAULT_IDLE_TIMEOUT_SECONDS (60)
+#define DEFAULT_TOTAL_TIMEOUT_SECONDS (0)
+
+_Static_assert(PCC_DELTA_COUNTS == AMOUNT_OF_PRINTABLE_CHARS, "a delta carries every printable count");
+
+// epoll: one per worker, lent to whichever connection is readable, so idle connections hold no buffer
+#define RECEIVE_BUFFER_SIZE (64 * 1024)
+#define MAX_EVENTS (256)
+#define READS_PER_EVENT (16)
+#define MAX_WORKERS (1024)
+#define CACHE_LINE_SIZE (64)
+// a page, so each worker's memory can be placed on its own NUMA node
+#define WORKER_ALIGNMENT (4096)
+
+#define URING_ENTRIES (256)
+#define URING_CQ_ENTRIES (4096)
+#define URING_BUFFERS_AMOUNT (64)  // must be a power of two
+#define URING_BUFFER_SIZE (16 * 1024)
+#define URING_BUFFER_GROUP (0)
+
+// io_uring user_data values that are not connection pointers
+#define URING_TAG_ACCEPT (1)
+#define URING_TAG_SHUTDOWN (2)
+#define URING_TAG_CANCEL (3)
+#define URING_TAG_TIMEOUT (4)
+#define URING_TAG_UNIX_ACCEPT (5)
+
+#define CONNECTION_PENDING (0)
+#define CONNECTION_DONE (1)
+
+struct server_config {
+    uint16_t port;
+    unsigned int workers;
+    bool io_uring;
+    const char *stats_socket_path;  // NULL when live statistics are off
+    const char *unix_socket_path;   // NULL when only listening on TCP
+    unsigned int shm_max_ring;      // MB, the data area of a client's shared memory ring at most
+    unsigned int telemetry_interval;  // seconds between telemetry reports, 0 for SIGUSR1 only
+    const char *state_file_path;       // NULL when the statistics only live in memory
+    unsigned int checkpoint_interval;  // milliseconds between state file checkpoints
+    bool has_upstream;                 // a leaf, pushing its statistics to upstream_addr
+    struct sockaddr_in upstream_addr;
+    unsigned int push_interval;  // milliseconds between pushes
+    // an aggregator (parent) takes deltas from leaves at these addresses, 0 takes none at all
+    unsigned int leaves_count;
+    struct in_addr leaves[MAX_LEAF_ADDRESSES];
+    int backlog;
+    unsigned int defer_accept;  // seconds, 0 wakes the server up on the bare handshake
+    unsigned int fast_open;     // pending TCP Fast Open requests allowed, 0 when off
+    // in seconds, 0 turns a deadline off
+    unsigned int header_timeout;  // from the start of a request until its header is complete
+    unsigned int idle_timeout;    // without anything received or sent
+    unsigned int total_timeout;   // from the start of a request until its reply is sent
+    bool has_cpus;                // workers are pinned to cpus, round robin
+    cpu_set_t cpus;
+    enum pcc_huge_pages huge_pages;  // for the receive buffers
+};
+
+enum event_source_kind {
+    EVENT_SOURCE_LISTENER,
+    EVENT_SOURCE_UNIX_LISTENER,
+    EVENT_SOURCE_SHUTDOWN,
+    EVENT_SOURCE_CONNECTION,
+};
+
+// every epoll entry points at one of these, so the loop knows what became ready
+struct event_source {
+    enum event_source_kind kind;
+};
+
+// see pcc_protocol.h for the wire format
+enum connection_state {
+    CONNECTION_READING_HEADER,        // v1 N, or the v2 magic
+    CONNECTION_READING_V2_HEADER,     // the rest of struct pcc_v2_header
+    CONNECTION_READING_BYTE_SET,      // v2 struct pcc_byte_set
+    CONNECTION_RECEIVING_RING,        // v2 shared memory, the byte carrying the ring's memfd
+    CONNECTION_READING_LENGTH,        // v2 64 bit N
+    CONNECTION_READING_CHUNK_HEADER,  // v2 chunked, the length of the next chunk
+    CONNECTION_READING_BODY,
+    CONNECTION_SENDING_REPLY,
+};
+
+// what a PCC_V2_FLAG_BYTE_SET or PCC_V2_FLAG_HISTOGRAM request counts and replies, from the class slab
+struct request_class {
+    struct pcc_class set;  // with PCC_V2_FLAG_BYTE_SET, counted by table
+    // with PCC_V2_FLAG_HISTOGRAM the count, then the bins of the counted bytes, sent in place as the reply
+    uint64_t histogram[1 + PCC_HISTOGRAM_BINS];
+};
+
+/*
+ * Kept small, since an idle connection costs exactly this much: allocated from the worker's
+ * connection slab, with the per-character counts taken from the count slab (and an LZ4 window
+ * from the decoder slab) only while a request actually has body bytes, a request's own class
+ * from the class slab only while it names one, and no receive buffer of its own. A shared memory
+ * ring stays mapped from the connection's first PCC_V2_FLAG_SHM request on, so keep-alive
+ * requests through it cost no mmap and munmap each.
+ */
+struct connection {
+    struct event_source source;  // must stay first
+    int fd;
+    enum connection_state state;
+    uint32_t requests_served;  // on this connection, more than one with keep-alive
+    uint8_t version;
+    uint8_t flags;
+    uint8_t byte_class;  // of the request, enum pcc_class_id
+    uint8_t header_bytes;
+    uint16_t reply_size;
+    uint16_t reply_bytes_sent;
+    bool polling_output;  // epoll waits for EPOLLOUT instead of EPOLLIN
+    bool timed_out;       // io_uring: shut down, closed once its pending operation completes
+    unsigned char header[sizeof(struct pcc_byte_set)];  // the header field being read, at most a byte set
+    unsigned char reply[sizeof(uint64_t)];
+    uint64_t body_left;  // of the whole body, or of the current chunk
+    uint64_t pcc_count;
+    // AMOUNT_OF_PRINTABLE_CHARS counts from the count slab, NULL until body bytes arrive, a
+    // PCC_V2_FLAG_DELTA body is read into it as is
+    uint64_t *new_pcc_count;
+    struct pcc_lz4_decoder *lz4;  // from the decoder slab while a PCC_V2_FLAG_LZ4 body is read
+    struct request_class *request_class;  // while a byte set or histogram request is served
+    struct pcc_shm_ring *ring;    // from the ring slab, mapped until the connection closes
+    struct pcc_utf8_decoder utf8;  // a PCC_V2_FLAG_UTF8 sequence split between reads
+    // in timer ticks
+    uint64_t request_started;
+    uint64_t last_activity;
+    struct pcc_timer deadline;  // the earliest deadline that applies, armed lazily, see update_deadline
+#ifndef PCC_NO_TELEMETRY
+    struct pcc_request_timing timing;
+#endif
+    // the worker's list of open connections
+    struct connection *prev;
+    struct connection *next;
+};
+
+/*
+ * Statistics owned by a single worker, only written by that worker's thread. They are published
+ * seqlock style: sequence is odd while an update is in progress, so the stats thread can copy a
+ * torn-free snapshot without the worker ever waiting for it.
+ */
+struct pcc_shard {
+    _Alignas(CACHE_LINE_SIZE) uint64_t pcc_total[AMOUNT_OF_PRINTABLE_CHARS];
+    uint32_t clients_count;
+    uint32_t sequence;
+};
+
+struct worker {
+    _Alignas(WORKER_ALIGNMENT) struct pcc_shard shard;  // first, so no other worker shares its pages
+    unsigned int id;
+    int server_fd;
+    int unix_fd;  // shared by all workers, -1 without a Unix socket
+    int epoll_fd;
+    struct pcc_uring uring;
+    bool accepting;  // false once shutdown was requested
+    uint32_t active_connections;
+    struct connection *connections;
+    struct pcc_slab connection_slab;
+    struct pcc_slab count_slab;
+    struct pcc_slab decoder_slab;
+    struct pcc_slab class_slab;
+    struct pcc_slab ring_slab;
+    uint64_t shm_max_capacity;  // bytes, config->shm_max_ring
+    const struct in_addr *leaves;  // config->leaves
+    unsigned int leaves_count;
+    struct delta_ledger *ledger;   // the aggregator's, shared
+    // epoll receives into it, io_uring carves its provided buffers out of it, see map_receive_buffer
+    char *receive_buffer;
+    size_t receive_buffer_size;
+    int cpu;   // the thread is pinned to, -1 if it is not
+    int node;  // NUMA node the worker's memory is placed on, -1 if it is not
+    int return_code;
+    struct pcc_histogram histogram;  // scratch for the connection currently being processed
+    pthread_t thread;
+    struct event_source listener_source;
+    struct event_source unix_listener_source;
+    struct event_source shutdown_source;
+    // connection deadlines, in timer ticks, 0 when off
+    uint64_t header_timeout;
+    uint64_t idle_timeout;
+    uint64_t total_timeout;
+    bool has_deadlines;
+    uint64_t tick;  // read once per loop iteration
+    struct pcc_timer_wheel timers;
+    struct __kernel_timespec timer_wait;  // io_uring: how long to wait when deadlines are armed
+    bool timer_wait_armed;
+#ifndef PCC_NO_TELEMETRY
+    struct pcc_telemetry telemetry;
+#endif
+};
+
+// answers live statistics queries on a Unix socket, from its own thread
+struct stats_server {
+    int fd;
+    struct worker *workers;
+    unsigned int workers_count;
+    pthread_t thread;
+};
+
+// keeps the state file up to date with the worker shards, from its own thread
+struct state_checkpointer {
+    struct pcc_state state;
+    struct worker *workers;
+    unsigned int workers_count;
+    unsigned int interval;  // milliseconds
+    uint64_t checkpointed_clients;  // as of the last checkpoint, while it is unchanged there is nothing to write
+    struct upstream_pusher *pusher;  // a leaf's, its pushes are checkpointed along with the totals
+    struct pcc_state_upstream upstream;  // as of the last checkpoint, kept as is while not a leaf
+    bool has_upstream;
+    pthread_t thread;
+};
+
+// pushes what the workers served to the parent server, from its own thread
+struct upstream_pusher {
+    struct sockaddr_in addr;
+    struct worker *workers;
+    unsigned int workers_count;
+    unsigned int interval;  // milliseconds
+    int fd;                 // kept alive between pushes, -1 until connected
+    pthread_mutex_t lock;   // over what changes below, the checkpointer copies it
+    // as of the last push the parent acknowledged, the next one sends what was added since
+    uint64_t pushed[AMOUNT_OF_PRINTABLE_CHARS];
+    uint32_t pushed_clients;
+    uint64_t leaf_id;   // random, names the leaf to the parent, kept across restarts by the state file
+    uint64_t sequence;  // of the pending delta, or of the last acknowledged one
+    // a delta sent without getting its reply, resent as is until it is acknowledged
+    bool pending;
+    unsigned char request[sizeof(struct pcc_v2_header) + sizeof(uint64_t) + sizeof(struct pcc_delta)];
+    uint64_t expected_count;
+    uint64_t pending_totals[AMOUNT_OF_PRINTABLE_CHARS];  // pushed, once it is acknowledged
+    uint32_t pending_clients;
+    pthread_t thread;
+};
+
+struct delta_leaf {
+    bool used;  // any leaf_id is valid, 0 included
+    uint64_t leaf_id;
+    uint64_t sequence;  // the last one added, 0 before the first
+};
+
+/*
+ * An aggregator's last added delta per leaf, shared by the workers, so a resent one is dropped.
+ * Open addressing on leaf_id, grown at 3/4 load and never shrunk: a forgotten leaf would have
+ * its resent delta added twice.
+ */
+struct delta_ledger {
+    pthread_mutex_t lock;
+    size_t count;
+    size_t capacity;  // a power of 2, 0 until the first leaf
+    struct delta_leaf *leaves;
+};
+
+#ifndef PCC_NO_TELEMETRY
+// reports the workers' telemetry on SIGUSR1 and every interval, from its own thread
+struct telemetry_reporter {
+    struct worker *workers;
+    unsigned int workers_count;
+    unsigned int interval;
+    struct pcc_clock_sample started;
+    struct pcc_clock_sample last_report;
+    struct pcc_telemetry previous;  // for the rates over the last interval
+    pthread_t thread;
+};
+#endif
+
+// merged from the worker shards on shutdown
+uint64_t pcc_total[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+uint32_t clients_count = 0;
+volatile sig_atomic_t sigint_received = false;
+int shutdown_fd = -1;
+int telemetry_fd = -1;  // written by the SIGUSR1 handler
+
+bool is_printable(char c) {
+    return (PRINTABLE_LOWER_BOUND <= c && c <= PRINTABLE_UPPER_BOUND);
+}
+
+void print_pcc_statistics(FILE *out, const uint64_t totals[]) {
+    for (int c = PRINTABLE_LOWER_BOUND; c <= PRINTABLE_UPPER_BOUND; c++) {
+        uint64_t count = totals[PRINTABLE_TO_INDEX(c)];
+        if (count > 0) {
+            fprintf(out, "char '%c' : %" PRIu64 " times\n", (char)c, count);
+        }
+    }
+}
+
+// wakes up every worker, the eventfd stays readable so all of them see it
+void request_shutdown() {
+    uint64_t one = 1;
+    if (write(shutdown_fd, &one, sizeof(one)) != sizeof(one)) {
+        // already signaled, nothing else to do (and nothing async-signal-safe to report with)
+    }
+}
+
+void sigint_handler(int signum) {
+    sigint_received = true;
+    request_shutdown();
+}
+
+void sigusr1_handler(int signum) {
+    uint64_t one = 1;
+    if (write(telemetry_fd, &one, sizeof(one)) != sizeof(one)) {
+        // a report is already pending
+    }
+}
+
+// adds served requests to the shard, only called from the shard's own worker
+void update_pcc_total(struct pcc_shard *shard, const uint64_t new_pcc_count[], uint32_t clients) {
+    __atomic_store_n(&shard->sequence, shard->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);  // the odd sequence is visible before any new total
+
+    for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+        __atomic_store_n(&shard->pcc_total[i], shard->pcc_total[i] + new_pcc_count[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&shard->clients_count, shard->clients_count + clients, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&shard->sequence, shard->sequence + 1, __ATOMIC_RELEASE);
+}
+
+// copies a consistent version of the shard, retrying while its worker is in the middle of an update
+void read_pcc_shard(const struct pcc_shard *shard, uint64_t totals[], uint32_t *clients) {
+    uint32_t before = 0;
+    uint32_t after = 0;
+
+    do {
+        before = __atomic_load_n(&shard->sequence, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+            totals[i] = __atomic_load_n(&shard->pcc_total[i], __ATOMIC_RELAXED);
+        }
+        *clients = __atomic_load_n(&shard->clients_count, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&shard->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) != 0 || before != after);
+}
+
+/*
+ * Sums the worker shards. Each shard is read consistently, and since a request only ever touches
+ * its own worker's shard, the totals always match clients_count exactly.
+ */
+void merge_pcc_shards(struct worker *workers, unsigned int workers_count, uint64_t totals[], uint32_t *clients) {
+    uint64_t shard_totals[AMOUNT_OF_PRINTABLE_CHARS];
+    uint32_t shard_clients = 0;
+
+    memset(totals, 0, AMOUNT_OF_PRINTABLE_CHARS * sizeof(totals[0]));
+    *clients = 0;
+    for (unsigned int w = 0; w < workers_count; w++) {
+        read_pcc_shard(&workers[w].shard, shard_totals, &shard_clients);
+        for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+            totals[i] += shard_totals[i];
+        }
+        *clients += shard_clients;
+    }
+}
+
+// waiting for the first byte of a request, its first or the next keep-alive one, closing it loses nothing
+bool is_idle(const struct connection *conn) {
+    return conn->state == CONNECTION_READING_HEADER && conn->header_bytes == 0;
+}
+
+// the current request is still in its header, dropping the connection loses no counted byte
+bool is_before_body(const struct connection *conn) {
+    return conn->state == CONNECTION_READING_HEADER || conn->state == CONNECTION_READING_V2_HEADER ||
+           conn->state == CONNECTION_READING_BYTE_SET || conn->state == CONNECTION_RECEIVING_RING ||
+           conn->state == CONNECTION_READING_LENGTH;
+}
+
+uint64_t current_tick() {
+    return pcc_monotonic_ns() / (TIMER_TICK_MS * 1000000ULL);
+}
+
+uint64_t seconds_to_ticks(unsigned int seconds) {
+    return (uint64_t)seconds * 1000 / TIMER_TICK_MS;
+}
+
+// the earliest deadline that applies to the connection in its current state, UINT64_MAX if none does
+uint64_t connection_deadline(const struct worker *worker, const struct connection *conn) {
+    uint64_t deadline = UINT64_MAX;
+    if (worker->idle_timeout > 0) {
+        deadline = conn->last_activity + worker->idle_timeout;
+    }
+    if (is_idle(conn) && conn->requests_served > 0) {
+        return deadline;  // between keep-alive requests only the idle deadline applies
+    }
+
+    if (worker->header_timeout > 0 && is_before_body(conn) && conn->request_started + worker->header_timeout < deadline) {
+        deadline = conn->request_started + worker->header_timeout;
+    }
+    if (worker->total_timeout > 0 && conn->request_started + worker->total_timeout < deadline) {
+        deadline = conn->request_started + worker->total_timeout;
+    }
+    return deadline;
+}
+
+/*
+ * Arms the connection's timer if its deadline moved earlier. Activity only ever pushes deadlines
+ * back, so it merely stamps last_activity and expire_connection re-arms the timer when it finds
+ * the connection still has time left. That keeps the wheel out of the per-recv path.
+ */
+void update_deadline(struct worker *worker, struct connection *conn) {
+    uint64_t deadline = connection_deadline(worker, conn);
+    if (deadline == UINT64_MAX) {
+        pcc_timer_delete(&worker->timers, &conn->deadline);
+    } else if (!pcc_timer_is_armed(&conn->deadline) || deadline < conn->deadline.expires) {
+        pcc_timer_arm(&worker->timers, &conn->deadline, deadline);
+    }
+}
+
+struct connection *create_connection(struct worker *worker, int client_fd) {
+    struct connection *conn = pcc_slab_alloc(&worker->connection_slab);
+    if (conn == NULL) {
+        perror("malloc connection slab failed");
+        return NULL;
+    }
+    memset(conn, 0, sizeof(*conn));
+
+    conn->source.kind = EVENT_SOURCE_CONNECTION;
+    conn->fd = client_fd;
+    conn->state = CONNECTION_READING_HEADER;
+    conn->request_started = worker->tick;
+    conn->last_activity = worker->tick;
+    PCC_TELEMETRY_MARK(&conn->timing, started);
+    PCC_TELEMETRY_COUNT(&worker->telemetry, PCC_COUNTER_CONNECTIONS, 1);
+
+    conn->next = worker->connections;
+    if (worker->connections != NULL) {
+        worker->connections->prev = conn;
+    }
+    worker->connections = conn;
+    worker->active_connections++;
+    update_deadline(worker, conn);
+    return conn;
+}
+
+// the counts are only needed from the first body byte until the request is committed
+uint64_t *acquire_counts(struct worker *worker, struct connection *conn) {
+    if (conn->new_pcc_count == NULL) {
+        conn->new_pcc_count = pcc_slab_alloc(&worker->count_slab);
+        if (conn->new_pcc_count == NULL) {
+            perror("malloc count slab failed");
+            return NULL;
+        }
+        memset(conn->new_pcc_count, 0, AMOUNT_OF_PRINTABLE_CHARS * sizeof(uint64_t));
+    }
+    return conn->new_pcc_count;
+}
+
+// compressed bodies need a window of what they decoded to, 64KB, so it is borrowed the same way
+struct pcc_lz4_decoder *acquire_decoder(struct worker *worker, struct connection *conn) {
+    if (conn->lz4 == NULL) {
+        conn->lz4 = pcc_slab_alloc(&worker->decoder_slab);
+        if (conn->lz4 == NULL) {
+            perror("malloc decoder slab failed");
+            return NULL;
+        }
+        pcc_lz4_decoder_init(conn->lz4);
+    }
+    return conn->lz4;
+}
+
+// a byte set is turned into a class and a histogram zeroed for the request that asks for one
+struct request_class *acquire_request_class(struct worker *worker, struct connection *conn) {
+    if (conn->request_class == NULL) {
+        conn->request_class = pcc_slab_alloc(&worker->class_slab);
+        if (conn->request_class == NULL) {
+            perror("malloc class slab failed");
+            return NULL;
+        }
+        memset(conn->request_class->histogram, 0, sizeof(conn->request_class->histogram));
+    }
+    return conn->request_class;
+}
+
+void release_body_state(struct worker *worker, struct connection *conn) {
+    if (conn->new_pcc_count != NULL) {
+        pcc_slab_free(&worker->count_slab, conn->new_pcc_count);
+        conn->new_pcc_count = NULL;
+    }
+    if (conn->lz4 != NULL) {
+        pcc_slab_free(&worker->decoder_slab, conn->lz4);
+        conn->lz4 = NULL;
+    }
+    if (conn->request_class != NULL) {
+        pcc_slab_free(&worker->class_slab, conn->request_class);
+        conn->request_class = NULL;
+    }
+}
+
+void close_connection(struct worker *worker, struct connection *conn) {
+    // closing the fd also removes it from the epoll set
+    close(conn->fd);
+    pcc_timer_delete(&worker->timers, &conn->deadline);
+
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        worker->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    release_body_state(worker, conn);
+    if (conn->ring != NULL) {
+        pcc_shm_ring_unmap(conn->ring);
+        pcc_slab_free(&worker->ring_slab, conn->ring);
+    }
+    pcc_slab_free(&worker->connection_slab, conn);
+    worker->active_connections--;
+}
+
+/*
+ * On shutdown a connection that never sends (another) request would keep the worker waiting
+ * forever, so every one still reading a header is shut down: its read side wakes the pending
+ * recv with EOF (on both engines), which then closes it. A request that already arrived is
+ * still read and served first. Only connections in the middle of a body or a reply are waited for.
+ */
+void shut_waiting_connections(struct worker *worker) {
+    for (struct connection *conn = worker->connections; conn != NULL; conn = conn->next) {
+        if (is_before_body(conn)) {
+            shutdown(conn->fd, SHUT_RD);
+        }
+    }
+}
+
+/*
+ * Fired by the timer wheel. A connection past its deadline is dropped exactly like a client that
+ * disconnected: whatever it sent so far never reaches the statistics. On io_uring an operation
+ * still points at the connection, so it is shut down instead and closed once that completes.
+ */
+void expire_connection(struct pcc_timer *timer, void *context) {
+    struct worker *worker = context;
+    struct connection *conn = (struct connection *)((char *)timer - offsetof(struct connection, deadline));
+
+    uint64_t deadline = connection_deadline(worker, conn);
+    if (deadline > worker->tick) {
+        // there was activity since the timer was armed
+        if (deadline != UINT64_MAX) {
+            pcc_timer_arm(&worker->timers, timer, deadline);
+        }
+        return;
+    }
+
+    if (!is_idle(conn)) {
+        fprintf(stderr, "Client missed its deadline, dropping it\n");
+    }
+    if (worker->uring.fd != -1) {
+        conn->timed_out = true;
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    close_connection(worker, conn);
+}
+
+// once per loop iteration, so activity is stamped without reading the clock for every connection
+void update_tick(struct worker *worker) {
+    if (worker->has_deadlines) {
+        worker->tick = current_tick();
+    }
+}
+
+// after the iteration's events were handled, so none of them refers to a connection closed here
+void run_deadlines(struct worker *worker) {
+    pcc_timer_advance(&worker->timers, worker->tick, expire_connection, worker);
+}
+
+void prepare_reply(struct connection *conn) {
+    if (conn->version == 1) {
+        uint32_t reply = htonl((uint32_t)conn->pcc_count);
+        memcpy(conn->reply, &reply, sizeof(reply));
+        conn->reply_size = sizeof(reply);
+    } else if (conn->flags & PCC_V2_FLAG_HISTOGRAM) {
+        uint64_t *histogram = conn->request_class->histogram;
+        histogram[0] = conn->pcc_count;
+        for (int i = 0; i < 1 + PCC_HISTOGRAM_BINS; i++) {
+            histogram[i] = pcc_hton64(histogram[i]);
+        }
+        conn->reply_size = sizeof(conn->request_class->histogram);
+    } else {
+        uint64_t reply = pcc_hton64(conn->pcc_count);
+        memcpy(conn->reply, &reply, sizeof(reply));
+        conn->reply_size = sizeof(reply);
+    }
+    conn->reply_bytes_sent = 0;
+    conn->state = CONNECTION_SENDING_REPLY;
+    PCC_TELEMETRY_MARK(&conn->timing, body_done);
+}
+
+// what is left of the reply to send, a histogram is sent from the request's class
+const unsigned char *reply_left(const struct connection *conn) {
+    if (conn->flags & PCC_V2_FLAG_HISTOGRAM) {
+        return (const unsigned char *)conn->request_class->histogram + conn->reply_bytes_sent;
+    }
+    return conn->reply + conn->reply_bytes_sent;
+}
+
+// where leaf_id is in the ledger, or the free slot it goes to, under the ledger's lock
+struct delta_leaf *find_delta_leaf(struct delta_leaf *leaves, size_t capacity, uint64_t leaf_id) {
+    uint64_t hash = leaf_id * 0x9E3779B97F4A7C15ULL;  // spreads ids that differ in a few bits
+    size_t slot = (size_t)(hash ^ (hash >> 32)) & (capacity - 1);
+
+    while (leaves[slot].used && leaves[slot].leaf_id != leaf_id) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return &leaves[slot];
+}
+
+/*
+ * Makes room for a leaf's delta before it is replied to, so claim_delta always finds the leaf.
+ * Fails only when the ledger can not grow, the delta is then dropped unreplied and resent later.
+ */
+int reserve_delta_leaf(struct delta_ledger *ledger, uint64_t leaf_id) {
+    int return_code = GENERAL_SUCCESS;
+
+    pthread_mutex_lock(&ledger->lock);
+    if (ledger->capacity > 0 && find_delta_leaf(ledger->leaves, ledger->capacity, leaf_id)->used) {
+        goto cleanup;
+    }
+    if ((ledger->count + 1) * 4 > ledger->capacity * 3) {
+        size_t capacity = ledger->capacity > 0 ? ledger->capacity * 2 : DELTA_LEDGER_INITIAL_CAPACITY;
+        struct delta_leaf *leaves = calloc(capacity, sizeof(*leaves));
+        if (leaves == NULL) {
+            perror("Failed to grow the delta ledger");
+            return_code = GENERAL_ERROR;
+            goto cleanup;
+        }
+        for (size_t i = 0; i < ledger->capacity; i++) {
+            if (ledger->leaves[i].used) {
+                *find_delta_leaf(leaves, capacity, ledger->leaves[i].leaf_id) = ledger->leaves[i];
+            }
+        }
+        free(ledger->leaves);
+        ledger->leaves = leaves;
+        ledger->capacity = capacity;
+    }
+    struct delta_leaf *leaf = find_delta_leaf(ledger->leaves, ledger->capacity, leaf_id);
+    leaf->used = true;
+    leaf->leaf_id = leaf_id;
+    leaf->sequence = 0;
+    ledger->count++;
+cleanup:
+    pthread_mutex_unlock(&ledger->lock);
+    return return_code;
+}
+
+/*
+ * Whether a delta is new, taking note of it if so. A leaf resends a delta only while it has no
+ * reply, so any sequence up to the last one added from that leaf was added already. The leaf was
+ * reserved when its delta arrived.
+ */
+bool claim_delta(struct delta_ledger *ledger, uint64_t leaf_id, uint64_t sequence) {
+    bool is_new = false;
+
+    pthread_mutex_lock(&ledger->lock);
+    struct delta_leaf *leaf = find_delta_leaf(ledger->leaves, ledger->capacity, leaf_id);
+    if (sequence > leaf->sequence) {
+        leaf->sequence = sequence;
+        is_new = true;
+    }
+    pthread_mutex_unlock(&ledger->lock);
+    return is_new;
+}
+
+/*
+ * The client got its reply, only now does it count towards the statistics. Every request counts
+ * as one client, so N requests over one keep-alive connection add up exactly like N connections.
+ * A delta counts as the clients its leaf served, unless it was added before and only resent.
+ */
+void commit_connection(struct worker *worker, struct connection *conn) {
+    static const uint64_t no_counts[AMOUNT_OF_PRINTABLE_CHARS] = {0};  // the request had no body
+    const struct pcc_delta *delta = (const struct pcc_delta *)conn->new_pcc_count;
+    // read_delta took only a clients_count that fits
+    uint32_t clients = (conn->flags & PCC_V2_FLAG_DELTA) ? (uint32_t)delta->clients_count : 1;
+    if (!(conn->flags & PCC_V2_FLAG_DELTA) || claim_delta(worker->ledger, delta->leaf_id, delta->sequence)) {
+        update_pcc_total(&worker->shard, conn->new_pcc_count != NULL ? conn->new_pcc_count : no_counts, clients);
+    }
+    conn->requests_served++;
+    release_body_state(worker, conn);
+}
+
+// gets a served keep-alive connection ready for its next request
+void reset_connection(struct connection *conn) {
+    conn->state = CONNECTION_READING_HEADER;
+    conn->version = 0;
+    conn->flags = 0;
+    conn->byte_class = PCC_CLASS_PRINTABLE;
+    pcc_utf8_decoder_init(&conn->utf8);
+    conn->header_bytes = 0;
+    conn->body_left = 0;
+    conn->pcc_count = 0;
+    conn->reply_size = 0;
+    conn->reply_bytes_sent = 0;
+#ifndef PCC_NO_TELEMETRY
+    memset(&conn->timing, 0, sizeof(conn->timing));
+#endif
+    PCC_TELEMETRY_MARK(&conn->timing, started);
+}
+
+#ifndef PCC_NO_TELEMETRY
+void record_request_telemetry(struct worker *worker, const struct connection *conn) {
+    const struct pcc_request_timing *timing = &conn->timing;
+    pcc_telemetry_record(&worker->telemetry, PCC_PHASE_HEADER, timing->header_done - timing->started);
+    pcc_telemetry_record(&worker->telemetry, PCC_PHASE_BODY, timing->body_done - timing->header_done);
+    pcc_telemetry_record(&worker->telemetry, PCC_PHASE_COUNT, timing->counting);
+    PCC_TELEMETRY_RECORD(&worker->telemetry, PCC_PHASE_REPLY, timing->body_done);
+    pcc_telemetry_count(&worker->telemetry, PCC_COUNTER_REQUESTS, 1);
+}
+#endif
+
+/*
+ * Called once the reply is sent. Returns CONNECTION_PENDING if the connection stays open for
+ * another request, CONNECTION_DONE if it should be closed.
+ */
+int finish_request(struct worker *worker, struct connection *conn) {
+#ifndef PCC_NO_TELEMETRY
+    record_request_telemetry(worker, conn);
+#endif
+    commit_connection(worker, conn);
+    if (!(conn->flags & PCC_V2_FLAG_KEEP_ALIVE) || !worker->accepting) {
+        return CONNECTION_DONE;
+    }
+
+    reset_connection(conn);
+    return CONNECTION_PENDING;
+}
+
+// the size of the header field read in the given state
+size_t header_field_size(enum connection_state state) {
+    switch (state) {
+    case CONNECTION_READING_HEADER:
+    case CONNECTION_READING_CHUNK_HEADER:
+        return sizeof(uint32_t);
+    case CONNECTION_READING_V2_HEADER:
+        return sizeof(struct pcc_v2_header) - sizeof(uint32_t);
+    case CONNECTION_READING_BYTE_SET:
+        return sizeof(struct pcc_byte_set);
+    case CONNECTION_READING_LENGTH:
+        return sizeof(uint64_t);
+    default:
+        return 0;
+    }
+}
+
+// how many more bytes belong to the field or body being read, 0 once the request is complete
+size_t input_wanted(const struct connection *conn) {
+    switch (conn->state) {
+    case CONNECTION_READING_BODY:
+        return conn->body_left;
+    case CONNECTION_SENDING_REPLY:
+        return 0;
+    default:
+        return header_field_size(conn->state) - conn->header_bytes;
+    }
+}
+
+// the body, or the current chunk of it, was fully read
+void end_body(struct connection *conn) {
+    if (conn->flags & PCC_V2_FLAG_CHUNKED) {
+        conn->state = CONNECTION_READING_CHUNK_HEADER;
+    } else {
+        prepare_reply(conn);
+    }
+}
+
+void start_body(struct connection *conn, uint64_t length) {
+    conn->body_left = length;
+    conn->state = CONNECTION_READING_BODY;
+    if (length == 0) {
+        end_body(conn);
+    }
+}
+
+// a delta adds to the statistics as is, so only an aggregator takes one, from a leaf it knows over TCP
+bool is_from_leaf(const struct worker *worker, const struct connection *conn) {
+    struct sockaddr_in peer = {0};
+    socklen_t peer_length = sizeof(peer);
+
+    if (getpeername(conn->fd, (struct sockaddr *)&peer, &peer_length) == -1 || peer.sin_family != AF_INET) {
+        return false;
+    }
+    for (unsigned int i = 0; i < worker->leaves_count; i++) {
+        if (worker->leaves[i].s_addr == peer.sin_addr.s_addr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the v2 header, and the byte set after it, are read, what comes next depends on the flags
+void start_v2_body(struct connection *conn) {
+    // a ring handed over by an earlier request on the connection is taken from its start again
+    conn->state = (conn->flags & PCC_V2_FLAG_SHM) && conn->ring == NULL ? CONNECTION_RECEIVING_RING
+                  : (conn->flags & PCC_V2_FLAG_CHUNKED)               ? CONNECTION_READING_CHUNK_HEADER
+                                                                      : CONNECTION_READING_LENGTH;
+    if ((conn->flags & PCC_V2_FLAG_SHM) && conn->ring != NULL) {
+        conn->ring->position = 0;
+    }
+    if (conn->flags & PCC_V2_FLAG_CHUNKED) {
+        PCC_TELEMETRY_MARK(&conn->timing, header_done);  // chunk headers are part of the body
+    }
+}
+
+// the request's own class, counted by table like any set
+void read_byte_set(struct connection *conn) {
+    struct pcc_byte_set set = {0};
+    unsigned char bytes[PCC_HISTOGRAM_BINS];
+    size_t amount = 0;
+
+    memcpy(&set, conn->header, sizeof(set));
+    for (int byte = 0; byte < PCC_HISTOGRAM_BINS; byte++) {
+        if (pcc_byte_set_has(&set, (uint8_t)byte)) {
+            bytes[amount++] = (unsigned char)byte;
+        }
+    }
+    pcc_class_init_set(&conn->request_class->set, "set", bytes, amount);
+}
+
+// what the reply of the current request counts
+const struct pcc_class *counted_class(const struct connection *conn) {
+    if (conn->flags & PCC_V2_FLAG_BYTE_SET) {
+        return &conn->request_class->set;
+    }
+    return &pcc_classes[conn->byte_class];
+}
+
+// acts on a fully read header field, returns GENERAL_ERROR if the request is neither valid v1 nor v2
+int parse_header_field(struct worker *worker, struct connection *conn) {
+    uint32_t value32 = 0;
+    uint64_t value64 = 0;
+    struct pcc_v2_header v2_header = {0};
+
+    conn->header_bytes = 0;
+    switch (conn->state) {
+    case CONNECTION_READING_HEADER:
+        memcpy(&value32, conn->header, sizeof(value32));
+        value32 = ntohl(value32);
+        if (value32 == PCC_V2_MAGIC) {
+            conn->state = CONNECTION_READING_V2_HEADER;
+            return GENERAL_SUCCESS;
+        }
+        conn->version = 1;
+        PCC_TELEMETRY_MARK(&conn->timing, header_done);
+        start_body(conn, value32);
+        return GENERAL_SUCCESS;
+    case CONNECTION_READING_V2_HEADER:
+        memcpy((char *)&v2_header + offsetof(struct pcc_v2_header, version), conn->header,
+               header_field_size(conn->state));
+        if (v2_header.version != PCC_V2_VERSION || (v2_header.flags & ~PCC_V2_KNOWN_FLAGS) != 0 ||
+            v2_header.byte_class >= PCC_CLASS_BUILTIN_AMOUNT || v2_header.reserved != 0) {
+            fprintf(stderr, "Invalid v2 request header, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+        if (v2_header.byte_class != PCC_CLASS_PRINTABLE && (v2_header.flags & (PCC_V2_FLAG_LZ4 | PCC_V2_FLAG_DELTA))) {
+            fprintf(stderr, "Only printable characters are counted in compressed bodies and deltas, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+        if ((v2_header.flags & PCC_V2_FLAG_UTF8) &&
+            (v2_header.byte_class != PCC_CLASS_PRINTABLE || (v2_header.flags & (PCC_V2_FLAG_LZ4 | PCC_V2_FLAG_DELTA)))) {
+            fprintf(stderr, "UTF-8 bodies are counted by printable codepoints and never compressed, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+        if ((v2_header.flags & (PCC_V2_FLAG_BYTE_SET | PCC_V2_FLAG_HISTOGRAM)) &&
+            (v2_header.flags & (PCC_V2_FLAG_LZ4 | PCC_V2_FLAG_DELTA | PCC_V2_FLAG_UTF8))) {
+            fprintf(stderr, "Byte sets and histograms are only counted in plain bodies, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+        if ((v2_header.flags & PCC_V2_FLAG_BYTE_SET) && v2_header.byte_class != PCC_CLASS_PRINTABLE) {
+            fprintf(stderr, "A byte set takes the place of the byte class, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+        if ((v2_header.flags & PCC_V2_FLAG_SHM) && !(v2_header.flags & PCC_V2_FLAG_CHUNKED)) {
+            fprintf(stderr, "Shared memory requests must be chunked, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+        if ((v2_header.flags & PCC_V2_FLAG_DELTA) &&
+            (v2_header.flags & (PCC_V2_FLAG_CHUNKED | PCC_V2_FLAG_LZ4 | PCC_V2_FLAG_SHM))) {
+            fprintf(stderr, "Invalid delta request, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+        if ((v2_header.flags & PCC_V2_FLAG_DELTA) && worker->leaves_count == 0) {
+            fprintf(stderr, "Deltas are only taken with --aggregator, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+        if ((v2_header.flags & PCC_V2_FLAG_DELTA) && !is_from_leaf(worker, conn)) {
+            fprintf(stderr, "Delta from a peer that is not a configured leaf, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+        conn->version = v2_header.version;
+        conn->flags = v2_header.flags;
+        conn->byte_class = v2_header.byte_class;
+        if ((conn->flags & (PCC_V2_FLAG_BYTE_SET | PCC_V2_FLAG_HISTOGRAM)) &&
+            acquire_request_class(worker, conn) == NULL) {
+            return GENERAL_ERROR;
+        }
+        if (conn->flags & PCC_V2_FLAG_BYTE_SET) {
+            conn->state = CONNECTION_READING_BYTE_SET;
+            return GENERAL_SUCCESS;
+        }
+        start_v2_body(conn);
+        return GENERAL_SUCCESS;
+    case CONNECTION_READING_BYTE_SET:
+        read_byte_set(conn);
+        start_v2_body(conn);
+        return GENERAL_SUCCESS;
+    case CONNECTION_READING_LENGTH:
+        memcpy(&value64, conn->header, sizeof(value64));
+        PCC_TELEMETRY_MARK(&conn->timing, header_done);
+        if ((conn->flags & PCC_V2_FLAG_DELTA) && pcc_ntoh64(value64) != sizeof(struct pcc_delta)) {
+            fprintf(stderr, "Invalid delta length, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+        start_body(conn, pcc_ntoh64(value64));
+        return GENERAL_SUCCESS;
+    case CONNECTION_READING_CHUNK_HEADER:
+        memcpy(&value32, conn->header, sizeof(value32));
+        value32 = ntohl(value32);
+        if (value32 == 0) {
+            if (!pcc_utf8_is_complete(&conn->utf8)) {
+                fprintf(stderr, "UTF-8 body ends inside a sequence, dropping the client\n");
+                return GENERAL_ERROR;
+            }
+            prepare_reply(conn);  // the empty chunk ends the stream
+        } else {
+            start_body(conn, value32);
+        }
+        return GENERAL_SUCCESS;
+    default:
+        return GENERAL_ERROR;
+    }
+}
+
+/*
+ * Counts len bytes of the body being read, which are at most what is left of it (or of the
+ * current chunk). Returns GENERAL_ERROR if the request is malformed.
+ */
+int count_body(struct worker *worker, struct connection *conn, const char *data, size_t len) {
+    if (acquire_counts(worker, conn) == NULL) {
+        return GENERAL_ERROR;
+    }
+    // process into current statistics, the histogram also yields the printable total
+    pcc_ticks_t counting_started = PCC_TELEMETRY_NOW();
+    if (conn->flags & PCC_V2_FLAG_LZ4) {
+        // decoded straight into the counts, only the window of the plaintext exists
+        if (acquire_decoder(worker, conn) == NULL) {
+            return GENERAL_ERROR;
+        }
+        if (pcc_lz4_count(conn->lz4, &worker->histogram, data, len, conn->new_pcc_count, &conn->pcc_count) == -1) {
+            fprintf(stderr, "Invalid compressed body, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+    } else if (conn->flags & PCC_V2_FLAG_UTF8) {
+        // the statistics still count bytes, the reply counts codepoints
+        pcc_histogram_add(&worker->histogram, data, len, conn->new_pcc_count);
+        if (pcc_utf8_count(&conn->utf8, data, len, &conn->pcc_count) == -1) {
+            fprintf(stderr, "Invalid UTF-8 body, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+    } else if (conn->flags & PCC_V2_FLAG_HISTOGRAM) {
+        // one pass over all 256 bins serves both the statistics and the reply
+        uint64_t all[PCC_HISTOGRAM_BINS] = {0};
+        pcc_histogram_add_all(&worker->histogram, data, len, all);
+        for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+            conn->new_pcc_count[i] += all[PRINTABLE_LOWER_BOUND + i];
+        }
+        conn->pcc_count += pcc_class_select(counted_class(conn), all, conn->request_class->histogram + 1);
+    } else if (conn->byte_class == PCC_CLASS_PRINTABLE && !(conn->flags & PCC_V2_FLAG_BYTE_SET)) {
+        conn->pcc_count += pcc_histogram_add(&worker->histogram, data, len, conn->new_pcc_count);
+    } else {
+        // the statistics still want the printable characters, the reply counts the class
+        pcc_histogram_add(&worker->histogram, data, len, conn->new_pcc_count);
+        conn->pcc_count += pcc_class_count(counted_class(conn), data, len);
+    }
+    PCC_TELEMETRY_SPAN(&conn->timing, counting, counting_started);
+    PCC_TELEMETRY_COUNT(&worker->telemetry, PCC_COUNTER_BYTES, len);
+    conn->body_left -= len;
+    if (conn->body_left == 0) {
+        if (conn->lz4 != NULL) {
+            // the body, or the chunk, was one block
+            if (!pcc_lz4_is_complete(conn->lz4)) {
+                fprintf(stderr, "Compressed block ends inside a sequence, dropping the client\n");
+                return GENERAL_ERROR;
+            }
+            pcc_lz4_decoder_init(conn->lz4);
+        }
+        if (!(conn->flags & PCC_V2_FLAG_CHUNKED) && !pcc_utf8_is_complete(&conn->utf8)) {
+            fprintf(stderr, "UTF-8 body ends inside a sequence, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+        end_body(conn);
+    }
+    return GENERAL_SUCCESS;
+}
+
+// a pushed delta is not counted but taken as is, once all of it arrived
+int read_delta(struct worker *worker, struct connection *conn, const char *data, size_t len) {
+    if (acquire_counts(worker, conn) == NULL) {
+        return GENERAL_ERROR;
+    }
+    memcpy((char *)conn->new_pcc_count + sizeof(struct pcc_delta) - conn->body_left, data, len);
+    conn->body_left -= len;
+    if (conn->body_left == 0) {
+        for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+            conn->new_pcc_count[i] = pcc_ntoh64(conn->new_pcc_count[i]);
+            conn->pcc_count += conn->new_pcc_count[i];
+        }
+        struct pcc_delta *delta = (struct pcc_delta *)conn->new_pcc_count;
+        delta->clients_count = pcc_ntoh64(delta->clients_count);
+        delta->leaf_id = pcc_ntoh64(delta->leaf_id);
+        delta->sequence = pcc_ntoh64(delta->sequence);
+        if (delta->clients_count > UINT32_MAX) {
+            fprintf(stderr, "Delta of more clients than the statistics hold, dropping the client\n");
+            return GENERAL_ERROR;
+        }
+        if (GENERAL_ERROR == reserve_delta_leaf(worker->ledger, delta->leaf_id)) {
+            return GENERAL_ERROR;
+        }
+        end_body(conn);
+    }
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * A shared memory chunk is already in the ring when its length arrives, so it is counted right
+ * away, in place, and handed back to the client.
+ */
+int count_ring_chunk(struct worker *worker, struct connection *conn) {
+    struct pcc_shm_ring *ring = conn->ring;
+    size_t length = conn->body_left;
+
+    if (length > ring->capacity) {
+        fprintf(stderr, "Shared memory chunk is larger than the ring, dropping the client\n");
+        return GENERAL_ERROR;
+    }
+
+    size_t start = ring->position % ring->capacity;
+    size_t first = ring->capacity - start < length ? ring->capacity - start : length;
+    if (GENERAL_ERROR == count_body(worker, conn, (const char *)ring->data + start, first)) {
+        return GENERAL_ERROR;
+    }
+    if (first < length && GENERAL_ERROR == count_body(worker, conn, (const char *)ring->data, length - first)) {
+        return GENERAL_ERROR;
+    }
+    ring->position += length;
+    pcc_shm_publish(ring, ring->position);
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Maps the shared memory ring of the connection's first PCC_V2_FLAG_SHM request once the byte
+ * carrying it arrived.
+ * Returns 1 when the request can go on to its chunks, 0 while the byte is not there yet, or -1
+ * if the connection has to be dropped.
+ */
+int receive_ring(struct worker *worker, struct connection *conn) {
+    int ring_fd = -1;
+    int received = pcc_shm_recv_fd(conn->fd, &ring_fd);
+    if (received == 0) {
+        return 0;
+    }
+    if (received == -1) {
+        if (errno != ECONNRESET) {
+            perror("receive shared memory ring failed");
+        }
+        return -1;
+    }
+
+    struct pcc_shm_ring *ring = pcc_slab_alloc(&worker->ring_slab);
+    if (ring == NULL) {
+        perror("malloc ring slab failed");
+        close(ring_fd);
+        return -1;
+    }
+    if (pcc_shm_ring_map(ring, ring_fd, worker->shm_max_capacity) == -1) {
+        perror("map shared memory ring failed");
+        pcc_slab_free(&worker->ring_slab, ring);
+        return -1;
+    }
+    ring->position = 0;
+    conn->ring = ring;
+    conn->state = CONNECTION_READING_CHUNK_HEADER;
+    conn->last_activity = worker->tick;
+    return 1;
+}
+
+/*
+ * Feeds received bytes into the connection's request: the header fields (each may arrive split
+ * over several segments) and the payload, in whatever order the protocol version has them.
+ * Returns how many of the bytes belonged to the request, or -1 if the request is malformed.
+ * Once the request is complete the connection moves on to sending the reply.
+ */
+ssize_t consume_input(struct worker *worker, struct connection *conn, const char *data, size_t len) {
+    size_t consumed = 0;
+
+    conn->last_activity = worker->tick;
+    if (is_idle(conn) && conn->requests_served > 0) {
+        // the next keep-alive request starts, and with it its header and total deadlines
+        conn->request_started = worker->tick;
+        update_deadline(worker, conn);
+    }
+
+    // the ring's fd does not come with the bytes, recv stops right before it
+    while (consumed < len && conn->state != CONNECTION_SENDING_REPLY && conn->state != CONNECTION_RECEIVING_RING) {
+        size_t part = input_wanted(conn) < len - consumed ? input_wanted(conn) : len - consumed;
+
+        if (conn->state == CONNECTION_READING_BODY) {
+            int read = (conn->flags & PCC_V2_FLAG_DELTA) ? read_delta(worker, conn, data + consumed, part)
+                                                         : count_body(worker, conn, data + consumed, part);
+            if (GENERAL_ERROR == read) {
+                return -1;
+            }
+            consumed += part;
+            continue;
+        }
+
+        memcpy(conn->header + conn->header_bytes, data + consumed, part);
+        conn->header_bytes += part;
+        consumed += part;
+        if (input_wanted(conn) == 0 && GENERAL_ERROR == parse_header_field(worker, conn)) {
+            return -1;
+        }
+        if (conn->state == CONNECTION_READING_BODY && (conn->flags & PCC_V2_FLAG_SHM) &&
+            GENERAL_ERROR == count_ring_chunk(worker, conn)) {
+            return -1;
+        }
+    }
+
+    return consumed;
+}
+
+/*
+ * Advances a connection as far as it can go without blocking, through as many pipelined requests
+ * as have arrived. Returns CONNECTION_DONE once the connection should be closed (served or
+ * dropped), CONNECTION_PENDING if it is waiting for more readiness events.
+ */
+int progress_connection(struct worker *worker, struct connection *conn) {
+    char *buffer = worker->receive_buffer;
+    ssize_t bytes_received = 0;
+    ssize_t bytes_sent = 0;
+    int reads_left = READS_PER_EVENT;
+
+    while (true) {
+        while (conn->state != CONNECTION_SENDING_REPLY) {
+            if (reads_left-- == 0) {
+                // let other connections progress, level-triggered epoll will bring us back
+                return CONNECTION_PENDING;
+            }
+
+            if (conn->state == CONNECTION_RECEIVING_RING) {
+                int received = receive_ring(worker, conn);
+                if (received == -1) {
+                    return CONNECTION_DONE;
+                }
+                if (received == 0) {
+                    return CONNECTION_PENDING;
+                }
+                continue;
+            }
+
+            size_t to_read = input_wanted(conn);
+            if (to_read > worker->receive_buffer_size) {
+                to_read = worker->receive_buffer_size;
+            }
+
+            bytes_received = recv(conn->fd, buffer, to_read, 0);
+            if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return CONNECTION_PENDING;
+            }
+            if (bytes_received == 0 && is_idle(conn)) {
+                return CONNECTION_DONE;  // the client is done with the connection, or never used it
+            }
+            if (bytes_received == -1 || bytes_received == 0) {
+                if (conn->state == CONNECTION_READING_HEADER) {
+                    perror("recv N failed");
+                } else if (bytes_received == -1 && (errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE)) {
+                    perror("recv failed");
+                }
+                return CONNECTION_DONE;  // client disconnected, not a server error
+            }
+
+            if (consume_input(worker, conn, buffer, bytes_received) == -1) {
+                return CONNECTION_DONE;
+            }
+        }
+
+        while (conn->reply_bytes_sent < conn->reply_size) {
+            bytes_sent = send(conn->fd, reply_left(conn), conn->reply_size - conn->reply_bytes_sent, MSG_NOSIGNAL);
+            if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                struct epoll_event event = {.events = EPOLLOUT, .data.ptr = conn};
+                if (0 != epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event)) {
+                    perror("epoll_ctl failed");
+                    return CONNECTION_DONE;
+                }
+                conn->polling_output = true;
+                return CONNECTION_PENDING;
+            }
+            if (bytes_sent == -1) {
+                if (errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE) {
+                    perror("send pcc_count failed");
+                }
+                return CONNECTION_DONE;  // not a server error
+            }
+            conn->reply_bytes_sent += bytes_sent;
+            conn->last_activity = worker->tick;
+        }
+
+        if (CONNECTION_DONE == finish_request(worker, conn)) {
+            return CONNECTION_DONE;
+        }
+
+        if (conn->polling_output) {
+            struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+            if (0 != epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event)) {
+                perror("epoll_ctl failed");
+                return CONNECTION_DONE;
+            }
+            conn->polling_output = false;
+        }
+    }
+}
+
+int accept_new_clients(struct worker *worker, int listen_fd) {
+    while (true) {
+        pcc_ticks_t accept_started = PCC_TELEMETRY_NOW();
+        int client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return GENERAL_SUCCESS;  // drained the accept queue
+            }
+            if (errno == ECONNABORTED || errno == EINTR || errno == EMFILE || errno == ENFILE) {
+                // transient, the connection is lost or will be retried on the next wakeup
+                perror("accept failed");
+                return GENERAL_SUCCESS;
+            }
+            perror("accept failed");
+            return GENERAL_ERROR;
+        }
+        PCC_TELEMETRY_RECORD(&worker->telemetry, PCC_PHASE_ACCEPT, accept_started);
+
+        struct connection *conn = create_connection(worker, client_fd);
+        if (conn == NULL) {
+            close(client_fd);
+            return GENERAL_SUCCESS;  // drop the client, keep serving the others
+        }
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+        if (0 != epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_fd, &event)) {
+            perror("epoll_ctl failed");
+            close_connection(worker, conn);
+            return GENERAL_SUCCESS;
+        }
+    }
+}
+
+int create_server_socket(const struct server_config *config) {
+    int server_fd = -1;
+    struct sockaddr_in serv_addr = {0};
+    socklen_t addrsize = sizeof(struct sockaddr_in);
+
+    // io_uring waits for readiness itself, epoll needs accept to never block
+    server_fd = socket(AF_INET, SOCK_STREAM | (config->io_uring ? 0 : SOCK_NONBLOCK), 0);
+    if (server_fd == -1) {
+        perror("socket creation failed");
+        goto error;
+    }
+
+    int opt_true = 1;
+    if (0 != setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_true, sizeof(opt_true))) {
+        perror("setsockopt failed");
+        goto error;
+    }
+
+    // each worker binds its own socket to the port and the kernel balances connections between them
+    if (config->workers > 1 &&
+        0 != setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt_true, sizeof(opt_true))) {
+        perror("setsockopt SO_REUSEPORT failed");
+        goto error;
+    }
+
+    // a connection only reaches the accept queue once its first bytes arrived, so a worker that
+    // wakes up for it can read the header right away instead of going through another epoll round
+    if (config->defer_accept > 0 && 0 != setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config->defer_accept,
+                                                    sizeof(config->defer_accept))) {
+        perror("setsockopt TCP_DEFER_ACCEPT failed");
+        goto error;
+    }
+
+    // a short request can ride on the SYN, the kernel also needs bit 2 of net.ipv4.tcp_fastopen
+    if (config->fast_open > 0 &&
+        0 != setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN, &config->fast_open, sizeof(config->fast_open))) {
+        perror("setsockopt TCP_FASTOPEN failed");
+        goto error;
+    }
+
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serv_addr.sin_port = htons(config->port);
+
+    if (0 != bind(server_fd, (struct sockaddr *)&serv_addr, addrsize)) {
+        perror("bind failed");
+        goto error;
+    }
+
+    if (0 != listen(server_fd, config->backlog)) {
+        perror("listen failed");
+        goto error;
+    }
+
+    return server_fd;
+error:
+    if (server_fd != -1) {
+        close(server_fd);
+    }
+    return -1;
+}
+
+/*
+ * The Unix socket for clients on the same host, the only way to PCC_V2_FLAG_SHM. Unlike the TCP
+ * port it is one socket that every worker accepts from.
+ */
+int create_unix_socket(const struct server_config *config) {
+    int unix_fd = -1;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(config->unix_socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unix socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, config->unix_socket_path);
+
+    unix_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | (config->io_uring ? 0 : SOCK_NONBLOCK), 0);
+    if (unix_fd == -1) {
+        perror("unix socket creation failed");
+        goto error;
+    }
+    unlink(addr.sun_path);  // left over from a previous run
+    if (0 != bind(unix_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("unix socket bind failed");
+        goto error;
+    }
+    if (0 != listen(unix_fd, config->backlog)) {
+        perror("unix socket listen failed");
+        goto error;
+    }
+    return unix_fd;
+error:
+    if (unix_fd != -1) {
+        close(unix_fd);
+    }
+    return -1;
+}
+
+int run_event_loop(struct worker *worker) {
+    int return_code = GENERAL_ERROR;
+    struct epoll_event events[MAX_EVENTS];
+
+    struct epoll_event server_event = {.events = EPOLLIN, .data.ptr = &worker->listener_source};
+    if (0 != epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->server_fd, &server_event)) {
+        perror("epoll_ctl failed");
+        goto cleanup;
+    }
+
+    // every worker waits on the shared socket, EPOLLEXCLUSIVE wakes only one of them per client
+    struct epoll_event unix_event = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &worker->unix_listener_source};
+    if (worker->unix_fd != -1 && 0 != epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->unix_fd, &unix_event)) {
+        perror("epoll_ctl failed");
+        goto cleanup;
+    }
+
+    struct epoll_event shutdown_event = {.events = EPOLLIN, .data.ptr = &worker->shutdown_source};
+    if (0 != epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, shutdown_fd, &shutdown_event)) {
+        perror("epoll_ctl failed");
+        goto cleanup;
+    }
+
+    // after shutdown is requested stop accepting, but finish handling the clients already in progress
+    while (worker->accepting || worker->active_connections > 0) {
+        pcc_ticks_t wait_started = PCC_TELEMETRY_NOW();
+        int ready = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, worker->timers.armed > 0 ? TIMER_TICK_MS : -1);
+        PCC_TELEMETRY_RECORD(&worker->telemetry, PCC_PHASE_WAIT, wait_started);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            goto cleanup;
+        }
+        update_tick(worker);
+
+        for (int i = 0; i < ready; i++) {
+            struct event_source *source = events[i].data.ptr;
+            switch (source->kind) {
+            case EVENT_SOURCE_LISTENER:
+                if (worker->accepting && GENERAL_ERROR == accept_new_clients(worker, worker->server_fd)) {
+                    goto cleanup;
+                }
+                break;
+            case EVENT_SOURCE_UNIX_LISTENER:
+                if (worker->accepting && GENERAL_ERROR == accept_new_clients(worker, worker->unix_fd)) {
+                    goto cleanup;
+                }
+                break;
+            case EVENT_SOURCE_SHUTDOWN:
+                if (worker->accepting) {
+                    // the eventfd is never drained, so it has to leave the set together with the listener
+                    if (0 != epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->server_fd, NULL) ||
+                        (worker->unix_fd != -1 && 0 != epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->unix_fd, NULL)) ||
+                        0 != epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, shutdown_fd, NULL)) {
+                        perror("epoll_ctl failed");
+                        goto cleanup;
+                    }
+                    worker->accepting = false;
+                    shut_waiting_connections(worker);
+                }
+                break;
+            case EVENT_SOURCE_CONNECTION: {
+                struct connection *conn = (struct connection *)source;
+                if (CONNECTION_DONE == progress_connection(worker, conn)) {
+                    close_connection(worker, conn);
+                }
+                break;
+            }
+            }
+        }
+        run_deadlines(worker);
+    }
+
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    return return_code;
+}
+
+// gets a free sqe, flushing the submission queue to the kernel if it is full
+struct io_uring_sqe *uring_get_sqe(struct worker *worker) {
+    struct io_uring_sqe *sqe = pcc_uring_get_sqe(&worker->uring);
+    if (sqe == NULL) {
+        if (0 != pcc_uring_submit(&worker->uring, 0)) {
+            perror("io_uring_enter failed");
+            return NULL;
+        }
+        sqe = pcc_uring_get_sqe(&worker->uring);
+    }
+    return sqe;
+}
+
+// tagged URING_TAG_ACCEPT for the TCP socket, URING_TAG_UNIX_ACCEPT for the Unix one
+int uring_arm_accept(struct worker *worker, int listen_fd, uint64_t tag) {
+    struct io_uring_sqe *sqe = uring_get_sqe(worker);
+    if (sqe == NULL) {
+        return GENERAL_ERROR;
+    }
+
+    // a single multishot accept keeps producing a completion per new client
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = tag;
+    return GENERAL_SUCCESS;
+}
+
+int uring_arm_shutdown(struct worker *worker) {
+    struct io_uring_sqe *sqe = uring_get_sqe(worker);
+    if (sqe == NULL) {
+        return GENERAL_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shutdown_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_TAG_SHUTDOWN;
+    return GENERAL_SUCCESS;
+}
+
+int uring_cancel_accept(struct worker *worker, uint64_t tag) {
+    struct io_uring_sqe *sqe = uring_get_sqe(worker);
+    if (sqe == NULL) {
+        return GENERAL_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = tag;
+    sqe->user_data = URING_TAG_CANCEL;
+    return GENERAL_SUCCESS;
+}
+
+// wakes the loop up after a tick, so deadlines are checked while no completions arrive
+int uring_arm_timeout(struct worker *worker) {
+    struct io_uring_sqe *sqe = uring_get_sqe(worker);
+    if (sqe == NULL) {
+        return GENERAL_ERROR;
+    }
+
+    worker->timer_wait.tv_sec = 0;
+    worker->timer_wait.tv_nsec = TIMER_TICK_MS * 1000000LL;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&worker->timer_wait;
+    sqe->len = 1;
+    sqe->user_data = URING_TAG_TIMEOUT;
+    worker->timer_wait_armed = true;
+    return GENERAL_SUCCESS;
+}
+
+// a connection has at most one request in flight, so its state tells which one completed
+int uring_arm_recv(struct worker *worker, struct connection *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(worker);
+    if (sqe == NULL) {
+        return GENERAL_ERROR;
+    }
+
+    size_t to_read = input_wanted(conn);
+    if (to_read > worker->receive_buffer_size / URING_BUFFERS_AMOUNT) {
+        to_read = worker->receive_buffer_size / URING_BUFFERS_AMOUNT;
+    }
+
+    // the kernel picks the buffer from the provided ring only once data is there
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->len = to_read;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+    return GENERAL_SUCCESS;
+}
+
+// waits for the byte carrying a shared memory ring, which a recv into a provided buffer would lose
+int uring_arm_poll_in(struct worker *worker, struct connection *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(worker);
+    if (sqe == NULL) {
+        return GENERAL_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+    return GENERAL_SUCCESS;
+}
+
+int uring_arm_send(struct worker *worker, struct connection *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(worker);
+    if (sqe == NULL) {
+        return GENERAL_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)reply_left(conn);
+    sqe->len = conn->reply_size - conn->reply_bytes_sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+    return GENERAL_SUCCESS;
+}
+
+int uring_add_client(struct worker *worker, int client_fd) {
+    struct connection *conn = create_connection(worker, client_fd);
+    if (conn == NULL) {
+        close(client_fd);
+        return GENERAL_SUCCESS;  // drop the client, keep serving the others
+    }
+
+    return uring_arm_recv(worker, conn);
+}
+
+// the next operation for a connection that is still reading its request
+int uring_continue_reading(struct worker *worker, struct connection *conn) {
+    if (conn->state != CONNECTION_RECEIVING_RING) {
+        return uring_arm_recv(worker, conn);
+    }
+
+    int received = receive_ring(worker, conn);
+    if (received == -1) {
+        close_connection(worker, conn);
+        return GENERAL_SUCCESS;
+    }
+    return received == 0 ? uring_arm_poll_in(worker, conn) : uring_arm_recv(worker, conn);
+}
+
+int uring_handle_connection(struct worker *worker, struct connection *conn, int32_t res, uint32_t flags) {
+    if (conn->timed_out) {
+        // the operation the shutdown woke up, its data no longer matters
+        if (flags & IORING_CQE_F_BUFFER) {
+            pcc_uring_recycle_buffer(&worker->uring, flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        close_connection(worker, conn);
+        return GENERAL_SUCCESS;
+    }
+
+    if (conn->state == CONNECTION_RECEIVING_RING) {
+        // the poll uring_arm_poll_in armed completed
+        if (res < 0) {
+            errno = -res;
+            perror("poll failed");
+            close_connection(worker, conn);
+            return GENERAL_SUCCESS;
+        }
+        return uring_continue_reading(worker, conn);
+    }
+
+    if (conn->state != CONNECTION_SENDING_REPLY) {
+        if (res == -ENOBUFS) {
+            // every provided buffer was taken, they are recycled as completions are handled
+            return uring_arm_recv(worker, conn);
+        }
+        if (res <= 0) {
+            errno = -res;
+            if (res == 0 && is_idle(conn)) {
+                // the client is done with the connection, or never used it
+            } else if (conn->state == CONNECTION_READING_HEADER) {
+                perror("recv N failed");
+            } else if (errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE) {
+                perror("recv failed");
+            }
+            close_connection(worker, conn);
+            return GENERAL_SUCCESS;  // client disconnected, not a server error
+        }
+
+        uint16_t buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+        ssize_t consumed = consume_input(worker, conn, pcc_uring_buffer(&worker->uring, buffer_id), res);
+        pcc_uring_recycle_buffer(&worker->uring, buffer_id);
+        if (consumed == -1) {
+            close_connection(worker, conn);
+            return GENERAL_SUCCESS;  // a bad request only costs its own connection
+        }
+
+        return conn->state == CONNECTION_SENDING_REPLY ? uring_arm_send(worker, conn) : uring_continue_reading(worker, conn);
+    }
+
+    if (res < 0) {
+        errno = -res;
+        if (errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE) {
+            perror("send pcc_count failed");
+        }
+        close_connection(worker, conn);
+        return GENERAL_SUCCESS;  // not a server error
+    }
+
+    conn->reply_bytes_sent += res;
+    conn->last_activity = worker->tick;
+    if (conn->reply_bytes_sent < conn->reply_size) {
+        return uring_arm_send(worker, conn);
+    }
+
+    if (CONNECTION_DONE == finish_request(worker, conn)) {
+        close_connection(worker, conn);
+        return GENERAL_SUCCESS;
+    }
+    return uring_arm_recv(worker, conn);
+}
+
+/*
+ * io_uring flavour of run_event_loop. One io_uring_enter per iteration both submits everything
+ * queued since the previous one and waits, then the whole batch of completions is handled.
+ */
+int run_uring_loop(struct worker *worker) {
+    int return_code = GENERAL_ERROR;
+    bool accept_armed = false;
+    bool unix_accept_armed = false;
+
+    if (GENERAL_ERROR == uring_arm_accept(worker, worker->server_fd, URING_TAG_ACCEPT) ||
+        GENERAL_ERROR == uring_arm_shutdown(worker)) {
+        goto cleanup;
+    }
+    accept_armed = true;
+    if (worker->unix_fd != -1) {
+        if (GENERAL_ERROR == uring_arm_accept(worker, worker->unix_fd, URING_TAG_UNIX_ACCEPT)) {
+            goto cleanup;
+        }
+        unix_accept_armed = true;
+    }
+
+    // after shutdown is requested stop accepting, but finish handling the clients already in progress
+    while (worker->accepting || accept_armed || unix_accept_armed || worker->active_connections > 0) {
+        if (worker->timers.armed > 0 && !worker->timer_wait_armed && GENERAL_ERROR == uring_arm_timeout(worker)) {
+            goto cleanup;
+        }
+
+        pcc_ticks_t wait_started = PCC_TELEMETRY_NOW();
+        if (0 != pcc_uring_submit(&worker->uring, 1)) {
+            perror("io_uring_enter failed");
+            goto cleanup;
+        }
+        PCC_TELEMETRY_RECORD(&worker->telemetry, PCC_PHASE_WAIT, wait_started);
+        update_tick(worker);
+
+        struct io_uring_cqe *cqe = NULL;
+        while ((cqe = pcc_uring_peek_cqe(&worker->uring)) != NULL) {
+            uint64_t user_data = cqe->user_data;
+            int32_t res = cqe->res;
+            uint32_t flags = cqe->flags;
+            pcc_uring_cqe_seen(&worker->uring);
+
+            switch (user_data) {
+            case URING_TAG_ACCEPT:
+            case URING_TAG_UNIX_ACCEPT: {
+                bool *armed = user_data == URING_TAG_ACCEPT ? &accept_armed : &unix_accept_armed;
+                int listen_fd = user_data == URING_TAG_ACCEPT ? worker->server_fd : worker->unix_fd;
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    *armed = false;
+                }
+                if (res >= 0) {
+                    if (GENERAL_ERROR == uring_add_client(worker, res)) {
+                        goto cleanup;
+                    }
+                } else if (res != -ECANCELED) {
+                    errno = -res;
+                    perror("accept failed");
+                    if (errno != ECONNABORTED && errno != EINTR && errno != EMFILE && errno != ENFILE) {
+                        goto cleanup;
+                    }
+                }
+                if (worker->accepting && !*armed) {
+                    if (GENERAL_ERROR == uring_arm_accept(worker, listen_fd, user_data)) {
+                        goto cleanup;
+                    }
+                    *armed = true;
+                }
+                break;
+            }
+            case URING_TAG_SHUTDOWN:
+                worker->accepting = false;
+                if (GENERAL_ERROR == uring_cancel_accept(worker, URING_TAG_ACCEPT) ||
+                    (unix_accept_armed && GENERAL_ERROR == uring_cancel_accept(worker, URING_TAG_UNIX_ACCEPT))) {
+                    goto cleanup;
+                }
+                shut_waiting_connections(worker);
+                break;
+            case URING_TAG_CANCEL:
+                break;
+            case URING_TAG_TIMEOUT:
+                worker->timer_wait_armed = false;
+                break;
+            default:
+                if (GENERAL_ERROR == uring_handle_connection(worker, (struct connection *)(uintptr_t)user_data, res, flags)) {
+                    goto cleanup;
+                }
+                break;
+            }
+        }
+        run_deadlines(worker);
+    }
+
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    return return_code;
+}
+
+// probes once at startup, so an old kernel or a seccomp filter falls back to epoll instead of failing
+bool is_uring_supported() {
+    struct pcc_uring ring;
+    char buffer[4096];  // registered, never received into
+    if (0 != pcc_uring_init(&ring, 1, 2)) {
+        return false;
+    }
+
+    bool supported = (0 == pcc_uring_setup_buffers(&ring, buffer, 1, sizeof(buffer), URING_BUFFER_GROUP));
+    pcc_uring_destroy(&ring);
+    return supported;
+}
+
+/*
+ * With --cpus, worker w runs on the w-th CPU of the set, round robin. On a machine with more than
+ * one NUMA node, what the worker touches per request then lives on that CPU's node: its struct
+ * (shard, histogram, timers, telemetry) is moved there, its receive buffer is mapped there, and
+ * the slab chunks it allocates from its own pinned thread land there by first touch.
+ */
+void place_worker(const struct server_config *config, struct worker *worker, int numa_nodes) {
+    worker->cpu = config->has_cpus ? pcc_cpu_set_nth(&config->cpus, worker->id) : -1;
+    worker->node = worker->cpu != -1 && numa_nodes > 1 ? pcc_numa_node_of_cpu(worker->cpu) : -1;
+    if (worker->node != -1 && pcc_numa_place(worker, sizeof(*worker), worker->node) == -1) {
+        perror("mbind failed, the worker's memory stays where it is");
+        worker->node = -1;
+    }
+    if (worker->cpu != -1) {
+        fprintf(stderr, "Worker %u on CPU %d, NUMA node %d%s\n", worker->id, worker->cpu,
+                pcc_numa_node_of_cpu(worker->cpu),
+                numa_nodes > 1 && worker->node == -1 ? " (memory not placed)" : "");
+    }
+}
+
+// at least size bytes, on the worker's node and backed by the pages --huge-pages asks for
+int map_receive_buffer(const struct server_config *config, struct worker *worker, size_t size) {
+    enum pcc_huge_pages got = PCC_HUGE_PAGES_OFF;
+
+    worker->receive_buffer_size = pcc_buffer_size(size, config->huge_pages);
+    worker->receive_buffer = pcc_buffer_map(size, config->huge_pages, worker->node, &got);
+    if (worker->receive_buffer == NULL) {
+        perror("mmap receive buffer failed");
+        return GENERAL_ERROR;
+    }
+    if (got != config->huge_pages && worker->id == 0) {
+        fprintf(stderr, "%s huge pages are not available, the receive buffers use %s pages\n",
+                config->huge_pages == PCC_HUGE_PAGES_EXPLICIT ? "Explicit (vm.nr_hugepages)" : "Transparent",
+                got == PCC_HUGE_PAGES_TRANSPARENT ? "transparent huge" : "regular");
+    }
+    return GENERAL_SUCCESS;
+}
+
+int init_worker_engine(const struct server_config *config, struct worker *worker) {
+    if (config->io_uring) {
+        if (0 != pcc_uring_init(&worker->uring, URING_ENTRIES, URING_CQ_ENTRIES)) {
+            perror("io_uring_setup failed");
+            return GENERAL_ERROR;
+        }
+        // a whole huge page makes for larger buffers, the kernel only takes one once data is there
+        if (GENERAL_ERROR == map_receive_buffer(config, worker, URING_BUFFERS_AMOUNT * URING_BUFFER_SIZE)) {
+            return GENERAL_ERROR;
+        }
+        if (0 != pcc_uring_setup_buffers(&worker->uring, worker->receive_buffer, URING_BUFFERS_AMOUNT,
+                                         worker->receive_buffer_size / URING_BUFFERS_AMOUNT, URING_BUFFER_GROUP)) {
+            perror("io_uring buffer ring registration failed");
+            return GENERAL_ERROR;
+        }
+        return GENERAL_SUCCESS;
+    }
+
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->epoll_fd == -1) {
+        perror("epoll_create1 failed");
+        return GENERAL_ERROR;
+    }
+    return map_receive_buffer(config, worker, RECEIVE_BUFFER_SIZE);
+}
 
-#define BUFFER_SIZE (1024)
+void *worker_main(void *arg) {
+    struct worker *worker = arg;
 
-uint32_t pcc_total[AMOUNT_OF_PRINTABLE_CHARS] = {0};
-uint32_t clients_count = 0;
-bool sigint_received = false;
+    worker->return_code = worker->uring.fd != -1 ? run_uring_loop(worker) : run_event_loop(worker);
+    if (worker->return_code == GENERAL_ERROR) {
+        // a broken worker takes the whole server down, like the single threaded server did
+        request_shutdown();
+    }
 
-bool is_printable(char c) {
-    return (PRINTABLE_LOWER_BOUND <= c && c <= PRINTABLE_UPPER_BOUND);
+    return NULL;
 }
 
-void print_pcc_statistics() {
-    for (int c = PRINTABLE_LOWER_BOUND; c <= PRINTABLE_UPPER_BOUND; c++) {
-        int count = pcc_total[PRINTABLE_TO_INDEX(c)];
-        if (count > 0) {
-            printf("char '%c' : %u times\n", (char)c, count);
+int create_stats_socket(const char *path) {
+    int stats_fd = -1;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Statistics socket path is too long: %s\n", path);
+        goto error;
+    }
+    strcpy(addr.sun_path, path);
+
+    stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (stats_fd == -1) {
+        perror("stats socket creation failed");
+        goto error;
+    }
+
+    // a socket file left behind by a previous run would fail the bind
+    unlink(path);
+    if (0 != bind(stats_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("stats bind failed");
+        goto error;
+    }
+
+    if (0 != listen(stats_fd, STATS_LISTEN_QUEUE_SIZE)) {
+        perror("stats listen failed");
+        goto error;
+    }
+
+    return stats_fd;
+error:
+    if (stats_fd != -1) {
+        close(stats_fd);
+    }
+    return -1;
+}
+
+// replies with the same table the server prints on shutdown, then closes the connection
+void serve_stats_query(struct stats_server *stats, int client_fd) {
+    uint64_t totals[AMOUNT_OF_PRINTABLE_CHARS];
+    uint32_t clients = 0;
+    char *report = NULL;
+    size_t report_size = 0;
+
+    merge_pcc_shards(stats->workers, stats->workers_count, totals, &clients);
+
+    FILE *out = open_memstream(&report, &report_size);
+    if (out == NULL) {
+        perror("open_memstream failed");
+        return;
+    }
+    print_pcc_statistics(out, totals);
+    fprintf(out, "Served %u client(s) so far\n", clients);
+    if (0 != fclose(out)) {
+        perror("fclose failed");
+        free(report);
+        return;
+    }
+
+    size_t bytes_sent = 0;
+    while (bytes_sent < report_size) {
+        ssize_t chunk_size = send(client_fd, report + bytes_sent, report_size - bytes_sent, MSG_NOSIGNAL);
+        if (chunk_size == -1) {
+            perror("send statistics failed");
+            break;
         }
+        bytes_sent += chunk_size;
     }
+    free(report);
 }
 
-void sigint_handler(int signum) {
-    sigint_received = true;
+void *stats_main(void *arg) {
+    struct stats_server *stats = arg;
+    struct pollfd fds[2] = {
+        {.fd = stats->fd, .events = POLLIN},
+        {.fd = shutdown_fd, .events = POLLIN},
+    };
+
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;  // the server is shutting down
+        }
+        if (fds[0].revents & POLLIN) {
+            int client_fd = accept4(stats->fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client_fd == -1) {
+                perror("stats accept failed");
+                continue;
+            }
+            serve_stats_query(stats, client_fd);
+            close(client_fd);
+        }
+    }
+
+    return NULL;
 }
 
-void update_pcc_total(uint32_t new_pcc_count[]) {
-    for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
-        pcc_total[i] += new_pcc_count[i];
+// before the workers start: the shards begin where the last checkpoint left off, slots of workers
+// this run does not have go to the first one
+void recover_pcc_shards(struct state_checkpointer *checkpointer) {
+    uint64_t totals[AMOUNT_OF_PRINTABLE_CHARS];
+    uint64_t clients = 0;
+
+    for (uint32_t slot = 0; slot < checkpointer->state.header->slot_count; slot++) {
+        pcc_state_read_slot(&checkpointer->state, slot, totals, &clients);
+        struct pcc_shard *shard = &checkpointer->workers[slot < checkpointer->workers_count ? slot : 0].shard;
+        for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+            shard->pcc_total[i] += totals[i];
+        }
+        shard->clients_count += clients;
+        checkpointer->checkpointed_clients += clients;
     }
 }
 
-int handle_new_client(int server_fd) {
-    int return_code = GENERAL_ERROR;
-    uint32_t N = 0;
-    uint32_t pcc_count = 0;
-    int client_fd = -1;
-    ssize_t bytes_received = 0;
-    ssize_t bytes_sent = 0;
-    uint32_t new_pcc_count[AMOUNT_OF_PRINTABLE_CHARS] = {0};
-    char buffer[BUFFER_SIZE] = {0};
+// what of the pusher the state file keeps, taken whole under its lock
+void snapshot_upstream(struct upstream_pusher *pusher, struct pcc_state_upstream *upstream) {
+    pthread_mutex_lock(&pusher->lock);
+    upstream->leaf_id = pusher->leaf_id;
+    upstream->sequence = pusher->sequence;
+    upstream->pending = pusher->pending;
+    upstream->pushed_clients = pusher->pushed_clients;
+    upstream->pending_clients = pusher->pending ? pusher->pending_clients : 0;
+    memcpy(upstream->pushed, pusher->pushed, sizeof(upstream->pushed));
+    if (pusher->pending) {
+        memcpy(upstream->pending_totals, pusher->pending_totals, sizeof(upstream->pending_totals));
+    } else {
+        memset(upstream->pending_totals, 0, sizeof(upstream->pending_totals));
+    }
+    pthread_mutex_unlock(&pusher->lock);
+}
 
-    client_fd = accept(server_fd, NULL, NULL);
-    if (client_fd == -1) {
-        if (errno == EINTR) {
-            // Interrupted by signal, likely SIGINT, quitely shutting down.
-            return GENERAL_SUCCESS;
+/*
+ * Writes a consistent copy of every shard to the state file and syncs it, all workers in one
+ * batch and never on a worker's own path, with a leaf's pushes. Nothing is written while no
+ * client was served and nothing was pushed since the last checkpoint.
+ */
+int checkpoint_pcc_shards(struct state_checkpointer *checkpointer) {
+    uint64_t totals[AMOUNT_OF_PRINTABLE_CHARS];
+    uint32_t clients = 0;
+    uint64_t served = 0;
+    struct pcc_state_upstream upstream = checkpointer->upstream;
+    bool pushed = false;
+
+    if (checkpointer->pusher != NULL) {
+        // before the shards, which only grow: the pushes never cover more than the checkpointed totals
+        snapshot_upstream(checkpointer->pusher, &upstream);
+        pushed = !checkpointer->has_upstream || memcmp(&upstream, &checkpointer->upstream, sizeof(upstream)) != 0;
+    }
+    for (unsigned int w = 0; w < checkpointer->workers_count; w++) {
+        served += __atomic_load_n(&checkpointer->workers[w].shard.clients_count, __ATOMIC_RELAXED);
+    }
+    if (served == checkpointer->checkpointed_clients && !pushed) {
+        return GENERAL_SUCCESS;
+    }
+
+    uint64_t generation = pcc_state_next_generation(&checkpointer->state);
+    served = 0;
+    for (uint32_t slot = 0; slot < checkpointer->state.header->slot_count; slot++) {
+        if (slot < checkpointer->workers_count) {
+            read_pcc_shard(&checkpointer->workers[slot].shard, totals, &clients);
+        } else {
+            // recovered into the first worker's shard
+            memset(totals, 0, sizeof(totals));
+            clients = 0;
         }
-        perror("accept failed");
-        goto cleanup;
+        pcc_state_write_slot(&checkpointer->state, slot, generation, totals, clients);
+        served += clients;
+    }
+    bool has_upstream = checkpointer->pusher != NULL || checkpointer->has_upstream;
+    pcc_state_write_upstream(&checkpointer->state, generation, has_upstream ? &upstream : NULL);
+    if (pcc_state_commit(&checkpointer->state, generation) == -1) {
+        perror("state file checkpoint failed");
+        return GENERAL_ERROR;
     }
+    checkpointer->checkpointed_clients = served;
+    checkpointer->upstream = upstream;
+    checkpointer->has_upstream = has_upstream;
+    return GENERAL_SUCCESS;
+}
 
-    // receive N - expecting to receive an int in one call
-    bytes_received = recv(client_fd, &N, sizeof(N), 0);
-    if (bytes_received != sizeof(N)) {
-        perror("recv N failed");
-        return_code = GENERAL_SUCCESS;  // server drops connections and continues
-        goto cleanup;
+void *checkpoint_main(void *arg) {
+    struct state_checkpointer *checkpointer = arg;
+    struct pollfd shutdown_pfd = {.fd = shutdown_fd, .events = POLLIN};
+
+    while (true) {
+        int ready = poll(&shutdown_pfd, 1, (int)checkpointer->interval);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            break;
+        }
+        if (ready > 0) {
+            break;  // the server is shutting down, the last checkpoint follows once the workers are done
+        }
+        // a failed checkpoint leaves the previous one standing, the next interval tries again
+        checkpoint_pcc_shards(checkpointer);
+    }
+
+    return NULL;
+}
+
+// a blocking connection to the parent, with timeouts so a parent that stops answering can not
+// hold the leaf's shutdown up for long
+int connect_upstream(const struct sockaddr_in *addr) {
+    struct timeval timeout = {.tv_sec = UPSTREAM_TIMEOUT_SECONDS};
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (0 != setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) ||
+        0 != setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+        0 != connect(fd, (const struct sockaddr *)addr, sizeof(*addr))) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
     }
+    return fd;
+}
 
-    N = ntohl(N);
+// sends the request and reads the parent's reply, which must be the sum of the pushed counts
+int send_delta(int fd, const unsigned char *request, size_t size, uint64_t expected_count) {
+    uint64_t reply = 0;
+    size_t received = 0;
 
-    bytes_received = 0;
-    while (bytes_received < N) {
-        ssize_t chunk_size = recv(client_fd, buffer, BUFFER_SIZE, 0);
-        if (chunk_size == -1 || chunk_size == 0) {
+    for (size_t sent = 0; sent < size;) {
+        ssize_t chunk_size = send(fd, request + sent, size - sent, MSG_NOSIGNAL);
+        if (chunk_size == -1) {
             if (errno == EINTR) {
-                break; // Interrupted by signal, likely SIGINT, finish handling current client.
+                continue;
             }
-            if (errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE) {
-                perror("recv failed");
+            return GENERAL_ERROR;
+        }
+        sent += chunk_size;
+    }
+    while (received < sizeof(reply)) {
+        ssize_t chunk_size = recv(fd, (char *)&reply + received, sizeof(reply) - received, 0);
+        if (chunk_size == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            return_code = GENERAL_SUCCESS;  // client disconnected, not a server error
-            goto cleanup;
+            return GENERAL_ERROR;
         }
+        if (chunk_size == 0) {
+            errno = ECONNRESET;
+            return GENERAL_ERROR;
+        }
+        received += chunk_size;
+    }
+    if (pcc_ntoh64(reply) != expected_count) {
+        errno = EPROTO;
+        return GENERAL_ERROR;
+    }
+    return GENERAL_SUCCESS;
+}
+
+// the request of the pending delta, what was added from the last acknowledged push to pending_totals
+void build_delta_request(struct upstream_pusher *pusher) {
+    struct pcc_v2_header header = {
+        .magic = htonl(PCC_V2_MAGIC),
+        .version = PCC_V2_VERSION,
+        .flags = PCC_V2_FLAG_DELTA | PCC_V2_FLAG_KEEP_ALIVE,
+    };
+    uint64_t length = pcc_hton64(sizeof(struct pcc_delta));
+    struct pcc_delta delta;
+
+    pusher->expected_count = 0;
+    for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+        delta.pcc_total[i] = pcc_hton64(pusher->pending_totals[i] - pusher->pushed[i]);
+        pusher->expected_count += pusher->pending_totals[i] - pusher->pushed[i];
+    }
+    delta.clients_count = pcc_hton64(pusher->pending_clients - pusher->pushed_clients);
+    delta.leaf_id = pcc_hton64(pusher->leaf_id);
+    delta.sequence = pcc_hton64(pusher->sequence);
+    memcpy(pusher->request, &header, sizeof(header));
+    memcpy(pusher->request + sizeof(header), &length, sizeof(length));
+    memcpy(pusher->request + sizeof(header) + sizeof(length), &delta, sizeof(delta));
+}
+
+// the delta of everything served since the last acknowledged push, 0 if there is nothing new
+uint64_t prepare_delta(struct upstream_pusher *pusher) {
+    merge_pcc_shards(pusher->workers, pusher->workers_count, pusher->pending_totals, &pusher->pending_clients);
+    if (pusher->pending_clients == pusher->pushed_clients) {
+        return 0;
+    }
+    pusher->sequence++;
+    build_delta_request(pusher);
+    return pusher->pending_clients - pusher->pushed_clients;
+}
+
+// a restarted leaf takes up where the state file left its pushes, a delta that was pending is
+// resent first, with its sequence, as the parent may have added it
+void resume_upstream(struct upstream_pusher *pusher, const struct pcc_state_upstream *upstream) {
+    pusher->leaf_id = upstream->leaf_id;
+    pusher->sequence = upstream->sequence;
+    memcpy(pusher->pushed, upstream->pushed, sizeof(pusher->pushed));
+    pusher->pushed_clients = (uint32_t)upstream->pushed_clients;
+    pusher->pending = upstream->pending != 0;
+    if (pusher->pending) {
+        memcpy(pusher->pending_totals, upstream->pending_totals, sizeof(pusher->pending_totals));
+        pusher->pending_clients = (uint32_t)upstream->pending_clients;
+        build_delta_request(pusher);
+    }
+}
 
-        // process into current statistics
-        for (ssize_t i = 0; i < chunk_size; i++) {
-            char c = buffer[i];
-            if (is_printable(c)) {
-                pcc_count++;
-                new_pcc_count[PRINTABLE_TO_INDEX(c)]++;
+// sends the pending delta, on the kept alive connection or a new one
+int send_pending_delta(struct upstream_pusher *pusher) {
+    // a kept alive connection may have been closed by the parent's idle timeout since the last
+    // push, that one is retried once on a new connection
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused = pusher->fd != -1;
+        if (!reused) {
+            pusher->fd = connect_upstream(&pusher->addr);
+            if (pusher->fd == -1) {
+                return GENERAL_ERROR;
             }
         }
+        if (GENERAL_SUCCESS == send_delta(pusher->fd, pusher->request, sizeof(pusher->request),
+                                          pusher->expected_count)) {
+            return GENERAL_SUCCESS;
+        }
+        int saved_errno = errno;
+        close(pusher->fd);
+        pusher->fd = -1;
+        errno = saved_errno;
+        if (!reused) {
+            break;
+        }
+    }
+    return GENERAL_ERROR;
+}
 
-        bytes_received += chunk_size;
+/*
+ * Sends the parent everything served since the last push it acknowledged, as one delta, so the
+ * upstream traffic is one fixed size request per interval whatever the client request rate.
+ * Nothing is sent while no client was served. A delta that got no reply stays pending and is
+ * resent unchanged, with its sequence, before anything newer: the parent may have added it and
+ * only the reply was lost, then it recognizes the sequence and does not add it again.
+ */
+int push_upstream(struct upstream_pusher *pusher) {
+    while (true) {
+        if (!pusher->pending) {
+            pthread_mutex_lock(&pusher->lock);
+            pusher->pending = prepare_delta(pusher) > 0;
+            pthread_mutex_unlock(&pusher->lock);
+            if (!pusher->pending) {
+                return GENERAL_SUCCESS;
+            }
+        }
+        if (GENERAL_SUCCESS != send_pending_delta(pusher)) {
+            fprintf(stderr, "Push to upstream failed: %s\n", strerror(errno));
+            return GENERAL_ERROR;
+        }
+        pthread_mutex_lock(&pusher->lock);
+        memcpy(pusher->pushed, pusher->pending_totals, sizeof(pusher->pushed));
+        pusher->pushed_clients = pusher->pending_clients;
+        pusher->pending = false;
+        pthread_mutex_unlock(&pusher->lock);
     }
+}
 
-    // expecting to send an int in one call
-    pcc_count = htonl(pcc_count);
-    bytes_sent = send(client_fd, &pcc_count, sizeof(pcc_count), 0);
-    if (bytes_sent != sizeof(pcc_count)) {
-        if (errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE) {
-            perror("send pcc_count failed");
+void *upstream_main(void *arg) {
+    struct upstream_pusher *pusher = arg;
+    struct pollfd shutdown_pfd = {.fd = shutdown_fd, .events = POLLIN};
+
+    while (true) {
+        int ready = poll(&shutdown_pfd, 1, (int)pusher->interval);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            break;
         }
-        return_code = GENERAL_SUCCESS;  // not a server error
-        goto cleanup;
+        if (ready > 0) {
+            break;  // the server is shutting down, the last push follows once the workers are done
+        }
+        push_upstream(pusher);
     }
 
-    clients_count++;
-    update_pcc_total(new_pcc_count);
-    return_code = GENERAL_SUCCESS;
-cleanup:
-    if (client_fd != -1) {
-        close(client_fd);
+    return NULL;
+}
+
+#ifndef PCC_NO_TELEMETRY
+// one JSON line on stderr, see pcc_telemetry_write_json
+void report_telemetry(struct telemetry_reporter *reporter) {
+    static struct pcc_telemetry merged;  // only ever used by the reporter thread
+    char *report = NULL;
+    size_t report_size = 0;
+
+    memset(&merged, 0, sizeof(merged));
+    for (unsigned int w = 0; w < reporter->workers_count; w++) {
+        pcc_telemetry_merge(&merged, &reporter->workers[w].telemetry);
     }
 
-    return return_code;
+    struct pcc_clock_sample now = pcc_clock_sample();
+    FILE *out = open_memstream(&report, &report_size);
+    if (out == NULL) {
+        perror("open_memstream failed");
+        return;
+    }
+    pcc_telemetry_write_json(out, &merged, &reporter->previous, now.ns - reporter->started.ns,
+                             now.ns - reporter->last_report.ns, pcc_ns_per_tick(reporter->started, now));
+    if (0 == fclose(out)) {
+        // stderr is unbuffered, a single write keeps the line whole
+        fwrite(report, 1, report_size, stderr);
+    }
+    free(report);
+
+    reporter->previous = merged;
+    reporter->last_report = now;
+}
+
+void *telemetry_main(void *arg) {
+    struct telemetry_reporter *reporter = arg;
+    struct pollfd fds[2] = {
+        {.fd = telemetry_fd, .events = POLLIN},
+        {.fd = shutdown_fd, .events = POLLIN},
+    };
+    int timeout = reporter->interval > 0 ? (int)reporter->interval * 1000 : -1;
+
+    while (true) {
+        int ready = poll(fds, 2, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;  // the server is shutting down
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t requests = 0;
+            if (read(telemetry_fd, &requests, sizeof(requests)) != sizeof(requests)) {
+                // raced with another read, the report below covers it
+            }
+        }
+        report_telemetry(reporter);
+    }
+
+    return NULL;
+}
+#endif
+
+// starts the worker's thread already on its CPU, so it never runs or touches memory anywhere else
+int start_worker(struct worker *worker) {
+    pthread_attr_t attr;
+    cpu_set_t cpu;
+
+    int error = pthread_attr_init(&attr);
+    if (error != 0) {
+        return error;
+    }
+    if (worker->cpu != -1) {
+        CPU_ZERO(&cpu);
+        CPU_SET(worker->cpu, &cpu);
+        error = pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+    }
+    if (error == 0) {
+        error = pthread_create(&worker->thread, &attr, worker_main, worker);
+    }
+    pthread_attr_destroy(&attr);
+    return error;
 }
 
-int run_server(uint16_t port) {
+int run_server(const struct server_config *config) {
     int return_code = GENERAL_ERROR;
-    int server_fd = -1;
-    struct sockaddr_in serv_addr = {0};
-    socklen_t addrsize = sizeof(struct sockaddr_in);
+    struct worker *workers = NULL;
+    unsigned int workers_started = 0;
+    int unix_fd = -1;
+    struct stats_server stats = {.fd = -1};
+    bool stats_started = false;
+    struct state_checkpointer checkpointer = {.state = {.fd = -1, .header = MAP_FAILED}};
+    bool checkpointer_started = false;
+    struct upstream_pusher pusher = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+    bool pusher_started = false;
+    static struct delta_ledger ledger = {.lock = PTHREAD_MUTEX_INITIALIZER};  // shared by the workers
     struct sigaction act = {0};
+    sigset_t sigint_mask;
     act.sa_handler = sigint_handler;
-    // act.sa_flags = SA_RESTART;  // need for send \ recv?
+#ifndef PCC_NO_TELEMETRY
+    static struct telemetry_reporter reporter;  // too big for the stack
+    bool reporter_started = false;
+    struct sigaction usr1_act = {0};
+    usr1_act.sa_handler = sigusr1_handler;
+#endif
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) {
-        perror("socket creation failed");
+    pcc_count_init();  // before any worker counts a byte class a request names
+    pcc_utf8_init();
+
+    shutdown_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shutdown_fd == -1) {
+        perror("eventfd failed");
         goto cleanup;
     }
 
-    int opt_reuse_addr_true = 1;
-    if (0 != setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_reuse_addr_true, sizeof(opt_reuse_addr_true))) {
-        perror("setsockopt failed");
+    workers = aligned_alloc(WORKER_ALIGNMENT, config->workers * sizeof(*workers));
+    if (workers == NULL) {
+        perror("aligned_alloc workers failed");
         goto cleanup;
     }
+    memset(workers, 0, config->workers * sizeof(*workers));
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serv_addr.sin_port = htons(port);
+    if (config->unix_socket_path != NULL) {
+        unix_fd = create_unix_socket(config);
+        if (unix_fd == -1) {
+            goto cleanup;
+        }
+    }
 
-    if (0 != bind(server_fd, (struct sockaddr *)&serv_addr, addrsize)) {
-        perror("bind failed");
-        goto cleanup;
+    for (unsigned int w = 0; w < config->workers; w++) {
+        workers[w].id = w;
+        workers[w].server_fd = -1;
+        workers[w].unix_fd = unix_fd;
+        workers[w].epoll_fd = -1;
+        workers[w].uring.fd = -1;
+        workers[w].accepting = true;
+        workers[w].listener_source.kind = EVENT_SOURCE_LISTENER;
+        workers[w].unix_listener_source.kind = EVENT_SOURCE_UNIX_LISTENER;
+        workers[w].shutdown_source.kind = EVENT_SOURCE_SHUTDOWN;
+        workers[w].header_timeout = seconds_to_ticks(config->header_timeout);
+        workers[w].idle_timeout = seconds_to_ticks(config->idle_timeout);
+        workers[w].total_timeout = seconds_to_ticks(config->total_timeout);
+        workers[w].shm_max_capacity = (uint64_t)config->shm_max_ring * 1024 * 1024;
+        workers[w].leaves = config->leaves;
+        workers[w].leaves_count = config->leaves_count;
+        workers[w].ledger = &ledger;
+        workers[w].has_deadlines = config->header_timeout > 0 || config->idle_timeout > 0 || config->total_timeout > 0;
+        workers[w].tick = current_tick();
+        pcc_timer_wheel_init(&workers[w].timers, workers[w].tick);
+        pcc_histogram_init(&workers[w].histogram);
+        pcc_slab_init(&workers[w].connection_slab, sizeof(struct connection));
+        // room for a whole struct pcc_delta, one more than the counts
+        pcc_slab_init(&workers[w].count_slab, sizeof(struct pcc_delta));
+        pcc_slab_init(&workers[w].decoder_slab, sizeof(struct pcc_lz4_decoder));
+        pcc_slab_init(&workers[w].class_slab, sizeof(struct request_class));
+        pcc_slab_init(&workers[w].ring_slab, sizeof(struct pcc_shm_ring));
     }
 
-    if (0 != listen(server_fd, LISTEN_QUEUE_SIZE)) {
-        perror("listen failed");
-        goto cleanup;
+    int numa_nodes = pcc_numa_node_count();
+    for (unsigned int w = 0; w < config->workers; w++) {
+        place_worker(config, &workers[w], numa_nodes);
+        workers[w].server_fd = create_server_socket(config);
+        if (workers[w].server_fd == -1) {
+            goto cleanup;
+        }
+
+        if (GENERAL_ERROR == init_worker_engine(config, &workers[w])) {
+            goto cleanup;
+        }
+    }
+
+    if (config->state_file_path != NULL) {
+        if (pcc_state_open(&checkpointer.state, config->state_file_path, config->workers) == -1) {
+            fprintf(stderr, "Can not open state file %s: %s\n", config->state_file_path,
+                    errno == EWOULDBLOCK ? "in use by another server" : strerror(errno));
+            goto cleanup;
+        }
+        checkpointer.workers = workers;
+        checkpointer.workers_count = config->workers;
+        checkpointer.interval = config->checkpoint_interval;
+        recover_pcc_shards(&checkpointer);
+        checkpointer.has_upstream = pcc_state_read_upstream(&checkpointer.state, &checkpointer.upstream);
+        if (checkpointer.checkpointed_clients > 0) {
+            fprintf(stderr, "Recovered %" PRIu64 " client(s) from %s\n", checkpointer.checkpointed_clients,
+                    config->state_file_path);
+        }
+    }
+
+    if (config->has_upstream) {
+        pusher.addr = config->upstream_addr;
+        pusher.workers = workers;
+        pusher.workers_count = config->workers;
+        pusher.interval = config->push_interval;
+        if (checkpointer.has_upstream) {
+            resume_upstream(&pusher, &checkpointer.upstream);
+        } else {
+            // no pushes kept in a state file: the shards start empty, or with what was served before
+            // this server was a leaf, which is not the parent's to add
+            merge_pcc_shards(workers, config->workers, pusher.pushed, &pusher.pushed_clients);
+            if (getrandom(&pusher.leaf_id, sizeof(pusher.leaf_id), 0) != sizeof(pusher.leaf_id)) {
+                perror("getrandom failed");
+                goto cleanup;
+            }
+        }
+        if (checkpointer.state.fd != -1) {
+            checkpointer.pusher = &pusher;
+        }
+    }
+
+    if (config->stats_socket_path != NULL) {
+        stats.fd = create_stats_socket(config->stats_socket_path);
+        if (stats.fd == -1) {
+            goto cleanup;
+        }
+        stats.workers = workers;
+        stats.workers_count = config->workers;
     }
 
     if (0 != sigaction(SIGINT, &act, NULL)) {
@@ -164,39 +2499,439 @@ int run_server(uint16_t port) {
         goto cleanup;
     }
 
-    while (!sigint_received) {
-        if (GENERAL_ERROR == handle_new_client(server_fd)) {
+#ifndef PCC_NO_TELEMETRY
+    telemetry_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (telemetry_fd == -1) {
+        perror("eventfd failed");
+        goto cleanup;
+    }
+    reporter.workers = workers;
+    reporter.workers_count = config->workers;
+    reporter.interval = config->telemetry_interval;
+    reporter.started = pcc_clock_sample();
+    reporter.last_report = reporter.started;
+    if (0 != sigaction(SIGUSR1, &usr1_act, NULL)) {
+        perror("sigaction failed");
+        goto cleanup;
+    }
+#endif
+
+    // workers inherit blocked SIGINT and SIGUSR1, so only the main thread ever runs the handlers
+    sigemptyset(&sigint_mask);
+    sigaddset(&sigint_mask, SIGINT);
+    sigaddset(&sigint_mask, SIGUSR1);
+    if (0 != pthread_sigmask(SIG_BLOCK, &sigint_mask, NULL)) {
+        perror("pthread_sigmask failed");
+        goto cleanup;
+    }
+
+    for (; workers_started < config->workers; workers_started++) {
+        int error = start_worker(&workers[workers_started]);
+        if (error != 0) {
+            errno = error;
+            perror("pthread_create failed");
+            request_shutdown();
+            break;
+        }
+    }
+
+    if (stats.fd != -1) {
+        int error = pthread_create(&stats.thread, NULL, stats_main, &stats);
+        if (error != 0) {
+            errno = error;
+            perror("pthread_create failed");
+            request_shutdown();
+        } else {
+            stats_started = true;
+        }
+    }
+
+    if (checkpointer.state.fd != -1) {
+        int error = pthread_create(&checkpointer.thread, NULL, checkpoint_main, &checkpointer);
+        if (error != 0) {
+            errno = error;
+            perror("pthread_create failed");
+            request_shutdown();
+        } else {
+            checkpointer_started = true;
+        }
+    }
+
+    if (config->has_upstream) {
+        int error = pthread_create(&pusher.thread, NULL, upstream_main, &pusher);
+        if (error != 0) {
+            errno = error;
+            perror("pthread_create failed");
+            request_shutdown();
+        } else {
+            pusher_started = true;
+        }
+    }
+
+#ifndef PCC_NO_TELEMETRY
+    int reporter_error = pthread_create(&reporter.thread, NULL, telemetry_main, &reporter);
+    if (reporter_error != 0) {
+        errno = reporter_error;
+        perror("pthread_create failed");
+        request_shutdown();
+    } else {
+        reporter_started = true;
+    }
+#endif
+
+    if (0 != pthread_sigmask(SIG_UNBLOCK, &sigint_mask, NULL)) {
+        perror("pthread_sigmask failed");
+        request_shutdown();
+    }
+
+    for (unsigned int w = 0; w < workers_started; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    if (stats_started) {
+        pthread_join(stats.thread, NULL);
+    }
+    if (checkpointer_started) {
+        pthread_join(checkpointer.thread, NULL);
+    }
+    if (pusher_started) {
+        pthread_join(pusher.thread, NULL);
+        // the drain: once this returns the parent holds everything this leaf served
+        push_upstream(&pusher);
+    }
+    if (checkpointer.state.fd != -1) {
+        // everything the workers served and the drain pushed, the next start picks up exactly here
+        checkpoint_pcc_shards(&checkpointer);
+    }
+#ifndef PCC_NO_TELEMETRY
+    if (reporter_started) {
+        pthread_join(reporter.thread, NULL);
+    }
+    if (!reporter_started) {
+        goto cleanup;
+    }
+#endif
+    if (workers_started < config->workers || (stats.fd != -1 && !stats_started) ||
+        (checkpointer.state.fd != -1 && !checkpointer_started) || (config->has_upstream && !pusher_started)) {
+        goto cleanup;
+    }
+    for (unsigned int w = 0; w < config->workers; w++) {
+        if (workers[w].return_code == GENERAL_ERROR) {
             goto cleanup;
         }
     }
 
-    print_pcc_statistics();
+    merge_pcc_shards(workers, config->workers, pcc_total, &clients_count);
+    print_pcc_statistics(stdout, pcc_total);
     printf("Served %u client(s) successfully\n", clients_count);
 
     return_code = GENERAL_SUCCESS;
 cleanup:
-    if (server_fd != -1) {
-        close(server_fd);
+    if (stats.fd != -1) {
+        close(stats.fd);
+        unlink(config->stats_socket_path);
+    }
+    if (unix_fd != -1) {
+        close(unix_fd);
+        unlink(config->unix_socket_path);
+    }
+    pcc_state_close(&checkpointer.state);
+    free(ledger.leaves);
+    if (pusher.fd != -1) {
+        close(pusher.fd);
+    }
+    if (workers != NULL) {
+        for (unsigned int w = 0; w < config->workers; w++) {
+            if (workers[w].server_fd != -1) {
+                close(workers[w].server_fd);
+            }
+            if (workers[w].epoll_fd != -1) {
+                close(workers[w].epoll_fd);
+            }
+            if (workers[w].uring.fd != -1) {
+                pcc_uring_destroy(&workers[w].uring);
+            }
+            pcc_buffer_unmap(workers[w].receive_buffer, workers[w].receive_buffer_size);
+            pcc_slab_destroy(&workers[w].connection_slab);
+            pcc_slab_destroy(&workers[w].count_slab);
+            pcc_slab_destroy(&workers[w].decoder_slab);
+            pcc_slab_destroy(&workers[w].class_slab);
+            pcc_slab_destroy(&workers[w].ring_slab);
+        }
+        free(workers);
+    }
+    if (shutdown_fd != -1) {
+        close(shutdown_fd);
+        shutdown_fd = -1;
+    }
+    if (telemetry_fd != -1) {
+        close(telemetry_fd);
+        telemetry_fd = -1;
     }
 
     return return_code;
 }
 
+// IP:PORT, an IPv4 address
+int parse_upstream(const char *arg, struct sockaddr_in *addr) {
+    char ip[INET_ADDRSTRLEN];
+    unsigned short port = 0;
+    const char *colon = strrchr(arg, ':');
+
+    if (colon == NULL || (size_t)(colon - arg) >= sizeof(ip) || sscanf(colon + 1, "%hu", &port) != 1 || port == 0) {
+        return GENERAL_ERROR;
+    }
+    memcpy(ip, arg, colon - arg);
+    ip[colon - arg] = '\0';
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? GENERAL_SUCCESS : GENERAL_ERROR;
+}
+
+// a comma separated list of IPv4 addresses, the leaves of an aggregator
+int parse_leaves(const char *arg, struct server_config *config) {
+    char ip[INET_ADDRSTRLEN];
+    const char *p = arg;
+
+    config->leaves_count = 0;
+    while (true) {
+        size_t length = strcspn(p, ",");
+        if (length == 0 || length >= sizeof(ip) || config->leaves_count == MAX_LEAF_ADDRESSES) {
+            return GENERAL_ERROR;
+        }
+        memcpy(ip, p, length);
+        ip[length] = '\0';
+        if (inet_pton(AF_INET, ip, &config->leaves[config->leaves_count++]) != 1) {
+            return GENERAL_ERROR;
+        }
+        if (p[length] == '\0') {
+            return GENERAL_SUCCESS;
+        }
+        p += length + 1;
+    }
+}
+
+void print_usage(const char *program) {
+#ifndef PCC_NO_TELEMETRY
+    fprintf(stderr, "Usage: %s [--workers N] [--io-uring] [--stats-socket PATH] [--telemetry-interval SECONDS]\n",
+            program);
+#else
+    fprintf(stderr, "Usage: %s [--workers N] [--io-uring] [--stats-socket PATH]\n", program);
+#endif
+    fprintf(stderr, "          [--backlog N] [--defer-accept SECONDS] [--fast-open QUEUE] [--unix-socket PATH]\n");
+    fprintf(stderr, "          [--state-file PATH] [--checkpoint-interval MS] [--upstream IP:PORT] [--push-interval MS]\n");
+    fprintf(stderr, "          [--aggregator IP[,IP...]]\n");
+    fprintf(stderr, "          [--header-timeout SECONDS] [--idle-timeout SECONDS] [--total-timeout SECONDS]\n");
+    fprintf(stderr, "          [--cpus LIST] [--huge-pages off|thp|explicit] [--shm-max-ring MB] <port>\n");
+    fprintf(stderr, "--backlog defaults to %d, --defer-accept to %d (0 turns it off), TCP Fast Open is off by default.\n",
+            DEFAULT_LISTEN_QUEUE_SIZE, DEFAULT_DEFER_ACCEPT_SECONDS);
+    fprintf(stderr, "--unix-socket also listens on PATH, where clients on this host may send through shared memory\n"
+                    "rings of up to --shm-max-ring MB (default %d).\n",
+            DEFAULT_SHM_MAX_RING_MB);
+    fprintf(stderr, "--state-file keeps the statistics in PATH across restarts and crashes, checkpointed every\n"
+                    "--checkpoint-interval MS (default %d).\n",
+            DEFAULT_CHECKPOINT_INTERVAL_MS);
+    fprintf(stderr, "--upstream pushes what this server served to the pcc_server at IP:PORT, batched every\n"
+                    "--push-interval MS (default %d) and once more on shutdown. Only a server started with\n"
+                    "--aggregator takes such pushes, from the leaves at the listed addresses.\n",
+            DEFAULT_PUSH_INTERVAL_MS);
+    fprintf(stderr, "A request must send its header within %d s and finish within %d s (0 for no limit), and a connection\n"
+                    "may go %d s without sending or receiving anything. 0 turns a deadline off.\n",
+            DEFAULT_HEADER_TIMEOUT_SECONDS, DEFAULT_TOTAL_TIMEOUT_SECONDS, DEFAULT_IDLE_TIMEOUT_SECONDS);
+    fprintf(stderr, "--cpus pins worker N to the Nth CPU of LIST (like 0-3,8), round robin, with its memory on that\n"
+                    "CPU's NUMA node. --huge-pages backs the receive buffers with transparent or explicit huge pages.\n");
+#ifndef PCC_NO_TELEMETRY
+    fprintf(stderr, "Telemetry is reported to stderr as JSON on SIGUSR1, and every SECONDS if given.\n");
+#endif
+}
+
 int main(int argc, char *argv[]) {
     int return_code = GENERAL_ERROR;
-    uint16_t port = 0;
+    struct server_config config = {
+        .port = 0,
+        .workers = 1,
+        .backlog = DEFAULT_LISTEN_QUEUE_SIZE,
+        .shm_max_ring = DEFAULT_SHM_MAX_RING_MB,
+        .defer_accept = DEFAULT_DEFER_ACCEPT_SECONDS,
+        .header_timeout = DEFAULT_HEADER_TIMEOUT_SECONDS,
+        .idle_timeout = DEFAULT_IDLE_TIMEOUT_SECONDS,
+        .total_timeout = DEFAULT_TOTAL_TIMEOUT_SECONDS,
+        .checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL_MS,
+        .push_interval = DEFAULT_PUSH_INTERVAL_MS,
+    };
+    static const struct option long_options[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"io-uring", no_argument, NULL, 'u'},
+        {"stats-socket", required_argument, NULL, 's'},
+#ifndef PCC_NO_TELEMETRY
+        {"telemetry-interval", required_argument, NULL, 't'},
+#endif
+        {"backlog", required_argument, NULL, 'b'},
+        {"defer-accept", required_argument, NULL, 'd'},
+        {"fast-open", required_argument, NULL, 'f'},
+        {"unix-socket", required_argument, NULL, 'U'},
+        {"state-file", required_argument, NULL, 'S'},
+        {"checkpoint-interval", required_argument, NULL, 'C'},
+        {"upstream", required_argument, NULL, 'P'},
+        {"push-interval", required_argument, NULL, 'i'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"idle-timeout", required_argument, NULL, 'I'},
+        {"total-timeout", required_argument, NULL, 'T'},
+        {"cpus", required_argument, NULL, 'c'},
+        {"huge-pages", required_argument, NULL, 'g'},
+        {"shm-max-ring", required_argument, NULL, 'R'},
+        {"aggregator", required_argument, NULL, 'A'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt = 0;
+
+    while ((opt = getopt_long(argc, argv, "w:us:t:b:d:f:U:S:C:P:i:H:I:T:c:g:R:A:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'w':
+            if (sscanf(optarg, "%u", &config.workers) != 1 || config.workers == 0 || config.workers > MAX_WORKERS) {
+                fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'u':
+            config.io_uring = true;
+            break;
+        case 's':
+            config.stats_socket_path = optarg;
+            break;
+#ifndef PCC_NO_TELEMETRY
+        case 't':
+            if (sscanf(optarg, "%u", &config.telemetry_interval) != 1 || config.telemetry_interval > INT32_MAX / 1000) {
+                fprintf(stderr, "Invalid telemetry interval: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+#endif
+        case 'b':
+            if (sscanf(optarg, "%d", &config.backlog) != 1 || config.backlog <= 0) {
+                fprintf(stderr, "Invalid backlog: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'd':
+            if (sscanf(optarg, "%u", &config.defer_accept) != 1 || config.defer_accept > INT32_MAX) {
+                fprintf(stderr, "Invalid defer accept timeout: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'f':
+            if (sscanf(optarg, "%u", &config.fast_open) != 1 || config.fast_open > INT32_MAX) {
+                fprintf(stderr, "Invalid fast open queue length: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'U':
+            config.unix_socket_path = optarg;
+            break;
+        case 'S':
+            config.state_file_path = optarg;
+            break;
+        case 'A':
+            if (GENERAL_ERROR == parse_leaves(optarg, &config)) {
+                fprintf(stderr, "Invalid leaf addresses: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'R':
+            if (sscanf(optarg, "%u", &config.shm_max_ring) != 1 || config.shm_max_ring == 0 ||
+                (uint64_t)config.shm_max_ring * 1024 * 1024 > PCC_SHM_MAX_CAPACITY) {
+                fprintf(stderr, "Invalid shared memory ring size: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'C':
+            if (sscanf(optarg, "%u", &config.checkpoint_interval) != 1 || config.checkpoint_interval == 0 ||
+                config.checkpoint_interval > INT32_MAX) {
+                fprintf(stderr, "Invalid checkpoint interval: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'P':
+            if (GENERAL_ERROR == parse_upstream(optarg, &config.upstream_addr)) {
+                fprintf(stderr, "Invalid upstream, expected IP:PORT: %s\n", optarg);
+                goto cleanup;
+            }
+            config.has_upstream = true;
+            break;
+        case 'i':
+            if (sscanf(optarg, "%u", &config.push_interval) != 1 || config.push_interval == 0 ||
+                config.push_interval > INT32_MAX) {
+                fprintf(stderr, "Invalid push interval: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        case 'H':
+        case 'I':
+        case 'T': {
+            unsigned int *timeout = opt == 'H' ? &config.header_timeout
+                                    : opt == 'I' ? &config.idle_timeout
+                                                 : &config.total_timeout;
+            if (sscanf(optarg, "%u", timeout) != 1) {
+                fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        }
+        case 'c':
+            if (pcc_cpu_list_parse(optarg, &config.cpus) == -1 || CPU_COUNT(&config.cpus) == 0) {
+                fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                goto cleanup;
+            }
+            config.has_cpus = true;
+            break;
+        case 'g':
+            config.huge_pages = PCC_HUGE_PAGES_OFF;
+            while (config.huge_pages <= PCC_HUGE_PAGES_EXPLICIT &&
+                   strcmp(optarg, pcc_huge_pages_names[config.huge_pages]) != 0) {
+                config.huge_pages++;
+            }
+            if (config.huge_pages > PCC_HUGE_PAGES_EXPLICIT) {
+                fprintf(stderr, "Invalid huge pages: %s\n", optarg);
+                goto cleanup;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            goto cleanup;
+        }
+    }
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    if (argc - optind != 1) {
+        print_usage(argv[0]);
         goto cleanup;
     }
 
-    if (sscanf(argv[1], "%hu", &port) != 1) {
-        fprintf(stderr, "Invalid port number: %s\n", argv[1]);
+    if (sscanf(argv[optind], "%hu", &config.port) != 1) {
+        fprintf(stderr, "Invalid port number: %s\n", argv[optind]);
         goto cleanup;
     }
 
-    if (GENERAL_ERROR == run_server(port)) {
+    if (config.io_uring && !is_uring_supported()) {
+        fprintf(stderr, "io_uring is not available (%s), falling back to epoll\n", strerror(errno));
+        config.io_uring = false;
+    }
+
+    if (config.has_cpus) {
+        // a worker pinned to a CPU the process may not run on would fail to start, so tell which
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+            perror("sched_getaffinity failed");
+            goto cleanup;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &config.cpus) && !CPU_ISSET(cpu, &allowed)) {
+                fprintf(stderr, "CPU %d is not available to this process\n", cpu);
+                goto cleanup;
+            }
+        }
+    }
+
+    if (GENERAL_ERROR == run_server(&config)) {
         goto cleanup;
     }
 
@@ -204,4 +2939,4 @@ int main(int argc, char *argv[]) {
 
 cleanup:
     return return_code;
-}
\ No newline at end of file
+}
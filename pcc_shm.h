@@ -0,0 +1,267 @@
+#ifndef PCC_SHM_H
+#define PCC_SHM_H
+
+/*
+ * Shared memory ring for PCC_V2_FLAG_SHM requests, between a client and a server on one host.
+ *
+ * The client creates a memfd, seals its size and maps it: a page holding struct
+ * pcc_shm_ring_header, then the data area. It passes the fd over the Unix socket (SCM_RIGHTS) and
+ * from then on writes each chunk into the data area where the previous one ended, wrapping around
+ * at its end, and only sends the chunk's length over the socket. The server counts the chunk in
+ * place and publishes how far it got, the client only overwrites data behind that. So the body
+ * is copied once, into the ring, and never goes through a socket buffer.
+ *
+ * The ring is handed over once per connection, with its first PCC_V2_FLAG_SHM request, and stays
+ * mapped on both sides until the connection closes; every request's chunks start at the
+ * beginning of the ring again.
+ *
+ * The seal matters: a client that could shrink the memfd under the server's mapping would make
+ * the server's reads fault, so the server refuses rings without F_SEAL_SHRINK. Nor does it take
+ * the client's word that the pages exist: the ring is faulted in as chunks are counted, only the
+ * header page is writable, and the server caps the size it maps.
+ *
+ * Both sides need _GNU_SOURCE (memfd_create, the F_SEAL_* constants) before any include.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define PCC_SHM_HEADER_SIZE (4096)  // the data area starts on its own page
+#define PCC_SHM_MIN_CAPACITY (4096)
+#define PCC_SHM_MAX_CAPACITY (1ULL << 30)  // what the server may be configured to take at most
+// how long the client sleeps on the ring before checking that the server is still there
+#define PCC_SHM_WAIT_SLICE_MS (100)
+
+struct pcc_shm_ring_header {
+    uint64_t consumed;  // bytes of the current request the server counted, only the server writes it
+    uint32_t sequence;  // bumped with every update of consumed, the futex the client sleeps on
+    uint32_t waiting;   // nonzero while the client sleeps, so the server only makes the syscall then
+};
+
+struct pcc_shm_ring {
+    int fd;  // the memfd, the server closes it once mapped
+    struct pcc_shm_ring_header *header;
+    unsigned char *data;
+    size_t capacity;  // of the data area
+    size_t mapping_size;
+    uint64_t position;  // where the next chunk starts, counted from the start of the current request
+    bool handed_over;   // client side: the server has the ring, later requests on the connection reuse it
+};
+
+static inline long pcc_futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout) {
+    // not FUTEX_PRIVATE_FLAG, the waiter and the waker are different processes
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+// client side: returns 0, or -1 with errno set
+static inline int pcc_shm_ring_create(struct pcc_shm_ring *ring, size_t capacity) {
+    int saved_errno = 0;
+
+    ring->header = MAP_FAILED;
+    ring->mapping_size = PCC_SHM_HEADER_SIZE + capacity;
+    ring->capacity = capacity;
+    ring->handed_over = false;
+    ring->fd = memfd_create("pcc_shm_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ring->fd == -1) {
+        return -1;
+    }
+
+    if (ftruncate(ring->fd, ring->mapping_size) == -1 ||
+        fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+        goto error;
+    }
+    ring->header = mmap(NULL, ring->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (ring->header == MAP_FAILED) {
+        goto error;
+    }
+    ring->data = (unsigned char *)ring->header + PCC_SHM_HEADER_SIZE;
+    return 0;
+error:
+    saved_errno = errno;
+    close(ring->fd);
+    ring->fd = -1;
+    errno = saved_errno;
+    return -1;
+}
+
+/*
+ * Server side: maps a ring received from a client and takes over the fd, which is closed either
+ * way. The data area is read only, and nothing is populated up front: a sparse memfd costs the
+ * server only the pages of the chunks it is sent. Returns 0, or -1 with errno set, EINVAL for a
+ * ring that is unsealed or whose data area is not within [PCC_SHM_MIN_CAPACITY, max_capacity].
+ */
+static inline int pcc_shm_ring_map(struct pcc_shm_ring *ring, int fd, uint64_t max_capacity) {
+    struct stat ring_stat = {0};
+    int seals = fcntl(fd, F_GET_SEALS);
+
+    ring->fd = -1;
+    ring->header = MAP_FAILED;
+    if (seals == -1 || fstat(fd, &ring_stat) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (!(seals & F_SEAL_SHRINK) || ring_stat.st_size < PCC_SHM_HEADER_SIZE + PCC_SHM_MIN_CAPACITY ||
+        (uint64_t)ring_stat.st_size > PCC_SHM_HEADER_SIZE + max_capacity) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    ring->mapping_size = ring_stat.st_size;
+    ring->capacity = ring->mapping_size - PCC_SHM_HEADER_SIZE;
+    ring->header = mmap(NULL, ring->mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring->header == MAP_FAILED) {
+        return -1;
+    }
+    // the server only ever writes how far it got
+    if (mprotect(ring->header, PCC_SHM_HEADER_SIZE, PROT_READ | PROT_WRITE) == -1) {
+        int saved_errno = errno;
+        munmap(ring->header, ring->mapping_size);
+        ring->header = MAP_FAILED;
+        errno = saved_errno;
+        return -1;
+    }
+    ring->data = (unsigned char *)ring->header + PCC_SHM_HEADER_SIZE;
+    return 0;
+}
+
+static inline void pcc_shm_ring_unmap(struct pcc_shm_ring *ring) {
+    if (ring->header != MAP_FAILED) {
+        munmap(ring->header, ring->mapping_size);
+        ring->header = MAP_FAILED;
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+// copies len bytes to the ring at the request position, wrapping around, len is at most the capacity
+static inline void pcc_shm_ring_write(struct pcc_shm_ring *ring, uint64_t position, const void *data, size_t len) {
+    size_t start = position % ring->capacity;
+    size_t first = ring->capacity - start < len ? ring->capacity - start : len;
+    memcpy(ring->data + start, data, first);
+    memcpy(ring->data, (const char *)data + first, len - first);
+}
+
+// server side: everything before consumed may be overwritten
+static inline void pcc_shm_publish(struct pcc_shm_ring *ring, uint64_t consumed) {
+    struct pcc_shm_ring_header *header = ring->header;
+    __atomic_store_n(&header->consumed, consumed, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->sequence, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->waiting, __ATOMIC_SEQ_CST) != 0) {
+        pcc_futex(&header->sequence, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+/*
+ * Client side: waits until the server consumed at least `consumed` bytes of the request. Between
+ * sleeps the socket is checked, so a server that dropped the request does not leave the client
+ * hanging. Returns 0, or -1 with errno set (ECONNRESET if the server went away).
+ */
+static inline int pcc_shm_wait(struct pcc_shm_ring *ring, int sock_fd, uint64_t consumed) {
+    struct pcc_shm_ring_header *header = ring->header;
+    const struct timespec slice = {.tv_sec = 0, .tv_nsec = PCC_SHM_WAIT_SLICE_MS * 1000000L};
+
+    while (__atomic_load_n(&header->consumed, __ATOMIC_ACQUIRE) < consumed) {
+        // announced before the last check, so the server either sees it or the check sees its update
+        __atomic_store_n(&header->waiting, 1, __ATOMIC_SEQ_CST);
+        uint32_t sequence = __atomic_load_n(&header->sequence, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->consumed, __ATOMIC_ACQUIRE) >= consumed) {
+            break;
+        }
+        if (pcc_futex(&header->sequence, FUTEX_WAIT, sequence, &slice) == -1 && errno == ETIMEDOUT) {
+            struct pollfd pfd = {.fd = sock_fd, .events = POLLRDHUP};
+            if (poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+                __atomic_store_n(&header->waiting, 0, __ATOMIC_RELAXED);
+                errno = ECONNRESET;
+                return -1;
+            }
+        }
+    }
+    __atomic_store_n(&header->waiting, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// client side, once the request's last chunk was consumed: the next request starts at 0 again
+static inline void pcc_shm_ring_reset(struct pcc_shm_ring *ring) {
+    __atomic_store_n(&ring->header->consumed, 0, __ATOMIC_RELAXED);
+}
+
+// sends one byte carrying the fd, returns 0 or -1 with errno set
+static inline int pcc_shm_send_fd(int sock_fd, int fd) {
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control = {0};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while (sendmsg(sock_fd, &msg, MSG_NOSIGNAL) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads the byte pcc_shm_send_fd sent, without blocking. Returns 1 with the fd in *fd, 0 if the
+ * byte did not arrive yet, or -1 with errno set: EPROTO if it came without an fd, ECONNRESET on EOF.
+ */
+static inline int pcc_shm_recv_fd(int sock_fd, int *fd) {
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control = {0};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+
+    ssize_t received = recvmsg(sock_fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (received == -1) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    if (received == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len < CMSG_LEN(sizeof(int))) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    if (msg.msg_flags & MSG_CTRUNC) {
+        // more than one fd, the kernel closed the ones that did not fit
+        close(*fd);
+        errno = EPROTO;
+        return -1;
+    }
+    return 1;
+}
+
+#endif // PCC_SHM_H
@@ -0,0 +1,88 @@
+#ifndef PCC_SLAB_H
+#define PCC_SLAB_H
+
+/*
+ * Fixed size object allocator.
+ *
+ * Objects are carved out of blocks of PCC_SLAB_BLOCK_SIZE bytes and freed objects go on a free
+ * list threaded through themselves, so allocating and freeing are a couple of pointer moves with
+ * no per-object header and no rounding up to malloc's size classes. Blocks are only given back
+ * by pcc_slab_destroy, a slab settles at the peak amount of objects it ever held.
+ *
+ * A slab is owned by a single thread, nothing here is thread safe.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#define PCC_SLAB_BLOCK_SIZE (64 * 1024)
+
+struct pcc_slab_block {
+    struct pcc_slab_block *next;
+    _Alignas(max_align_t) char objects[];
+};
+
+struct pcc_slab {
+    size_t object_size;
+    size_t objects_per_block;
+    void *free_list;
+    struct pcc_slab_block *blocks;
+    size_t in_use;
+};
+
+static inline void pcc_slab_init(struct pcc_slab *slab, size_t object_size) {
+    // every object has to hold the free list link, and stay aligned for whatever it contains
+    size_t alignment = _Alignof(max_align_t);
+    if (object_size < sizeof(void *)) {
+        object_size = sizeof(void *);
+    }
+    slab->object_size = (object_size + alignment - 1) / alignment * alignment;
+    slab->objects_per_block = (PCC_SLAB_BLOCK_SIZE - sizeof(struct pcc_slab_block)) / slab->object_size;
+    if (slab->objects_per_block == 0) {
+        slab->objects_per_block = 1;
+    }
+    slab->free_list = NULL;
+    slab->blocks = NULL;
+    slab->in_use = 0;
+}
+
+// returns NULL if a new block was needed and could not be allocated, the object is not cleared
+static inline void *pcc_slab_alloc(struct pcc_slab *slab) {
+    if (slab->free_list == NULL) {
+        struct pcc_slab_block *block = malloc(sizeof(*block) + slab->objects_per_block * slab->object_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = slab->blocks;
+        slab->blocks = block;
+        // pushed in reverse, so objects are handed out in address order
+        for (size_t i = slab->objects_per_block; i > 0; i--) {
+            void *object = block->objects + (i - 1) * slab->object_size;
+            *(void **)object = slab->free_list;
+            slab->free_list = object;
+        }
+    }
+
+    void *object = slab->free_list;
+    slab->free_list = *(void **)object;
+    slab->in_use++;
+    return object;
+}
+
+static inline void pcc_slab_free(struct pcc_slab *slab, void *object) {
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+}
+
+static inline void pcc_slab_destroy(struct pcc_slab *slab) {
+    while (slab->blocks != NULL) {
+        struct pcc_slab_block *next = slab->blocks->next;
+        free(slab->blocks);
+        slab->blocks = next;
+    }
+    slab->free_list = NULL;
+    slab->in_use = 0;
+}
+
+#endif // PCC_SLAB_H
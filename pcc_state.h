@@ -0,0 +1,247 @@
+#ifndef PCC_STATE_H
+#define PCC_STATE_H
+
+/*
+ * Memory-mapped state file that keeps the server's statistics across crashes.
+ *
+ * A header page, then a slot per worker. Each slot holds two copies of that worker's totals and
+ * a checkpoint only ever writes the copy the last completed checkpoint did not use: every slot
+ * gets its generation % 2 copy, those pages are msync'ed, and only then the header's generation
+ * moves on, which is again synced. A crash at any point leaves the header naming a generation
+ * whose copies are all on disk, so reopening the file finds the last consistent totals without
+ * reading more than it maps. Slots added after a checkpoint (the server restarted with more
+ * workers) carry an older generation and count as empty.
+ *
+ * A leaf's place in its parent's ledger rides in the header page after the header, two copies of
+ * it checkpointed the same way, so the totals and what of them the parent holds always match.
+ *
+ * Checkpoints are taken by one thread at a time, the file is locked so only one process uses it.
+ * Under -std=c11 this needs _DEFAULT_SOURCE or _GNU_SOURCE (flock, ftruncate, pread).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcc_count.h"
+
+#define PCC_STATE_MAGIC (0x4554415453434350ULL)  // "PCCSTATE"
+#define PCC_STATE_VERSION (1)
+#define PCC_STATE_HEADER_SIZE (4096)  // the slots start on their own page, so they are synced apart from it
+#define PCC_STATE_MAX_SLOTS (1 << 16)
+
+struct pcc_state_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t counts;  // AMOUNT_OF_PRINTABLE_CHARS, a file from a build counting other classes is refused
+    uint32_t slot_count;
+    uint32_t reserved;
+    uint64_t generation;  // of the last completed checkpoint, 0 before the first
+};
+
+struct pcc_state_copy {
+    uint64_t generation;  // of the checkpoint that wrote it
+    uint64_t clients_count;
+    uint64_t pcc_total[AMOUNT_OF_PRINTABLE_CHARS];
+};
+
+struct pcc_state_slot {
+    struct pcc_state_copy copies[2];
+};
+
+// a leaf's pushes: what the parent acknowledged, and the delta it may or may not have added
+struct pcc_state_upstream {
+    uint64_t leaf_id;
+    uint64_t sequence;  // of the pending delta, or of the last acknowledged one
+    uint64_t pending;   // 1 if a delta was sent without getting its reply
+    uint64_t pushed_clients;
+    uint64_t pending_clients;
+    uint64_t pushed[AMOUNT_OF_PRINTABLE_CHARS];
+    uint64_t pending_totals[AMOUNT_OF_PRINTABLE_CHARS];
+};
+
+struct pcc_state_upstream_copy {
+    uint64_t generation;  // of the checkpoint that wrote it
+    struct pcc_state_upstream upstream;
+};
+
+#define PCC_STATE_UPSTREAM_OFFSET (64)  // in the header page, a cache line after the header
+_Static_assert(sizeof(struct pcc_state_header) <= PCC_STATE_UPSTREAM_OFFSET, "the header ends before the upstream copies");
+_Static_assert(PCC_STATE_UPSTREAM_OFFSET + 2 * sizeof(struct pcc_state_upstream_copy) <= PCC_STATE_HEADER_SIZE,
+               "both upstream copies fit in the header page");
+
+struct pcc_state {
+    int fd;
+    struct pcc_state_header *header;
+    struct pcc_state_upstream_copy *upstream;  // two of them
+    struct pcc_state_slot *slots;
+    size_t mapping_size;
+};
+
+static inline size_t pcc_state_file_size(uint32_t slot_count) {
+    return PCC_STATE_HEADER_SIZE + (size_t)slot_count * sizeof(struct pcc_state_slot);
+}
+
+static inline int pcc_state_map(struct pcc_state *state, size_t size) {
+    state->header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, state->fd, 0);
+    if (state->header == MAP_FAILED) {
+        return -1;
+    }
+    state->upstream = (struct pcc_state_upstream_copy *)((char *)state->header + PCC_STATE_UPSTREAM_OFFSET);
+    state->slots = (struct pcc_state_slot *)((char *)state->header + PCC_STATE_HEADER_SIZE);
+    state->mapping_size = size;
+    return 0;
+}
+
+static inline void pcc_state_close(struct pcc_state *state) {
+    if (state->header != MAP_FAILED) {
+        munmap(state->header, state->mapping_size);
+        state->header = MAP_FAILED;
+    }
+    if (state->fd != -1) {
+        close(state->fd);  // drops the lock
+        state->fd = -1;
+    }
+}
+
+/*
+ * Opens the state file, creating it if it does not exist, with room for at least slot_count
+ * slots. An existing file keeps its slots and its last checkpoint. Returns 0, or -1 with errno
+ * set: EWOULDBLOCK if another process has it open, EINVAL if it is not a state file of this
+ * format.
+ */
+static inline int pcc_state_open(struct pcc_state *state, const char *path, uint32_t slot_count) {
+    struct stat file_stat = {0};
+    int saved_errno = 0;
+
+    state->header = MAP_FAILED;
+    state->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (state->fd == -1) {
+        return -1;
+    }
+    if (flock(state->fd, LOCK_EX | LOCK_NB) == -1 || fstat(state->fd, &file_stat) == -1) {
+        goto error;
+    }
+
+    struct pcc_state_header header = {0};
+    if (file_stat.st_size >= PCC_STATE_HEADER_SIZE && pread(state->fd, &header, sizeof(header), 0) != sizeof(header)) {
+        goto error;
+    }
+
+    if (file_stat.st_size == 0 || header.magic == 0) {
+        // new file, the magic goes in last so a crash before it leaves a file that is started over
+        if (ftruncate(state->fd, pcc_state_file_size(slot_count)) == -1 ||
+            pcc_state_map(state, pcc_state_file_size(slot_count)) == -1) {
+            goto error;
+        }
+        memset(state->header, 0, state->mapping_size);
+        state->header->version = PCC_STATE_VERSION;
+        state->header->counts = AMOUNT_OF_PRINTABLE_CHARS;
+        state->header->slot_count = slot_count;
+        state->header->generation = 0;
+        __atomic_store_n(&state->header->magic, PCC_STATE_MAGIC, __ATOMIC_RELEASE);
+        if (msync(state->header, state->mapping_size, MS_SYNC) == -1) {
+            goto error;
+        }
+        return 0;
+    }
+
+    if (file_stat.st_size < PCC_STATE_HEADER_SIZE || header.magic != PCC_STATE_MAGIC ||
+        header.version != PCC_STATE_VERSION || header.counts != AMOUNT_OF_PRINTABLE_CHARS ||
+        header.slot_count > PCC_STATE_MAX_SLOTS || (uint64_t)file_stat.st_size < pcc_state_file_size(header.slot_count)) {
+        errno = EINVAL;
+        goto error;
+    }
+
+    // more workers than last time: the new slots are zeros of generation 0, empty until written
+    uint32_t slots = header.slot_count > slot_count ? header.slot_count : slot_count;
+    if ((uint64_t)file_stat.st_size < pcc_state_file_size(slots) &&
+        (ftruncate(state->fd, pcc_state_file_size(slots)) == -1 || fsync(state->fd) == -1)) {
+        goto error;  // the new size is on disk before the header counts the slots
+    }
+    if (pcc_state_map(state, pcc_state_file_size(slots)) == -1) {
+        goto error;
+    }
+    state->header->slot_count = slots;
+    return 0;
+error:
+    saved_errno = errno;
+    pcc_state_close(state);
+    errno = saved_errno;
+    return -1;
+}
+
+// the slot as of the last completed checkpoint, zeros if it was not part of it
+static inline void pcc_state_read_slot(const struct pcc_state *state, uint32_t slot, uint64_t totals[],
+                                       uint64_t *clients) {
+    uint64_t generation = state->header->generation;
+    const struct pcc_state_copy *copy = &state->slots[slot].copies[generation % 2];
+
+    if (copy->generation != generation) {
+        memset(totals, 0, AMOUNT_OF_PRINTABLE_CHARS * sizeof(totals[0]));
+        *clients = 0;
+        return;
+    }
+    memcpy(totals, copy->pcc_total, AMOUNT_OF_PRINTABLE_CHARS * sizeof(totals[0]));
+    *clients = copy->clients_count;
+}
+
+// the leaf's pushes as of the last completed checkpoint, false if it was not part of it
+static inline bool pcc_state_read_upstream(const struct pcc_state *state, struct pcc_state_upstream *upstream) {
+    uint64_t generation = state->header->generation;
+    const struct pcc_state_upstream_copy *copy = &state->upstream[generation % 2];
+
+    if (generation == 0 || copy->generation != generation) {
+        return false;
+    }
+    *upstream = copy->upstream;
+    return true;
+}
+
+/*
+ * A checkpoint writes every slot with pcc_state_write_slot and the leaf's pushes, NULL if there
+ * are none, with pcc_state_write_upstream, then completes with pcc_state_commit.
+ */
+static inline uint64_t pcc_state_next_generation(const struct pcc_state *state) {
+    return state->header->generation + 1;
+}
+
+static inline void pcc_state_write_slot(struct pcc_state *state, uint32_t slot, uint64_t generation,
+                                        const uint64_t totals[], uint64_t clients) {
+    struct pcc_state_copy *copy = &state->slots[slot].copies[generation % 2];
+
+    memcpy(copy->pcc_total, totals, AMOUNT_OF_PRINTABLE_CHARS * sizeof(totals[0]));
+    copy->clients_count = clients;
+    copy->generation = generation;
+}
+
+static inline void pcc_state_write_upstream(struct pcc_state *state, uint64_t generation,
+                                            const struct pcc_state_upstream *upstream) {
+    struct pcc_state_upstream_copy *copy = &state->upstream[generation % 2];
+
+    if (upstream == NULL) {
+        copy->generation = 0;  // not even from an earlier try at this generation that crashed
+        return;
+    }
+    copy->upstream = *upstream;
+    copy->generation = generation;
+}
+
+// returns 0, or -1 with errno set, in which case the previous checkpoint still stands
+static inline int pcc_state_commit(struct pcc_state *state, uint64_t generation) {
+    // the header page too, for the upstream copy, its generation is still the previous one
+    if (msync(state->header, state->mapping_size, MS_SYNC) == -1) {
+        return -1;
+    }
+    // one aligned 8 byte store within a single sector, it reaches the disk whole or not at all
+    __atomic_store_n(&state->header->generation, generation, __ATOMIC_RELEASE);
+    return msync(state->header, PCC_STATE_HEADER_SIZE, MS_SYNC);
+}
+
+#endif // PCC_STATE_H
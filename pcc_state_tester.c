@@ -0,0 +1,243 @@
+#define _GNU_SOURCE  // flock, ftruncate and pread under -std=c11
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcc_state.h"
+
+#define GENERAL_ERROR (1)
+#define GENERAL_SUCCESS (0)
+
+char path[64];
+int failures = 0;
+
+// what a checkpoint of generation writes to slot, distinct for every slot and generation
+void make_totals(uint32_t slot, uint64_t generation, uint64_t totals[]) {
+    for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+        totals[i] = generation * 1000000 + slot * 1000 + i;
+    }
+}
+
+void checkpoint(struct pcc_state *state, uint32_t slots, bool commit) {
+    uint64_t totals[AMOUNT_OF_PRINTABLE_CHARS];
+    uint64_t generation = pcc_state_next_generation(state);
+
+    for (uint32_t slot = 0; slot < slots; slot++) {
+        make_totals(slot, generation, totals);
+        pcc_state_write_slot(state, slot, generation, totals, generation + slot);
+    }
+    if (commit && pcc_state_commit(state, generation) == -1) {
+        perror("pcc_state_commit failed");
+        failures++;
+    }
+}
+
+// the slot holds what checkpoint wrote in generation, or zeros for generation 0
+void expect_slot(const struct pcc_state *state, uint32_t slot, uint64_t generation, const char *test_name) {
+    uint64_t totals[AMOUNT_OF_PRINTABLE_CHARS];
+    uint64_t expected[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+    uint64_t clients = 0;
+
+    pcc_state_read_slot(state, slot, totals, &clients);
+    if (generation > 0) {
+        make_totals(slot, generation, expected);
+    }
+    if (memcmp(totals, expected, sizeof(totals)) != 0 || clients != (generation > 0 ? generation + slot : 0)) {
+        printf("FAIL: %s: slot %u does not hold generation %lu\n", test_name, slot, (unsigned long)generation);
+        failures++;
+    }
+}
+
+// what a checkpoint of generation writes as the leaf's pushes, a delta pending in odd ones
+void make_upstream(uint64_t generation, struct pcc_state_upstream *upstream) {
+    memset(upstream, 0, sizeof(*upstream));
+    upstream->leaf_id = 0xfeed;
+    upstream->sequence = generation;
+    upstream->pending = generation % 2;
+    upstream->pushed_clients = generation * 10;
+    upstream->pending_clients = upstream->pending ? generation * 10 + 1 : 0;
+    make_totals(0, generation, upstream->pushed);
+    if (upstream->pending) {
+        make_totals(1, generation, upstream->pending_totals);
+    }
+}
+
+// the leaf's pushes are what checkpoint wrote in generation, or missing for generation 0
+void expect_upstream(const struct pcc_state *state, uint64_t generation, const char *test_name) {
+    struct pcc_state_upstream upstream;
+    struct pcc_state_upstream expected;
+
+    make_upstream(generation, &expected);
+    if (generation == 0 ? pcc_state_read_upstream(state, &upstream)
+                        : !pcc_state_read_upstream(state, &upstream) || memcmp(&upstream, &expected, sizeof(upstream)) != 0) {
+        printf("FAIL: %s: the pushes are not those of generation %lu\n", test_name, (unsigned long)generation);
+        failures++;
+    }
+}
+
+bool open_state(struct pcc_state *state, uint32_t slots, const char *test_name) {
+    if (pcc_state_open(state, path, slots) == -1) {
+        printf("FAIL: %s: pcc_state_open: %s\n", test_name, strerror(errno));
+        failures++;
+        return false;
+    }
+    return true;
+}
+
+int test_checkpoints() {
+    struct pcc_state state;
+
+    // Test 1: a new file starts empty
+    unlink(path);
+    if (!open_state(&state, 2, "new file")) {
+        return GENERAL_ERROR;
+    }
+    expect_slot(&state, 0, 0, "new file");
+    expect_slot(&state, 1, 0, "new file");
+
+    // Test 2: a committed checkpoint is what the next open finds
+    checkpoint(&state, 2, true);
+    checkpoint(&state, 2, true);
+    pcc_state_close(&state);
+    if (!open_state(&state, 2, "committed")) {
+        return GENERAL_ERROR;
+    }
+    expect_slot(&state, 0, 2, "committed");
+    expect_slot(&state, 1, 2, "committed");
+
+    // Test 3: a checkpoint that crashed before its commit leaves the previous one, and so does its
+    // retry after the restart crashing halfway through the slots
+    checkpoint(&state, 2, false);
+    pcc_state_close(&state);
+    if (!open_state(&state, 2, "uncommitted")) {
+        return GENERAL_ERROR;
+    }
+    checkpoint(&state, 1, false);
+    pcc_state_close(&state);
+    if (!open_state(&state, 2, "uncommitted")) {
+        return GENERAL_ERROR;
+    }
+    expect_slot(&state, 0, 2, "uncommitted");
+    expect_slot(&state, 1, 2, "uncommitted");
+
+    // Test 4: more slots keep the old ones, the new ones are empty until the next checkpoint
+    pcc_state_close(&state);
+    if (!open_state(&state, 4, "grown")) {
+        return GENERAL_ERROR;
+    }
+    expect_slot(&state, 1, 2, "grown");
+    expect_slot(&state, 2, 0, "grown");
+    expect_slot(&state, 3, 0, "grown");
+    checkpoint(&state, 4, true);
+    pcc_state_close(&state);
+
+    // Test 5: fewer slots never shrink the file
+    if (!open_state(&state, 1, "fewer slots")) {
+        return GENERAL_ERROR;
+    }
+    if (state.header->slot_count != 4) {
+        printf("FAIL: fewer slots: the file has %u slots\n", state.header->slot_count);
+        failures++;
+    }
+    expect_slot(&state, 3, 3, "fewer slots");
+
+    // Test 6: only one process at a time, a second open of the file is refused while it is locked
+    struct pcc_state other;
+    if (pcc_state_open(&other, path, 1) != -1 || errno != EWOULDBLOCK) {
+        printf("FAIL: a state file in use was opened again\n");
+        failures++;
+        pcc_state_close(&other);
+    }
+    pcc_state_close(&state);
+    return failures == 0 ? GENERAL_SUCCESS : GENERAL_ERROR;
+}
+
+int test_upstream() {
+    struct pcc_state state;
+    struct pcc_state_upstream upstream;
+
+    // Test 7: a leaf's pushes are checkpointed with the totals, and an uncommitted checkpoint
+    // leaves the previous ones
+    unlink(path);
+    if (!open_state(&state, 1, "pushes")) {
+        return GENERAL_ERROR;
+    }
+    expect_upstream(&state, 0, "pushes");
+    for (int commit = 0; commit < 3; commit++) {
+        uint64_t generation = pcc_state_next_generation(&state);
+        checkpoint(&state, 1, false);
+        make_upstream(generation, &upstream);
+        pcc_state_write_upstream(&state, generation, &upstream);
+        if (commit < 2 && pcc_state_commit(&state, generation) == -1) {
+            perror("pcc_state_commit failed");
+            failures++;
+        }
+    }
+    pcc_state_close(&state);
+    if (!open_state(&state, 1, "pushes")) {
+        return GENERAL_ERROR;
+    }
+    expect_slot(&state, 0, 2, "pushes");
+    expect_upstream(&state, 2, "pushes");
+
+    // Test 8: a checkpoint without them, as of a server that is no leaf, has none, also when it
+    // retries a generation whose crashed try wrote them
+    checkpoint(&state, 1, false);
+    pcc_state_write_upstream(&state, pcc_state_next_generation(&state), NULL);
+    if (pcc_state_commit(&state, pcc_state_next_generation(&state)) == -1) {
+        perror("pcc_state_commit failed");
+        failures++;
+    }
+    expect_upstream(&state, 0, "no pushes");
+    pcc_state_close(&state);
+    return failures == 0 ? GENERAL_SUCCESS : GENERAL_ERROR;
+}
+
+int test_bad_files() {
+    struct pcc_state state;
+    char garbage[PCC_STATE_HEADER_SIZE];
+
+    // Test 9: something that is not a state file is left alone
+    memset(garbage, 'x', sizeof(garbage));
+    FILE *file = fopen(path, "w");
+    if (file == NULL || fwrite(garbage, 1, sizeof(garbage), file) != sizeof(garbage) || fclose(file) != 0) {
+        perror("writing the test file failed");
+        return GENERAL_ERROR;
+    }
+    if (pcc_state_open(&state, path, 1) != -1 || errno != EINVAL) {
+        printf("FAIL: a file that is not a state file was opened\n");
+        failures++;
+        pcc_state_close(&state);
+    }
+
+    // Test 10: a file whose creation crashed before the magic was written is started over
+    memset(garbage, 0, sizeof(garbage));
+    file = fopen(path, "w");
+    if (file == NULL || fwrite(garbage, 1, sizeof(garbage), file) != sizeof(garbage) || fclose(file) != 0) {
+        perror("writing the test file failed");
+        return GENERAL_ERROR;
+    }
+    if (open_state(&state, 2, "half created")) {
+        expect_slot(&state, 1, 0, "half created");
+        pcc_state_close(&state);
+    }
+    return failures == 0 ? GENERAL_SUCCESS : GENERAL_ERROR;
+}
+
+int main(int argc, char *argv[]) {
+    int return_code = GENERAL_SUCCESS;
+
+    snprintf(path, sizeof(path), "/tmp/pcc_state_tester_%d.bin", (int)getpid());
+    if (test_checkpoints() != GENERAL_SUCCESS || test_upstream() != GENERAL_SUCCESS ||
+        test_bad_files() != GENERAL_SUCCESS) {
+        return_code = GENERAL_ERROR;
+    }
+    unlink(path);
+
+    if (return_code == GENERAL_SUCCESS) {
+        printf("PASS: state file\n");
+    }
+    return return_code;
+}
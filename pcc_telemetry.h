@@ -0,0 +1,248 @@
+#ifndef PCC_TELEMETRY_H
+#define PCC_TELEMETRY_H
+
+/*
+ * Latency histograms and counters for the server's hot path.
+ *
+ * Timestamps are raw ticks (rdtsc on x86, CLOCK_MONOTONIC ns elsewhere), converted to ns only
+ * when a report is written, so a probe costs one tick read plus one bucket increment.
+ *
+ * Histograms are log-linear: values below PCC_LATENCY_SUB_BUCKETS get a bucket each, above that
+ * every power of two is split into PCC_LATENCY_SUB_BUCKETS linear buckets, which bounds the
+ * error of any reported percentile to 1 / PCC_LATENCY_SUB_BUCKETS of the value.
+ *
+ * A struct pcc_telemetry has a single writer (its worker), every update is a relaxed atomic
+ * store so another thread can read it at any time without locks. Readers may see one counter
+ * a probe ahead of another, which is fine for telemetry.
+ *
+ * Building with -DPCC_NO_TELEMETRY turns the PCC_TELEMETRY_* probes into nothing, the
+ * histogram functions stay available for tools that measure latency themselves.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PCC_TELEMETRY_TSC (1)
+#endif
+
+#define PCC_LATENCY_SUB_BUCKET_BITS (3)
+#define PCC_LATENCY_SUB_BUCKETS (1 << PCC_LATENCY_SUB_BUCKET_BITS)
+// the highest bucket index belongs to the top power of two of a 64 bit value
+#define PCC_LATENCY_BUCKETS ((64 - PCC_LATENCY_SUB_BUCKET_BITS + 1) * PCC_LATENCY_SUB_BUCKETS)
+
+typedef uint64_t pcc_ticks_t;
+
+enum pcc_phase {
+    PCC_PHASE_WAIT,    // worker blocked waiting for events
+    PCC_PHASE_ACCEPT,  // accepting one client (epoll only, io_uring accepts asynchronously)
+    PCC_PHASE_HEADER,  // connection accepted (or previous request done) until the body starts
+    PCC_PHASE_BODY,    // body start until the last byte of it was received
+    PCC_PHASE_COUNT,   // CPU time spent counting the body
+    PCC_PHASE_REPLY,   // body done until the reply was fully sent
+    PCC_PHASES_AMOUNT,
+};
+
+static const char *pcc_phase_names[PCC_PHASES_AMOUNT] = {"wait", "accept", "header", "body", "count", "reply"};
+
+enum pcc_counter {
+    PCC_COUNTER_BYTES,        // body bytes received
+    PCC_COUNTER_CONNECTIONS,  // connections accepted
+    PCC_COUNTER_REQUESTS,     // requests replied to
+    PCC_COUNTERS_AMOUNT,
+};
+
+static const char *pcc_counter_names[PCC_COUNTERS_AMOUNT] = {"bytes", "connections", "requests"};
+
+struct pcc_latency_histogram {
+    uint64_t buckets[PCC_LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t sum;  // in ticks, for the mean
+};
+
+struct pcc_telemetry {
+    struct pcc_latency_histogram phases[PCC_PHASES_AMOUNT];
+    uint64_t counters[PCC_COUNTERS_AMOUNT];
+};
+
+// timestamps of one request, turned into phase latencies once it is done
+struct pcc_request_timing {
+    pcc_ticks_t started;
+    pcc_ticks_t header_done;
+    pcc_ticks_t body_done;
+    pcc_ticks_t counting;  // accumulated, not a timestamp
+};
+
+// pairs a tick reading with CLOCK_MONOTONIC, two of them give the tick rate
+struct pcc_clock_sample {
+    pcc_ticks_t ticks;
+    uint64_t ns;
+};
+
+static inline uint64_t pcc_monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static inline pcc_ticks_t pcc_telemetry_now(void) {
+#ifdef PCC_TELEMETRY_TSC
+    return __rdtsc();
+#else
+    return pcc_monotonic_ns();
+#endif
+}
+
+static inline struct pcc_clock_sample pcc_clock_sample(void) {
+    struct pcc_clock_sample sample = {.ticks = pcc_telemetry_now(), .ns = pcc_monotonic_ns()};
+    return sample;
+}
+
+// ns per tick measured between two samples, assumes an invariant TSC like every recent x86 has
+static inline double pcc_ns_per_tick(struct pcc_clock_sample from, struct pcc_clock_sample to) {
+    if (to.ticks <= from.ticks) {
+        return 1.0;
+    }
+    return (double)(to.ns - from.ns) / (double)(to.ticks - from.ticks);
+}
+
+static inline unsigned int pcc_latency_bucket(uint64_t value) {
+    if (value < PCC_LATENCY_SUB_BUCKETS) {
+        return (unsigned int)value;
+    }
+    unsigned int msb = 63 - __builtin_clzll(value);
+    unsigned int shift = msb - PCC_LATENCY_SUB_BUCKET_BITS;
+    return ((shift + 1) << PCC_LATENCY_SUB_BUCKET_BITS) | ((value >> shift) & (PCC_LATENCY_SUB_BUCKETS - 1));
+}
+
+// the largest value that lands in the bucket
+static inline uint64_t pcc_latency_bucket_upper(unsigned int bucket) {
+    if (bucket < PCC_LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned int shift = (bucket >> PCC_LATENCY_SUB_BUCKET_BITS) - 1;
+    uint64_t lower = (uint64_t)(PCC_LATENCY_SUB_BUCKETS | (bucket & (PCC_LATENCY_SUB_BUCKETS - 1))) << shift;
+    return lower + ((1ULL << shift) - 1);
+}
+
+// single writer, see the top of the file
+static inline void pcc_latency_record(struct pcc_latency_histogram *histogram, uint64_t value) {
+    uint64_t *bucket = &histogram->buckets[pcc_latency_bucket(value)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, histogram->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, histogram->sum + value, __ATOMIC_RELAXED);
+}
+
+static inline void pcc_latency_merge(struct pcc_latency_histogram *into, const struct pcc_latency_histogram *from) {
+    for (unsigned int b = 0; b < PCC_LATENCY_BUCKETS; b++) {
+        into->buckets[b] += __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+    }
+    into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+}
+
+// the upper bound of the bucket holding the q-quantile (0 < q <= 1), 0 for an empty histogram
+static inline uint64_t pcc_latency_percentile(const struct pcc_latency_histogram *histogram, double q) {
+    uint64_t seen = 0;
+    uint64_t rank = (uint64_t)(q * (double)histogram->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (unsigned int b = 0; b < PCC_LATENCY_BUCKETS; b++) {
+        seen += histogram->buckets[b];
+        if (seen >= rank) {
+            return pcc_latency_bucket_upper(b);
+        }
+    }
+    return 0;
+}
+
+static inline void pcc_telemetry_record(struct pcc_telemetry *telemetry, enum pcc_phase phase, pcc_ticks_t ticks) {
+    pcc_latency_record(&telemetry->phases[phase], ticks);
+}
+
+static inline void pcc_telemetry_count(struct pcc_telemetry *telemetry, enum pcc_counter counter, uint64_t amount) {
+    __atomic_store_n(&telemetry->counters[counter], telemetry->counters[counter] + amount, __ATOMIC_RELAXED);
+}
+
+static inline void pcc_telemetry_merge(struct pcc_telemetry *into, const struct pcc_telemetry *from) {
+    for (int p = 0; p < PCC_PHASES_AMOUNT; p++) {
+        pcc_latency_merge(&into->phases[p], &from->phases[p]);
+    }
+    for (int c = 0; c < PCC_COUNTERS_AMOUNT; c++) {
+        into->counters[c] += __atomic_load_n(&from->counters[c], __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Writes one JSON object on a single line: counters with their rate over `interval_ns` (since
+ * `previous`, pass NULL for no rates) and per phase count, mean, p50, p99, p99.9, max and the
+ * non-empty buckets as [upper bound ns, count] pairs.
+ */
+static inline void pcc_telemetry_write_json(FILE *out, const struct pcc_telemetry *telemetry,
+                                            const struct pcc_telemetry *previous, uint64_t uptime_ns,
+                                            uint64_t interval_ns, double ns_per_tick) {
+    fprintf(out, "{\"uptime_ns\":%lu,\"interval_ns\":%lu", (unsigned long)uptime_ns, (unsigned long)interval_ns);
+    for (int c = 0; c < PCC_COUNTERS_AMOUNT; c++) {
+        fprintf(out, ",\"%s\":%lu", pcc_counter_names[c], (unsigned long)telemetry->counters[c]);
+        if (previous != NULL && interval_ns > 0) {
+            double delta = (double)(telemetry->counters[c] - previous->counters[c]);
+            fprintf(out, ",\"%s_per_sec\":%.1f", pcc_counter_names[c], delta * 1e9 / (double)interval_ns);
+        }
+    }
+
+    fprintf(out, ",\"phases\":{");
+    for (int p = 0; p < PCC_PHASES_AMOUNT; p++) {
+        const struct pcc_latency_histogram *histogram = &telemetry->phases[p];
+        uint64_t max_ticks = 0;
+        for (unsigned int b = 0; b < PCC_LATENCY_BUCKETS; b++) {
+            if (histogram->buckets[b] > 0) {
+                max_ticks = pcc_latency_bucket_upper(b);
+            }
+        }
+
+        fprintf(out, "%s\"%s\":{\"count\":%lu,\"mean_ns\":%.0f,\"p50_ns\":%.0f,\"p99_ns\":%.0f,\"p999_ns\":%.0f,"
+                     "\"max_ns\":%.0f,\"buckets\":[",
+                p == 0 ? "" : ",", pcc_phase_names[p], (unsigned long)histogram->count,
+                histogram->count > 0 ? (double)histogram->sum / (double)histogram->count * ns_per_tick : 0.0,
+                (double)pcc_latency_percentile(histogram, 0.50) * ns_per_tick,
+                (double)pcc_latency_percentile(histogram, 0.99) * ns_per_tick,
+                (double)pcc_latency_percentile(histogram, 0.999) * ns_per_tick, (double)max_ticks * ns_per_tick);
+
+        const char *separator = "";
+        for (unsigned int b = 0; b < PCC_LATENCY_BUCKETS; b++) {
+            if (histogram->buckets[b] > 0) {
+                fprintf(out, "%s[%.0f,%lu]", separator, (double)pcc_latency_bucket_upper(b) * ns_per_tick,
+                        (unsigned long)histogram->buckets[b]);
+                separator = ",";
+            }
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "}}\n");
+}
+
+#ifndef PCC_NO_TELEMETRY
+
+#define PCC_TELEMETRY_NOW() pcc_telemetry_now()
+#define PCC_TELEMETRY_MARK(timing, field) ((timing)->field = pcc_telemetry_now())
+#define PCC_TELEMETRY_SPAN(timing, field, started) ((timing)->field += pcc_telemetry_now() - (started))
+#define PCC_TELEMETRY_RECORD(telemetry, phase, started) \
+    pcc_telemetry_record((telemetry), (phase), pcc_telemetry_now() - (started))
+#define PCC_TELEMETRY_COUNT(telemetry, counter, amount) pcc_telemetry_count((telemetry), (counter), (amount))
+
+#else
+
+#define PCC_TELEMETRY_NOW() ((pcc_ticks_t)0)
+#define PCC_TELEMETRY_MARK(timing, field) ((void)0)
+#define PCC_TELEMETRY_SPAN(timing, field, started) ((void)(started))
+#define PCC_TELEMETRY_RECORD(telemetry, phase, started) ((void)(started))
+#define PCC_TELEMETRY_COUNT(telemetry, counter, amount) ((void)0)
+
+#endif // PCC_NO_TELEMETRY
+
+#endif // PCC_TELEMETRY_H
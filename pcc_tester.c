@@ -1,24 +1,41 @@
+#define _GNU_SOURCE  // memfd_create
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <time.h>
+
+#include "pcc_count.h"
+#include "pcc_protocol.h"
+#include "pcc_lz4.h"
+#include "pcc_shm.h"
 
 #define GENERAL_ERROR (1)
 #define GENERAL_SUCCESS (0)
 
 #define BUFFER_SIZE (1024)
-#define PRINTABLE_LOWER_BOUND (32)
-#define PRINTABLE_UPPER_BOUND (126)
-#define AMOUNT_OF_PRINTABLE_CHARS (PRINTABLE_UPPER_BOUND - PRINTABLE_LOWER_BOUND + 1)
-#define PRINTABLE_TO_INDEX(c) ((c) - PRINTABLE_LOWER_BOUND)
+
+// 10 single request connections, 3 pipelined, 2 compressed, 2 Unix socket and 5 byte class
+// requests per test set, every request is a client, and a delta pushed for DELTA_CLIENTS clients
+// of a leaf
+#define DELTA_CLIENTS (5)
+#define CLIENTS_PER_TEST_SET (25 + DELTA_CLIENTS)
+#define LOG_DATA_SIZE (20000)
+// 100 ms apart, the server must exit within 3 s of SIGINT
+#define SHUTDOWN_POLLS (30)
+// empty deltas each test set pushes from as many other leaves, more than the server first has room for
+#define LEDGER_FILL_LEAVES (300)
 
 uint32_t expected_totals[AMOUNT_OF_PRINTABLE_CHARS] = {0};
+char unix_socket_path[64];  // the server also listens here
 
 int is_printable(char c) {
     return (PRINTABLE_LOWER_BOUND <= c && c <= PRINTABLE_UPPER_BOUND);
@@ -67,14 +84,22 @@ int receive_count(int sock_fd, uint32_t *count) {
     return GENERAL_SUCCESS;
 }
 
-int run_test(const char *ip, uint16_t port, uint32_t N, const char *data, const char *test_name) {
-    printf("\nRunning test: %s\n", test_name);
-    uint32_t expected = count_printable(data, N);
-
+// from source_ip if it is not NULL, the server tells leaves apart by their address
+int connect_to_server_from(const char *source_ip, const char *ip, uint16_t port) {
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (sock_fd == -1) {
         perror("socket creation failed");
-        return GENERAL_ERROR;
+        return -1;
+    }
+
+    if (source_ip != NULL) {
+        struct sockaddr_in source_addr = {.sin_family = AF_INET};
+        if (inet_pton(AF_INET, source_ip, &source_addr.sin_addr) != 1 ||
+            bind(sock_fd, (struct sockaddr *)&source_addr, sizeof(source_addr)) == -1) {
+            perror("bind failed");
+            close(sock_fd);
+            return -1;
+        }
     }
 
     struct sockaddr_in serv_addr = {0};
@@ -82,13 +107,28 @@ int run_test(const char *ip, uint16_t port, uint32_t N, const char *data, const
     if (inet_pton(AF_INET, ip, &serv_addr.sin_addr) != 1) {
         perror("inet_pton failed");
         close(sock_fd);
-        return GENERAL_ERROR;
+        return -1;
     }
     serv_addr.sin_port = htons(port);
 
     if (connect(sock_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1) {
         perror("connect failed");
         close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+int connect_to_server(const char *ip, uint16_t port) {
+    return connect_to_server_from(NULL, ip, port);
+}
+
+int run_test(const char *ip, uint16_t port, uint32_t N, const char *data, const char *test_name) {
+    printf("\nRunning test: %s\n", test_name);
+    uint32_t expected = count_printable(data, N);
+
+    int sock_fd = connect_to_server(ip, port);
+    if (sock_fd == -1) {
         return GENERAL_ERROR;
     }
 
@@ -111,6 +151,679 @@ int run_test(const char *ip, uint16_t port, uint32_t N, const char *data, const
     return GENERAL_SUCCESS;
 }
 
+int send_all(int sock_fd, const void *data, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t bytes_sent = send(sock_fd, (const char *)data + sent, len - sent, 0);
+        if (bytes_sent == -1) {
+            perror("send failed");
+            return GENERAL_ERROR;
+        }
+        sent += bytes_sent;
+    }
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Three requests over one keep-alive connection, all sent before any reply is read:
+ * v2 with a length, v2 chunked (the body split over two chunks) and a v1 request, which ends
+ * the connection. Replies must come back in order.
+ */
+int run_keep_alive_test(const char *ip, uint16_t port, const char *first, uint32_t first_len, const char *second,
+                        uint32_t second_len) {
+    printf("\nRunning test: Pipelined keep-alive\n");
+    int return_code = GENERAL_ERROR;
+    uint32_t split = second_len / 2;
+
+    int sock_fd = connect_to_server(ip, port);
+    if (sock_fd == -1) {
+        return GENERAL_ERROR;
+    }
+
+    struct pcc_v2_header header = {.magic = htonl(PCC_V2_MAGIC), .version = PCC_V2_VERSION,
+                                   .flags = PCC_V2_FLAG_KEEP_ALIVE};
+    uint64_t length = pcc_hton64(first_len);
+    struct pcc_v2_header chunked_header = header;
+    chunked_header.flags |= PCC_V2_FLAG_CHUNKED;
+    uint32_t first_chunk = htonl(split);
+    uint32_t second_chunk = htonl(second_len - split);
+    uint32_t end_chunk = 0;
+
+    if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &length, sizeof(length)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, first, first_len) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &chunked_header, sizeof(chunked_header)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &first_chunk, sizeof(first_chunk)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, second, split) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &second_chunk, sizeof(second_chunk)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, second + split, second_len - split) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &end_chunk, sizeof(end_chunk)) != GENERAL_SUCCESS ||
+        send_data(sock_fd, first_len, first) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+
+    uint64_t replies[2];
+    uint32_t last_reply;
+    if (recv(sock_fd, replies, sizeof(replies), MSG_WAITALL) != sizeof(replies) ||
+        receive_count(sock_fd, &last_reply) != GENERAL_SUCCESS) {
+        perror("recv replies failed");
+        goto cleanup;
+    }
+
+    uint64_t expected[3] = {count_printable(first, first_len), count_printable(second, second_len),
+                            count_printable(first, first_len)};
+    uint64_t received[3] = {pcc_ntoh64(replies[0]), pcc_ntoh64(replies[1]), last_reply};
+    for (int i = 0; i < 3; i++) {
+        if (expected[i] != received[i]) {
+            printf("FAIL: request %d expected %lu, received %lu\n", i + 1, (unsigned long)expected[i],
+                   (unsigned long)received[i]);
+            goto cleanup;
+        }
+    }
+
+    char extra;
+    if (recv(sock_fd, &extra, sizeof(extra), 0) != 0) {
+        printf("FAIL: connection still open after the v1 request\n");
+        goto cleanup;
+    }
+
+    printf("PASS: 3 pipelined requests\n");
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    close(sock_fd);
+    return return_code;
+}
+
+// repetitive like the logs compression is meant for: runs of printable and non-printable bytes, short and long
+size_t make_log_data(char *data) {
+    size_t len = 0;
+    for (int line = 0; len + 512 < LOG_DATA_SIZE; line++) {
+        len += sprintf(data + len, "2026-10-17 12:%02d:%02d INFO worker %d served request %d", line / 60 % 60,
+                       line % 60, line % 4, line);
+        memset(data + len, line % 3 == 0 ? ' ' : '\0', line % 50);
+        len += line % 50;
+        memset(data + len, line % 7 == 0 ? '=' : '\x80', line % 7 == 0 ? 300 : 3);
+        len += line % 7 == 0 ? 300 : 3;
+        data[len++] = '\n';
+    }
+    return len;
+}
+
+/*
+ * Two PCC_V2_FLAG_LZ4 requests over one keep-alive connection: the whole data as one block, sent
+ * in 7 byte pieces so sequences split anywhere, then chunked with each half of the data as its own
+ * block. Both must count exactly like the uncompressed data. Then a block that ends right after a
+ * match, which must be dropped without a reply (and without reaching the statistics).
+ */
+int run_compressed_test(const char *ip, uint16_t port, const char *data, size_t len) {
+    printf("\nRunning test: Compressed requests\n");
+    int return_code = GENERAL_ERROR;
+    int sock_fd = -1;
+    uint32_t hash_table[PCC_LZ4_HASH_SIZE];
+    char *encoded = malloc(3 * PCC_LZ4_MAX_ENCODED_SIZE(len));
+    if (encoded == NULL) {
+        perror("malloc failed");
+        goto cleanup;
+    }
+    size_t half = len / 2;
+    size_t encoded_len = pcc_lz4_encode(data, len, encoded, hash_table);
+    char *first_block = encoded + encoded_len;
+    size_t first_len = pcc_lz4_encode(data, half, first_block, hash_table);
+    char *second_block = first_block + first_len;
+    size_t second_len = pcc_lz4_encode(data + half, len - half, second_block, hash_table);
+
+    sock_fd = connect_to_server(ip, port);
+    if (sock_fd == -1) {
+        goto cleanup;
+    }
+
+    struct pcc_v2_header header = {.magic = htonl(PCC_V2_MAGIC), .version = PCC_V2_VERSION,
+                                   .flags = PCC_V2_FLAG_LZ4 | PCC_V2_FLAG_KEEP_ALIVE};
+    uint64_t length = pcc_hton64(encoded_len);
+    struct pcc_v2_header chunked_header = {.magic = htonl(PCC_V2_MAGIC), .version = PCC_V2_VERSION,
+                                           .flags = PCC_V2_FLAG_LZ4 | PCC_V2_FLAG_CHUNKED};
+    uint32_t first_chunk = htonl(first_len);
+    uint32_t second_chunk = htonl(second_len);
+    uint32_t end_chunk = 0;
+
+    if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &length, sizeof(length)) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    for (size_t sent = 0; sent < encoded_len; sent += 7) {
+        if (send_all(sock_fd, encoded + sent, encoded_len - sent < 7 ? encoded_len - sent : 7) != GENERAL_SUCCESS) {
+            goto cleanup;
+        }
+    }
+    if (send_all(sock_fd, &chunked_header, sizeof(chunked_header)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &first_chunk, sizeof(first_chunk)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, first_block, first_len) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &second_chunk, sizeof(second_chunk)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, second_block, second_len) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &end_chunk, sizeof(end_chunk)) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+
+    uint64_t replies[2];
+    if (recv(sock_fd, replies, sizeof(replies), MSG_WAITALL) != sizeof(replies)) {
+        perror("recv replies failed");
+        goto cleanup;
+    }
+    uint64_t expected = count_printable(data, len);
+    for (int i = 0; i < 2; i++) {
+        if (pcc_ntoh64(replies[i]) != expected) {
+            printf("FAIL: compressed request %d expected %lu, received %lu\n", i + 1, (unsigned long)expected,
+                   (unsigned long)pcc_ntoh64(replies[i]));
+            goto cleanup;
+        }
+    }
+    close(sock_fd);
+
+    // one literal, then a match of 4 with offset 1 and nothing after it
+    sock_fd = connect_to_server(ip, port);
+    if (sock_fd == -1) {
+        goto cleanup;
+    }
+    header.flags = PCC_V2_FLAG_LZ4;
+    const char truncated[] = {0x10, 'a', 0x01, 0x00};
+    length = pcc_hton64(sizeof(truncated));
+    char reply;
+    if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &length, sizeof(length)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, truncated, sizeof(truncated)) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    if (recv(sock_fd, &reply, sizeof(reply), 0) > 0) {
+        printf("FAIL: a block ending after a match got a reply\n");
+        goto cleanup;
+    }
+
+    printf("PASS: %lu bytes compressed to %lu\n", (unsigned long)len, (unsigned long)encoded_len);
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    if (sock_fd != -1) {
+        close(sock_fd);
+    }
+    free(encoded);
+    return return_code;
+}
+
+int connect_to_unix_socket(void) {
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock_fd == -1) {
+        perror("socket creation failed");
+        return -1;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, unix_socket_path);
+    if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("connect failed");
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+/*
+ * Over the Unix socket: a v1 request, then a PCC_V2_FLAG_SHM request through the smallest ring
+ * there is, in chunks of uneven sizes so they wrap around its end at different offsets, one of
+ * them as big as the whole ring. A second one on the same keep-alive connection reuses the ring
+ * without handing it over again. Then an unchunked PCC_V2_FLAG_SHM request, which must be dropped.
+ */
+int run_unix_socket_test(const char *mixed, const char *data, size_t len) {
+    printf("\nRunning test: Unix socket and shared memory\n");
+    static const size_t chunk_sizes[] = {1, 1000, PCC_SHM_MIN_CAPACITY, 777, 3001};
+    int return_code = GENERAL_ERROR;
+    int sock_fd = -1;
+    struct pcc_shm_ring ring = {.fd = -1, .header = MAP_FAILED};
+    uint32_t received = 0;
+
+    sock_fd = connect_to_unix_socket();
+    if (sock_fd == -1 || send_data(sock_fd, strlen(mixed), mixed) != GENERAL_SUCCESS ||
+        receive_count(sock_fd, &received) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    if (received != count_printable(mixed, strlen(mixed))) {
+        printf("FAIL: Unix socket request expected %u, received %u\n", count_printable(mixed, strlen(mixed)), received);
+        goto cleanup;
+    }
+    close(sock_fd);
+
+    if (pcc_shm_ring_create(&ring, PCC_SHM_MIN_CAPACITY) == -1) {
+        perror("pcc_shm_ring_create failed");
+        goto cleanup;
+    }
+    sock_fd = connect_to_unix_socket();
+    if (sock_fd == -1) {
+        goto cleanup;
+    }
+    struct pcc_v2_header header = {.magic = htonl(PCC_V2_MAGIC), .version = PCC_V2_VERSION,
+                                   .flags = PCC_V2_FLAG_CHUNKED | PCC_V2_FLAG_SHM | PCC_V2_FLAG_KEEP_ALIVE};
+    if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS || pcc_shm_send_fd(sock_fd, ring.fd) == -1) {
+        goto cleanup;
+    }
+    uint64_t position = 0;
+    for (size_t i = 0; position < len; i++) {
+        size_t chunk = chunk_sizes[i % (sizeof(chunk_sizes) / sizeof(chunk_sizes[0]))];
+        if (chunk > len - position) {
+            chunk = len - position;
+        }
+        if (position + chunk > ring.capacity && pcc_shm_wait(&ring, sock_fd, position + chunk - ring.capacity) == -1) {
+            perror("pcc_shm_wait failed");
+            goto cleanup;
+        }
+        pcc_shm_ring_write(&ring, position, data + position, chunk);
+        uint32_t chunk_length = htonl(chunk);
+        if (send_all(sock_fd, &chunk_length, sizeof(chunk_length)) != GENERAL_SUCCESS) {
+            goto cleanup;
+        }
+        position += chunk;
+    }
+    uint32_t end_chunk = 0;
+    uint64_t reply = 0;
+    if (send_all(sock_fd, &end_chunk, sizeof(end_chunk)) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    if (recv(sock_fd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) {
+        perror("recv reply failed");
+        goto cleanup;
+    }
+    if (pcc_ntoh64(reply) != count_printable(data, len)) {
+        printf("FAIL: shared memory request expected %u, received %lu\n", count_printable(data, len),
+               (unsigned long)pcc_ntoh64(reply));
+        goto cleanup;
+    }
+    if (__atomic_load_n(&ring.header->consumed, __ATOMIC_ACQUIRE) != len) {
+        printf("FAIL: the server consumed %lu of %lu ring bytes\n", (unsigned long)ring.header->consumed,
+               (unsigned long)len);
+        goto cleanup;
+    }
+
+    // the ring is still mapped on the server's side, the next request starts at its beginning
+    pcc_shm_ring_reset(&ring);
+    header.flags = PCC_V2_FLAG_CHUNKED | PCC_V2_FLAG_SHM;
+    pcc_shm_ring_write(&ring, 0, mixed, strlen(mixed));
+    uint32_t mixed_length = htonl(strlen(mixed));
+    if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &mixed_length, sizeof(mixed_length)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &end_chunk, sizeof(end_chunk)) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    if (recv(sock_fd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) {
+        perror("recv reply failed");
+        goto cleanup;
+    }
+    if (pcc_ntoh64(reply) != count_printable(mixed, strlen(mixed))) {
+        printf("FAIL: reusing the ring expected %u, received %lu\n", count_printable(mixed, strlen(mixed)),
+               (unsigned long)pcc_ntoh64(reply));
+        goto cleanup;
+    }
+    close(sock_fd);
+
+    sock_fd = connect_to_unix_socket();
+    if (sock_fd == -1) {
+        goto cleanup;
+    }
+    header.flags = PCC_V2_FLAG_SHM;
+    char byte;
+    if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    if (recv(sock_fd, &byte, sizeof(byte), 0) > 0) {
+        printf("FAIL: an unchunked shared memory request got a reply\n");
+        goto cleanup;
+    }
+
+    printf("PASS: %lu bytes through a %lu byte ring\n", (unsigned long)len, (unsigned long)ring.capacity);
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    pcc_shm_ring_unmap(&ring);
+    if (sock_fd != -1) {
+        close(sock_fd);
+    }
+    return return_code;
+}
+
+// what the delta of Test 14 pushes, as if a leaf served it
+uint64_t delta_count(int index) {
+    return index % 3;
+}
+
+/*
+ * A leaf's push to the server, which pcc_tester starts as an aggregator of 127.0.0.1: first from
+ * 127.0.0.2, which is not one of its leaves and must be dropped. Then a PCC_V2_FLAG_DELTA request
+ * whose body is a struct pcc_delta, sent in two pieces that split a count. The server must reply
+ * with the sum of the counts and add them, as DELTA_CLIENTS clients, to its statistics. The same
+ * delta resent on a new connection, as after a lost reply, gets the same reply and is not added
+ * again, nor after LEDGER_FILL_LEAVES other leaves pushed in between. Then a chunked delta and a
+ * delta of more clients than the statistics hold, which must both be dropped.
+ */
+int run_delta_test(const char *ip, uint16_t port) {
+    printf("\nRunning test: Pushed delta\n");
+    int return_code = GENERAL_ERROR;
+    struct pcc_v2_header header = {.magic = htonl(PCC_V2_MAGIC), .version = PCC_V2_VERSION,
+                                   .flags = PCC_V2_FLAG_DELTA | PCC_V2_FLAG_KEEP_ALIVE};
+    uint64_t length = pcc_hton64(sizeof(struct pcc_delta));
+    struct pcc_delta delta;
+    uint64_t expected = 0;
+    uint64_t reply = 0;
+
+    for (int i = 0; i < PCC_DELTA_COUNTS; i++) {
+        delta.pcc_total[i] = pcc_hton64(delta_count(i));
+        expected += delta_count(i);
+    }
+    delta.clients_count = pcc_hton64(DELTA_CLIENTS);
+    delta.leaf_id = pcc_hton64(getpid());  // the concurrent testers are different leaves
+    delta.sequence = pcc_hton64(1);
+
+    // dropped on its header, the rest of the request could meet a closed connection
+    int sock_fd = connect_to_server_from("127.0.0.2", ip, port);
+    if (sock_fd == -1) {
+        return GENERAL_ERROR;
+    }
+    if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    if (recv(sock_fd, &reply, sizeof(reply), MSG_WAITALL) > 0) {
+        printf("FAIL: a delta from a peer that is not a leaf was answered\n");
+        goto cleanup;
+    }
+    close(sock_fd);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (attempt > 0) {
+            close(sock_fd);
+        }
+        sock_fd = connect_to_server(ip, port);
+        if (sock_fd == -1) {
+            return GENERAL_ERROR;
+        }
+        if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS ||
+            send_all(sock_fd, &length, sizeof(length)) != GENERAL_SUCCESS ||
+            send_all(sock_fd, &delta, 101) != GENERAL_SUCCESS ||
+            send_all(sock_fd, (const char *)&delta + 101, sizeof(delta) - 101) != GENERAL_SUCCESS) {
+            goto cleanup;
+        }
+        if (recv(sock_fd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) {
+            perror("recv reply failed");
+            goto cleanup;
+        }
+        if (pcc_ntoh64(reply) != expected) {
+            printf("FAIL: delta expected %lu, received %lu\n", (unsigned long)expected,
+                   (unsigned long)pcc_ntoh64(reply));
+            goto cleanup;
+        }
+    }
+
+    // the server must remember every leaf, not only the latest ones
+    struct pcc_delta empty = {.clients_count = 0, .sequence = pcc_hton64(1)};
+    for (uint64_t leaf = 1; leaf <= LEDGER_FILL_LEAVES; leaf++) {
+        empty.leaf_id = pcc_hton64(((uint64_t)getpid() << 32) | leaf);
+        if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS ||
+            send_all(sock_fd, &length, sizeof(length)) != GENERAL_SUCCESS ||
+            send_all(sock_fd, &empty, sizeof(empty)) != GENERAL_SUCCESS) {
+            goto cleanup;
+        }
+    }
+    if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &length, sizeof(length)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &delta, sizeof(delta)) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    for (int i = 0; i <= LEDGER_FILL_LEAVES; i++) {
+        if (recv(sock_fd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) {
+            perror("recv reply failed");
+            goto cleanup;
+        }
+        uint64_t expected_reply = i < LEDGER_FILL_LEAVES ? 0 : expected;
+        if (pcc_ntoh64(reply) != expected_reply) {
+            printf("FAIL: delta expected %lu, received %lu\n", (unsigned long)expected_reply,
+                   (unsigned long)pcc_ntoh64(reply));
+            goto cleanup;
+        }
+    }
+
+    header.flags |= PCC_V2_FLAG_CHUNKED;
+    if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    if (recv(sock_fd, &reply, sizeof(reply), MSG_WAITALL) > 0) {
+        printf("FAIL: a chunked delta was answered\n");
+        goto cleanup;
+    }
+    close(sock_fd);
+
+    // dropped once its body is read, so all of it can be sent
+    sock_fd = connect_to_server(ip, port);
+    if (sock_fd == -1) {
+        return GENERAL_ERROR;
+    }
+    header.flags = PCC_V2_FLAG_DELTA;
+    delta.clients_count = pcc_hton64((uint64_t)UINT32_MAX + 1);
+    delta.sequence = pcc_hton64(2);
+    if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &length, sizeof(length)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &delta, sizeof(delta)) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    if (recv(sock_fd, &reply, sizeof(reply), MSG_WAITALL) > 0) {
+        printf("FAIL: a delta of more than UINT32_MAX clients was answered\n");
+        goto cleanup;
+    }
+
+    printf("PASS: delta of %d clients\n", DELTA_CLIENTS);
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    close(sock_fd);
+    return return_code;
+}
+
+// the byte classes of Test 15, written out independently of pcc_count.h
+bool in_class(uint8_t byte_class, char c) {
+    switch (byte_class) {
+    case PCC_CLASS_ANY:
+        return true;
+    case PCC_CLASS_DIGIT:
+        return '0' <= c && c <= '9';
+    case PCC_CLASS_WHITESPACE:
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    default:
+        return is_printable(c);
+    }
+}
+
+// the byte set of Test 15: newlines, colons and the lowercase hex digits
+bool in_test_set(char c) {
+    return c == '\n' || c == ':' || ('a' <= c && c <= 'f');
+}
+
+/*
+ * Five pipelined requests over one keep-alive connection, each naming what its reply counts:
+ * digits with a length, whitespace chunked, every byte with its histogram, then a byte set
+ * chunked and the same set with its histogram. Each reply must count that class or set, while
+ * the statistics count the printable characters of all five. Then a class the server does not
+ * know and a byte set that also names a class, both of which must be dropped.
+ */
+int run_class_test(const char *ip, uint16_t port, const char *data, size_t len) {
+    printf("\nRunning test: Byte classes\n");
+    int return_code = GENERAL_ERROR;
+    const uint8_t classes[] = {PCC_CLASS_DIGIT, PCC_CLASS_WHITESPACE, PCC_CLASS_ANY, PCC_CLASS_PRINTABLE,
+                               PCC_CLASS_PRINTABLE};
+    const uint8_t flags[] = {PCC_V2_FLAG_KEEP_ALIVE, PCC_V2_FLAG_KEEP_ALIVE | PCC_V2_FLAG_CHUNKED,
+                             PCC_V2_FLAG_KEEP_ALIVE | PCC_V2_FLAG_HISTOGRAM,
+                             PCC_V2_FLAG_KEEP_ALIVE | PCC_V2_FLAG_CHUNKED | PCC_V2_FLAG_BYTE_SET,
+                             PCC_V2_FLAG_BYTE_SET | PCC_V2_FLAG_HISTOGRAM};
+    const int requests = sizeof(classes) / sizeof(classes[0]);
+    struct pcc_v2_header header = {.magic = htonl(PCC_V2_MAGIC), .version = PCC_V2_VERSION};
+    struct pcc_byte_set set = {0};
+    uint64_t length = pcc_hton64(len);
+    uint32_t chunk = htonl((uint32_t)len);
+    uint32_t end_chunk = 0;
+    uint64_t reply = 0;
+    uint64_t bins[PCC_HISTOGRAM_BINS];
+
+    for (int byte = 0; byte < PCC_HISTOGRAM_BINS; byte++) {
+        if (in_test_set((char)byte)) {
+            pcc_byte_set_add(&set, (uint8_t)byte);
+        }
+    }
+
+    int sock_fd = connect_to_server(ip, port);
+    if (sock_fd == -1) {
+        return GENERAL_ERROR;
+    }
+    for (int r = 0; r < requests; r++) {
+        bool chunked = flags[r] & PCC_V2_FLAG_CHUNKED;
+        header.byte_class = classes[r];
+        header.flags = flags[r];
+        if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS ||
+            ((flags[r] & PCC_V2_FLAG_BYTE_SET) && send_all(sock_fd, &set, sizeof(set)) != GENERAL_SUCCESS) ||
+            (chunked ? send_all(sock_fd, &chunk, sizeof(chunk)) : send_all(sock_fd, &length, sizeof(length))) !=
+                GENERAL_SUCCESS ||
+            send_all(sock_fd, data, len) != GENERAL_SUCCESS ||
+            (chunked && send_all(sock_fd, &end_chunk, sizeof(end_chunk)) != GENERAL_SUCCESS)) {
+            goto cleanup;
+        }
+    }
+    for (int r = 0; r < requests; r++) {
+        bool histogram = flags[r] & PCC_V2_FLAG_HISTOGRAM;
+        if (recv(sock_fd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply) ||
+            (histogram && recv(sock_fd, bins, sizeof(bins), MSG_WAITALL) != sizeof(bins))) {
+            perror("recv replies failed");
+            goto cleanup;
+        }
+
+        uint64_t expected = 0;
+        uint64_t expected_bins[PCC_HISTOGRAM_BINS] = {0};
+        for (size_t i = 0; i < len; i++) {
+            bool counted = (flags[r] & PCC_V2_FLAG_BYTE_SET) ? in_test_set(data[i]) : in_class(classes[r], data[i]);
+            expected += counted;
+            expected_bins[(unsigned char)data[i]] += counted;
+        }
+        if (pcc_ntoh64(reply) != expected) {
+            printf("FAIL: request %d expected %lu, received %lu\n", r, (unsigned long)expected,
+                   (unsigned long)pcc_ntoh64(reply));
+            goto cleanup;
+        }
+        for (int byte = 0; histogram && byte < PCC_HISTOGRAM_BINS; byte++) {
+            if (pcc_ntoh64(bins[byte]) != expected_bins[byte]) {
+                printf("FAIL: request %d byte %d expected %lu, received %lu\n", r, byte,
+                       (unsigned long)expected_bins[byte], (unsigned long)pcc_ntoh64(bins[byte]));
+                goto cleanup;
+            }
+        }
+    }
+    close(sock_fd);
+
+    // the header alone is dropped, anything sent after it could meet a closed connection
+    for (int r = 0; r < 2; r++) {
+        sock_fd = connect_to_server(ip, port);
+        if (sock_fd == -1) {
+            return GENERAL_ERROR;
+        }
+        header.byte_class = r == 0 ? PCC_CLASS_BUILTIN_AMOUNT : PCC_CLASS_DIGIT;
+        header.flags = r == 0 ? 0 : PCC_V2_FLAG_BYTE_SET;
+        if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS) {
+            goto cleanup;
+        }
+        if (recv(sock_fd, &reply, sizeof(reply), MSG_WAITALL) > 0) {
+            printf("FAIL: %s was answered\n", r == 0 ? "an unknown class" : "a byte set naming a class");
+            goto cleanup;
+        }
+        close(sock_fd);
+    }
+    sock_fd = -1;
+
+    printf("PASS: 3 byte classes, a byte set and 2 histograms\n");
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    if (sock_fd != -1) {
+        close(sock_fd);
+    }
+    return return_code;
+}
+
+// German "Gruesse" with its umlaut and sharp s, two CJK characters, an emoji, then a newline,
+// U+0085 (a C1 control), the euro sign and DEL
+static const char utf8_text[] = "Gr\xc3\xbc\xc3\x9f" "e, \xe4\xb8\x96\xe7\x95\x8c! \xf0\x9f\x98\x80"
+                                "\n\xc2\x85\xe2\x82\xac\x7f";
+#define UTF8_TEXT_PRINTABLE (13)  // all but the newline, the C1 control and DEL
+#define UTF8_CHUNK_SIZE (3)       // cuts most of its sequences in two
+
+/*
+ * Two PCC_V2_FLAG_UTF8 requests over one keep-alive connection: the text in chunks that split
+ * its sequences, then in one piece. Both replies must count printable codepoints, while the
+ * statistics count the text's printable bytes twice. Then a body ending inside a sequence, which
+ * must be dropped.
+ */
+int run_utf8_test(const char *ip, uint16_t port) {
+    printf("\nRunning test: UTF-8 codepoints\n");
+    int return_code = GENERAL_ERROR;
+    size_t len = strlen(utf8_text);
+    struct pcc_v2_header header = {.magic = htonl(PCC_V2_MAGIC), .version = PCC_V2_VERSION};
+    uint64_t length = pcc_hton64(len);
+    uint32_t end_chunk = 0;
+    uint64_t replies[2];
+
+    int sock_fd = connect_to_server(ip, port);
+    if (sock_fd == -1) {
+        return GENERAL_ERROR;
+    }
+    header.flags = PCC_V2_FLAG_UTF8 | PCC_V2_FLAG_CHUNKED | PCC_V2_FLAG_KEEP_ALIVE;
+    if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    for (size_t sent = 0; sent < len; sent += UTF8_CHUNK_SIZE) {
+        size_t part = len - sent < UTF8_CHUNK_SIZE ? len - sent : UTF8_CHUNK_SIZE;
+        uint32_t chunk = htonl((uint32_t)part);
+        if (send_all(sock_fd, &chunk, sizeof(chunk)) != GENERAL_SUCCESS ||
+            send_all(sock_fd, utf8_text + sent, part) != GENERAL_SUCCESS) {
+            goto cleanup;
+        }
+    }
+    header.flags = PCC_V2_FLAG_UTF8;
+    if (send_all(sock_fd, &end_chunk, sizeof(end_chunk)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &length, sizeof(length)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, utf8_text, len) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    if (recv(sock_fd, replies, sizeof(replies), MSG_WAITALL) != sizeof(replies)) {
+        perror("recv replies failed");
+        goto cleanup;
+    }
+    for (int r = 0; r < 2; r++) {
+        if (pcc_ntoh64(replies[r]) != UTF8_TEXT_PRINTABLE) {
+            printf("FAIL: expected %d codepoints, received %lu\n", UTF8_TEXT_PRINTABLE,
+                   (unsigned long)pcc_ntoh64(replies[r]));
+            goto cleanup;
+        }
+    }
+    close(sock_fd);
+
+    sock_fd = connect_to_server(ip, port);
+    if (sock_fd == -1) {
+        return GENERAL_ERROR;
+    }
+    length = pcc_hton64(2);
+    if (send_all(sock_fd, &header, sizeof(header)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, &length, sizeof(length)) != GENERAL_SUCCESS ||
+        send_all(sock_fd, "\xe4\xb8", 2) != GENERAL_SUCCESS) {
+        goto cleanup;
+    }
+    if (recv(sock_fd, replies, sizeof(replies[0]), MSG_WAITALL) > 0) {
+        printf("FAIL: a body ending inside a sequence was answered\n");
+        goto cleanup;
+    }
+
+    printf("PASS: %d printable codepoints, split anywhere\n", UTF8_TEXT_PRINTABLE);
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    close(sock_fd);
+    return return_code;
+}
+
 void accumulate_expected_totals(uint32_t N, const char *data) {
     for (size_t i = 0; i < N; i++) {
         if (is_printable(data[i])) {
@@ -220,6 +933,48 @@ int run_all_tests(const char *ip, uint16_t port) {
     }
     free(very_large_data);
 
+    // Test 11: Pipelined keep-alive requests
+    total_tests++;
+    if (run_keep_alive_test(ip, port, mixed, strlen(mixed), printable, 95) == GENERAL_SUCCESS) {
+        tests_passed++;
+    }
+
+    // Test 12: LZ4 compressed requests
+    total_tests++;
+    char *log_data = malloc(LOG_DATA_SIZE);
+    if (!log_data) {
+        perror("malloc failed");
+        return GENERAL_ERROR;
+    }
+    if (run_compressed_test(ip, port, log_data, make_log_data(log_data)) == GENERAL_SUCCESS) {
+        tests_passed++;
+    }
+
+    // Test 13: Unix socket and shared memory ring
+    total_tests++;
+    if (run_unix_socket_test(mixed, log_data, make_log_data(log_data)) == GENERAL_SUCCESS) {
+        tests_passed++;
+    }
+
+    // Test 14: A delta pushed by a leaf
+    total_tests++;
+    if (run_delta_test(ip, port) == GENERAL_SUCCESS) {
+        tests_passed++;
+    }
+
+    // Test 15: Byte classes
+    total_tests++;
+    if (run_class_test(ip, port, log_data, make_log_data(log_data)) == GENERAL_SUCCESS) {
+        tests_passed++;
+    }
+    free(log_data);
+
+    // Test 16: UTF-8 codepoints
+    total_tests++;
+    if (run_utf8_test(ip, port) == GENERAL_SUCCESS) {
+        tests_passed++;
+    }
+
     return tests_passed == total_tests ? GENERAL_SUCCESS : GENERAL_ERROR;
 }
 
@@ -282,11 +1037,42 @@ void accumulate_expected() {
     }
     accumulate_expected_totals(very_large_size, very_large_data);
     free(very_large_data);
+
+    // Test 11: Pipelined keep-alive, mixed twice and all printable once
+    accumulate_expected_totals(strlen(mixed), mixed);
+    accumulate_expected_totals(95, printable);
+    accumulate_expected_totals(strlen(mixed), mixed);
+
+    // Test 12: Compressed, the log data twice
+    char *log_data = malloc(LOG_DATA_SIZE);
+    size_t log_size = make_log_data(log_data);
+    accumulate_expected_totals(log_size, log_data);
+    accumulate_expected_totals(log_size, log_data);
+
+    // Test 13: Unix socket, mixed over v1, the log data and mixed again through shared memory
+    accumulate_expected_totals(strlen(mixed), mixed);
+    accumulate_expected_totals(log_size, log_data);
+    accumulate_expected_totals(strlen(mixed), mixed);
+
+    // Test 14: Pushed delta, once however often it is resent
+    for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
+        expected_totals[i] += delta_count(i);
+    }
+
+    // Test 15: Byte classes, sets and histograms, the log data five times
+    for (int r = 0; r < 5; r++) {
+        accumulate_expected_totals(log_size, log_data);
+    }
+    free(log_data);
+
+    // Test 16: UTF-8, the text twice, the dropped request does not count
+    accumulate_expected_totals(strlen(utf8_text), utf8_text);
+    accumulate_expected_totals(strlen(utf8_text), utf8_text);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <port> [server options...]\n", argv[0]);
         return GENERAL_ERROR;
     }
 
@@ -297,6 +1083,7 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Invalid port number: %s\n", argv[1]);
         return GENERAL_ERROR;
     }
+    snprintf(unix_socket_path, sizeof(unix_socket_path), "/tmp/pcc_tester_%hu.sock", port);
 
     // Start server in background
     int pipefd[2];
@@ -316,10 +1103,22 @@ int main(int argc, char *argv[]) {
         close(pipefd[0]);
         dup2(pipefd[1], STDOUT_FILENO);
         close(pipefd[1]);
+        // extra arguments select a server mode, e.g. --workers 4, Test 14 pushes as a leaf on loopback
         char port_str[16];
         sprintf(port_str, "%hu", port);
-        execl("./pcc_server", "pcc_server", port_str, NULL);
-        perror("execl failed");
+        char *server_argv[argc + 5];
+        server_argv[0] = "pcc_server";
+        server_argv[1] = "--unix-socket";
+        server_argv[2] = unix_socket_path;
+        server_argv[3] = "--aggregator";
+        server_argv[4] = "127.0.0.1";
+        for (int i = 2; i < argc; i++) {
+            server_argv[i + 3] = argv[i];
+        }
+        server_argv[argc + 3] = port_str;
+        server_argv[argc + 4] = NULL;
+        execv("./pcc_server", server_argv);
+        perror("execv failed");
         exit(GENERAL_ERROR);
     }
 
@@ -372,15 +1171,44 @@ int main(int argc, char *argv[]) {
         expected_totals[i] *= num_concurrent;
     }
 
+    // a client that connected but never sends must not hold up the shutdown, the Unix socket
+    // hands it to the server right away where TCP would defer it
+    int silent_fd = connect_to_unix_socket();
+    if (silent_fd == -1) {
+        kill(child_pid, SIGINT);
+        wait(NULL);
+        close(pipefd[0]);
+        return GENERAL_ERROR;
+    }
+    struct timespec accept_wait = {.tv_nsec = 200 * 1000000L};
+    nanosleep(&accept_wait, NULL);
+
     // Send SIGINT to server
     if (kill(child_pid, SIGINT) == -1) {
         perror("kill failed");
+        close(silent_fd);
         return GENERAL_ERROR;
     }
 
-    // Wait for server to finish
+    // Wait for server to finish, well before its header timeout would drop the silent client
     int status;
-    if (wait(&status) == -1) {
+    struct timespec exit_poll = {.tv_nsec = 100 * 1000000L};
+    pid_t exited = 0;
+    for (int polls = 0; polls < SHUTDOWN_POLLS && exited == 0; polls++) {
+        exited = waitpid(child_pid, &status, WNOHANG);
+        if (exited == 0) {
+            nanosleep(&exit_poll, NULL);
+        }
+    }
+    close(silent_fd);
+    if (exited == 0) {
+        printf("FAIL: server did not shut down with a silent client connected\n");
+        kill(child_pid, SIGKILL);
+        wait(NULL);
+        close(pipefd[0]);
+        return GENERAL_ERROR;
+    }
+    if (exited == -1) {
         perror("wait failed");
         return GENERAL_ERROR;
     }
@@ -418,8 +1246,8 @@ int main(int argc, char *argv[]) {
 
     // Verify
     int stats_ok = 1;
-    if (clients_served != 30) {
-        printf("FAIL: Expected 30 clients, served %d\n", clients_served);
+    if (clients_served != num_concurrent * CLIENTS_PER_TEST_SET) {
+        printf("FAIL: Expected %d clients, served %d\n", num_concurrent * CLIENTS_PER_TEST_SET, clients_served);
         stats_ok = 0;
     }
     for (int i = 0; i < AMOUNT_OF_PRINTABLE_CHARS; i++) {
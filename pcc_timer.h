@@ -0,0 +1,149 @@
+#ifndef PCC_TIMER_H
+#define PCC_TIMER_H
+
+/*
+ * Hierarchical timer wheel, shaped like the classic Linux one.
+ *
+ * Time is counted in ticks of whatever length the caller picks. Level 0 has a slot per tick for
+ * the next PCC_TIMER_SLOTS ticks, each level above covers PCC_TIMER_SLOTS times the range of the
+ * one below, with slots as wide as that whole range. When level 0 wraps, the matching slot of
+ * level 1 is cascaded: its timers are placed again, now close enough for level 0, and so on up.
+ * Timers further out than the top level wait in its furthest slot and are placed again when it
+ * cascades. Arming, re-arming and deleting are O(1), advancing costs O(1) per tick plus the
+ * timers that fire or cascade, no matter how many are armed.
+ *
+ * Timers are intrusive: embed a struct pcc_timer and get back to the owner with offsetof.
+ * A wheel is owned by a single thread, nothing here is thread safe.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#define PCC_TIMER_SLOT_BITS (6)
+#define PCC_TIMER_SLOTS (1 << PCC_TIMER_SLOT_BITS)
+#define PCC_TIMER_SLOT_MASK (PCC_TIMER_SLOTS - 1)
+#define PCC_TIMER_LEVELS (4)
+// the furthest ahead a timer can be placed
+#define PCC_TIMER_MAX_DELTA ((1ULL << (PCC_TIMER_SLOT_BITS * PCC_TIMER_LEVELS)) - 1)
+
+struct pcc_timer {
+    struct pcc_timer *next;
+    struct pcc_timer **pprev;  // whatever points at this timer, NULL while it is not armed
+    uint64_t expires;          // tick
+};
+
+struct pcc_timer_wheel {
+    uint64_t now;  // the next tick to run, every timer that expired before it has fired
+    uint64_t armed;
+    struct pcc_timer *slots[PCC_TIMER_LEVELS][PCC_TIMER_SLOTS];
+};
+
+typedef void (*pcc_timer_fn)(struct pcc_timer *timer, void *context);
+
+static inline void pcc_timer_wheel_init(struct pcc_timer_wheel *wheel, uint64_t now) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+static inline bool pcc_timer_is_armed(const struct pcc_timer *timer) {
+    return timer->pprev != NULL;
+}
+
+static inline void pcc_timer_unlink(struct pcc_timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static inline void pcc_timer_place(struct pcc_timer_wheel *wheel, struct pcc_timer *timer) {
+    // overdue timers fire on the next tick that runs
+    uint64_t expires = timer->expires > wheel->now ? timer->expires : wheel->now;
+    uint64_t delta = expires - wheel->now;
+    if (delta > PCC_TIMER_MAX_DELTA) {
+        delta = PCC_TIMER_MAX_DELTA;
+        expires = wheel->now + delta;
+    }
+
+    unsigned int level = 0;
+    while (delta >> (PCC_TIMER_SLOT_BITS * (level + 1)) != 0) {
+        level++;
+    }
+
+    struct pcc_timer **head = &wheel->slots[level][(expires >> (PCC_TIMER_SLOT_BITS * level)) & PCC_TIMER_SLOT_MASK];
+    timer->next = *head;
+    if (*head != NULL) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+static inline void pcc_timer_delete(struct pcc_timer_wheel *wheel, struct pcc_timer *timer) {
+    if (pcc_timer_is_armed(timer)) {
+        pcc_timer_unlink(timer);
+        wheel->armed--;
+    }
+}
+
+// arms the timer, or moves it if it already was
+static inline void pcc_timer_arm(struct pcc_timer_wheel *wheel, struct pcc_timer *timer, uint64_t expires) {
+    pcc_timer_delete(wheel, timer);
+    timer->expires = expires;
+    pcc_timer_place(wheel, timer);
+    wheel->armed++;
+}
+
+// places the timers of the current slot of a level again, returns that slot's index
+static inline unsigned int pcc_timer_cascade(struct pcc_timer_wheel *wheel, unsigned int level) {
+    unsigned int index = (wheel->now >> (PCC_TIMER_SLOT_BITS * level)) & PCC_TIMER_SLOT_MASK;
+    struct pcc_timer *timer = wheel->slots[level][index];
+
+    wheel->slots[level][index] = NULL;
+    while (timer != NULL) {
+        struct pcc_timer *next = timer->next;
+        pcc_timer_place(wheel, timer);
+        timer = next;
+    }
+    return index;
+}
+
+/*
+ * Runs every tick up to and including `now`, calling fire for each timer that expired. A fired
+ * timer is no longer armed, fire may arm it again or arm and delete any other timer.
+ */
+static inline void pcc_timer_advance(struct pcc_timer_wheel *wheel, uint64_t now, pcc_timer_fn fire, void *context) {
+    while (wheel->now <= now && wheel->armed > 0) {
+        unsigned int index = wheel->now & PCC_TIMER_SLOT_MASK;
+        if (index == 0) {
+            for (unsigned int level = 1; level < PCC_TIMER_LEVELS && pcc_timer_cascade(wheel, level) == 0; level++) {
+            }
+        }
+
+        // moved to a local list first, so fire can delete timers that are about to fire too
+        struct pcc_timer *expired = wheel->slots[0][index];
+        wheel->slots[0][index] = NULL;
+        if (expired != NULL) {
+            expired->pprev = &expired;
+        }
+        while (expired != NULL) {
+            struct pcc_timer *timer = expired;
+            pcc_timer_unlink(timer);
+            wheel->armed--;
+            fire(timer, context);
+        }
+
+        wheel->now++;
+    }
+
+    // nothing is armed, so the ticks in between have nothing to run
+    if (wheel->now <= now) {
+        wheel->now = now + 1;
+    }
+}
+
+#endif // PCC_TIMER_H
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcc_timer.h"
+
+#define GENERAL_ERROR (1)
+#define GENERAL_SUCCESS (0)
+
+#define TIMERS_AMOUNT (10000)
+#define RANDOM_STEPS (200000)
+#define FAR_DELTA (PCC_TIMER_MAX_DELTA * 3)
+
+struct test_timer {
+    struct pcc_timer timer;
+    uint64_t expected;  // the tick it has to fire on
+    uint64_t fired_at;
+    unsigned int fired;
+    bool armed;
+};
+
+struct test_timer timers[TIMERS_AMOUNT];
+struct pcc_timer_wheel wheel;
+int failures = 0;
+
+uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+uint64_t next_random() {
+    // xorshift64, deterministic so failures reproduce
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+void arm(struct test_timer *t, uint64_t expires) {
+    pcc_timer_arm(&wheel, &t->timer, expires);
+    t->expected = expires > wheel.now ? expires : wheel.now;
+    t->armed = true;
+}
+
+void fire(struct pcc_timer *timer, void *context) {
+    struct test_timer *t = (struct test_timer *)((char *)timer - offsetof(struct test_timer, timer));
+    if (!t->armed || wheel.now != t->expected) {
+        printf("FAIL: timer %ld fired on tick %lu, expected %lu (armed %d)\n", (long)(t - timers),
+               (unsigned long)wheel.now, (unsigned long)t->expected, t->armed);
+        failures++;
+    }
+    t->armed = false;
+    t->fired++;
+    t->fired_at = wheel.now;
+}
+
+// deltas that hit every level, including ones beyond the top level
+uint64_t random_delta() {
+    switch (next_random() % 8) {
+    case 0:
+        return 0;
+    case 1:
+        return next_random() % PCC_TIMER_SLOTS;
+    case 2:
+        return next_random() % (PCC_TIMER_SLOTS * PCC_TIMER_SLOTS);
+    case 3:
+        return next_random() % (PCC_TIMER_SLOTS * PCC_TIMER_SLOTS * PCC_TIMER_SLOTS);
+    case 4:
+        return next_random() % FAR_DELTA;
+    default:
+        return next_random() % 300;
+    }
+}
+
+int check_all_fired(const char *test_name) {
+    // every armed timer fires by the furthest deadline, and only once
+    pcc_timer_advance(&wheel, wheel.now + FAR_DELTA + 1, fire, NULL);
+    for (int i = 0; i < TIMERS_AMOUNT; i++) {
+        if (timers[i].armed) {
+            printf("FAIL: %s: timer %d never fired, expected on tick %lu\n", test_name, i,
+                   (unsigned long)timers[i].expected);
+            failures++;
+        }
+    }
+    if (wheel.armed != 0) {
+        printf("FAIL: %s: wheel still counts %lu armed timers\n", test_name, (unsigned long)wheel.armed);
+        failures++;
+    }
+    return failures == 0 ? GENERAL_SUCCESS : GENERAL_ERROR;
+}
+
+int test_random_operations() {
+    memset(timers, 0, sizeof(timers));
+    pcc_timer_wheel_init(&wheel, 12345);
+
+    // Test 1: random arms, re-arms and deletes while time moves on in uneven steps
+    for (int step = 0; step < RANDOM_STEPS; step++) {
+        struct test_timer *t = &timers[next_random() % TIMERS_AMOUNT];
+        switch (next_random() % 4) {
+        case 0:
+            pcc_timer_delete(&wheel, &t->timer);
+            t->armed = false;
+            break;
+        default:
+            arm(t, wheel.now + random_delta());
+            break;
+        }
+        if (next_random() % 4 == 0) {
+            pcc_timer_advance(&wheel, wheel.now + next_random() % 100, fire, NULL);
+        }
+    }
+
+    return check_all_fired("random operations");
+}
+
+// fires timer 0, which deletes timer 1 (same tick) and re-arms itself once
+void fire_and_modify(struct pcc_timer *timer, void *context) {
+    fire(timer, context);
+    if (timer == &timers[0].timer && timers[0].fired == 1) {
+        pcc_timer_delete(&wheel, &timers[1].timer);
+        timers[1].armed = false;
+        arm(&timers[0], wheel.now + 5);
+    }
+}
+
+int test_fire_modifies() {
+    memset(timers, 0, sizeof(timers));
+    pcc_timer_wheel_init(&wheel, 0);
+
+    // Test 2: a callback deleting a timer due on the same tick, and re-arming its own
+    arm(&timers[0], 100);
+    arm(&timers[1], 100);
+    arm(&timers[2], 100);
+    pcc_timer_advance(&wheel, 200, fire_and_modify, NULL);
+    if (timers[0].fired != 2 || timers[0].fired_at != 105 || timers[1].fired != 0 || timers[2].fired != 1) {
+        printf("FAIL: fire callback modifying the wheel\n");
+        failures++;
+    }
+
+    // Test 3: overdue timers fire on the next tick that runs, idle time is skipped
+    arm(&timers[3], 50);
+    pcc_timer_advance(&wheel, 1000000, fire, NULL);
+    if (timers[3].fired != 1 || timers[3].fired_at != 201 || wheel.now != 1000001) {
+        printf("FAIL: overdue timer fired on tick %lu\n", (unsigned long)timers[3].fired_at);
+        failures++;
+    }
+
+    return check_all_fired("fire modifies");
+}
+
+int main(int argc, char *argv[]) {
+    int return_code = GENERAL_SUCCESS;
+
+    if (test_random_operations() != GENERAL_SUCCESS || test_fire_modifies() != GENERAL_SUCCESS) {
+        return_code = GENERAL_ERROR;
+    }
+
+    if (return_code == GENERAL_SUCCESS) {
+        printf("PASS: timer wheel\n");
+    }
+    return return_code;
+}
@@ -0,0 +1,243 @@
+#ifndef PCC_URING_H
+#define PCC_URING_H
+
+/*
+ * Minimal io_uring wrapper on top of the raw syscalls (no liburing).
+ *
+ * Covers what the server needs: one SQ/CQ pair, batched submission, and a ring of provided
+ * buffers (IORING_REGISTER_PBUF_RING) that recv requests pick from with IOSQE_BUFFER_SELECT.
+ * Needs Linux 5.19+ for provided buffer rings and multishot accept, pcc_uring_init fails
+ * cleanly on anything older so the caller can fall back to epoll.
+ *
+ * A ring is owned by a single thread, nothing here is thread safe.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct pcc_uring {
+    int fd;
+    // submission queue
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int sqe_tail;  // next sqe to hand out, published to *sq_tail on submit
+    // completion queue
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    // mappings
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+    // provided buffers
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;  // the caller's, see pcc_uring_setup_buffers
+    unsigned int buffer_size;
+    unsigned int buffers_amount;
+    uint16_t buf_tail;
+    uint16_t buf_group;
+};
+
+static inline int pcc_uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int pcc_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int pcc_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline void pcc_uring_destroy(struct pcc_uring *ring) {
+    if (ring->buf_ring != NULL) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->rings != NULL) {
+        munmap(ring->rings, ring->rings_size);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// returns 0 on success, otherwise -1 with errno set and the ring left destroyed
+static inline int pcc_uring_init(struct pcc_uring *ring, unsigned int entries, unsigned int cq_entries) {
+    struct io_uring_params params = {0};
+    int saved_errno = 0;
+
+    memset(ring, 0, sizeof(*ring));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+
+    ring->fd = pcc_uring_setup(entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+
+    // one mapping for both rings keeps this simple, every kernel with provided buffer rings has it
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = ENOSYS;
+        goto error;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) {
+        ring->rings = NULL;
+        goto error;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto error;
+    }
+
+    char *base = ring->rings;
+    ring->sq_head = (unsigned int *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(base + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)(base + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned int *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+    // sqe slots map 1:1 onto the index array, so it only has to be filled once
+    unsigned int *sq_array = (unsigned int *)(base + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    ring->sqe_tail = *ring->sq_tail;
+
+    return 0;
+error:
+    saved_errno = errno;
+    pcc_uring_destroy(ring);
+    errno = saved_errno;
+    return -1;
+}
+
+// returns NULL when the submission queue is full, submit and retry in that case
+static inline struct io_uring_sqe *pcc_uring_get_sqe(struct pcc_uring *ring) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*
+ * Publishes every prepared sqe and, if wait_for is not 0, blocks until that many completions
+ * are ready. Returns 0 or -1 with errno set.
+ */
+static inline int pcc_uring_submit(struct pcc_uring *ring, unsigned int wait_for) {
+    unsigned int to_submit = ring->sqe_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    if (to_submit == 0 && wait_for == 0) {
+        return 0;
+    }
+
+    while (true) {
+        int submitted = pcc_uring_enter(ring->fd, to_submit, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted >= 0) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+        // the sqes were not consumed if the enter itself was interrupted
+        to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+}
+
+static inline struct io_uring_cqe *pcc_uring_peek_cqe(struct pcc_uring *ring) {
+    unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+static inline void pcc_uring_cqe_seen(struct pcc_uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static inline char *pcc_uring_buffer(struct pcc_uring *ring, unsigned int buffer_id) {
+    return ring->buffers + (size_t)buffer_id * ring->buffer_size;
+}
+
+// hands a buffer back to the kernel, so a later buffer-select recv can fill it
+static inline void pcc_uring_recycle_buffer(struct pcc_uring *ring, uint16_t buffer_id) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buffers_amount - 1)];
+    buf->addr = (uint64_t)(uintptr_t)pcc_uring_buffer(ring, buffer_id);
+    buf->len = ring->buffer_size;
+    buf->bid = buffer_id;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Registers buffers_amount buffers of buffer_size bytes as provided buffer group `group`, carved
+ * out of buffers, which the caller maps (so it decides where and with which pages) and unmaps
+ * only after pcc_uring_destroy. buffers_amount must be a power of two. Returns 0 or -1 with
+ * errno set.
+ */
+static inline int pcc_uring_setup_buffers(struct pcc_uring *ring, char *buffers, unsigned int buffers_amount,
+                                          unsigned int buffer_size, uint16_t group) {
+    struct io_uring_buf_reg reg = {0};
+
+    ring->buf_ring_size = buffers_amount * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+
+    ring->buffers = buffers;
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = buffers_amount;
+    reg.bgid = group;
+    if (pcc_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        return -1;
+    }
+
+    ring->buffer_size = buffer_size;
+    ring->buffers_amount = buffers_amount;
+    ring->buf_group = group;
+    ring->buf_tail = 0;
+    for (unsigned int i = 0; i < buffers_amount; i++) {
+        pcc_uring_recycle_buffer(ring, (uint16_t)i);
+    }
+
+    return 0;
+}
+
+#endif // PCC_URING_H
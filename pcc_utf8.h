@@ -0,0 +1,355 @@
+#ifndef PCC_UTF8_H
+#define PCC_UTF8_H
+
+/*
+ * UTF-8 validation and printable codepoint counting, for PCC_V2_FLAG_UTF8 bodies.
+ *
+ * A codepoint is printable unless it is a control: C0 (U+0000 to U+001F), DEL (U+007F) or C1
+ * (U+0080 to U+009F). For ASCII that is exactly the printable bytes, above it everything is
+ * counted, unassigned and format codepoints included, since telling those apart needs the
+ * Unicode tables rather than a few compares. Valid means RFC 3629: no overlong forms, no
+ * surrogates, nothing above U+10FFFF, no stray or missing continuation bytes.
+ *
+ * The vector kernel is the lookup algorithm of Keiser and Lemire ("Validating UTF-8 In Less Than
+ * One Instruction Per Byte"): three table lookups on the nibbles of each byte and the one before
+ * it flag every two byte error, a saturating subtract finds the bytes that must be the third or
+ * fourth of a sequence. 128 bytes without a byte >= 128 skip all of that, they only need the
+ * bytes before not to end inside a sequence, and are counted like the printable class counts them.
+ *
+ * The decoder keeps an incomplete sequence at the end of a piece until the next one completes
+ * it, so a body can be fed in pieces split anywhere. pcc_utf8_init() picks the kernel, call it
+ * once at startup like pcc_count_init().
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "pcc_count.h"
+
+#define PCC_UTF8_MAX_SEQUENCE (4)
+
+// counts the printable codepoints of len bytes of complete sequences, returns -1 if invalid
+typedef int (*pcc_utf8_count_fn)(const char *data, size_t len, uint64_t *printable);
+
+struct pcc_utf8_kernel {
+    const char *name;
+    bool (*is_supported)(void);
+    pcc_utf8_count_fn count;
+};
+
+struct pcc_utf8_decoder {
+    unsigned char pending[PCC_UTF8_MAX_SEQUENCE];  // the start of a sequence the last piece cut off
+    uint8_t pending_length;
+};
+
+// of the sequence a lead byte starts, 0 for a continuation byte or one no sequence starts with
+static inline size_t pcc_utf8_sequence_length(unsigned char lead) {
+    if (lead < 0x80) {
+        return 1;
+    }
+    if ((lead & 0xE0) == 0xC0) {
+        return 2;
+    }
+    if ((lead & 0xF0) == 0xE0) {
+        return 3;
+    }
+    if ((lead & 0xF8) == 0xF0) {
+        return 4;
+    }
+    return 0;
+}
+
+static inline int pcc_utf8_count_scalar(const char *data, size_t len, uint64_t *printable) {
+    static const uint32_t min_codepoint[PCC_UTF8_MAX_SEQUENCE + 1] = {0, 0, 0x80, 0x800, 0x10000};
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t count = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        if (bytes[i] < 0x80) {
+            count += (PRINTABLE_LOWER_BOUND <= bytes[i] && bytes[i] <= PRINTABLE_UPPER_BOUND);
+            i++;
+            continue;
+        }
+
+        size_t length = pcc_utf8_sequence_length(bytes[i]);
+        if (length == 0 || len - i < length) {
+            return -1;
+        }
+        uint32_t codepoint = bytes[i] & (0x7F >> length);
+        for (size_t k = 1; k < length; k++) {
+            if ((bytes[i + k] & 0xC0) != 0x80) {
+                return -1;
+            }
+            codepoint = (codepoint << 6) | (bytes[i + k] & 0x3F);
+        }
+        if (codepoint < min_codepoint[length] || codepoint > 0x10FFFF || (0xD800 <= codepoint && codepoint <= 0xDFFF)) {
+            return -1;
+        }
+        count += codepoint >= 0xA0;  // past C1
+        i += length;
+    }
+
+    *printable += count;
+    return 0;
+}
+
+#ifdef PCC_COUNT_X86
+
+// what the lookups flag, an error is a byte whose three lookups share a bit
+#define PCC_UTF8_TOO_SHORT (1 << 0)    // a lead byte followed by a lead byte or ASCII
+#define PCC_UTF8_TOO_LONG (1 << 1)     // ASCII followed by a continuation byte
+#define PCC_UTF8_OVERLONG_3 (1 << 2)   // E0 followed by 80 to 9F
+#define PCC_UTF8_TOO_LARGE (1 << 3)    // F4 followed by 90 to BF, or F5 and above
+#define PCC_UTF8_SURROGATE (1 << 4)    // ED followed by A0 to BF
+#define PCC_UTF8_OVERLONG_2 (1 << 5)   // C0 or C1
+#define PCC_UTF8_TOO_LARGE_1000 (1 << 6)
+#define PCC_UTF8_OVERLONG_4 (1 << 6)   // F0 followed by 80 to 8F
+#define PCC_UTF8_TWO_CONTS (1 << 7)    // two continuation bytes, fine only where must23 says so
+#define PCC_UTF8_CARRY (PCC_UTF8_TOO_SHORT | PCC_UTF8_TOO_LONG | PCC_UTF8_TWO_CONTS)
+
+// the high nibble of the first byte of each pair
+static const uint8_t pcc_utf8_byte_1_high[16] = {
+    PCC_UTF8_TOO_LONG, PCC_UTF8_TOO_LONG, PCC_UTF8_TOO_LONG, PCC_UTF8_TOO_LONG,
+    PCC_UTF8_TOO_LONG, PCC_UTF8_TOO_LONG, PCC_UTF8_TOO_LONG, PCC_UTF8_TOO_LONG,
+    PCC_UTF8_TWO_CONTS, PCC_UTF8_TWO_CONTS, PCC_UTF8_TWO_CONTS, PCC_UTF8_TWO_CONTS,
+    PCC_UTF8_TOO_SHORT | PCC_UTF8_OVERLONG_2,
+    PCC_UTF8_TOO_SHORT,
+    PCC_UTF8_TOO_SHORT | PCC_UTF8_OVERLONG_3 | PCC_UTF8_SURROGATE,
+    PCC_UTF8_TOO_SHORT | PCC_UTF8_TOO_LARGE | PCC_UTF8_TOO_LARGE_1000 | PCC_UTF8_OVERLONG_4,
+};
+
+// the low nibble of the first byte
+static const uint8_t pcc_utf8_byte_1_low[16] = {
+    PCC_UTF8_CARRY | PCC_UTF8_OVERLONG_3 | PCC_UTF8_OVERLONG_2 | PCC_UTF8_OVERLONG_4,
+    PCC_UTF8_CARRY | PCC_UTF8_OVERLONG_2,
+    PCC_UTF8_CARRY,
+    PCC_UTF8_CARRY,
+    PCC_UTF8_CARRY | PCC_UTF8_TOO_LARGE,
+    PCC_UTF8_CARRY | PCC_UTF8_TOO_LARGE | PCC_UTF8_TOO_LARGE_1000,
+    PCC_UTF8_CARRY | PCC_UTF8_TOO_LARGE | PCC_UTF8_TOO_LARGE_1000,
+    PCC_UTF8_CARRY | PCC_UTF8_TOO_LARGE | PCC_UTF8_TOO_LARGE_1000,
+    PCC_UTF8_CARRY | PCC_UTF8_TOO_LARGE | PCC_UTF8_TOO_LARGE_1000,
+    PCC_UTF8_CARRY | PCC_UTF8_TOO_LARGE | PCC_UTF8_TOO_LARGE_1000,
+    PCC_UTF8_CARRY | PCC_UTF8_TOO_LARGE | PCC_UTF8_TOO_LARGE_1000,
+    PCC_UTF8_CARRY | PCC_UTF8_TOO_LARGE | PCC_UTF8_TOO_LARGE_1000,
+    PCC_UTF8_CARRY | PCC_UTF8_TOO_LARGE | PCC_UTF8_TOO_LARGE_1000,
+    PCC_UTF8_CARRY | PCC_UTF8_TOO_LARGE | PCC_UTF8_TOO_LARGE_1000 | PCC_UTF8_SURROGATE,
+    PCC_UTF8_CARRY | PCC_UTF8_TOO_LARGE | PCC_UTF8_TOO_LARGE_1000,
+    PCC_UTF8_CARRY | PCC_UTF8_TOO_LARGE | PCC_UTF8_TOO_LARGE_1000,
+};
+
+// the high nibble of the second byte
+static const uint8_t pcc_utf8_byte_2_high[16] = {
+    PCC_UTF8_TOO_SHORT, PCC_UTF8_TOO_SHORT, PCC_UTF8_TOO_SHORT, PCC_UTF8_TOO_SHORT,
+    PCC_UTF8_TOO_SHORT, PCC_UTF8_TOO_SHORT, PCC_UTF8_TOO_SHORT, PCC_UTF8_TOO_SHORT,
+    PCC_UTF8_TOO_LONG | PCC_UTF8_OVERLONG_2 | PCC_UTF8_TWO_CONTS | PCC_UTF8_OVERLONG_3 | PCC_UTF8_TOO_LARGE_1000 |
+        PCC_UTF8_OVERLONG_4,
+    PCC_UTF8_TOO_LONG | PCC_UTF8_OVERLONG_2 | PCC_UTF8_TWO_CONTS | PCC_UTF8_OVERLONG_3 | PCC_UTF8_TOO_LARGE,
+    PCC_UTF8_TOO_LONG | PCC_UTF8_OVERLONG_2 | PCC_UTF8_TWO_CONTS | PCC_UTF8_SURROGATE | PCC_UTF8_TOO_LARGE,
+    PCC_UTF8_TOO_LONG | PCC_UTF8_OVERLONG_2 | PCC_UTF8_TWO_CONTS | PCC_UTF8_SURROGATE | PCC_UTF8_TOO_LARGE,
+    PCC_UTF8_TOO_SHORT, PCC_UTF8_TOO_SHORT, PCC_UTF8_TOO_SHORT, PCC_UTF8_TOO_SHORT,
+};
+
+// a block ending in these still expects continuation bytes: a lead in the last byte, a three or
+// four byte lead in the second to last, a four byte lead in the third to last
+static const uint8_t pcc_utf8_incomplete_max[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF,
+};
+
+// the block shifted by n bytes, its first n bytes the last n of the previous block
+#define PCC_UTF8_PREV_AVX2(input, prev_input, n) \
+    _mm256_alignr_epi8((input), _mm256_permute2x128_si256((prev_input), (input), 0x21), 16 - (n))
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i pcc_utf8_lookup_avx2(const uint8_t table[16], __m256i nibbles) {
+    return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table)), nibbles);
+}
+
+// flags every invalid byte of a block, given the one before it
+__attribute__((target("avx2"), always_inline))
+static inline __m256i pcc_utf8_check_avx2(__m256i input, __m256i prev1, __m256i prev_input) {
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+    __m256i prev1_high = _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble);
+    __m256i special_cases =
+        _mm256_and_si256(_mm256_and_si256(pcc_utf8_lookup_avx2(pcc_utf8_byte_1_high, prev1_high),
+                                          pcc_utf8_lookup_avx2(pcc_utf8_byte_1_low, _mm256_and_si256(prev1, low_nibble))),
+                         pcc_utf8_lookup_avx2(pcc_utf8_byte_2_high,
+                                              _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble)));
+
+    // only 111_____ two bytes back and 1111____ three bytes back reach 0x80
+    __m256i third_byte = _mm256_subs_epu8(PCC_UTF8_PREV_AVX2(input, prev_input, 2), _mm256_set1_epi8(0xE0 - 0x80));
+    __m256i fourth_byte = _mm256_subs_epu8(PCC_UTF8_PREV_AVX2(input, prev_input, 3), _mm256_set1_epi8(0xF0 - 0x80));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(third_byte, fourth_byte), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must23, special_cases);
+}
+
+// checks a block that is not all ASCII, returns its lead bytes, one per codepoint
+__attribute__((target("avx2"), always_inline))
+static inline __m256i pcc_utf8_block_avx2(__m256i input, __m256i prev_input, __m256i *error, __m256i *c1_counters) {
+    __m256i prev1 = PCC_UTF8_PREV_AVX2(input, prev_input, 1);
+    *error = _mm256_or_si256(*error, pcc_utf8_check_avx2(input, prev1, prev_input));
+    // C2 followed by 80 to 9F
+    __m256i c1 = _mm256_and_si256(_mm256_cmpeq_epi8(prev1, _mm256_set1_epi8((char)0xC2)),
+                                  _mm256_cmpgt_epi8(_mm256_set1_epi8((char)0xA0), input));
+    *c1_counters = _mm256_sub_epi8(*c1_counters, c1);
+    return pcc_in_range_avx2(input, -64, -1);  // C0 to FF
+}
+
+/*
+ * PCC_UTF8_STEP_BLOCKS blocks of 32 bytes per step. If none has a byte >= 128 the step only
+ * counts their printable bytes, as pcc_count_ranges_avx2 does, and makes sure the step before did
+ * not end inside a sequence, so one test covers 128 bytes of ASCII. Otherwise every block is
+ * checked and also counts its lead bytes, less the C1 controls. Counts go into byte accumulators
+ * folded with psadbw, the C1 ones into their own so no lane ever goes below zero. The tail is a
+ * step padded with zeros, which are ASCII and not printable.
+ */
+#define PCC_UTF8_STEP_BLOCKS (4)
+#define PCC_UTF8_STEP (PCC_UTF8_STEP_BLOCKS * sizeof(__m256i))
+
+__attribute__((target("avx2")))
+static inline int pcc_utf8_count_avx2(const char *data, size_t len, uint64_t *printable) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i incomplete_max = _mm256_loadu_si256((const __m256i *)pcc_utf8_incomplete_max);
+    __m256i prev_input = zero;
+    __m256i prev_incomplete = zero;
+    __m256i error = zero;
+    __m256i totals = zero;
+    __m256i c1_totals = zero;
+    char tail[PCC_UTF8_STEP];
+    size_t i = 0;
+
+    while (i < len) {
+        __m256i counters = zero;
+        __m256i c1_counters = zero;
+        // PCC_UTF8_STEP_BLOCKS counts per lane and step
+        for (int n = 0; n < PCC_COUNT_MAX_FOLD_ITERATIONS / PCC_UTF8_STEP_BLOCKS && i < len; n++) {
+            const char *step = data + i;
+            if (len - i < PCC_UTF8_STEP) {
+                memset(tail, 0, sizeof(tail));
+                memcpy(tail, data + i, len - i);
+                step = tail;
+            }
+            i += PCC_UTF8_STEP;
+
+            __m256i blocks[PCC_UTF8_STEP_BLOCKS];
+            __m256i any_high = zero;
+            for (int b = 0; b < PCC_UTF8_STEP_BLOCKS; b++) {
+                blocks[b] = _mm256_loadu_si256((const __m256i *)(step + b * sizeof(__m256i)));
+                any_high = _mm256_or_si256(any_high, blocks[b]);
+                counters = _mm256_sub_epi8(counters,
+                                           pcc_in_range_avx2(blocks[b], PRINTABLE_LOWER_BOUND, PRINTABLE_UPPER_BOUND));
+            }
+            if (_mm256_movemask_epi8(any_high) == 0) {
+                error = _mm256_or_si256(error, prev_incomplete);
+                prev_incomplete = zero;
+            } else {
+                for (int b = 0; b < PCC_UTF8_STEP_BLOCKS; b++) {
+                    counters = _mm256_sub_epi8(counters,
+                                               pcc_utf8_block_avx2(blocks[b], b == 0 ? prev_input : blocks[b - 1],
+                                                                   &error, &c1_counters));
+                }
+                prev_incomplete = _mm256_subs_epu8(blocks[PCC_UTF8_STEP_BLOCKS - 1], incomplete_max);
+            }
+            prev_input = blocks[PCC_UTF8_STEP_BLOCKS - 1];
+        }
+        totals = _mm256_add_epi64(totals, _mm256_sad_epu8(counters, zero));
+        c1_totals = _mm256_add_epi64(c1_totals, _mm256_sad_epu8(c1_counters, zero));
+    }
+
+    // the last sequence must end with the data
+    error = _mm256_or_si256(error, prev_incomplete);
+    if (!_mm256_testz_si256(error, error)) {
+        return -1;
+    }
+    totals = _mm256_sub_epi64(totals, c1_totals);
+    *printable += (uint64_t)_mm256_extract_epi64(totals, 0) + (uint64_t)_mm256_extract_epi64(totals, 1) +
+                  (uint64_t)_mm256_extract_epi64(totals, 2) + (uint64_t)_mm256_extract_epi64(totals, 3);
+    return 0;
+}
+
+static const struct pcc_utf8_kernel pcc_utf8_kernels[] = {
+    {"scalar", pcc_count_always_supported, pcc_utf8_count_scalar},
+    {"avx2", pcc_count_avx2_supported, pcc_utf8_count_avx2},
+};
+
+#else
+
+static const struct pcc_utf8_kernel pcc_utf8_kernels[] = {
+    {"scalar", pcc_count_always_supported, pcc_utf8_count_scalar},
+};
+
+#endif
+
+#define PCC_UTF8_KERNELS_AMOUNT (sizeof(pcc_utf8_kernels) / sizeof(pcc_utf8_kernels[0]))
+
+static const struct pcc_utf8_kernel *pcc_utf8_selected_kernel = &pcc_utf8_kernels[0];
+
+static inline const struct pcc_utf8_kernel *pcc_utf8_init(void) {
+    for (size_t k = PCC_UTF8_KERNELS_AMOUNT; k > 0; k--) {
+        if (pcc_utf8_kernels[k - 1].is_supported()) {
+            pcc_utf8_selected_kernel = &pcc_utf8_kernels[k - 1];
+            break;
+        }
+    }
+    return pcc_utf8_selected_kernel;
+}
+
+static inline void pcc_utf8_decoder_init(struct pcc_utf8_decoder *decoder) {
+    decoder->pending_length = 0;
+}
+
+// a body may only end between sequences
+static inline bool pcc_utf8_is_complete(const struct pcc_utf8_decoder *decoder) {
+    return decoder->pending_length == 0;
+}
+
+// how many of the last bytes are a sequence that continues past them, 0 to 3
+static inline size_t pcc_utf8_incomplete_tail(const unsigned char *bytes, size_t len) {
+    for (size_t back = 1; back < PCC_UTF8_MAX_SEQUENCE && back <= len; back++) {
+        unsigned char byte = bytes[len - back];
+        if ((byte & 0xC0) != 0x80) {
+            return pcc_utf8_sequence_length(byte) > back ? back : 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Adds the printable codepoints of the next len bytes of the stream to *printable. Returns -1 as
+ * soon as the stream is known to be invalid, the decoder is then of no further use. A sequence
+ * cut off at the end waits in the decoder and is counted with the piece that completes it.
+ */
+static inline int pcc_utf8_count(struct pcc_utf8_decoder *decoder, const char *data, size_t len,
+                                 uint64_t *printable) {
+    const unsigned char *bytes = (const unsigned char *)data;
+
+    if (decoder->pending_length > 0) {
+        size_t needed = pcc_utf8_sequence_length(decoder->pending[0]) - decoder->pending_length;
+        size_t step = len < needed ? len : needed;
+        memcpy(decoder->pending + decoder->pending_length, bytes, step);
+        decoder->pending_length += step;
+        bytes += step;
+        len -= step;
+        if (step < needed) {
+            return 0;
+        }
+        if (pcc_utf8_count_scalar((const char *)decoder->pending, decoder->pending_length, printable) == -1) {
+            return -1;
+        }
+        decoder->pending_length = 0;
+    }
+
+    size_t tail = pcc_utf8_incomplete_tail(bytes, len);
+    if (pcc_utf8_selected_kernel->count((const char *)bytes, len - tail, printable) == -1) {
+        return -1;
+    }
+    memcpy(decoder->pending, bytes + len - tail, tail);
+    decoder->pending_length = (uint8_t)tail;
+    return 0;
+}
+
+#endif // PCC_UTF8_H
@@ -0,0 +1,139 @@
+#!/bin/bash
+
+# Runs a parent pcc_server taking deltas from loopback (--aggregator) and LEAVES leaf servers
+# pushing to it (--upstream), sends clients to the leaves, then drains: the leaves shut down
+# first, each pushing what it has left, then the parent. The parent's table and client count must
+# be exactly the sum of the leaves', also after the parent stalled long enough for the leaves to
+# give pushes up and resend them, and after the first leaf crashed with a push pending and was
+# restarted from its state file.
+
+# 1. Configuration - Change these if needed
+PORT=12350
+IP="127.0.0.1"
+LEAVES=${LEAVES:-3}
+CLIENTS_PER_LEAF=${CLIENTS_PER_LEAF:-4}
+PUSH_INTERVAL_MS=200
+# longer than a leaf waits for a reply, twice over (5 s, and 5 s more on a new connection)
+STALL_SECONDS=${STALL_SECONDS:-12}
+CHECKPOINT_INTERVAL_MS=100
+TEST_FILE="test_aggregation_data.bin"
+SERVER_BIN="./pcc_server"
+CLIENT_BIN="./pcc_client"
+OUTPUT_DIR=$(mktemp -d)
+
+# 2. Cleanup - Kill any old instances that might be holding the ports
+echo "Cleaning up old processes..."
+killall -9 pcc_server pcc_client 2>/dev/null
+sleep 1
+
+# 3. Compile - Using the required flags
+echo "Compiling with required flags..."
+gcc -O3 -Wall -std=c11 -D_DEFAULT_SOURCE -pthread pcc_server.c -o pcc_server && \
+gcc -O3 -Wall -std=c11 -pthread pcc_client.c -o pcc_client
+
+if [ $? -ne 0 ]; then
+    echo "Compilation failed! Fix errors before running."
+    exit 1
+fi
+
+# 4. Create Test Data - 1MB of random bytes
+head -c 1000000 /dev/urandom > $TEST_FILE
+
+# 5. Start Servers - the parent, then the leaves pushing to it
+echo "Starting parent on port $PORT and $LEAVES leaves..."
+$SERVER_BIN --aggregator $IP $PORT > $OUTPUT_DIR/parent.txt &
+PARENT_PID=$!
+sleep 1
+LEAF_PIDS=()
+# the first leaf keeps its totals and pushes in a state file
+start_leaf() {
+    local STATE_ARGS=()
+    if [ $1 -eq 1 ]; then
+        STATE_ARGS=(--state-file $OUTPUT_DIR/leaf_1.state --checkpoint-interval $CHECKPOINT_INTERVAL_MS)
+    fi
+    $SERVER_BIN --upstream $IP:$PORT --push-interval $PUSH_INTERVAL_MS "${STATE_ARGS[@]}" $((PORT + $1)) \
+        > $OUTPUT_DIR/leaf_$1.txt 2>> $OUTPUT_DIR/leaf_$1.err &
+    LEAF_PIDS[$1 - 1]=$!
+}
+for ((i = 1; i <= LEAVES; i++))
+do
+    start_leaf $i
+done
+sleep 1
+
+# 6. Run Clients - half before a push interval passes, half after, so both periodic pushes and
+# the last one on shutdown carry clients
+for ((round = 0; round < 2; round++))
+do
+    for ((i = 1; i <= LEAVES; i++))
+    do
+        for ((c = 0; c < CLIENTS_PER_LEAF / 2; c++))
+        do
+            $CLIENT_BIN $IP $((PORT + i)) $TEST_FILE > /dev/null || echo "Client of leaf $i failed!"
+        done
+    done
+    sleep 1
+done
+
+# 7. Stall - the parent stops answering while the leaves push more, they give those pushes up and
+# resend them later, after the parent already took them in from the connections they left behind
+echo "Stalling the parent for $STALL_SECONDS s..."
+kill -SIGSTOP $PARENT_PID
+for ((i = 1; i <= LEAVES; i++))
+do
+    $CLIENT_BIN $IP $((PORT + i)) $TEST_FILE > /dev/null || echo "Client of leaf $i failed!"
+done
+sleep $STALL_SECONDS
+kill -SIGCONT $PARENT_PID
+sleep 2
+RETRIED=$(cat $OUTPUT_DIR/leaf_*.err | grep -c "Push to upstream failed")
+
+# 8. Crash - the first leaf dies with a push the stalled parent has not answered and a client
+# served after it, both checkpointed along with its totals. Restarted, it must resend that push
+# as the same leaf, so the parent adds it exactly once, whether it took in the one the crashed
+# leaf left behind or not, and then push the client it had not pushed yet.
+echo "Crashing the first leaf with a push pending..."
+kill -SIGSTOP $PARENT_PID
+for ((c = 0; c < 2; c++))
+do
+    $CLIENT_BIN $IP $((PORT + 1)) $TEST_FILE > /dev/null || echo "Client of leaf 1 failed!"
+    sleep 1
+done
+{ kill -9 ${LEAF_PIDS[0]} && wait ${LEAF_PIDS[0]}; } 2>/dev/null
+kill -SIGCONT $PARENT_PID
+start_leaf 1
+sleep 2
+
+# 9. Drain - leaves first, then the parent
+for PID in "${LEAF_PIDS[@]}"
+do
+    kill -SIGINT $PID
+done
+for PID in "${LEAF_PIDS[@]}"
+do
+    wait $PID
+done
+kill -SIGINT $PARENT_PID
+wait $PARENT_PID
+
+# 10. Compare - the parent's lines against the leaves' lines added up
+sum() {
+    awk -F ' : ' '/^char / { split($2, n, " "); total[$1] += n[1] }
+                  /^Served / { split($0, n, " "); clients += n[2] }
+                  END { for (c in total) print c " : " total[c] " times"; print "clients " clients }' "$@" | sort
+}
+if [ "$RETRIED" -eq 0 ]; then
+    echo "FAIL: no push was given up while the parent stalled, nothing was resent"
+    RESULT=1
+elif [ -s $OUTPUT_DIR/parent.txt ] && diff <(sum $OUTPUT_DIR/leaf_*.txt) <(sum $OUTPUT_DIR/parent.txt); then
+    echo "PASS: the parent holds the sum of $LEAVES leaves, $(sum $OUTPUT_DIR/parent.txt | grep clients)," \
+         "$RETRIED push(es) resent"
+    RESULT=0
+else
+    echo "FAIL: the parent does not hold the sum of the leaves"
+    RESULT=1
+fi
+
+# 11. Final Cleanup
+rm -rf $TEST_FILE $OUTPUT_DIR
+exit $RESULT
@@ -14,14 +14,41 @@ sleep 1
 
 # 3. Compile - Using the required flags
 echo "Compiling with required flags..."
-gcc -O3 -Wall -std=c11 -D_DEFAULT_SOURCE pcc_server.c -o pcc_server
-gcc -O3 -Wall -std=c11 pcc_client.c -o pcc_client
+gcc -O3 -Wall -std=c11 -D_DEFAULT_SOURCE -pthread pcc_server.c -o pcc_server && \
+gcc -O3 -Wall -std=c11 -pthread pcc_client.c -o pcc_client && \
+gcc -O3 -Wall -std=c11 pcc_count_tester.c -o pcc_count_tester && \
+gcc -O3 -Wall -std=c11 pcc_timer_tester.c -o pcc_timer_tester && \
+gcc -O3 -Wall -std=c11 pcc_state_tester.c -o pcc_state_tester
 
 if [ $? -ne 0 ]; then
     echo "Compilation failed! Fix errors before running."
     exit 1
 fi
 
+# Counting kernels must match the scalar loop bit for bit
+echo "Testing counting kernels..."
+./pcc_count_tester
+if [ $? -ne 0 ]; then
+    echo "Counting kernel tests failed!"
+    exit 1
+fi
+
+# Connection deadlines must fire on exactly the tick they are due
+echo "Testing the timer wheel..."
+./pcc_timer_tester
+if [ $? -ne 0 ]; then
+    echo "Timer wheel tests failed!"
+    exit 1
+fi
+
+# The state file must come back with the last committed checkpoint, whatever was interrupted
+echo "Testing the state file..."
+./pcc_state_tester
+if [ $? -ne 0 ]; then
+    echo "State file tests failed!"
+    exit 1
+fi
+
 # 4. Create Test Data - 5MB of random printable characters
 echo "Generating test file..."
 tr -dc ' -~' < /dev/urandom | head -c 5000000 > $TEST_FILE